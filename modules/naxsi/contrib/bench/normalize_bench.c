@@ -0,0 +1,249 @@
+/*
+** name/value normalization micro-benchmark.
+** Splits each payload in urlencoded vars, then for every var :
+**  - decodes it the way args were decoded up to 0.45
+**    (naxsi_unescape_uri, then a second pass for null bytes) and with
+**    the single pass ngx_http_dummy_normalize(),
+**  - checks every str: pattern of a rules file against it, with the
+**    strfaststr naxsi uses,
+**  - applies t:urldecode|removenulls|compresswhitespace once per rule
+**    carrying it (-t), or once per var, shared by all of them.
+** Decoded outputs are cross-checked, then ns/byte and the share of
+** decoding in (decoding + matching) are reported.
+**
+** usage : normalize_bench [-r rules] [-n iterations] [-t rules] payload ...
+*/
+
+#include <time.h>
+#include "naxsi.h"
+
+#define BENCH_MAX_NEEDLES	256
+#define BENCH_MAX_VARS		4096
+#define BENCH_TRANSFORM		(NAXSI_T_URLDECODE|NAXSI_T_REMOVENULLS|\
+				 NAXSI_T_COMPRESSWS)
+
+static ngx_str_t	needles[BENCH_MAX_NEEDLES];
+static ngx_uint_t	nb_needles;
+static ngx_str_t	vars[BENCH_MAX_VARS];
+static ngx_uint_t	nb_vars;
+static u_char		*scratch, *tscratch;
+
+/* collect (lowercased) str: patterns, as the rules parser does */
+static int
+load_needles(const char *path)
+{
+  FILE		*f;
+  char		line[4096], *p, *q;
+  ngx_uint_t	i;
+
+  f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return (-1);
+  }
+  while (fgets(line, sizeof(line), f) && nb_needles < BENCH_MAX_NEEDLES) {
+    if (line[0] == '#' || !(p = strstr(line, "\"str:")))
+      continue;
+    p += 5;
+    for (q = p; *q && *q != '"'; q++)
+      if (*q == '\\' && q[1])
+	q++;
+    needles[nb_needles].data = malloc(q - p + 1);
+    for (i = 0; p < q; p++) {
+      if (*p == '\\' && p + 1 < q)
+	p++;
+      needles[nb_needles].data[i++] = ngx_tolower(*p);
+    }
+    needles[nb_needles].data[i] = 0;
+    needles[nb_needles].len = i;
+    if (i)
+      nb_needles++;
+  }
+  fclose(f);
+  return (nb_needles ? 0 : -1);
+}
+
+static int
+load_payload(const char *path, ngx_str_t *out)
+{
+  FILE	*f;
+  long	len;
+
+  f = fopen(path, "rb");
+  if (!f || fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0) {
+    perror(path);
+    return (-1);
+  }
+  rewind(f);
+  out->data = calloc(1, len + 1);
+  out->len = fread(out->data, 1, len, f);
+  fclose(f);
+  return (0);
+}
+
+/* values of the name=value&... pairs, as ngx_http_spliturl_ruleset sees them */
+static void
+split_vars(ngx_str_t *payload)
+{
+  u_char	*p, *end, *eq, *amp;
+
+  nb_vars = 0;
+  p = payload->data;
+  end = p + payload->len;
+  while (p < end && nb_vars < BENCH_MAX_VARS) {
+    amp = memchr(p, '&', end - p);
+    if (!amp)
+      amp = end;
+    eq = memchr(p, '=', amp - p);
+    vars[nb_vars].data = eq ? eq + 1 : p;
+    vars[nb_vars].len = amp - vars[nb_vars].data;
+    if (vars[nb_vars].len)
+      nb_vars++;
+    p = amp + 1;
+  }
+}
+
+/* args decoding as done up to 0.45 */
+static size_t
+legacy_decode(u_char *dst, ngx_str_t *v)
+{
+  u_char	*d, *s;
+  size_t	i, len;
+
+  d = dst;
+  s = v->data;
+  naxsi_unescape_uri(&d, &s, v->len, 0);
+  len = d - dst;
+  for (i = 0; i < len; i++)
+    if (dst[i] == 0x0)
+      dst[i] = '0';
+  return (len);
+}
+
+static size_t
+single_decode(u_char *dst, ngx_str_t *v)
+{
+  return (ngx_http_dummy_normalize(dst, v->data, v->len,
+				   NAXSI_T_URLDECODE|NAXSI_T_NULLZERO));
+}
+
+static ngx_uint_t
+match_all(u_char *data, size_t len)
+{
+  ngx_uint_t	n, nb;
+
+  nb = 0;
+  for (n = 0; n < nb_needles; n++)
+    if (strfaststr(data, len, needles[n].data, needles[n].len))
+      nb++;
+  return (nb);
+}
+
+static double
+now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+** decode [iterations] times every var with [decode], then
+** transform it [nb_transforms] times. [match] adds the str: checks.
+*/
+static double
+run(size_t (*decode)(u_char *, ngx_str_t *), ngx_uint_t nb_transforms,
+    int match, int iterations, ngx_uint_t *sum)
+{
+  double	start;
+  ngx_uint_t	v, t;
+  size_t	len;
+  int		it;
+
+  *sum = 0;
+  start = now();
+  for (it = 0; it < iterations; it++)
+    for (v = 0; v < nb_vars; v++) {
+      len = decode(scratch, &(vars[v]));
+      for (t = 0; t < nb_transforms; t++)
+	*sum += ngx_http_dummy_normalize(tscratch, scratch, len,
+					 BENCH_TRANSFORM);
+      if (match)
+	*sum += match_all(scratch, len);
+    }
+  return (now() - start);
+}
+
+int
+main(int ac, char **av)
+{
+  const char		*rules = "../../naxsi_config/naxsi_core.rules";
+  ngx_str_t		payload;
+  ngx_uint_t		v, sum, nb_transforms;
+  size_t		l1, l2, bytes;
+  double		legacy, single, per_rule, shared, match, nsb;
+  int			i, opt, iterations, errors;
+
+  iterations = 2000;
+  nb_transforms = 8;
+  while ((opt = getopt(ac, av, "r:n:t:")) != -1) {
+    if (opt == 'r')
+      rules = optarg;
+    else if (opt == 'n')
+      iterations = atoi(optarg);
+    else if (opt == 't')
+      nb_transforms = atoi(optarg);
+    else {
+      fprintf(stderr, "usage: %s [-r rules] [-n iterations] [-t rules] "
+	      "payload ...\n", av[0]);
+      return (1);
+    }
+  }
+  if (optind >= ac || load_needles(rules) < 0)
+    return (1);
+  printf("%d str: patterns from %s, %d rules with transforms, "
+	 "%d iterations\n", (int) nb_needles, rules, (int) nb_transforms,
+	 iterations);
+  errors = 0;
+  for (i = optind; i < ac; i++) {
+    if (load_payload(av[i], &payload) < 0)
+      return (1);
+    split_vars(&payload);
+    scratch = malloc(payload.len + 1);
+    tscratch = malloc(payload.len + 1);
+    bytes = 0;
+    /* the single pass must decode exactly what the two passes decode */
+    for (v = 0; v < nb_vars; v++) {
+      bytes += vars[v].len;
+      l1 = legacy_decode(scratch, &(vars[v]));
+      l2 = single_decode(tscratch, &(vars[v]));
+      if (l1 != l2 || memcmp(scratch, tscratch, l1)) {
+	printf("  MISMATCH on var %d '%.*s'\n", (int) v,
+	       (int) vars[v].len, vars[v].data);
+	errors++;
+      }
+    }
+    nsb = 1e9 / ((double) bytes * iterations);
+    printf("%s (%d bytes, %d vars)\n", av[i], (int) payload.len,
+	   (int) nb_vars);
+    legacy = run(legacy_decode, 0, 0, iterations, &sum);
+    single = run(single_decode, 0, 0, iterations, &sum);
+    per_rule = run(single_decode, nb_transforms, 0, iterations, &sum) - single;
+    shared = run(single_decode, nb_transforms ? 1 : 0, 0, iterations, &sum) -
+      single;
+    match = run(single_decode, 0, 1, iterations, &sum) - single;
+    printf("  %-22s %8.2f ns/byte\n", "decode, two passes", legacy * nsb);
+    printf("  %-22s %8.2f ns/byte\n", "decode, single pass", single * nsb);
+    printf("  %-22s %8.2f ns/byte\n", "transform, per rule", per_rule * nsb);
+    printf("  %-22s %8.2f ns/byte\n", "transform, shared", shared * nsb);
+    printf("  %-22s %8.2f ns/byte\n", "str: matching", match * nsb);
+    printf("  decoding share : %.1f%% before, %.1f%% after\n",
+	   100 * (legacy + per_rule) / (legacy + per_rule + match),
+	   100 * (single + shared) / (single + shared + match));
+    free(scratch);
+    free(tscratch);
+    free(payload.data);
+  }
+  return (errors ? 2 : 0);
+}
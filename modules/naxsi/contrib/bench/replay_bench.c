@@ -0,0 +1,854 @@
+/*
+** rule engine replay benchmark and regression check.
+** Loads the MainRules of a rules file and a location configuration
+** (SecRulesEnabled, LearningMode, CheckRule, BasicRule) the way naxsi
+** does at configuration time, then replays corpus files of recorded
+** requests through ngx_http_dummy_data_parse(), as the access handler
+** does once the body is read :
+**  - once, printing for every request its verdict, its scores and its
+**    match set (rule id, zone and var name of every match),
+**  - then [iterations] times, reporting requests/s, ns per byte of
+**    request and the time spent in each phase.
+** Match sets can be written to a file (-w) and checked against one
+** (-e, exit status 2 on difference), to prove that changes to the
+** matchers or their data structures keep the same verdicts.
+**
+** Corpus files hold raw HTTP/1.x requests, one after the other :
+** request line, headers, empty line and Content-Length bytes of body.
+** Lines starting with '#' between two requests are comments.
+**
+** usage : replay_bench [-r rules] [-l location] [-n iterations]
+**		       [-b body buffer] [-e expected | -w expected] corpus ...
+*/
+
+#include <time.h>
+#include "naxsi.h"
+
+#define REPLAY_MAX_ARGS		32
+/* dummy_str and friends may read a few bytes past tokens */
+#define REPLAY_SLACK		8
+#define REPLAY_MAX_REQUESTS	4096
+#define REPLAY_MAX_HEADERS	64
+#define REPLAY_LINE_MAX		16384
+
+typedef struct
+{
+  /* corpus file:index */
+  char		name[256];
+  ngx_uint_t	method;
+  ngx_str_t	method_name;
+  /* decoded, as r->uri */
+  ngx_str_t	uri;
+  ngx_str_t	args;
+  ngx_str_t	keys[REPLAY_MAX_HEADERS];
+  ngx_str_t	values[REPLAY_MAX_HEADERS];
+  ngx_uint_t	nb_headers;
+  ngx_int_t	content_type;
+  off_t		content_length;
+  ngx_str_t	host;
+  ngx_str_t	body;
+  /* size of the recorded request */
+  size_t	bytes;
+} replay_req_t;
+
+ngx_module_t			ngx_http_naxsi_module = { 1 };
+
+static ngx_log_t		replay_log;
+static ngx_conf_t		replay_cf;
+static ngx_http_dummy_main_conf_t	*main_cf;
+static ngx_http_dummy_loc_conf_t	*loc_cf;
+static ngx_http_core_main_conf_t	core_main_cf;
+static ngx_http_core_loc_conf_t		core_loc_cf;
+static void			*main_confs[2];
+static void			*loc_confs[2];
+static ngx_connection_t		replay_connection;
+static replay_req_t		reqs[REPLAY_MAX_REQUESTS];
+static ngx_uint_t		nb_reqs;
+static size_t			body_buffer = 8192;
+static ngx_uint_t		nb_whitelisted;
+
+/* naxsi_stats.c and naxsi_learning.c are not built */
+void
+ngx_http_dummy_stats_rule_hit(ngx_http_request_t *r, ngx_http_rule_t *rule,
+			      ngx_flag_t whitelisted)
+{
+  (void) r;
+  (void) rule;
+  nb_whitelisted += whitelisted ? 1 : 0;
+}
+
+void
+ngx_http_dummy_stats_totals(ngx_http_request_t *r,
+			    ngx_http_dummy_loc_conf_t *cf,
+			    ngx_int_t *processed, ngx_int_t *blocked)
+{
+  (void) r;
+  *processed = cf->request_processed;
+  *blocked = cf->request_blocked;
+}
+
+void
+ngx_http_dummy_sink_event(ngx_http_request_t *r, ngx_str_t *event)
+{
+  (void) r;
+  (void) event;
+}
+
+static int
+load_file(const char *path, u_char **data, size_t *len)
+{
+  FILE	*f;
+  long	l;
+
+  f = fopen(path, "rb");
+  if (!f || fseek(f, 0, SEEK_END) || (l = ftell(f)) < 0) {
+    perror(path);
+    return (-1);
+  }
+  rewind(f);
+  *data = calloc(1, l + 1);
+  *len = fread(*data, 1, l, f);
+  fclose(f);
+  return (0);
+}
+
+/*
+** next token, as nginx config parser cuts them (see naxsi_rulesc).
+** Returns 1 on ';', 0 on a token, -1 at end of file.
+*/
+static int
+next_token(u_char **pos, u_char *end, ngx_str_t *tok, ngx_uint_t *line)
+{
+  u_char	*p, *d, quote;
+
+  p = *pos;
+  for (;;) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+      if (*p == '\n')
+	(*line)++;
+      p++;
+    }
+    if (p < end && *p == '#') {
+      while (p < end && *p != '\n')
+	p++;
+      continue;
+    }
+    break;
+  }
+  if (p >= end)
+    return (-1);
+  if (*p == ';') {
+    *pos = p + 1;
+    return (1);
+  }
+  tok->data = d = calloc(1, end - p + REPLAY_SLACK);
+  quote = (*p == '"' || *p == '\'') ? *p++ : 0;
+  while (p < end) {
+    if (quote && *p == quote) {
+      p++;
+      break;
+    }
+    if (!quote && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' ||
+		   *p == ';'))
+      break;
+    if (*p == '\\' && p + 1 < end) {
+      p++;
+      if (*p == 't')
+	*d++ = '\t';
+      else if (*p == 'r')
+	*d++ = '\r';
+      else if (*p == 'n')
+	*d++ = '\n';
+      else if (*p == '"' || *p == '\'' || *p == '\\')
+	*d++ = *p;
+      else {
+	*d++ = '\\';
+	*d++ = *p;
+      }
+      p++;
+      continue;
+    }
+    if (*p == '\n')
+      (*line)++;
+    *d++ = *p++;
+  }
+  tok->len = d - tok->data;
+  *pos = p;
+  return (0);
+}
+
+/* MainRule / BasicRule, parsed by naxsi's own parser */
+static int
+parse_rule(ngx_str_t *args, ngx_uint_t nb, ngx_http_rule_t *rule)
+{
+  ngx_memzero(rule, sizeof(ngx_http_rule_t));
+  return (ngx_http_dummy_cfg_parse_one_rule(&replay_cf, args, rule, nb) ==
+	  NGX_CONF_OK ? 0 : -1);
+}
+
+/* CheckRule "$TAG >= 8" BLOCK; */
+static int
+parse_check_rule(ngx_str_t *args, ngx_uint_t nb)
+{
+  ngx_http_check_rule_t	*cr;
+  u_char		*p, *q;
+
+  if (nb != 3 || args[1].data[0] != '$')
+    return (-1);
+  if (!loc_cf->check_rules)
+    loc_cf->check_rules = ngx_array_create(replay_cf.pool, 2,
+					   sizeof(ngx_http_check_rule_t));
+  if (!loc_cf->check_rules || !(cr = ngx_array_push(loc_cf->check_rules)))
+    return (-1);
+  ngx_memzero(cr, sizeof(ngx_http_check_rule_t));
+  p = args[1].data;
+  q = (u_char *) ngx_strchr(p, ' ');
+  if (!q)
+    return (-1);
+  cr->sc_tag.data = p;
+  cr->sc_tag.len = q - p;
+  while (*q == ' ')
+    q++;
+  if (q[0] == '>')
+    cr->cmp = q[1] == '=' ? SUP_OR_EQUAL : SUP;
+  else if (q[0] == '<')
+    cr->cmp = q[1] == '=' ? INF_OR_EQUAL : INF;
+  else
+    return (-1);
+  while (*q && !(*q >= '0' && *q <= '9') && *q != '-')
+    q++;
+  cr->sc_score = atoi((const char *) q);
+  /* every action blocks, as in ngx_http_dummy_read_conf */
+  if (!ngx_strstr(args[2].data, "BLOCK") &&
+      !ngx_strstr(args[2].data, "ALLOW") &&
+      !ngx_strstr(args[2].data, "LOG"))
+    return (-1);
+  cr->block = 1;
+  return (0);
+}
+
+static int
+main_directive(ngx_str_t *args, ngx_uint_t nb)
+{
+  ngx_http_rule_t	rule;
+
+  if (ngx_strcmp(args[0].data, TOP_MAIN_BASIC_RULE_T))
+    return (1);
+  if (parse_rule(args, nb, &rule) < 0 ||
+      ngx_http_dummy_push_main_rule(replay_cf.pool, &main_cf->get_rules,
+				    &main_cf->body_rules,
+				    &main_cf->header_rules,
+				    &main_cf->generic_rules, &rule) != NGX_OK)
+    return (-1);
+  return (0);
+}
+
+static int
+loc_directive(ngx_str_t *args, ngx_uint_t nb)
+{
+  ngx_http_rule_t	rule, *wl;
+
+  if (!ngx_strcmp(args[0].data, TOP_ENABLED_FLAG_T))
+    loc_cf->enabled = 1;
+  else if (!ngx_strcmp(args[0].data, TOP_DISABLED_FLAG_T))
+    loc_cf->force_disabled = 1;
+  else if (!ngx_strcmp(args[0].data, TOP_LEARNING_FLAG_T))
+    loc_cf->learning = 1;
+  else if (!ngx_strcmp(args[0].data, TOP_DENIED_URL_T))
+    return (0);
+  else if (!ngx_strcmp(args[0].data, TOP_CHECK_RULE_T))
+    return (parse_check_rule(args, nb));
+  else if (!ngx_strcmp(args[0].data, TOP_BASIC_RULE_T)) {
+    if (parse_rule(args, nb, &rule) < 0)
+      return (-1);
+    if (!rule.wl_id)
+      return (ngx_http_dummy_push_main_rule(replay_cf.pool,
+					    &loc_cf->get_rules,
+					    &loc_cf->body_rules,
+					    &loc_cf->header_rules,
+					    &loc_cf->generic_rules,
+					    &rule) == NGX_OK ? 0 : -1);
+    if (!loc_cf->whitelist_rules)
+      loc_cf->whitelist_rules = ngx_array_create(replay_cf.pool, 2,
+						 sizeof(ngx_http_rule_t));
+    if (!loc_cf->whitelist_rules ||
+	!(wl = ngx_array_push(loc_cf->whitelist_rules)))
+      return (-1);
+    ngx_memcpy(wl, &rule, sizeof(ngx_http_rule_t));
+  }
+  else
+    return (1);
+  return (0);
+}
+
+static int
+read_conf(const char *path, int (*directive)(ngx_str_t *, ngx_uint_t))
+{
+  ngx_str_t	args[REPLAY_MAX_ARGS];
+  ngx_uint_t	nb, line, start;
+  u_char	*data, *p, *end;
+  size_t	len;
+  int		ret;
+
+  if (load_file(path, &data, &len) < 0)
+    return (-1);
+  p = data;
+  end = data + len;
+  line = 1;
+  nb = 0;
+  start = line;
+  while ((ret = next_token(&p, end, &(args[nb]), &line)) >= 0) {
+    if (ret == 0) {
+      if (!nb)
+	start = line;
+      if (++nb == REPLAY_MAX_ARGS) {
+	fprintf(stderr, "%s:%d: too many arguments\n", path, (int) start);
+	return (-1);
+      }
+      continue;
+    }
+    if (!nb)
+      continue;
+    ret = directive(args, nb);
+    if (ret < 0) {
+      fprintf(stderr, "%s:%d: invalid %s\n", path, (int) start,
+	      args[0].data);
+      return (-1);
+    }
+    if (ret > 0)
+      fprintf(stderr, "%s:%d: %s ignored\n", path, (int) start,
+	      args[0].data);
+    nb = 0;
+  }
+  return (0);
+}
+
+/* as ngx_http_dummy_compile_zone_rules */
+static int
+compile_zone_rules(ngx_http_ac_t **str_ac, ngx_http_rx_set_t **rx_set,
+		   ngx_http_dummy_dispatch_t **dispatch, ngx_array_t **rules)
+{
+  int	zone;
+
+  for (zone = HEADERS; zone < UNKNOWN; zone++) {
+    str_ac[zone] = ngx_http_ac_compile(&replay_cf, rules[zone], zone);
+    if (str_ac[zone] == NGX_CONF_ERROR)
+      return (-1);
+    if (str_ac[zone] && str_ac[zone]->nb_patterns > main_cf->ac_max_patterns)
+      main_cf->ac_max_patterns = str_ac[zone]->nb_patterns;
+    rx_set[zone] = ngx_http_rx_compile(&replay_cf, rules[zone], zone);
+    if (rx_set[zone] == NGX_CONF_ERROR)
+      return (-1);
+    if (rx_set[zone] && rx_set[zone]->nb_rules > main_cf->rx_max_rules)
+      main_cf->rx_max_rules = rx_set[zone]->nb_rules;
+    dispatch[zone] = ngx_http_dummy_dispatch_compile(&replay_cf, rules[zone],
+						     zone, str_ac[zone],
+						     rx_set[zone]);
+    if (dispatch[zone] == NGX_CONF_ERROR)
+      return (-1);
+  }
+  return (0);
+}
+
+/* configuration, as ngx_http_dummy_init and init_module do it */
+static int
+load_conf(const char *rules, const char *location)
+{
+  ngx_http_dummy_loc_conf_t	**loc;
+  ngx_array_t			*zone_rules[UNKNOWN];
+  ngx_cycle_t			cycle;
+
+  replay_log.log_level = NGX_LOG_ERR;
+  replay_cf.log = &replay_log;
+  replay_cf.pool = ngx_create_pool(16384, &replay_log);
+  replay_cf.temp_pool = replay_cf.pool;
+  if (!replay_cf.pool)
+    return (-1);
+  main_cf = ngx_pcalloc(replay_cf.pool, sizeof(ngx_http_dummy_main_conf_t));
+  loc_cf = ngx_pcalloc(replay_cf.pool, sizeof(ngx_http_dummy_loc_conf_t));
+  if (!main_cf || !loc_cf)
+    return (-1);
+  main_cf->locations = ngx_array_create(replay_cf.pool, 1,
+					sizeof(ngx_http_dummy_loc_conf_t *));
+  if (!main_cf->locations || !(loc = ngx_array_push(main_cf->locations)))
+    return (-1);
+  *loc = loc_cf;
+  loc_cf->pushed = 1;
+  if (read_conf(rules, main_directive) < 0 ||
+      read_conf(location, loc_directive) < 0)
+    return (-1);
+  ngx_http_dummy_zone_rules(zone_rules, main_cf);
+  if (compile_zone_rules(main_cf->str_ac, main_cf->rx_set, main_cf->dispatch,
+			 zone_rules) < 0)
+    return (-1);
+  ngx_http_dummy_zone_rules(zone_rules, loc_cf);
+  if (compile_zone_rules(loc_cf->str_ac, loc_cf->rx_set, loc_cf->dispatch,
+			 zone_rules) < 0)
+    return (-1);
+  if (ngx_http_dummy_index_rules(&replay_cf, main_cf) != NGX_OK)
+    return (-1);
+  nx_int__weird_request.id_index =
+    ngx_http_dummy_rule_id_index(main_cf, WEIRD_REQUEST_INTERNAL_RULE_ID);
+  nx_int__big_request.id_index =
+    ngx_http_dummy_rule_id_index(main_cf, BIG_BODY_INTERNAL_RULE_ID);
+  if (ngx_http_dummy_create_hashtables_n(loc_cf, &replay_cf,
+					 main_cf) != NGX_OK)
+    return (-1);
+  cycle.pool = replay_cf.pool;
+  cycle.log = &replay_log;
+  if (ngx_http_rx_jit_compile(&cycle, main_cf) != NGX_OK)
+    return (-1);
+  main_confs[ngx_http_core_module.ctx_index] = &core_main_cf;
+  main_confs[ngx_http_naxsi_module.ctx_index] = main_cf;
+  loc_confs[ngx_http_core_module.ctx_index] = &core_loc_cf;
+  loc_confs[ngx_http_naxsi_module.ctx_index] = loc_cf;
+  replay_connection.log = &replay_log;
+  ngx_str_set(&replay_connection.addr_text, "127.0.0.1");
+  return (0);
+}
+
+/* next line of [p, end[, without its \r\n */
+static u_char *
+next_line(u_char **p, u_char *end, size_t *len)
+{
+  u_char	*line, *eol;
+
+  if (*p >= end)
+    return (NULL);
+  line = *p;
+  eol = memchr(line, '\n', end - line);
+  if (!eol)
+    eol = end;
+  *p = eol < end ? eol + 1 : end;
+  if (eol > line && eol[-1] == '\r')
+    eol--;
+  *len = eol - line;
+  return (line);
+}
+
+static ngx_uint_t
+method_of(ngx_str_t *m)
+{
+  if (m->len == 3 && !ngx_strncmp(m->data, "GET", 3))
+    return (NGX_HTTP_GET);
+  if (m->len == 4 && !ngx_strncmp(m->data, "HEAD", 4))
+    return (NGX_HTTP_HEAD);
+  if (m->len == 4 && !ngx_strncmp(m->data, "POST", 4))
+    return (NGX_HTTP_POST);
+  if (m->len == 3 && !ngx_strncmp(m->data, "PUT", 3))
+    return (NGX_HTTP_PUT);
+  return (0);
+}
+
+/* one request, [p] is on its request line */
+static int
+parse_request(const char *path, ngx_uint_t index, u_char **p, u_char *end,
+	      replay_req_t *rq)
+{
+  u_char	*start, *line, *sp, *q, *d, *s;
+  size_t	len;
+  ngx_uint_t	h;
+
+  start = *p;
+  line = next_line(p, end, &len);
+  snprintf(rq->name, sizeof(rq->name), "%s:%d", path, (int) index);
+  sp = memchr(line, ' ', len);
+  if (!sp) {
+    fprintf(stderr, "%s: bad request line\n", rq->name);
+    return (-1);
+  }
+  rq->method_name.data = line;
+  rq->method_name.len = sp - line;
+  rq->method = method_of(&(rq->method_name));
+  s = sp + 1;
+  q = memchr(s, ' ', line + len - s);
+  if (!q)
+    q = line + len;
+  /* path is decoded as nginx does for r->uri, args are kept raw */
+  sp = memchr(s, '?', q - s);
+  if (sp) {
+    rq->args.data = sp + 1;
+    rq->args.len = q - sp - 1;
+  }
+  else
+    sp = q;
+  rq->uri.data = d = malloc(sp - s + 1);
+  naxsi_unescape_uri(&d, &s, sp - s, 0);
+  rq->uri.len = d - rq->uri.data;
+  rq->content_type = -1;
+  rq->content_length = -1;
+  while ((line = next_line(p, end, &len)) && len) {
+    h = rq->nb_headers;
+    sp = memchr(line, ':', len);
+    if (!sp || h == REPLAY_MAX_HEADERS) {
+      fprintf(stderr, "%s: bad or too many headers\n", rq->name);
+      return (-1);
+    }
+    rq->keys[h].data = line;
+    rq->keys[h].len = sp - line;
+    for (sp++; sp < line + len && (*sp == ' ' || *sp == '\t'); sp++)
+      ;
+    rq->values[h].data = sp;
+    rq->values[h].len = line + len - sp;
+    if (rq->keys[h].len == 12 &&
+	!ngx_strncasecmp(line, (u_char *) "Content-Type", 12))
+      rq->content_type = h;
+    else if (rq->keys[h].len == 14 &&
+	     !ngx_strncasecmp(line, (u_char *) "Content-Length", 14))
+      rq->content_length = atol((const char *) sp);
+    else if (rq->keys[h].len == 4 &&
+	     !ngx_strncasecmp(line, (u_char *) "Host", 4))
+      rq->host = rq->values[h];
+    rq->nb_headers++;
+  }
+  if (rq->content_length > 0) {
+    if (rq->content_length > end - *p) {
+      fprintf(stderr, "%s: truncated body\n", rq->name);
+      return (-1);
+    }
+    rq->body.data = *p;
+    rq->body.len = rq->content_length;
+    *p += rq->content_length;
+  }
+  rq->bytes = *p - start;
+  return (0);
+}
+
+static int
+load_corpus(const char *path)
+{
+  u_char	*data, *p, *end, *line;
+  size_t	len;
+  ngx_uint_t	index;
+
+  if (load_file(path, &data, &len) < 0)
+    return (-1);
+  p = data;
+  end = data + len;
+  index = 0;
+  while (p < end) {
+    /* skip blank lines and comments between requests */
+    line = p;
+    if (!next_line(&p, end, &len))
+      break;
+    if (!len || line[0] == '#')
+      continue;
+    p = line;
+    if (nb_reqs == REPLAY_MAX_REQUESTS) {
+      fprintf(stderr, "%s: too many requests\n", path);
+      return (-1);
+    }
+    if (parse_request(path, index++, &p, end, &(reqs[nb_reqs])) < 0)
+      return (-1);
+    nb_reqs++;
+  }
+  return (0);
+}
+
+/*
+** builds the request nginx would hand over to the access handler,
+** body read in [body_buffer] sized buffers.
+*/
+static ngx_http_request_t *
+make_request(replay_req_t *rq, ngx_pool_t *pool)
+{
+  ngx_http_request_t	*r;
+  ngx_table_elt_t	*h;
+  ngx_chain_t		**last, *cl;
+  ngx_uint_t		i;
+  size_t		off, n;
+
+  r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
+  if (!r)
+    return (NULL);
+  r->ctx = ngx_pcalloc(pool, 2 * sizeof(void *));
+  if (!r->ctx)
+    return (NULL);
+  r->main = r;
+  r->pool = pool;
+  r->connection = &replay_connection;
+  r->main_conf = main_confs;
+  r->loc_conf = loc_confs;
+  r->method = rq->method;
+  r->uri = rq->uri;
+  r->args = rq->args;
+  r->headers_in.server = rq->host;
+  r->headers_in.content_length_n = rq->content_length;
+  if (ngx_list_init(&(r->headers_in.headers), pool, 20,
+		    sizeof(ngx_table_elt_t)) != NGX_OK)
+    return (NULL);
+  for (i = 0; i < rq->nb_headers; i++) {
+    h = ngx_list_push(&(r->headers_in.headers));
+    if (!h)
+      return (NULL);
+    h->hash = 1;
+    h->key = rq->keys[i];
+    h->value = rq->values[i];
+    h->lowcase_key = NULL;
+    if ((ngx_int_t) i == rq->content_type)
+      r->headers_in.content_type = h;
+  }
+  if (rq->method != NGX_HTTP_POST && rq->method != NGX_HTTP_PUT)
+    return (r);
+  r->request_body = ngx_pcalloc(pool, sizeof(ngx_http_request_body_t));
+  if (!r->request_body)
+    return (NULL);
+  last = &(r->request_body->bufs);
+  for (off = 0; off < rq->body.len; off += n) {
+    n = ngx_min(body_buffer, rq->body.len - off);
+    cl = ngx_pcalloc(pool, sizeof(ngx_chain_t));
+    if (!cl || !(cl->buf = ngx_pcalloc(pool, sizeof(ngx_buf_t))))
+      return (NULL);
+    cl->buf->pos = cl->buf->start = rq->body.data + off;
+    cl->buf->last = cl->buf->end = rq->body.data + off + n;
+    cl->buf->memory = 1;
+    *last = cl;
+    last = &(cl->next);
+  }
+  return (r);
+}
+
+static int
+cmp_str(const void *a, const void *b)
+{
+  return (strcmp(*(char * const *) a, *(char * const *) b));
+}
+
+/* "id:ZONE[:name]", name %-escaped to keep the line parseable */
+static char *
+match_str(ngx_http_matched_rule_t *mr)
+{
+  const char	*zone;
+  char		*s, *d;
+  ngx_uint_t	i;
+  u_char	c;
+
+  /* no flag for file extensions */
+  zone = mr->url ? "URL" : mr->args_var ? "ARGS" : mr->body_var ? "BODY" :
+    mr->headers_var ? "HEADERS" : "FILE_EXT";
+  s = d = malloc(32 + 3 * mr->name.len);
+  d += sprintf(d, "%d:%s", (int) mr->rule->rule_id, zone);
+  if (mr->name.len)
+    *d++ = ':';
+  for (i = 0; i < mr->name.len; i++) {
+    c = mr->name.data[i];
+    if (c <= 0x20 || c >= 0x7f || c == '%' || c == ',')
+      d += sprintf(d, "%%%02X", c);
+    else
+      *d++ = c;
+  }
+  *d = 0;
+  return (s);
+}
+
+/*
+** one line per request :
+** name verdict scores match-set, match set sorted and deduplicated
+*/
+static char *
+verdict(replay_req_t *rq, ngx_http_request_ctx_t *ctx)
+{
+  ngx_http_matched_rule_t	*mr;
+  ngx_str_t			*tags;
+  char				**set, *line, *p;
+  ngx_uint_t			i, n, k;
+  size_t			len;
+
+  for (n = 0, mr = ctx->matched; mr; mr = mr->next)
+    n++;
+  set = malloc((n + 1) * sizeof(char *));
+  len = strlen(rq->name) + 64;
+  for (n = 0, mr = ctx->matched; mr; mr = mr->next) {
+    set[n] = match_str(mr);
+    len += strlen(set[n++]) + 1;
+  }
+  qsort(set, n, sizeof(char *), cmp_str);
+  tags = main_cf->sc_tags ? main_cf->sc_tags->elts : NULL;
+  for (i = 0; tags && i < main_cf->sc_tags->nelts; i++)
+    len += tags[i].len + NGX_INT_T_LEN + 2;
+  line = p = malloc(len);
+  p += sprintf(p, "%s %s%s%s", rq->name, ctx->block ? "block" : "pass",
+	       ctx->weird_request ? ",weird" : "",
+	       ctx->big_request ? ",big" : "");
+  *p++ = ' ';
+  for (i = 0, k = 0; tags && ctx->special_scores &&
+	 i < main_cf->sc_tags->nelts; i++) {
+    if (!ctx->special_scores[i].hit)
+      continue;
+    p += sprintf(p, "%s%.*s:%d", k++ ? "," : "", (int) tags[i].len,
+		 tags[i].data, (int) ctx->special_scores[i].sc_score);
+  }
+  if (!k)
+    *p++ = '-';
+  *p++ = ' ';
+  for (i = 0, k = 0; i < n; i++)
+    if (!i || strcmp(set[i], set[i - 1]))
+      p += sprintf(p, "%s%s", k++ ? "," : "", set[i]);
+  if (!k)
+    *p++ = '-';
+  *p = 0;
+  for (i = 0; i < n; i++)
+    free(set[i]);
+  free(set);
+  return (line);
+}
+
+/*
+** replays [rq], as the access handler does once the body was read,
+** its verdict line is returned if [line] is set.
+*/
+static uint64_t
+replay(replay_req_t *rq, uint64_t *phase_ns, char **line)
+{
+  ngx_http_request_ctx_t	*ctx;
+  ngx_http_request_t		*r;
+  ngx_pool_t			*pool;
+  uint64_t			start, took;
+  ngx_uint_t			i;
+
+  pool = ngx_create_pool(4096, &replay_log);
+  if (!pool || !(r = make_request(rq, pool)))
+    exit(1);
+  start = naxsi_now_ns();
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_request_ctx_t));
+  if (!ctx)
+    exit(1);
+  ngx_http_set_ctx(r, ctx, ngx_http_naxsi_module);
+  ctx->ready = 1;
+  ngx_http_dummy_data_parse(ctx, r);
+  took = naxsi_now_ns() - start;
+  for (i = 0; phase_ns && i < NAXSI_PHASE_TOTAL; i++)
+    phase_ns[i] += ctx->phase_ns[i];
+  if (line)
+    *line = verdict(rq, ctx);
+  ngx_destroy_pool(pool);
+  return (took);
+}
+
+/* compares verdict lines with the ones of [path], in order */
+static int
+check_expected(const char *path, char **lines)
+{
+  FILE		*f;
+  char		buf[REPLAY_LINE_MAX];
+  ngx_uint_t	i;
+  int		errors;
+
+  f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return (-1);
+  }
+  errors = 0;
+  for (i = 0; i < nb_reqs; i++) {
+    if (!fgets(buf, sizeof(buf), f)) {
+      printf("  MISSING %s\n", lines[i]);
+      errors++;
+      continue;
+    }
+    buf[strcspn(buf, "\n")] = 0;
+    if (strcmp(buf, lines[i])) {
+      printf("  EXPECTED %s\n  GOT      %s\n", buf, lines[i]);
+      errors++;
+    }
+  }
+  if (fgets(buf, sizeof(buf), f)) {
+    printf("  %s holds more requests than the corpus\n", path);
+    errors++;
+  }
+  fclose(f);
+  return (errors);
+}
+
+int
+main(int ac, char **av)
+{
+  const char	*rules = "../../naxsi_config/naxsi_core.rules";
+  const char	*location = "corpus/location.conf";
+  const char	*expected = NULL, *output = NULL;
+  const char	*phases[NAXSI_PHASE_TOTAL] = { "headers", "uri", "args",
+					       "body" };
+  uint64_t	phase_ns[NAXSI_PHASE_TOTAL], total;
+  char		**lines;
+  FILE		*f;
+  size_t	bytes;
+  ngx_uint_t	i, blocked;
+  int		opt, iterations, it, errors;
+
+  iterations = 200;
+  while ((opt = getopt(ac, av, "r:l:n:b:e:w:")) != -1) {
+    if (opt == 'r')
+      rules = optarg;
+    else if (opt == 'l')
+      location = optarg;
+    else if (opt == 'n')
+      iterations = atoi(optarg);
+    else if (opt == 'b')
+      body_buffer = atoi(optarg);
+    else if (opt == 'e')
+      expected = optarg;
+    else if (opt == 'w')
+      output = optarg;
+    else
+      optind = ac;
+  }
+  if (optind >= ac || !body_buffer) {
+    fprintf(stderr, "usage: %s [-r rules] [-l location] [-n iterations] "
+	    "[-b body buffer] [-e expected | -w expected] corpus ...\n", av[0]);
+    return (1);
+  }
+  if (load_conf(rules, location) < 0)
+    return (1);
+  for (i = optind; i < (ngx_uint_t) ac; i++)
+    if (load_corpus(av[i]) < 0)
+      return (1);
+  printf("%d rule ids from %s, %d requests, %d iterations\n",
+	 (int) main_cf->nb_rule_ids, rules, (int) nb_reqs, iterations);
+  /* verdicts */
+  lines = malloc(nb_reqs * sizeof(char *));
+  blocked = bytes = 0;
+  for (i = 0; i < nb_reqs; i++) {
+    replay(&(reqs[i]), NULL, &(lines[i]));
+    blocked += !strncmp(strchr(lines[i], ' ') + 1, "block", 5);
+    bytes += reqs[i].bytes;
+    if (!expected)
+      printf("  %s\n", lines[i]);
+  }
+  errors = 0;
+  if (expected) {
+    errors = check_expected(expected, lines);
+    if (errors < 0)
+      return (1);
+    printf("%d/%d verdicts differ from %s\n", errors, (int) nb_reqs,
+	   expected);
+  }
+  if (output) {
+    f = fopen(output, "w");
+    if (!f) {
+      perror(output);
+      return (1);
+    }
+    for (i = 0; i < nb_reqs; i++)
+      fprintf(f, "%s\n", lines[i]);
+    fclose(f);
+  }
+  /* throughput */
+  ngx_memzero(phase_ns, sizeof(phase_ns));
+  total = 0;
+  for (it = 0; it < iterations; it++)
+    for (i = 0; i < nb_reqs; i++)
+      total += replay(&(reqs[i]), phase_ns, NULL);
+  printf("%d blocked, %d whitelisted matches\n", (int) blocked,
+	 (int) (nb_whitelisted / (iterations + 1)));
+  if (!total || !iterations)
+    return (errors ? 2 : 0);
+  printf("  %-10s %10.0f req/s\n", "requests",
+	 (double) nb_reqs * iterations * 1e9 / total);
+  printf("  %-10s %10.2f ns/byte\n", "bytes",
+	 (double) total / ((double) bytes * iterations));
+  for (i = 0; i < NAXSI_PHASE_TOTAL; i++)
+    printf("  %-10s %10.0f ns/req (%.1f%%)\n", phases[i],
+	   (double) phase_ns[i] / ((double) nb_reqs * iterations),
+	   100.0 * phase_ns[i] / total);
+  return (errors ? 2 : 0);
+}
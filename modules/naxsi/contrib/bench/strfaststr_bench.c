@@ -0,0 +1,209 @@
+/*
+** strfaststr micro-benchmark.
+** Counts every occurrence of every str: pattern of a naxsi rules file
+** in each payload (same loop as ngx_http_process_basic_rule_buffer),
+** with the historical implementation and with every kernel the CPU
+** supports. Results are cross-checked, then throughput is reported.
+**
+** usage : strfaststr_bench [-r rules] [-n iterations] payload ...
+*/
+
+#include <time.h>
+#include "naxsi.h"
+
+#define BENCH_MAX_NEEDLES	256
+
+typedef char *(*bench_search_pt)(unsigned char *, unsigned int,
+				 unsigned char *, unsigned int);
+
+/* strfaststr as shipped up to naxsi 0.44, kept as the reference */
+static char *
+legacy_strncasechr(const char *s, int c, int len)
+{
+  int	cpt;
+  for (cpt = 0; cpt < len && s[cpt]; cpt++)
+    if (tolower(s[cpt]) == c)
+      return ((char *) s+cpt);
+  return (NULL);
+}
+
+static char *
+legacy_strfaststr(unsigned char *haystack, unsigned int hl,
+		  unsigned char *needle, unsigned int nl)
+{
+  char	*cpt, *found, *end;
+  if (hl < nl || !haystack || !needle || !nl || !hl) return (NULL);
+  cpt = (char *) haystack;
+  end = (char *) haystack + hl;
+  while (cpt < end) {
+      found = legacy_strncasechr((const char *) cpt, (int) needle[0], hl);
+      if (!found) return (NULL);
+      if (nl == 1) return (found);
+      if (!strncasecmp((const char *)found+1, (const char *) needle+1, nl-1))
+	return ((char *) found);
+      else {
+	  if (found+nl >= end)
+	    break;
+	  if (found+nl < end)
+	    cpt = found+1;
+	}
+    }
+  return (NULL);
+}
+
+static ngx_str_t	needles[BENCH_MAX_NEEDLES];
+static ngx_uint_t	nb_needles;
+
+/* collect (lowercased) str: patterns, as the rules parser does */
+static int
+load_needles(const char *path)
+{
+  FILE		*f;
+  char		line[4096], *p, *q;
+  ngx_uint_t	i;
+
+  f = fopen(path, "r");
+  if (!f) {
+    perror(path);
+    return (-1);
+  }
+  while (fgets(line, sizeof(line), f) && nb_needles < BENCH_MAX_NEEDLES) {
+    if (line[0] == '#' || !(p = strstr(line, "\"str:")))
+      continue;
+    p += 5;
+    for (q = p; *q && *q != '"'; q++)
+      if (*q == '\\' && q[1])
+	q++;
+    needles[nb_needles].data = malloc(q - p + 1);
+    for (i = 0; p < q; p++) {
+      if (*p == '\\' && p + 1 < q)
+	p++;
+      needles[nb_needles].data[i++] = ngx_tolower(*p);
+    }
+    needles[nb_needles].data[i] = 0;
+    needles[nb_needles].len = i;
+    if (i)
+      nb_needles++;
+  }
+  fclose(f);
+  return (nb_needles ? 0 : -1);
+}
+
+static int
+load_payload(const char *path, ngx_str_t *out)
+{
+  FILE	*f;
+  long	len;
+
+  f = fopen(path, "rb");
+  if (!f || fseek(f, 0, SEEK_END) || (len = ftell(f)) <= 0) {
+    perror(path);
+    return (-1);
+  }
+  rewind(f);
+  /* NUL terminated, the legacy version relies on it */
+  out->data = calloc(1, len + 1);
+  out->len = fread(out->data, 1, len, f);
+  fclose(f);
+  return (0);
+}
+
+static ngx_uint_t
+count_matches(bench_search_pt search, ngx_str_t *s, ngx_str_t *needle)
+{
+  unsigned char	*ret;
+  unsigned int	idx;
+  ngx_uint_t	nb;
+
+  nb = 0;
+  idx = 0;
+  while (idx < s->len &&
+	 (ret = (unsigned char *) search(s->data + idx, s->len - idx,
+					 needle->data, needle->len))) {
+    nb++;
+    idx = (ret - s->data) + 1;
+  }
+  return (nb);
+}
+
+static double
+now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static double
+run(bench_search_pt search, ngx_str_t *s, int iterations, ngx_uint_t *total)
+{
+  double	start;
+  ngx_uint_t	n, sum;
+  int		it;
+
+  sum = 0;
+  start = now();
+  for (it = 0; it < iterations; it++)
+    for (n = 0; n < nb_needles; n++)
+      sum += count_matches(search, s, &(needles[n]));
+  *total = sum;
+  return (now() - start);
+}
+
+int
+main(int ac, char **av)
+{
+  const char		*rules = "../../naxsi_config/naxsi_core.rules";
+  naxsi_strstr_kernel_t	*k;
+  ngx_str_t		payload;
+  ngx_uint_t		n, ref, got, total;
+  double		t, mb;
+  int			i, opt, iterations, errors;
+
+  iterations = 2000;
+  while ((opt = getopt(ac, av, "r:n:")) != -1) {
+    if (opt == 'r')
+      rules = optarg;
+    else if (opt == 'n')
+      iterations = atoi(optarg);
+    else {
+      fprintf(stderr, "usage: %s [-r rules] [-n iterations] payload ...\n",
+	      av[0]);
+      return (1);
+    }
+  }
+  if (optind >= ac || load_needles(rules) < 0)
+    return (1);
+  printf("%d str: patterns from %s, %d iterations\n",
+	 (int) nb_needles, rules, iterations);
+  errors = 0;
+  for (i = optind; i < ac; i++) {
+    if (load_payload(av[i], &payload) < 0)
+      return (1);
+    mb = (double) payload.len * nb_needles * iterations / (1024 * 1024);
+    printf("%s (%d bytes)\n", av[i], (int) payload.len);
+    /* every kernel must find exactly what the reference finds */
+    for (n = 0; n < nb_needles; n++) {
+      ref = count_matches(legacy_strfaststr, &payload, &(needles[n]));
+      for (k = naxsi_strstr_kernels(); k->search; k++) {
+	got = count_matches(k->search, &payload, &(needles[n]));
+	if (got != ref) {
+	  printf("  MISMATCH %s on '%s' : %d vs %d\n", k->name,
+		 needles[n].data, (int) got, (int) ref);
+	  errors++;
+	}
+      }
+    }
+    t = run(legacy_strfaststr, &payload, iterations, &total);
+    printf("  %-8s %10.1f MB/s (%d matches)\n", "legacy", mb / t,
+	   (int) total);
+    for (k = naxsi_strstr_kernels(); k->search; k++) {
+      t = run(k->search, &payload, iterations, &total);
+      printf("  %-8s %10.1f MB/s (%d matches)\n", k->name, mb / t,
+	     (int) total);
+    }
+    free(payload.data);
+  }
+  return (errors ? 2 : 0);
+}
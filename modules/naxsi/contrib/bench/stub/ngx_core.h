@@ -0,0 +1 @@
+#include "ngx_stub.h"
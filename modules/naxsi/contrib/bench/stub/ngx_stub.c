@@ -0,0 +1,444 @@
+/*
+** Minimal implementation of the nginx core functions used by naxsi
+** (pools, arrays, lists, hashes, logging, formatting), see ngx_stub.h.
+** Pools are a plain list of malloc()ed chunks released on destroy.
+*/
+
+#include "ngx_stub.h"
+
+typedef struct ngx_stub_chunk_s
+{
+  struct ngx_stub_chunk_s	*prev;
+  struct ngx_stub_chunk_s	*next;
+} ngx_stub_chunk_t;
+
+struct ngx_pool_s
+{
+  ngx_stub_chunk_t	*chunks;
+};
+
+typedef struct
+{
+  ngx_str_t	name;
+  ngx_uint_t	key;
+  void		*value;
+} ngx_stub_hash_elt_t;
+
+/* messages use nginx formats, see ngx_vslprintf */
+void
+ngx_stub_log(ngx_uint_t level, const char *fmt, ...)
+{
+  va_list	ap;
+  u_char	msg[2048], *p;
+
+  va_start(ap, fmt);
+  p = ngx_vslprintf(msg, msg + sizeof(msg), fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "[%d] %.*s\n", (int) level, (int) (p - msg), msg);
+}
+
+void
+ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf, int err,
+		   const char *fmt, ...)
+{
+  va_list	ap;
+  u_char	msg[2048], *p;
+
+  (void) cf;
+  (void) err;
+  va_start(ap, fmt);
+  p = ngx_vslprintf(msg, msg + sizeof(msg), fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "[%d] %.*s\n", (int) level, (int) (p - msg), msg);
+}
+
+ngx_pool_t *
+ngx_create_pool(size_t size, ngx_log_t *log)
+{
+  (void) size;
+  (void) log;
+  return (calloc(1, sizeof(ngx_pool_t)));
+}
+
+void
+ngx_destroy_pool(ngx_pool_t *pool)
+{
+  ngx_stub_chunk_t	*c, *next;
+
+  for (c = pool->chunks; c; c = next) {
+    next = c->next;
+    free(c);
+  }
+  free(pool);
+}
+
+void *
+ngx_palloc(ngx_pool_t *pool, size_t size)
+{
+  ngx_stub_chunk_t	*c;
+
+  /* keep the payload aligned as nginx does */
+  c = malloc(sizeof(ngx_stub_chunk_t) + 16 + size);
+  if (!c)
+    return (NULL);
+  c->prev = NULL;
+  c->next = pool->chunks;
+  if (pool->chunks)
+    pool->chunks->prev = c;
+  pool->chunks = c;
+  return ((u_char *) c + sizeof(ngx_stub_chunk_t) + 16);
+}
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+  return (ngx_palloc(pool, size));
+}
+
+void *
+ngx_pcalloc(ngx_pool_t *pool, size_t size)
+{
+  void	*p;
+
+  p = ngx_palloc(pool, size);
+  if (p)
+    ngx_memzero(p, size);
+  return (p);
+}
+
+ngx_int_t
+ngx_pfree(ngx_pool_t *pool, void *p)
+{
+  ngx_stub_chunk_t	*c;
+
+  if (!p)
+    return (NGX_DECLINED);
+  c = (ngx_stub_chunk_t *) ((u_char *) p - 16 - sizeof(ngx_stub_chunk_t));
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    pool->chunks = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  free(c);
+  return (NGX_OK);
+}
+
+ngx_array_t *
+ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size)
+{
+  ngx_array_t	*a;
+
+  a = ngx_palloc(p, sizeof(ngx_array_t));
+  if (!a)
+    return (NULL);
+  a->elts = ngx_palloc(p, n * size);
+  if (!a->elts)
+    return (NULL);
+  a->nelts = 0;
+  a->size = size;
+  a->nalloc = n;
+  a->pool = p;
+  return (a);
+}
+
+void *
+ngx_array_push(ngx_array_t *a)
+{
+  void	*new;
+
+  if (a->nelts == a->nalloc) {
+    new = ngx_palloc(a->pool, 2 * a->nalloc * a->size);
+    if (!new)
+      return (NULL);
+    ngx_memcpy(new, a->elts, a->nelts * a->size);
+    a->elts = new;
+    a->nalloc *= 2;
+  }
+  return ((u_char *) a->elts + a->size * a->nelts++);
+}
+
+ngx_int_t
+ngx_list_init(ngx_list_t *list, ngx_pool_t *pool, ngx_uint_t n, size_t size)
+{
+  list->part.elts = ngx_palloc(pool, n * size);
+  if (!list->part.elts)
+    return (NGX_ERROR);
+  list->part.nelts = 0;
+  list->part.next = NULL;
+  list->last = &list->part;
+  list->size = size;
+  list->nalloc = n;
+  list->pool = pool;
+  return (NGX_OK);
+}
+
+void *
+ngx_list_push(ngx_list_t *l)
+{
+  ngx_list_part_t	*last;
+
+  last = l->last;
+  if (last->nelts == l->nalloc) {
+    last = ngx_palloc(l->pool, sizeof(ngx_list_part_t));
+    if (!last)
+      return (NULL);
+    last->elts = ngx_palloc(l->pool, l->nalloc * l->size);
+    if (!last->elts)
+      return (NULL);
+    last->nelts = 0;
+    last->next = NULL;
+    l->last->next = last;
+    l->last = last;
+  }
+  return ((u_char *) last->elts + l->size * last->nelts++);
+}
+
+ngx_uint_t
+ngx_hash_key_lc(u_char *data, size_t len)
+{
+  ngx_uint_t	i, key;
+
+  key = 0;
+  for (i = 0; i < len; i++)
+    key = key * 31 + ngx_tolower(data[i]);
+  return (key);
+}
+
+ngx_uint_t
+ngx_hash_strlow(u_char *dst, u_char *src, size_t n)
+{
+  ngx_uint_t	key;
+
+  key = 0;
+  while (n--) {
+    *dst = ngx_tolower(*src);
+    key = key * 31 + *dst;
+    dst++;
+    src++;
+  }
+  return (key);
+}
+
+/* one bucket per key slot, collisions are chained in a NULL ended array */
+ngx_int_t
+ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names, ngx_uint_t nelts)
+{
+  ngx_hash_t		*hash;
+  ngx_stub_hash_elt_t	*elt;
+  ngx_uint_t		i, j, n, slot, *count;
+
+  hash = hinit->hash;
+  hash->size = nelts ? nelts : 1;
+  hash->buckets = ngx_pcalloc(hinit->pool, hash->size * sizeof(void *));
+  count = calloc(hash->size, sizeof(ngx_uint_t));
+  if (!hash->buckets || !count)
+    return (NGX_ERROR);
+  for (i = 0; i < nelts; i++)
+    count[names[i].key_hash % hash->size]++;
+  for (slot = 0; slot < hash->size; slot++) {
+    if (!count[slot])
+      continue;
+    hash->buckets[slot] = ngx_pcalloc(hinit->pool, (count[slot] + 1) *
+				      sizeof(ngx_stub_hash_elt_t));
+    if (!hash->buckets[slot])
+      return (NGX_ERROR);
+  }
+  for (i = 0; i < nelts; i++) {
+    slot = names[i].key_hash % hash->size;
+    elt = hash->buckets[slot];
+    for (n = 0; elt[n].name.data; n++)
+      ;
+    elt[n].name.len = names[i].key.len;
+    elt[n].name.data = ngx_palloc(hinit->pool, names[i].key.len + 1);
+    if (!elt[n].name.data)
+      return (NGX_ERROR);
+    for (j = 0; j < names[i].key.len; j++)
+      elt[n].name.data[j] = ngx_tolower(names[i].key.data[j]);
+    elt[n].key = names[i].key_hash;
+    elt[n].value = names[i].value;
+  }
+  free(count);
+  return (NGX_OK);
+}
+
+void *
+ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
+{
+  ngx_stub_hash_elt_t	*elt;
+
+  if (!hash->buckets)
+    return (NULL);
+  for (elt = hash->buckets[key % hash->size]; elt && elt->name.data; elt++)
+    if (elt->key == key && elt->name.len == len &&
+	!ngx_strncmp(elt->name.data, name, len))
+      return (elt->value);
+  return (NULL);
+}
+
+ngx_int_t
+ngx_strncasecmp(u_char *s1, u_char *s2, size_t n)
+{
+  return (strncasecmp((const char *) s1, (const char *) s2, n));
+}
+
+/* as nginx : compiled with rc->options, studied later (here : never) */
+ngx_int_t
+ngx_regex_compile(ngx_regex_compile_t *rc)
+{
+  const char	*err;
+  int		erroff;
+
+  rc->regex = ngx_pcalloc(rc->pool, sizeof(ngx_regex_t));
+  if (!rc->regex)
+    return (NGX_ERROR);
+  rc->regex->code = pcre_compile((const char *) rc->pattern.data,
+				 (int) rc->options, &err, &erroff, NULL);
+  if (!rc->regex->code) {
+    rc->err.data = (u_char *) err;
+    rc->err.len = strlen(err);
+    return (NGX_ERROR);
+  }
+  return (NGX_OK);
+}
+
+u_char *
+ngx_strcasestrn(u_char *s1, char *s2, size_t n)
+{
+  size_t	len;
+
+  /* as nginx, n is the length of s2 minus its first char */
+  len = n + 1;
+  for (; *s1; s1++)
+    if (!ngx_strncasecmp(s1, (u_char *) s2, len))
+      return (s1);
+  return (NULL);
+}
+
+/*
+** the nginx formats naxsi uses : %V, %s, %d, %i, %ui, %uA, %uL, %O,
+** %p and %%. Width and precision are not supported.
+*/
+u_char *
+ngx_vslprintf(u_char *buf, u_char *last, const char *fmt, va_list args)
+{
+  ngx_str_t	*v;
+  char		num[64], *str;
+  size_t	len;
+
+  for (; *fmt && buf < last; fmt++) {
+    if (*fmt != '%') {
+      *buf++ = *fmt;
+      continue;
+    }
+    fmt++;
+    str = num;
+    if (*fmt == 'V') {
+      v = va_arg(args, ngx_str_t *);
+      str = (char *) v->data;
+      len = v->len;
+    }
+    else if (*fmt == 's') {
+      str = va_arg(args, char *);
+      len = strlen(str);
+    }
+    else if (*fmt == 'd')
+      len = sprintf(num, "%d", va_arg(args, int));
+    else if (*fmt == 'i')
+      len = sprintf(num, "%ld", (long) va_arg(args, ngx_int_t));
+    else if (*fmt == 'O')
+      len = sprintf(num, "%lld", (long long) va_arg(args, off_t));
+    else if (*fmt == 'p')
+      len = sprintf(num, "%p", va_arg(args, void *));
+    else if (*fmt == 'u' && fmt[1] == 'L') {
+      fmt++;
+      len = sprintf(num, "%llu", (unsigned long long) va_arg(args, uint64_t));
+    }
+    else if (*fmt == 'u' && (fmt[1] == 'i' || fmt[1] == 'A')) {
+      fmt++;
+      len = sprintf(num, "%lu", (unsigned long) va_arg(args, ngx_uint_t));
+    }
+    else
+      len = sprintf(num, "%c", *fmt);
+    len = ngx_min(len, (size_t) (last - buf));
+    buf = ngx_cpymem(buf, str, len);
+  }
+  return (buf);
+}
+
+u_char *
+ngx_sprintf(u_char *buf, const char *fmt, ...)
+{
+  va_list	args;
+  u_char	*p;
+
+  va_start(args, fmt);
+  p = ngx_vslprintf(buf, (u_char *) -1, fmt, args);
+  va_end(args);
+  return (p);
+}
+
+/* %-escapes controls, spaces and the uri/args separators, as nginx */
+uintptr_t
+ngx_escape_uri(u_char *dst, u_char *src, size_t size, ngx_uint_t type)
+{
+  static u_char	hex[] = "0123456789ABCDEF";
+  uintptr_t	n;
+  int		esc;
+
+  n = 0;
+  while (size--) {
+    esc = (*src <= 0x20 || *src >= 0x7f || *src == '"' || *src == '#' ||
+	   *src == '%' || *src == '\'' || *src == '<' || *src == '>' ||
+	   (*src == '?' && type == NGX_ESCAPE_URI) ||
+	   ((*src == '&' || *src == '+' || *src == '=' || *src == '?') &&
+	    type == NGX_ESCAPE_ARGS));
+    if (!dst) {
+      n += esc;
+      src++;
+      continue;
+    }
+    if (esc) {
+      *dst++ = '%';
+      *dst++ = hex[*src >> 4];
+      *dst++ = hex[*src & 0xf];
+      src++;
+    }
+    else
+      *dst++ = *src++;
+  }
+  return (dst ? (uintptr_t) dst : n);
+}
+
+ssize_t
+ngx_read_file(ngx_file_t *file, u_char *buf, size_t size, off_t offset)
+{
+  return (pread(file->fd, buf, size, offset));
+}
+
+ngx_module_t				ngx_http_core_module = { 0 };
+ngx_http_request_body_filter_pt	ngx_http_top_request_body_filter;
+
+ngx_int_t
+ngx_http_internal_redirect(ngx_http_request_t *r, ngx_str_t *uri,
+			   ngx_str_t *args)
+{
+  (void) r;
+  (void) uri;
+  (void) args;
+  return (NGX_DONE);
+}
+
+void
+ngx_http_core_run_phases(ngx_http_request_t *r)
+{
+  (void) r;
+}
+
+ngx_int_t
+ngx_http_read_client_request_body(ngx_http_request_t *r,
+				  ngx_http_client_body_handler_pt post_handler)
+{
+  post_handler(r);
+  return (NGX_OK);
+}
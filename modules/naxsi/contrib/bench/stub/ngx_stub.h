@@ -0,0 +1,404 @@
+/*
+** Minimal stand-in for the nginx core headers, just enough to build
+** the naxsi sources outside of an nginx tree (see ../README).
+** Types and macros mimic nginx 1.9.x, functions live in ngx_stub.c.
+*/
+
+#ifndef __NGX_STUB_H__
+#define __NGX_STUB_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pcre.h>
+
+#define nginx_version		1009004
+#define NGINX_VERSION		"1.9.4"
+
+#define ngx_inline		inline
+
+typedef intptr_t		ngx_int_t;
+typedef uintptr_t		ngx_uint_t;
+typedef intptr_t		ngx_flag_t;
+typedef unsigned char		u_char;
+
+#define NGX_OK			0
+#define NGX_ERROR		-1
+#define NGX_AGAIN		-2
+#define NGX_BUSY		-3
+#define NGX_DONE		-4
+#define NGX_DECLINED		-5
+#define NGX_ABORT		-6
+
+#define NGX_CONF_OK		NULL
+#define NGX_CONF_ERROR		(void *) -1
+
+#define NGX_LOG_STDERR		0
+#define NGX_LOG_EMERG		1
+#define NGX_LOG_ALERT		2
+#define NGX_LOG_CRIT		3
+#define NGX_LOG_ERR		4
+#define NGX_LOG_WARN		5
+#define NGX_LOG_NOTICE		6
+#define NGX_LOG_INFO		7
+#define NGX_LOG_DEBUG		8
+#define NGX_LOG_DEBUG_HTTP	0x100
+
+#define NGX_UNESCAPE_URI	1
+#define NGX_UNESCAPE_REDIRECT	2
+
+typedef struct
+{
+  size_t	len;
+  u_char	*data;
+} ngx_str_t;
+
+#define ngx_string(str)		{ sizeof(str) - 1, (u_char *) str }
+#define ngx_null_string		{ 0, NULL }
+#define ngx_str_set(str, text)						\
+  (str)->len = sizeof(text) - 1; (str)->data = (u_char *) text
+
+typedef struct ngx_pool_s	ngx_pool_t;
+typedef struct ngx_http_request_s	ngx_http_request_t;
+/* only used through pointers by the benchmarked code */
+typedef struct ngx_command_s	ngx_command_t;
+typedef struct ngx_shm_zone_s	ngx_shm_zone_t;
+typedef struct ngx_open_file_s	ngx_open_file_t;
+
+typedef uintptr_t		ngx_atomic_uint_t;
+typedef volatile ngx_atomic_uint_t	ngx_atomic_t;
+#define ngx_memory_barrier()	__sync_synchronize()
+typedef int			ngx_socket_t;
+typedef int			ngx_fd_t;
+typedef ngx_uint_t		ngx_msec_t;
+
+/* embedded in the learning sink, never used by the bench */
+typedef struct
+{
+  void		*data;
+} ngx_event_t;
+
+typedef struct
+{
+  ngx_uint_t	log_level;
+} ngx_log_t;
+
+typedef struct
+{
+  ngx_pool_t	*pool;
+  ngx_log_t	*log;
+} ngx_cycle_t;
+
+typedef struct
+{
+  void		*elts;
+  ngx_uint_t	nelts;
+  size_t	size;
+  ngx_uint_t	nalloc;
+  ngx_pool_t	*pool;
+} ngx_array_t;
+
+typedef struct
+{
+  ngx_str_t	*name;
+  ngx_array_t	*args;
+  ngx_pool_t	*pool;
+  ngx_pool_t	*temp_pool;
+  ngx_log_t	*log;
+  void		*ctx;
+} ngx_conf_t;
+
+typedef struct
+{
+  void		**buckets;
+  ngx_uint_t	size;
+} ngx_hash_t;
+
+typedef struct
+{
+  ngx_str_t	key;
+  ngx_uint_t	key_hash;
+  void		*value;
+} ngx_hash_key_t;
+
+typedef ngx_uint_t (*ngx_hash_key_pt) (u_char *data, size_t len);
+
+typedef struct
+{
+  ngx_hash_t	*hash;
+  ngx_hash_key_pt key;
+  ngx_uint_t	max_size;
+  ngx_uint_t	bucket_size;
+  char		*name;
+  ngx_pool_t	*pool;
+  ngx_pool_t	*temp_pool;
+} ngx_hash_init_t;
+
+typedef struct
+{
+  pcre		*code;
+  pcre_extra	*extra;
+} ngx_regex_t;
+
+typedef struct
+{
+  ngx_str_t	pattern;
+  ngx_pool_t	*pool;
+  ngx_int_t	options;
+  ngx_regex_t	*regex;
+  int		captures;
+  int		named_captures;
+  int		name_size;
+  u_char	*names;
+  ngx_str_t	err;
+} ngx_regex_compile_t;
+
+/*
+** request side, only the fields naxsi_runtime.c and naxsi_body.c use.
+** Module configurations and contexts are indexed by ctx_index, as in
+** nginx : a replay program fills r->main_conf, r->loc_conf and r->ctx.
+*/
+typedef struct
+{
+  ngx_uint_t	ctx_index;
+} ngx_module_t;
+
+typedef struct
+{
+  ngx_str_t	name;
+  ngx_str_t	post_action;
+} ngx_http_core_loc_conf_t;
+
+typedef struct
+{
+  ngx_uint_t	dummy;
+} ngx_http_core_main_conf_t;
+
+typedef struct ngx_list_part_s	ngx_list_part_t;
+
+struct ngx_list_part_s
+{
+  void			*elts;
+  ngx_uint_t		nelts;
+  ngx_list_part_t	*next;
+};
+
+typedef struct
+{
+  ngx_list_part_t	*last;
+  ngx_list_part_t	part;
+  size_t		size;
+  ngx_uint_t		nalloc;
+  ngx_pool_t		*pool;
+} ngx_list_t;
+
+typedef struct
+{
+  ngx_uint_t	hash;
+  ngx_str_t	key;
+  ngx_str_t	value;
+  u_char	*lowcase_key;
+} ngx_table_elt_t;
+
+typedef struct
+{
+  ngx_fd_t	fd;
+  ngx_str_t	name;
+  ngx_log_t	*log;
+} ngx_file_t;
+
+typedef struct
+{
+  ngx_file_t	file;
+} ngx_temp_file_t;
+
+typedef struct
+{
+  u_char	*pos;
+  u_char	*last;
+  off_t		file_pos;
+  off_t		file_last;
+  u_char	*start;
+  u_char	*end;
+  ngx_file_t	*file;
+  unsigned	temporary:1;
+  unsigned	memory:1;
+  unsigned	in_file:1;
+  unsigned	last_buf:1;
+} ngx_buf_t;
+
+typedef struct ngx_chain_s	ngx_chain_t;
+
+struct ngx_chain_s
+{
+  ngx_buf_t	*buf;
+  ngx_chain_t	*next;
+};
+
+#define ngx_buf_in_memory(b)	((b)->temporary || (b)->memory)
+
+typedef ngx_int_t (*ngx_http_request_body_filter_pt)
+  (ngx_http_request_t *r, ngx_chain_t *chain);
+
+typedef struct
+{
+  ngx_temp_file_t	*temp_file;
+  ngx_chain_t		*bufs;
+} ngx_http_request_body_t;
+
+typedef struct
+{
+  ngx_log_t	*log;
+  ngx_str_t	addr_text;
+} ngx_connection_t;
+
+typedef struct
+{
+  ngx_list_t		headers;
+  ngx_str_t		server;
+  ngx_table_elt_t	*content_type;
+  off_t			content_length_n;
+} ngx_http_headers_in_t;
+
+typedef void (*ngx_http_client_body_handler_pt) (ngx_http_request_t *r);
+
+struct ngx_http_request_s
+{
+  ngx_connection_t		*connection;
+  void				**ctx;
+  void				**main_conf;
+  void				**loc_conf;
+  ngx_pool_t			*pool;
+  ngx_http_headers_in_t		headers_in;
+  ngx_http_request_body_t	*request_body;
+  ngx_uint_t			method;
+  ngx_str_t			uri;
+  ngx_str_t			args;
+  ngx_http_request_t		*main;
+  unsigned			count:16;
+  unsigned			internal:1;
+};
+
+#define NGX_HTTP_GET			0x0002
+#define NGX_HTTP_HEAD			0x0004
+#define NGX_HTTP_POST			0x0008
+#define NGX_HTTP_PUT			0x0010
+#define NGX_HTTP_OK			200
+#define NGX_HTTP_SPECIAL_RESPONSE	300
+#define NGX_HTTP_NOT_ALLOWED		405
+#define NGX_HTTP_INTERNAL_SERVER_ERROR	500
+#define NGX_HTTP_SERVICE_UNAVAILABLE	503
+
+#define NGX_ESCAPE_URI		0
+#define NGX_ESCAPE_ARGS		1
+
+#define NGX_INT_T_LEN		(sizeof("-9223372036854775808") - 1)
+#define NGX_INT64_LEN		(sizeof("-9223372036854775808") - 1)
+#define NGX_ATOMIC_T_LEN	(sizeof("-9223372036854775808") - 1)
+
+#define ngx_http_get_module_ctx(r, module)	(r)->ctx[module.ctx_index]
+#define ngx_http_set_ctx(r, c, module)	(r)->ctx[module.ctx_index] = c;
+#define ngx_http_get_module_main_conf(r, module)			\
+  (r)->main_conf[module.ctx_index]
+#define ngx_http_get_module_loc_conf(r, module)	(r)->loc_conf[module.ctx_index]
+
+extern ngx_module_t	ngx_http_core_module;
+/* naxsi_skeleton.c is not built : replay programs define it */
+extern ngx_module_t	ngx_http_naxsi_module;
+extern ngx_http_request_body_filter_pt	ngx_http_top_request_body_filter;
+
+#define ngx_tolower(c)		(u_char) ((c >= 'A' && c <= 'Z') ? (c | 0x20) : c)
+#define ngx_toupper(c)		(u_char) ((c >= 'a' && c <= 'z') ? (c & ~0x20) : c)
+#define ngx_memzero(buf, n)	(void) memset(buf, 0, n)
+#define ngx_memset(buf, c, n)	(void) memset(buf, c, n)
+#define ngx_memcpy(dst, src, n)	(void) memcpy(dst, src, n)
+#define ngx_memmove(dst, src, n)	(void) memmove(dst, src, n)
+#define ngx_memcmp(s1, s2, n)	memcmp((const char *) s1, (const char *) s2, n)
+#define ngx_cpymem(dst, src, n)	(((u_char *) memcpy(dst, src, n)) + (n))
+#define ngx_strlen(s)		strlen((const char *) s)
+#define ngx_strcmp(s1, s2)	strcmp((const char *) s1, (const char *) s2)
+#define ngx_strncmp(s1, s2, n)	strncmp((const char *) s1, (const char *) s2, n)
+#define ngx_strstr(s1, s2)	strstr((const char *) s1, (const char *) s2)
+#define ngx_strchr(s1, c)	strchr((const char *) s1, (int) c)
+#define ngx_qsort		qsort
+#define ngx_min(a, b)		((a > b) ? (b) : (a))
+#define ngx_max(a, b)		((a < b) ? (b) : (a))
+#define ngx_align(d, a)		(((d) + (a - 1)) & ~(a - 1))
+#define ngx_errno		errno
+
+typedef struct stat		ngx_file_info_t;
+
+#define NGX_INVALID_FILE	-1
+#define NGX_FILE_ERROR		-1
+#define NGX_FILE_RDONLY		O_RDONLY
+#define NGX_FILE_OPEN		0
+#define ngx_open_file(name, mode, create, access)			\
+  open((const char *) name, mode|create, access)
+#define ngx_open_file_n		"open()"
+#define ngx_fd_info(fd, sb)	fstat(fd, sb)
+#define ngx_fd_info_n		"fstat()"
+#define ngx_file_size(sb)	(sb)->st_size
+#define ngx_close_file		close
+#define ngx_libc_cdecl
+
+#define ngx_log_debug(level, log, err, ...)
+#define ngx_log_error(level, log, err, ...)				\
+  ngx_stub_log(level, __VA_ARGS__)
+
+void		ngx_stub_log(ngx_uint_t level, const char *fmt, ...);
+void		ngx_conf_log_error(ngx_uint_t level, ngx_conf_t *cf,
+				   int err, const char *fmt, ...);
+
+ngx_pool_t	*ngx_create_pool(size_t size, ngx_log_t *log);
+void		ngx_destroy_pool(ngx_pool_t *pool);
+void		*ngx_palloc(ngx_pool_t *pool, size_t size);
+void		*ngx_pnalloc(ngx_pool_t *pool, size_t size);
+void		*ngx_pcalloc(ngx_pool_t *pool, size_t size);
+ngx_int_t	ngx_pfree(ngx_pool_t *pool, void *p);
+
+ngx_array_t	*ngx_array_create(ngx_pool_t *p, ngx_uint_t n, size_t size);
+void		*ngx_array_push(ngx_array_t *a);
+ngx_int_t	ngx_list_init(ngx_list_t *list, ngx_pool_t *pool, ngx_uint_t n,
+			      size_t size);
+void		*ngx_list_push(ngx_list_t *l);
+
+ngx_uint_t	ngx_hash_key_lc(u_char *data, size_t len);
+ngx_uint_t	ngx_hash_strlow(u_char *dst, u_char *src, size_t n);
+ngx_int_t	ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+			      ngx_uint_t nelts);
+void		*ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name,
+			       size_t len);
+
+ngx_int_t	ngx_regex_compile(ngx_regex_compile_t *rc);
+
+ngx_int_t	ngx_strncasecmp(u_char *s1, u_char *s2, size_t n);
+u_char		*ngx_strcasestrn(u_char *s1, char *s2, size_t n);
+u_char		*ngx_sprintf(u_char *buf, const char *fmt, ...);
+u_char		*ngx_vslprintf(u_char *buf, u_char *last, const char *fmt,
+			       va_list args);
+uintptr_t	ngx_escape_uri(u_char *dst, u_char *src, size_t size,
+			       ngx_uint_t type);
+ssize_t		ngx_read_file(ngx_file_t *file, u_char *buf, size_t size,
+			      off_t offset);
+
+/* nginx request processing, never reached by replay programs */
+ngx_int_t	ngx_http_internal_redirect(ngx_http_request_t *r,
+					   ngx_str_t *uri, ngx_str_t *args);
+void		ngx_http_core_run_phases(ngx_http_request_t *r);
+ngx_int_t	ngx_http_read_client_request_body(ngx_http_request_t *r,
+						  ngx_http_client_body_handler_pt post_handler);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+** naxsi ruleset compiler.
+** Parses the MainRule, BasicRule whitelist (wl:) and CheckRule lines
+** of a rules file with naxsi's own parsers and writes the compiled
+** image loaded by naxsi_ruleset
+** (see naxsi_ruleset.c). The image is written to a temporary file
+** then renamed, so that a running nginx never maps a partial one.
+** With -c, the image is loaded back the way nginx does, and rule
+** counts and load time are printed.
+** Whitelists and CheckRules of the image apply in every location.
+**
+** usage : naxsi_rulesc [-c] rules output
+*/
+
+#include <time.h>
+#include "naxsi.h"
+
+#define RULESC_MAX_ARGS		32
+/* dummy_str and friends may read a few bytes past tokens */
+#define RULESC_SLACK		8
+
+static ngx_log_t	rulesc_log;
+static ngx_conf_t	rulesc_cf;
+static ngx_array_t	*rulesc_rules;
+static ngx_array_t	*rulesc_whitelists;
+static ngx_array_t	*rulesc_check_rules;
+
+static int
+load_file(const char *path, u_char **data, size_t *len)
+{
+  FILE	*f;
+  long	l;
+
+  f = fopen(path, "rb");
+  if (!f || fseek(f, 0, SEEK_END) || (l = ftell(f)) < 0) {
+    perror(path);
+    return (-1);
+  }
+  rewind(f);
+  *data = calloc(1, l + 1);
+  *len = fread(*data, 1, l, f);
+  fclose(f);
+  return (0);
+}
+
+/*
+** next token, as nginx config parser cuts them : blanks separated,
+** "..." or '...' quoted with \", \', \\, \t, \r and \n escapes.
+** Returns 1 on ';', 0 on a token, -1 at end of file.
+*/
+static int
+next_token(u_char **pos, u_char *end, ngx_str_t *tok, ngx_uint_t *line)
+{
+  u_char	*p, *d, quote;
+
+  p = *pos;
+  for (;;) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+      if (*p == '\n')
+	(*line)++;
+      p++;
+    }
+    if (p < end && *p == '#') {
+      while (p < end && *p != '\n')
+	p++;
+      continue;
+    }
+    break;
+  }
+  if (p >= end)
+    return (-1);
+  if (*p == ';') {
+    *pos = p + 1;
+    return (1);
+  }
+  tok->data = d = calloc(1, end - p + RULESC_SLACK);
+  quote = (*p == '"' || *p == '\'') ? *p++ : 0;
+  while (p < end) {
+    if (quote && *p == quote) {
+      p++;
+      break;
+    }
+    if (!quote && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' ||
+		   *p == ';'))
+      break;
+    if (*p == '\\' && p + 1 < end) {
+      p++;
+      if (*p == 't')
+	*d++ = '\t';
+      else if (*p == 'r')
+	*d++ = '\r';
+      else if (*p == 'n')
+	*d++ = '\n';
+      else if (*p == '"' || *p == '\'' || *p == '\\')
+	*d++ = *p;
+      else {
+	*d++ = '\\';
+	*d++ = *p;
+      }
+      p++;
+      continue;
+    }
+    if (*p == '\n')
+      (*line)++;
+    *d++ = *p++;
+  }
+  tok->len = d - tok->data;
+  *pos = p;
+  return (0);
+}
+
+/* one line : a MainRule, a BasicRule whitelist or a CheckRule */
+static int
+parse_line(const char *path, ngx_uint_t start, ngx_str_t *args, ngx_uint_t nb)
+{
+  ngx_http_rule_t	*rule;
+  ngx_http_check_rule_t	*cr;
+
+  if (!ngx_strcmp(args[0].data, TOP_CHECK_RULE_T)) {
+    cr = ngx_array_push(rulesc_check_rules);
+    if (!cr)
+      return (-1);
+    if (nb != 3 || 
+	ngx_http_dummy_cfg_parse_check_rule(&rulesc_cf, args, cr) != NGX_CONF_OK) {
+      fprintf(stderr, "%s:%d: invalid CheckRule\n", path, (int) start);
+      return (-1);
+    }
+    return (0);
+  }
+  if (!ngx_strcmp(args[0].data, TOP_MAIN_BASIC_RULE_T))
+    rule = ngx_array_push(rulesc_rules);
+  else if (!ngx_strcmp(args[0].data, TOP_BASIC_RULE_T))
+    rule = ngx_array_push(rulesc_whitelists);
+  else {
+    fprintf(stderr, "%s:%d: %s ignored, only MainRule, BasicRule wl: and "
+	    "CheckRule can be compiled\n", path, (int) start, args[0].data);
+    return (0);
+  }
+  if (!rule)
+    return (-1);
+  ngx_memzero(rule, sizeof(ngx_http_rule_t));
+  if (ngx_http_dummy_cfg_parse_one_rule(&rulesc_cf, args, rule,
+					nb) != NGX_CONF_OK) {
+    fprintf(stderr, "%s:%d: invalid %s\n", path, (int) start, args[0].data);
+    return (-1);
+  }
+  /* location BasicRules (str:, rx:) stay in nginx.conf */
+  if (!ngx_strcmp(args[0].data, TOP_BASIC_RULE_T)) {
+    if (!rule->wl_id || !rule->br) {
+      fprintf(stderr, "%s:%d: BasicRule without wl:\n", path, (int) start);
+      return (-1);
+    }
+    return (0);
+  }
+  if (rule->wl_id || !rule->br || (!rule->br->str && !rule->br->rx)) {
+    fprintf(stderr, "%s:%d: MainRule without str: or rx:\n", path,
+	    (int) start);
+    return (-1);
+  }
+  return (0);
+}
+
+static int
+parse_rules(const char *path)
+{
+  ngx_str_t		args[RULESC_MAX_ARGS];
+  ngx_uint_t		nb, line, start;
+  u_char		*data, *p, *end;
+  size_t		len;
+  int			ret;
+
+  if (load_file(path, &data, &len) < 0)
+    return (-1);
+  p = data;
+  end = data + len;
+  line = 1;
+  nb = 0;
+  start = line;
+  while ((ret = next_token(&p, end, &(args[nb]), &line)) >= 0) {
+    if (ret == 0) {
+      if (!nb)
+	start = line;
+      if (++nb == RULESC_MAX_ARGS) {
+	fprintf(stderr, "%s:%d: too many arguments\n", path, (int) start);
+	return (-1);
+      }
+      continue;
+    }
+    if (!nb)
+      continue;
+    if (parse_line(path, start, args, nb) < 0)
+      return (-1);
+    nb = 0;
+  }
+  if (nb) {
+    fprintf(stderr, "%s: unexpected end of file, missing ';'\n", path);
+    return (-1);
+  }
+  return (0);
+}
+
+static int
+write_image(const char *path, u_char *image, size_t size)
+{
+  char	tmp[4096];
+  FILE	*f;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  f = fopen(tmp, "wb");
+  if (!f) {
+    perror(tmp);
+    return (-1);
+  }
+  if (fwrite(image, 1, size, f) != size || fclose(f)) {
+    perror(tmp);
+    unlink(tmp);
+    return (-1);
+  }
+  if (rename(tmp, path)) {
+    perror(path);
+    unlink(tmp);
+    return (-1);
+  }
+  return (0);
+}
+
+static double
+now(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/* load the image back, as naxsi_ruleset does */
+static int
+check_image(const char *path, ngx_uint_t expected)
+{
+  ngx_http_dummy_ruleset_t	*rs;
+  ngx_http_dummy_main_conf_t	main_cf;
+  ngx_str_t			name;
+  double			start;
+
+  name.data = (u_char *) path;
+  name.len = strlen(path);
+  start = now();
+  rs = ngx_http_dummy_ruleset_load(&rulesc_cf, &name);
+  if (!rs)
+    return (-1);
+  /* no configuration here : rule ids are not numbered */
+  ngx_memzero(&main_cf, sizeof(ngx_http_dummy_main_conf_t));
+  if (ngx_http_dummy_ruleset_whitelists(&rulesc_cf, rulesc_cf.pool, &main_cf, 
+					rs) != NGX_OK) {
+    fprintf(stderr, "%s: whitelists can't be compiled\n", path);
+    return (-1);
+  }
+  printf("%s: %d rules loaded in %.0fus (generic %d, get %d, body %d, "
+	 "headers %d), %d whitelists, %d CheckRules\n", path, 
+	 (int) rs->nb_rules, (now() - start) * 1e6,
+	 rs->generic_rules ? (int) rs->generic_rules->nelts : 0,
+	 rs->get_rules ? (int) rs->get_rules->nelts : 0,
+	 rs->body_rules ? (int) rs->body_rules->nelts : 0,
+	 rs->header_rules ? (int) rs->header_rules->nelts : 0,
+	 (rs->wl && rs->wl->whitelist_rules) ? 
+	 (int) rs->wl->whitelist_rules->nelts : 0,
+	 (rs->wl && rs->wl->check_rules) ? 
+	 (int) rs->wl->check_rules->nelts : 0);
+  if (rs->nb_rules != expected) {
+    fprintf(stderr, "%s: %d rules compiled, %d loaded\n", path,
+	    (int) expected, (int) rs->nb_rules);
+    return (-1);
+  }
+  return (0);
+}
+
+int
+main(int ac, char **av)
+{
+  u_char	*image;
+  size_t	size;
+  int		opt, check;
+
+  check = 0;
+  while ((opt = getopt(ac, av, "c")) != -1) {
+    if (opt == 'c')
+      check = 1;
+    else
+      optind = ac;
+  }
+  if (ac - optind != 2) {
+    fprintf(stderr, "usage: %s [-c] rules output\n", av[0]);
+    return (1);
+  }
+  rulesc_log.log_level = NGX_LOG_ERR;
+  rulesc_cf.log = &rulesc_log;
+  rulesc_cf.pool = ngx_create_pool(16384, &rulesc_log);
+  rulesc_cf.temp_pool = rulesc_cf.pool;
+  if (!rulesc_cf.pool)
+    return (1);
+  rulesc_rules = ngx_array_create(rulesc_cf.pool, 64, sizeof(ngx_http_rule_t));
+  rulesc_whitelists = ngx_array_create(rulesc_cf.pool, 8, 
+				       sizeof(ngx_http_rule_t));
+  rulesc_check_rules = ngx_array_create(rulesc_cf.pool, 4, 
+					sizeof(ngx_http_check_rule_t));
+  if (!rulesc_rules || !rulesc_whitelists || !rulesc_check_rules ||
+      parse_rules(av[optind]) < 0)
+    return (1);
+  image = ngx_http_dummy_ruleset_build(rulesc_cf.pool, rulesc_rules,
+				       rulesc_whitelists, rulesc_check_rules,
+				       &size);
+  if (!image) {
+    fprintf(stderr, "%s: unable to build ruleset\n", av[optind]);
+    return (1);
+  }
+  if (write_image(av[optind + 1], image, size) < 0)
+    return (1);
+  printf("%s: %d rules, %d whitelists, %d CheckRules, %d bytes\n", 
+	 av[optind + 1], (int) rulesc_rules->nelts, 
+	 (int) rulesc_whitelists->nelts, (int) rulesc_check_rules->nelts, 
+	 (int) size);
+  if (check && check_image(av[optind + 1], rulesc_rules->nelts) < 0)
+    return (2);
+  return (0);
+}
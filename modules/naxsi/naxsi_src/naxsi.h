@@ -44,6 +44,40 @@
 #include <pcre.h>
 #include <ctype.h>
 
+/* sse2/avx2 strfaststr kernels, needs target("avx2") support (gcc >= 4.9) */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) &&	\
+  (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define NAXSI_HAVE_SIMD 1
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define NAXSI_HAVE_SIMD 0
+#endif
+
+/* PCRE JIT is available since pcre 8.20 */
+#if defined(PCRE_STUDY_JIT_COMPILE)
+#define NAXSI_HAVE_PCRE_JIT 1
+#else
+#define NAXSI_HAVE_PCRE_JIT 0
+#endif
+
+/* compiled pcre of a rx: rule, ngx_regex_t layout changed over time */
+#if defined nginx_version && (nginx_version >= 1002002 && nginx_version != 1003000)
+#define naxsi_rx_code(rx)	((rx)->regex->code)
+#define naxsi_rx_extra(rx)	((rx)->regex->extra)
+#define NAXSI_RX_HAVE_EXTRA	1
+#elif defined nginx_version && (nginx_version > 1001011)
+#define naxsi_rx_code(rx)	((rx)->regex->pcre)
+#define naxsi_rx_extra(rx)	NULL
+#define NAXSI_RX_HAVE_EXTRA	0
+#elif defined nginx_version
+#define naxsi_rx_code(rx)	((pcre *) (rx)->regex)
+#define naxsi_rx_extra(rx)	NULL
+#define NAXSI_RX_HAVE_EXTRA	0
+#else
+#error "nginx_version not defined."
+#endif
+
 
 extern ngx_module_t ngx_http_naxsi_module;
 
@@ -119,6 +153,23 @@ typedef struct
 
 #define WEIRD_REQUEST_INTERNAL_RULE_ID 1
 #define BIG_BODY_INTERNAL_RULE_ID 2
+
+/*
+** set of whitelisted rule ids. rules are numbered at init time by
+** the position of their id in main_cf->rule_ids (rule->id_index), 
+** a whitelist check is then a bit test.
+*/
+typedef struct
+{
+  /* wl:0, every rule */
+  ngx_flag_t		all;
+  uintptr_t		*bits;
+} ngx_http_dummy_idset_t;
+
+#define NAXSI_IDSET_BITS	(8 * sizeof(uintptr_t))
+#define naxsi_idset_test(s, n)						\
+  ((s)->all || (((s)->bits[(n) / NAXSI_IDSET_BITS] >>			\
+		 ((n) % NAXSI_IDSET_BITS)) & 1))
 typedef struct
 {
   /* match in full body (POST DATA) */
@@ -165,6 +216,8 @@ typedef struct
   ngx_str_t			*name;
   ngx_int_t			hash;
   ngx_array_t			*ids;
+  /* ids, compiled */
+  ngx_http_dummy_idset_t	*idset;
 } ngx_http_whitelist_rule_t;
 
 
@@ -172,6 +225,17 @@ typedef struct
 
 
 
+/*
+** transforms applied to a name/value before matching, see
+** ngx_http_dummy_normalize(). URLDECODE|NULLZERO is what every
+** args value goes through, rules can ask for more with t:
+*/
+#define NAXSI_T_URLDECODE	0x01
+#define NAXSI_T_REMOVENULLS	0x02
+#define NAXSI_T_COMPRESSWS	0x04
+#define NAXSI_T_LOWERCASE	0x08
+#define NAXSI_T_NULLZERO	0x10
+
 /* basic rule */
 typedef struct
 {
@@ -204,6 +268,8 @@ typedef struct
   ngx_array_t		*custom_locations;
   /* ~~~~~~~ specific flags ~~~~~~~~~ */
   ngx_flag_t		negative:1;
+  /* rx: can be part of a combined regex, see naxsi_rx.c */
+  ngx_flag_t		rx_combinable:1;
 } ngx_http_basic_rule_t;
 
 
@@ -222,12 +288,14 @@ typedef struct
 /*
 ** This struct is used to store custom scores at runtime.
 **  ie : $XSS = 7
-** tag is the $XSS and sc_score is 7
+** scores are indexed by the id of the tag ($XSS, see
+** main_cf->sc_tags) and sc_score is 7
 */
 typedef struct
 {
-  ngx_str_t	*sc_tag;
   ngx_int_t	sc_score;
+  /* set once a rule scored on this tag */
+  ngx_flag_t	hit:1;
 } ngx_http_special_score_t;
 
 /*
@@ -238,6 +306,8 @@ typedef struct
 typedef struct
 {
   ngx_str_t	sc_tag;
+  /* position of sc_tag in main_cf->sc_tags */
+  ngx_uint_t	sc_tag_id;
   ngx_int_t	sc_score;
   ngx_int_t	cmp;
   ngx_flag_t	block:1;
@@ -271,8 +341,441 @@ typedef struct
   /* pointers on specific rule stuff */
   ngx_http_flag_rule_t		*fr;
   ngx_http_basic_rule_t		*br;
+  /* position of rule_id in main_cf->rule_ids */
+  ngx_uint_t			id_index;
+  /* position of sc_tag in main_cf->sc_tags */
+  ngx_uint_t			sc_tag_id;
 } ngx_http_rule_t;
 
+/*
+** Aho-Corasick automaton holding all the str: rules of a ruleset
+** that apply to one match zone (see naxsi_ac.c).
+** Transitions are stored as a full DFA over a compressed,
+** case-folded alphabet : delta[state * nb_classes + map[byte]]
+*/
+typedef struct
+{
+  ngx_uint_t		nb_states;
+  ngx_uint_t		nb_classes;
+  ngx_uint_t		nb_patterns;
+  u_char		map[256];
+  uint32_t		*delta;
+  /* first pattern ending on a state, -1 if none */
+  ngx_int_t		*out;
+  /* next state on the failure chain having an output, 0 if none */
+  uint32_t		*dict;
+  /* next pattern sharing the same string, -1 if none */
+  ngx_int_t		*next;
+  /* pattern index -> rule */
+  ngx_http_rule_t	**rules;
+} ngx_http_ac_t;
+
+/*
+** All the rx: rules of a ruleset that apply to one match zone,
+** compiled into a single regex (see naxsi_rx.c) :
+** (?>rx1)(?C)|(?>rx2)(?C)|...
+** every callout records the rule it follows, then fails.
+*/
+typedef struct
+{
+  pcre			*code;
+  pcre_extra		*extra;
+  ngx_flag_t		jit;
+  ngx_uint_t		nb_rules;
+  /* pattern offset following each rule's callout, ascending */
+  int			*callout_pos;
+  /* rule index -> rule */
+  ngx_http_rule_t	**rules;
+} ngx_http_rx_set_t;
+
+/*
+** rules of a ruleset that apply to one match zone (see naxsi_dispatch.c)
+*/
+typedef struct
+{
+  /* rules of the zone checked one by one (not by the automaton/rx set) */
+  ngx_http_rule_t	**rules;
+  ngx_uint_t		nb_rules;
+  /* custom location rules, lowercased var name -> ngx_array_t of rules */
+  ngx_hash_t		*custom;
+  size_t		custom_max_len;
+} ngx_http_dummy_dispatch_t;
+
+/*
+** fills zr[] with the ruleset that is checked against each match zone.
+** works with main, location and naxsi_ruleset configurations.
+*/
+#define ngx_http_dummy_zone_rules(zr, c) do {		\
+    (zr)[HEADERS] = (c)->header_rules;			\
+    (zr)[URL] = (c)->generic_rules;			\
+    (zr)[ARGS] = (c)->get_rules;			\
+    (zr)[BODY] = (c)->body_rules;			\
+    (zr)[FILE_EXT] = (c)->body_rules;			\
+  } while (0)
+
+/*
+** request body streaming inspection (see naxsi_body.c).
+** memory used per request is bounded whatever the body size :
+** values are inspected in windows of NAXSI_BODY_WINDOW bytes,
+** consecutive windows sharing NAXSI_BODY_OVERLAP bytes so that
+** a match spanning two chunks is not missed, as long as it is not
+** longer than NAXSI_BODY_OVERLAP bytes.
+*/
+#define NAXSI_BODY_WINDOW	32768
+#define NAXSI_BODY_OVERLAP	1024
+#define NAXSI_BODY_NAME_MAX	1024
+#define NAXSI_BODY_LINE_MAX	2048
+#define NAXSI_BODY_BOUNDARY_MAX	256
+#define NAXSI_BODY_READ		8192
+/* application/json : max nesting of objects/arrays */
+#define NAXSI_JSON_DEPTH_MAX	32
+
+enum NAXSI_BODY_TYPE {
+  NAXSI_BODY_NONE = 0,
+  NAXSI_BODY_URLENCODED,
+  NAXSI_BODY_MULTIPART,
+  NAXSI_BODY_JSON
+};
+
+typedef struct
+{
+  enum NAXSI_BODY_TYPE	type;
+  ngx_uint_t		state;
+  /* bytes received so far */
+  off_t			total;
+  /* current var name */
+  u_char		*name;
+  size_t		name_len;
+  /* current value window, [size] bytes */
+  u_char		*buf;
+  size_t		len;
+  size_t		size;
+  /* url-decoding state, carried across chunks */
+  ngx_uint_t		dstate;
+  u_char		dhex;
+  ngx_flag_t		windowed:1;
+  ngx_flag_t		has_eq:1;
+  ngx_flag_t		pending_weird:1;
+  ngx_flag_t		file:1;
+  ngx_flag_t		fed:1;
+  ngx_flag_t		done:1;
+  ngx_flag_t		jkey:1;
+  /* the window inspected is not the last one of its value */
+  ngx_flag_t		more:1;
+  /* negative rules (by id_index) whose pattern an earlier window of
+     the current value had, NULL until needed */
+  uintptr_t		*neg_seen;
+  /* multipart : "\r\n--" boundary, its KMP table and matched length */
+  u_char		*delim;
+  size_t		delim_len;
+  size_t		*kmp;
+  size_t		dmatch;
+  /* multipart : current part header line */
+  u_char		*line;
+  size_t		line_len;
+  ngx_uint_t		nb_lines;
+  /* read buffer for file-backed chains */
+  u_char		*rbuf;
+  /* json : open containers (bit set for arrays), length of the
+     key path at each depth, pending \uXXXX escape */
+  ngx_uint_t		jdepth;
+  uint64_t		jarray;
+  size_t		*jpath;
+  ngx_uint_t		jhex_n;
+  uint32_t		jcode;
+} ngx_http_dummy_body_t;
+
+/*
+** inspection phases, timed separately. NAXSI_PHASE_TOTAL is the
+** whole inspection of a request.
+*/
+enum NAXSI_PHASE {
+  NAXSI_PHASE_HEADERS = 0,
+  NAXSI_PHASE_URI,
+  NAXSI_PHASE_ARGS,
+  NAXSI_PHASE_BODY,
+  NAXSI_PHASE_TOTAL
+};
+
+/*
+** latency histograms, log2 scale : bucket 0 counts durations under
+** 1024ns, bucket i durations in [2^(9+i), 2^(10+i)[ ns, and the last
+** one everything above.
+*/
+#define NAXSI_HIST_BUCKETS	24
+
+/*
+** per-request costs, kept only with naxsi_slow_log : str: automatons,
+** combined rx: sets, then one slot per rule (by id_index).
+*/
+#define NAXSI_COST_AC		0
+#define NAXSI_COST_RX		1
+#define NAXSI_COST_RULES	2
+
+#define naxsi_cost_start(ctx)	((ctx)->rule_ns ? naxsi_now_ns() : 0)
+#define naxsi_cost_end(ctx, slot, start)				\
+  do {									\
+    if ((ctx)->rule_ns)							\
+      (ctx)->rule_ns[slot] += naxsi_now_ns() - (start);			\
+  } while (0)
+
+/*
+** statistics shared by all workers (naxsi_stats_zone, see naxsi_stats.c)
+*/
+typedef struct
+{
+  ngx_atomic_t		processed;
+  ngx_atomic_t		blocked;
+  /* time spent inspecting requests */
+  ngx_atomic_t		inspect_ns;
+  /* requests over naxsi_slow_log */
+  ngx_atomic_t		slow;
+  /* time spent in each phase, and its distribution */
+  ngx_atomic_t		phase_ns[NAXSI_PHASE_TOTAL];
+  ngx_atomic_t		hist[NAXSI_PHASE_TOTAL + 1][NAXSI_HIST_BUCKETS];
+} ngx_http_dummy_loc_stats_t;
+
+typedef struct
+{
+  /* number of (unwhitelisted) matches */
+  ngx_atomic_t		hits;
+  /* number of blocked requests the rule matched in */
+  ngx_atomic_t		blocked;
+  /* number of matches cancelled by a whitelist */
+  ngx_atomic_t		whitelisted;
+} ngx_http_dummy_rule_stats_t;
+
+typedef struct
+{
+  ngx_uint_t			nb_locations;
+  /* counters, see ngx_http_dummy_stats_pos */
+  ngx_uint_t			nb_rules;
+  /* main_cf->rule_ids when the zone was set up, to tell if it changed */
+  ngx_uint_t			nb_ids;
+  ngx_int_t			*ids;
+  ngx_http_dummy_loc_stats_t	*locations;
+  ngx_http_dummy_rule_stats_t	*rules;
+} ngx_http_dummy_stats_t;
+
+/*
+** learning sink (naxsi_learning_sink, see naxsi_learning.c)
+** one ring per worker, in shared memory. The worker owning a ring is
+** both its producer (requests) and its consumer (flush timer) :
+** head and tail are byte offsets, only ever increased, by one side each.
+*/
+typedef struct
+{
+  /* owner, 0 if free */
+  ngx_atomic_t		pid;
+  ngx_atomic_t		head;
+  ngx_atomic_t		tail;
+  /* events lost because the ring was full */
+  ngx_atomic_t		dropped;
+  size_t		size;
+  u_char		*data;
+} ngx_http_dummy_sink_ring_t;
+
+typedef struct
+{
+  ngx_uint_t			nb_rings;
+  ngx_http_dummy_sink_ring_t	*rings;
+} ngx_http_dummy_sink_shm_t;
+
+typedef struct
+{
+  ngx_shm_zone_t		*zone;
+  ngx_http_dummy_sink_shm_t	*shm;
+  /* "unix:" target : datagram socket, else an append only file */
+  ngx_flag_t			unix_sock;
+  ngx_open_file_t		*file;
+  struct sockaddr_un		sun;
+  ngx_socket_t			fd;
+  ngx_msec_t			flush;
+  /* worker side : owned ring, flush timer and buffer */
+  ngx_http_dummy_sink_ring_t	*ring;
+  ngx_event_t			ev;
+  u_char			*batch;
+  ngx_atomic_uint_t		dropped;
+  ngx_flag_t			failed;
+} ngx_http_dummy_sink_t;
+
+/*
+** compiled ruleset image (naxsi_ruleset <file>, see naxsi_ruleset.c),
+** as written by contrib/ruleset/naxsi_rulesc from MainRule, BasicRule
+** wl: and CheckRule lines.
+** Only fixed size fields and offsets from the start of the image, so
+** that it can be mapped and used as is : strings (str:, rx:, msg:,
+** score tags, custom location targets) are read in place.
+** Records follow the header in this order : rules, whitelists,
+** CheckRules, custom locations (of rules and whitelists), whitelisted
+** ids, strings.
+*/
+#define NAXSI_RULESET_MAGIC	"NXRULES"
+#define NAXSI_RULESET_VERSION	2
+/* written as is, tells the byte order of the image */
+#define NAXSI_RULESET_ENDIAN	0x01020304
+
+/* naxsi_ruleset_rule_t flags */
+#define NAXSI_RS_BODY		0x0001
+#define NAXSI_RS_BODY_VAR	0x0002
+#define NAXSI_RS_HEADERS	0x0004
+#define NAXSI_RS_HEADERS_VAR	0x0008
+#define NAXSI_RS_URL		0x0010
+#define NAXSI_RS_ARGS		0x0020
+#define NAXSI_RS_ARGS_VAR	0x0040
+#define NAXSI_RS_FILE_EXT	0x0080
+#define NAXSI_RS_CUSTOM		0x0100
+#define NAXSI_RS_NAME		0x0200
+#define NAXSI_RS_NEGATIVE	0x0400
+#define NAXSI_RS_BLOCK		0x0800
+#define NAXSI_RS_ALLOW		0x1000
+/* naxsi_ruleset_location_t kind */
+#define NAXSI_RS_SPECIFIC_URL	0x2000
+
+typedef struct
+{
+  u_char	magic[8];
+  uint32_t	version;
+  uint32_t	endian;
+  /* whole image */
+  uint64_t	size;
+  /* of everything following the header, see ngx_http_dummy_ruleset_sum */
+  uint64_t	checksum;
+  uint32_t	nb_rules;
+  uint32_t	nb_locations;
+  uint32_t	rules;
+  uint32_t	locations;
+  uint32_t	strings;
+  uint32_t	strings_len;
+  uint32_t	nb_whitelists;
+  uint32_t	nb_check_rules;
+  uint32_t	nb_ids;
+  uint32_t	whitelists;
+  uint32_t	check_rules;
+  uint32_t	ids;
+} naxsi_ruleset_hdr_t;
+
+/* offset in the string pool (0 : no string), strings are NUL terminated */
+typedef struct
+{
+  uint32_t	off;
+  uint32_t	len;
+} naxsi_ruleset_str_t;
+
+typedef struct
+{
+  int32_t		rule_id;
+  int32_t		score;
+  int32_t		sc_score;
+  uint32_t		flags;
+  uint32_t		transform;
+  /* custom locations : [location, location + nb_locations[ */
+  uint32_t		location;
+  uint32_t		nb_locations;
+  uint32_t		reserved;
+  /* str: is stored lowercased, as dummy_str does */
+  naxsi_ruleset_str_t	str;
+  naxsi_ruleset_str_t	rx;
+  naxsi_ruleset_str_t	msg;
+  naxsi_ruleset_str_t	sc_tag;
+} naxsi_ruleset_rule_t;
+
+typedef struct
+{
+  /* NAXSI_RS_ARGS_VAR, _BODY_VAR, _HEADERS_VAR or _SPECIFIC_URL */
+  uint32_t		kind;
+  uint32_t		hash;
+  naxsi_ruleset_str_t	target;
+} naxsi_ruleset_location_t;
+
+typedef struct
+{
+  /* match zone, as naxsi_ruleset_rule_t flags */
+  uint32_t		flags;
+  /* custom locations : [location, location + nb_locations[ */
+  uint32_t		location;
+  uint32_t		nb_locations;
+  /* whitelisted ids : [id, id + nb_ids[ of the id pool, 0 is every rule */
+  uint32_t		id;
+  uint32_t		nb_ids;
+  uint32_t		reserved;
+} naxsi_ruleset_wl_t;
+
+typedef struct
+{
+  int32_t		sc_score;
+  /* SUP, SUP_OR_EQUAL, INF or INF_OR_EQUAL */
+  uint32_t		cmp;
+  /* NAXSI_RS_BLOCK, NAXSI_RS_ALLOW */
+  uint32_t		flags;
+  uint32_t		reserved;
+  naxsi_ruleset_str_t	sc_tag;
+} naxsi_ruleset_check_t;
+
+/*
+** naxsi_ruleset shared zone. A rule id brought by a ruleset loaded at
+** runtime that main_cf->rule_ids doesn't have is numbered there, in
+** the order they came : its id_index is main_cf->nb_rule_ids plus its
+** position, the same in every worker. Each configuration gets its own
+** table, so that the workers of the previous one, still draining
+** their requests, keep theirs : a table is reused once no worker
+** holds it anymore (users).
+*/
+#define NAXSI_RULESET_IDS	1024
+#define NAXSI_RULESET_CONFS	4
+
+typedef struct
+{
+  /* configuration it belongs to, 0 if none yet */
+  ngx_atomic_t		conf;
+  ngx_atomic_t		users;
+  ngx_atomic_t		nb_ids;
+  ngx_int_t		ids[NAXSI_RULESET_IDS];
+} ngx_http_dummy_ruleset_ids_t;
+
+typedef struct
+{
+  /* bumped by naxsi_ruleset_control */
+  ngx_atomic_t			generation;
+  /* last configuration numbered */
+  ngx_atomic_t			conf;
+  ngx_http_dummy_ruleset_ids_t	ids[NAXSI_RULESET_CONFS];
+} ngx_http_dummy_ruleset_shm_t;
+
+/*
+** a loaded ruleset : MainRules checked after the main_cf ones, and
+** whitelists and CheckRules applied in every location along with the
+** location's own. It is fully built (regexes JIT compiled, rules
+** numbered, whitelists compiled) before being swapped in, requests
+** pin the ruleset in use when they start (refs, see naxsi_reload.c).
+*/
+typedef struct
+{
+  ngx_array_t			*get_rules;
+  ngx_array_t			*body_rules;
+  ngx_array_t			*header_rules;
+  ngx_array_t			*generic_rules;
+  ngx_http_ac_t			*str_ac[UNKNOWN];
+  ngx_http_rx_set_t		*rx_set[UNKNOWN];
+  ngx_http_dummy_dispatch_t	*dispatch[UNKNOWN];
+  /* one copy of each rule, the ones above are copies of these */
+  ngx_http_rule_t		*rules;
+  ngx_uint_t			nb_rules;
+  ngx_uint_t			ac_max_patterns;
+  ngx_uint_t			rx_max_rules;
+  /* whitelists and CheckRules, held as a location does, NULL if none */
+  struct ngx_http_dummy_loc_conf_s	*wl;
+  ngx_atomic_uint_t		generation;
+  ngx_uint_t			refs;
+  /* loaded with the configuration : everything belongs to the cycle */
+  ngx_flag_t			conf:1;
+  /* replaced, released with its last request */
+  ngx_flag_t			retired:1;
+  ngx_pool_t			*pool;
+  u_char			*map;
+  size_t			size;
+} ngx_http_dummy_ruleset_t;
+
 typedef struct
 {
   ngx_array_t	*get_rules; /*ngx_http_rule_t*/
@@ -281,11 +784,47 @@ typedef struct
   ngx_array_t	*generic_rules; 
   ngx_array_t	*locations; /*ngx_http_dummy_loc_conf_t*/
   ngx_log_t	*log;
+  /* str: rules automatons, indexed by match zone */
+  ngx_http_ac_t	*str_ac[UNKNOWN];
+  /* biggest nb_patterns of all automatons (main & locations) */
+  ngx_uint_t	ac_max_patterns;
+  /* combined rx: rules, indexed by match zone */
+  ngx_http_rx_set_t	*rx_set[UNKNOWN];
+  /* biggest nb_rules of all rx sets (main & locations) */
+  ngx_uint_t	rx_max_rules;
+  /* remaining rules, indexed by match zone */
+  ngx_http_dummy_dispatch_t	*dispatch[UNKNOWN];
+  /* ids of every rule (internal ones included), ascending, unique */
+  ngx_int_t	*rule_ids;
+  ngx_uint_t	nb_rule_ids;
+  /* id_index bound : nb_rule_ids, plus NAXSI_RULESET_IDS with naxsi_ruleset */
+  ngx_uint_t	nb_id_slots;
+  /* score tags ($SQL, $XSS ...) of every rule, ngx_str_t */
+  ngx_array_t	*sc_tags;
+  /* naxsi_stats_zone, NULL if not set */
+  ngx_shm_zone_t	*stats_zone;
+  ngx_http_dummy_stats_t	*stats;
+  /* naxsi_slow_log threshold, 0 if not set */
+  uint64_t	slow_ns;
+  /* naxsi_learning_sink, NULL if not set */
+  ngx_http_dummy_sink_t	*sink;
+  /* naxsi_ruleset, empty if not set */
+  ngx_str_t	ruleset_path;
+  ngx_shm_zone_t	*ruleset_zone;
+  ngx_http_dummy_ruleset_shm_t	*ruleset_shm;
+  /* table of this configuration in ruleset_shm->ids, and its position */
+  ngx_http_dummy_ruleset_ids_t	*ruleset_ids;
+  ngx_uint_t	ruleset_slot;
+  /* ruleset in use by this process, generation that failed to load */
+  ngx_http_dummy_ruleset_t	*ruleset;
+  ngx_atomic_uint_t	ruleset_failed;
+  /* worker side : generation polling timer */
+  ngx_event_t	ruleset_ev;
 } ngx_http_dummy_main_conf_t;
 
 
 /* TOP level configuration structure */
-typedef struct
+typedef struct ngx_http_dummy_loc_conf_s
 {
   ngx_array_t	*get_rules;
   ngx_array_t	*body_rules;
@@ -306,6 +845,14 @@ typedef struct
   ngx_hash_t	*wlr_headers_hash;
   /* rules that are globally disabled in one location */
   ngx_array_t	*disabled_rules;
+  /* disabled_rules, compiled : by zone, for content / for names */
+  ngx_http_dummy_idset_t	*disabled[UNKNOWN][2];
+  /* str: rules automatons, indexed by match zone */
+  ngx_http_ac_t	*str_ac[UNKNOWN];
+  /* combined rx: rules, indexed by match zone */
+  ngx_http_rx_set_t	*rx_set[UNKNOWN];
+  /* remaining rules, indexed by match zone */
+  ngx_http_dummy_dispatch_t	*dispatch[UNKNOWN];
   /* counters for both processed requests and
      blocked requests, used in naxsi_fmt */
   ngx_int_t	request_processed;
@@ -317,14 +864,19 @@ typedef struct
   ngx_flag_t	force_disabled:1;
   ngx_flag_t	pushed:1;
   ngx_str_t	*denied_url;
+  /* location name and index in main_cf->locations, for stats */
+  ngx_str_t	loc_name;
+  ngx_uint_t	stats_index;
 } ngx_http_dummy_loc_conf_t;
 
 
 /*
 ** used to store sets of matched rules during runtime
 */
-typedef struct
+typedef struct ngx_http_matched_rule_s
 {
+  /* next match, in order of appearance */
+  struct ngx_http_matched_rule_s	*next;
   /* matched in [name] var of body */
   ngx_flag_t		body_var:1;
   /* matched in [name] var of headers */
@@ -333,16 +885,36 @@ typedef struct
   ngx_flag_t		args_var:1;
   /* matched on URL */
   ngx_flag_t		url:1;
-  ngx_str_t		*name;
+  ngx_str_t		name;
   ngx_http_rule_t	*rule;
 } ngx_http_matched_rule_t;
 
+/*
+** a transformed name/value, cached for the rules sharing the same
+** transforms (see ngx_http_dummy_transform)
+*/
+#define NAXSI_NORM_SLOTS	4
+
+typedef struct
+{
+  u_char	*src;
+  size_t	src_len;
+  ngx_uint_t	flags;
+  ngx_str_t	out;
+  /* out bytes coming from the first ctx->skip_value bytes of src */
+  size_t	skip;
+  /* per-request buffer, reused as long as it is large enough */
+  u_char	*buf;
+  size_t	size;
+} ngx_http_dummy_norm_t;
+
 /*
 ** Context structure
 */
 typedef struct
 {
-  ngx_array_t	*special_scores;
+  /* indexed by score tag id, NULL until a rule scores on a tag */
+  ngx_http_special_score_t	*special_scores;
   ngx_int_t	score;
   // blocking flags
   ngx_flag_t	block:1;
@@ -354,8 +926,38 @@ typedef struct
   // flag request
   ngx_flag_t	weird_request:1;
   ngx_flag_t	big_request:1;
-  // matched rules
-  ngx_array_t	*matched;
+  // matched rules, in order
+  ngx_http_matched_rule_t	*matched;
+  ngx_http_matched_rule_t	**matched_last;
+  // bump allocator for match records, see ngx_http_dummy_arena_alloc
+  u_char	*arena_pos;
+  u_char	*arena_end;
+  // scratch space for ngx_http_ac_scan
+  ngx_uint_t	*ac_counts;
+  ngx_uint_t	*ac_hits;
+  // scratch space for ngx_http_rx_scan
+  u_char	*rx_fired;
+  ngx_uint_t	*rx_hits;
+  // transformed names/values of the current var, for t: rules
+  ngx_http_dummy_norm_t	*norm;
+  ngx_uint_t	norm_used;
+  ngx_uint_t	norm_next;
+  // streaming body inspection state
+  ngx_http_dummy_body_t	*body;
+  // set while checking a value window whose name was already checked
+  ngx_flag_t	skip_name:1;
+  // set while checking a body value that spans several windows
+  ngx_flag_t	split_value:1;
+  // leading bytes of the value window inspected with the previous one,
+  // matches ending there are not counted again
+  size_t	skip_value;
+  // time spent inspecting this request, ns : total and per phase
+  uint64_t	inspect_ns;
+  uint64_t	phase_ns[NAXSI_PHASE_TOTAL];
+  // per-rule costs (NAXSI_COST_*), NULL without naxsi_slow_log
+  uint64_t	*rule_ns;
+  // naxsi_ruleset rules, pinned for the whole request
+  ngx_http_dummy_ruleset_t	*ruleset;
 } ngx_http_request_ctx_t;
 
 #define TOP_DENIED_URL_T	"DeniedUrl"
@@ -365,6 +967,12 @@ typedef struct
 #define TOP_CHECK_RULE_T	"CheckRule"
 #define TOP_BASIC_RULE_T	"BasicRule"
 #define TOP_MAIN_BASIC_RULE_T	"MainRule"
+#define TOP_STATS_ZONE_T	"naxsi_stats_zone"
+#define TOP_STATS_T		"naxsi_stats"
+#define TOP_LEARNING_SINK_T	"naxsi_learning_sink"
+#define TOP_SLOW_LOG_T		"naxsi_slow_log"
+#define TOP_RULESET_T		"naxsi_ruleset"
+#define TOP_RULESET_CONTROL_T	"naxsi_ruleset_control"
 
 /*possible 'tokens' in rule */
 #define ID_T "id:"
@@ -381,6 +989,16 @@ typedef struct
 
 
 extern ngx_http_dummy_loc_conf_t *dummy_lc;
+extern ngx_http_rule_t nx_int__weird_request;
+extern ngx_http_rule_t nx_int__big_request;
+
+#define dummy_error_fatal(ctx, r, ...) do {				\
+    if (ctx) ctx->block = 1;						\
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,  "XX-******** NGINX NAXSI INTERNAL ERROR ********"); \
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, __VA_ARGS__); \
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "XX-func:%s file:%s line:%d", __func__, __FILE__, __LINE__); \
+    if (r && r->uri.data) ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "XX-uri:%s", r->uri.data); \
+  } while (0)
 
 
 
@@ -388,18 +1006,184 @@ void		*ngx_http_dummy_cfg_parse_one_rule(ngx_conf_t *cf,
 						   ngx_str_t	*value,
 						   ngx_http_rule_t *rule,
 						   ngx_int_t	nb_elem);
+void		*ngx_http_dummy_cfg_parse_check_rule(ngx_conf_t *cf,
+						     ngx_str_t *value,
+						     ngx_http_check_rule_t *rule_c);
 char		*strfaststr(unsigned char *haystack, unsigned int hl,
 			    unsigned char *needle, unsigned int nl);
+/* strfaststr implementations, see naxsi_strstr_kernels() */
+typedef struct
+{
+  const char	*name;
+  char		*(*search)(unsigned char *haystack, unsigned int hl,
+			   unsigned char *needle, unsigned int nl);
+  /* case sensitive, see naxsi_memmem() */
+  u_char	*(*find)(u_char *haystack, size_t hl,
+			 u_char *needle, size_t nl);
+} naxsi_strstr_kernel_t;
+naxsi_strstr_kernel_t	*naxsi_strstr_kernels(void);
+char		*strfaststr_scalar(unsigned char *haystack, unsigned int hl,
+				   unsigned char *needle, unsigned int nl);
+#if (NAXSI_HAVE_SIMD)
+char		*strfaststr_sse2(unsigned char *haystack, unsigned int hl,
+				 unsigned char *needle, unsigned int nl);
+char		*strfaststr_avx2(unsigned char *haystack, unsigned int hl,
+				 unsigned char *needle, unsigned int nl);
+#endif
+u_char		*naxsi_memmem(u_char *haystack, size_t hl,
+			      u_char *needle, size_t nl);
+u_char		*naxsi_memmem_scalar(u_char *haystack, size_t hl,
+				     u_char *needle, size_t nl);
+#if (NAXSI_HAVE_SIMD)
+u_char		*naxsi_memmem_sse2(u_char *haystack, size_t hl,
+				   u_char *needle, size_t nl);
+u_char		*naxsi_memmem_avx2(u_char *haystack, size_t hl,
+				   u_char *needle, size_t nl);
+#endif
 char		*strnchr(const char *s, int c, int len);
 char		*strncasechr(const char *s, int c, int len);
 ngx_int_t	ngx_http_dummy_create_hashtables(ngx_http_dummy_loc_conf_t *dlc,
 						 ngx_conf_t *cf);
 ngx_int_t	ngx_http_dummy_create_hashtables_n(ngx_http_dummy_loc_conf_t *dlc,
-						 ngx_conf_t *cf);
+						 ngx_conf_t *cf,
+						 ngx_http_dummy_main_conf_t *main_cf);
+ngx_int_t	ngx_http_dummy_index_rules(ngx_conf_t *cf,
+					   ngx_http_dummy_main_conf_t *main_cf);
+ngx_int_t	ngx_http_dummy_rule_id_index(ngx_http_dummy_main_conf_t *main_cf,
+					     ngx_int_t id);
+ngx_int_t	ngx_http_dummy_rule_id(ngx_http_dummy_main_conf_t *main_cf,
+				       ngx_uint_t n);
 void		ngx_http_dummy_data_parse(ngx_http_request_ctx_t *ctx, 
 						  ngx_http_request_t	 *r);
 ngx_int_t	ngx_http_output_forbidden_page(ngx_http_request_ctx_t *ctx, 
 					       ngx_http_request_t *r);
+ngx_http_ac_t	*ngx_http_ac_compile(ngx_conf_t *cf, ngx_array_t *rules,
+				     enum DUMMY_MATCH_ZONE zone);
+int		ngx_http_ac_rule_eligible(ngx_http_rule_t *r,
+					  enum DUMMY_MATCH_ZONE zone);
+ngx_uint_t	ngx_http_ac_scan(ngx_http_ac_t *ac, u_char *data, size_t len,
+				 size_t skip, ngx_uint_t *counts,
+				 ngx_uint_t *hits);
+int		ngx_http_dummy_rule_in_zone(ngx_http_rule_t *r,
+					    enum DUMMY_MATCH_ZONE zone);
+ngx_flag_t	ngx_http_rx_combinable(ngx_regex_compile_t *rx);
+int		ngx_http_rx_rule_eligible(ngx_http_rule_t *r,
+					  enum DUMMY_MATCH_ZONE zone);
+ngx_http_rx_set_t	*ngx_http_rx_compile(ngx_conf_t *cf, ngx_array_t *rules,
+					     enum DUMMY_MATCH_ZONE zone);
+ngx_int_t	ngx_http_rx_scan(ngx_http_rx_set_t *set, u_char *data, size_t len,
+				 size_t skip, u_char *fired, ngx_uint_t *hits);
+ngx_int_t	ngx_http_rx_jit_compile(ngx_cycle_t *cycle,
+					ngx_http_dummy_main_conf_t *main_cf);
+ngx_uint_t	ngx_http_rx_jit_rules(ngx_pool_t *pool, ngx_http_rule_t *rules,
+				      ngx_uint_t nb_rules);
+void		ngx_http_rx_release(ngx_http_rule_t *rules, ngx_uint_t nb_rules,
+				    ngx_http_rx_set_t **rx_set);
+ngx_http_dummy_dispatch_t	*ngx_http_dummy_dispatch_compile(ngx_conf_t *cf,
+								 ngx_array_t *rules,
+								 enum DUMMY_MATCH_ZONE zone,
+								 ngx_http_ac_t *ac,
+								 ngx_http_rx_set_t *rx);
+ngx_array_t	*ngx_http_dummy_dispatch_find(ngx_http_dummy_dispatch_t *dp,
+					      ngx_str_t *name,
+					      ngx_pool_t *pool);
+int		ngx_http_basestr_ruleset_n(ngx_pool_t *pool,
+					   ngx_str_t *name,
+					   ngx_str_t *value,
+					   ngx_http_dummy_dispatch_t *dp,
+					   ngx_http_ac_t *ac,
+					   ngx_http_rx_set_t *rx,
+					   ngx_http_request_t *req,
+					   ngx_http_request_ctx_t *ctx,
+					   enum DUMMY_MATCH_ZONE zone);
+int		ngx_http_dummy_is_rule_whitelisted_n(ngx_http_request_t *req,
+						     ngx_http_dummy_loc_conf_t *cf,
+						     ngx_http_rule_t *r,
+						     ngx_str_t *name,
+						     enum DUMMY_MATCH_ZONE zone,
+						     ngx_int_t target_name);
+ngx_int_t	ngx_http_dummy_body_init(ngx_http_request_ctx_t *ctx,
+					 ngx_http_request_t *r);
+void		ngx_http_dummy_body_feed(ngx_http_request_ctx_t *ctx,
+					 ngx_http_request_t *r,
+					 u_char *data, size_t len);
+void		ngx_http_dummy_body_feed_chain(ngx_http_request_ctx_t *ctx,
+					       ngx_http_request_t *r,
+					       ngx_chain_t *cl);
+void		ngx_http_dummy_body_finalize(ngx_http_request_ctx_t *ctx,
+					     ngx_http_request_t *r);
+ngx_int_t	ngx_http_dummy_body_filter_init(ngx_conf_t *cf);
+int		ngx_http_dummy_body_negative(ngx_http_request_ctx_t *ctx,
+					     ngx_http_request_t *r,
+					     ngx_http_rule_t *rl, int rc);
+char		*ngx_http_dummy_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+					   void *conf);
+char		*ngx_http_dummy_stats(ngx_conf_t *cf, ngx_command_t *cmd,
+				      void *conf);
+void		ngx_http_dummy_stats_rule_hit(ngx_http_request_t *r,
+					      ngx_http_rule_t *rule,
+					      ngx_flag_t whitelisted);
+void		ngx_http_dummy_stats_rule_reset(ngx_http_dummy_main_conf_t *main_cf,
+						ngx_uint_t n);
+char		*ngx_http_dummy_slow_log(ngx_conf_t *cf, ngx_command_t *cmd,
+					 void *conf);
+ngx_int_t	ngx_http_dummy_stats_request_init(ngx_http_request_t *r,
+						  ngx_http_request_ctx_t *ctx);
+void		ngx_http_dummy_stats_request(ngx_http_request_t *r,
+					     ngx_http_request_ctx_t *ctx,
+					     ngx_http_dummy_loc_conf_t *cf);
+void		ngx_http_dummy_stats_totals(ngx_http_request_t *r,
+					    ngx_http_dummy_loc_conf_t *cf,
+					    ngx_int_t *processed,
+					    ngx_int_t *blocked);
+char		*ngx_http_dummy_learning_sink(ngx_conf_t *cf,
+					      ngx_command_t *cmd, void *conf);
+ngx_int_t	ngx_http_dummy_sink_init_module(ngx_cycle_t *cycle,
+						ngx_http_dummy_main_conf_t *main_cf);
+ngx_int_t	ngx_http_dummy_sink_init_process(ngx_cycle_t *cycle);
+void		ngx_http_dummy_sink_exit_process(ngx_cycle_t *cycle);
+void		ngx_http_dummy_sink_event(ngx_http_request_t *r,
+					  ngx_str_t *fmt);
+ngx_int_t	ngx_http_dummy_push_main_rule(ngx_pool_t *pool,
+					      ngx_array_t **get_rules,
+					      ngx_array_t **body_rules,
+					      ngx_array_t **header_rules,
+					      ngx_array_t **generic_rules,
+					      ngx_http_rule_t *rule);
+ngx_int_t	ngx_http_dummy_sc_tag_id(ngx_pool_t *pool,
+					 ngx_http_dummy_main_conf_t *main_cf,
+					 ngx_str_t *tag);
+u_char		*ngx_http_dummy_ruleset_build(ngx_pool_t *pool,
+					      ngx_array_t *rules,
+					      ngx_array_t *whitelists,
+					      ngx_array_t *check_rules,
+					      size_t *size);
+uint64_t	ngx_http_dummy_ruleset_sum(u_char *data, size_t len);
+ngx_http_dummy_ruleset_t	*ngx_http_dummy_ruleset_load(ngx_conf_t *cf,
+							     ngx_str_t *path);
+ngx_int_t	ngx_http_dummy_ruleset_whitelists(ngx_conf_t *cf,
+						  ngx_pool_t *pool,
+						  ngx_http_dummy_main_conf_t *main_cf,
+						  ngx_http_dummy_ruleset_t *rs);
+void		ngx_http_dummy_ruleset_close(ngx_http_dummy_ruleset_t *rs);
+char		*ngx_http_dummy_ruleset(ngx_conf_t *cf, ngx_command_t *cmd,
+					void *conf);
+char		*ngx_http_dummy_ruleset_control(ngx_conf_t *cf,
+						ngx_command_t *cmd,
+						void *conf);
+ngx_int_t	ngx_http_dummy_ruleset_init(ngx_conf_t *cf,
+					    ngx_http_dummy_main_conf_t *main_cf);
+void		ngx_http_dummy_ruleset_init_module(ngx_cycle_t *cycle,
+						   ngx_http_dummy_main_conf_t *main_cf);
+ngx_int_t	ngx_http_dummy_ruleset_init_process(ngx_cycle_t *cycle);
+void		ngx_http_dummy_ruleset_exit_process(ngx_cycle_t *cycle);
+ngx_int_t	ngx_http_dummy_ruleset_request_init(ngx_http_request_t *r,
+						    ngx_http_request_ctx_t *ctx);
+uint64_t	naxsi_now_ns(void);
+size_t		ngx_http_dummy_normalize(u_char *dst, u_char *src, size_t len,
+					 ngx_uint_t flags);
+/* a new var is about to be checked, forget the transformed ones */
+#define naxsi_norm_reset(ctx)	((ctx)->norm_used = 0)
 void
 naxsi_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t type);
 
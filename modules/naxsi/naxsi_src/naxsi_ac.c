@@ -0,0 +1,249 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+** Multi-pattern matcher for str: rules.
+** All the (non-negative) str: rules of a ruleset that apply to a given
+** match zone are compiled at configuration time into a single, case
+** insensitive, Aho-Corasick automaton. The automaton is stored as a full
+** DFA over a compressed alphabet (only the bytes present in the patterns
+** get their own class), so that scanning a name/value is one table lookup
+** per byte, whatever the number of rules.
+*/
+
+#include "naxsi.h"
+
+//#define ac_debug
+
+/*
+** returns 1 if the rule has to be checked against [zone]
+** (used to build the dispatch tables, see naxsi_dispatch.c)
+*/
+int
+ngx_http_dummy_rule_in_zone(ngx_http_rule_t *r, enum DUMMY_MATCH_ZONE zone)
+{
+  if (!r->br)
+    return (0);
+  return ((zone == HEADERS && r->br->headers) ||
+	  (zone == URL && r->br->url) ||
+	  (zone == ARGS && r->br->args) ||
+	  (zone == BODY && r->br->body && !r->br->file_ext) ||
+	  (zone == FILE_EXT && r->br->file_ext));
+}
+
+/*
+** returns 1 if the rule can be handled by the automaton
+** instead of being checked on its own.
+*/
+int
+ngx_http_ac_rule_eligible(ngx_http_rule_t *r, enum DUMMY_MATCH_ZONE zone)
+{
+  if (!ngx_http_dummy_rule_in_zone(r, zone))
+    return (0);
+  /* 
+  ** negative rules match on absence, and rules with transforms look at
+  ** another buffer, leave them to the slow path
+  */
+  if (!r->br->str || !r->br->str->len || r->br->rx || r->br->negative ||
+      r->br->transform)
+    return (0);
+  return (1);
+}
+
+/*
+** in : a ruleset (array of ngx_http_rule_t) and a zone
+** does : builds the automaton for every eligible str: rule,
+**	  returns NULL if there is nothing to compile,
+**	  NGX_CONF_ERROR on failure.
+*/
+ngx_http_ac_t *
+ngx_http_ac_compile(ngx_conf_t *cf, ngx_array_t *rules,
+		    enum DUMMY_MATCH_ZONE zone)
+{
+  ngx_http_ac_t		*ac;
+  ngx_http_rule_t	*r;
+  ngx_uint_t		i, k, z, max_states, nb_patterns;
+  ngx_uint_t		head, tail, s, u, c;
+  uint32_t		*fail, *queue, *delta;
+  u_char		used[256];
+  ngx_str_t		*str;
+
+  if (!rules || rules->nelts == 0)
+    return (NULL);
+  r = rules->elts;
+  /* count patterns and the upper bound of states */
+  max_states = 1;
+  nb_patterns = 0;
+  ngx_memzero(used, sizeof(used));
+  for (i = 0; i < rules->nelts; i++) {
+    if (!ngx_http_ac_rule_eligible(&(r[i]), zone))
+      continue;
+    nb_patterns++;
+    max_states += r[i].br->str->len;
+    for (z = 0; z < r[i].br->str->len; z++)
+      used[ngx_tolower(r[i].br->str->data[z])] = 1;
+  }
+  if (!nb_patterns)
+    return (NULL);
+  ac = ngx_pcalloc(cf->pool, sizeof(ngx_http_ac_t));
+  if (!ac)
+    return (NGX_CONF_ERROR);
+  /* class 0 is "any byte not present in patterns" */
+  ac->nb_classes = 1;
+  for (c = 0; c < 256; c++)
+    if (used[c])
+      used[c] = ac->nb_classes++;
+  for (c = 0; c < 256; c++)
+    ac->map[c] = used[ngx_tolower(c)];
+  delta = ngx_pcalloc(cf->pool,
+		      max_states * ac->nb_classes * sizeof(uint32_t));
+  ac->out = ngx_pcalloc(cf->pool, max_states * sizeof(ngx_int_t));
+  ac->dict = ngx_pcalloc(cf->pool, max_states * sizeof(uint32_t));
+  ac->next = ngx_pcalloc(cf->pool, nb_patterns * sizeof(ngx_int_t));
+  ac->rules = ngx_pcalloc(cf->pool, nb_patterns * sizeof(ngx_http_rule_t *));
+  fail = ngx_pcalloc(cf->pool, max_states * sizeof(uint32_t));
+  queue = ngx_pcalloc(cf->pool, max_states * sizeof(uint32_t));
+  if (!delta || !ac->out || !ac->dict || !ac->next || !ac->rules ||
+      !fail || !queue)
+    return (NGX_CONF_ERROR);
+  for (s = 0; s < max_states; s++)
+    ac->out[s] = -1;
+  /*
+  ** build the trie. As no edge can lead back to the root,
+  ** a 0 transition means "no edge" during this step.
+  */
+  ac->nb_states = 1;
+  for (i = 0, k = 0; i < rules->nelts; i++) {
+    if (!ngx_http_ac_rule_eligible(&(r[i]), zone))
+      continue;
+    str = r[i].br->str;
+    s = 0;
+    for (z = 0; z < str->len; z++) {
+      c = ac->map[str->data[z]];
+      if (!delta[s * ac->nb_classes + c])
+	delta[s * ac->nb_classes + c] = ac->nb_states++;
+      s = delta[s * ac->nb_classes + c];
+    }
+    /* keep rule order for patterns sharing the same string */
+    ac->rules[k] = &(r[i]);
+    ac->next[k] = -1;
+    if (ac->out[s] == -1)
+      ac->out[s] = k;
+    else {
+      for (u = ac->out[s]; ac->next[u] != -1; u = ac->next[u])
+	;
+      ac->next[u] = k;
+    }
+    k++;
+  }
+  ac->nb_patterns = nb_patterns;
+  /*
+  ** breadth-first walk to compute failure links,
+  ** and turn the trie into a full DFA.
+  */
+  head = tail = 0;
+  for (c = 0; c < ac->nb_classes; c++) {
+    u = delta[c];
+    if (u) {
+      fail[u] = 0;
+      queue[tail++] = u;
+    }
+  }
+  while (head < tail) {
+    s = queue[head++];
+    /* nearest state on the failure chain having an output */
+    ac->dict[s] = (ac->out[fail[s]] != -1) ? fail[s] : ac->dict[fail[s]];
+    for (c = 0; c < ac->nb_classes; c++) {
+      u = delta[s * ac->nb_classes + c];
+      if (u) {
+	fail[u] = delta[fail[s] * ac->nb_classes + c];
+	queue[tail++] = u;
+      }
+      else
+	delta[s * ac->nb_classes + c] = delta[fail[s] * ac->nb_classes + c];
+    }
+  }
+  /* shrink transition table to the states actually used */
+  ac->delta = ngx_palloc(cf->pool,
+			 ac->nb_states * ac->nb_classes * sizeof(uint32_t));
+  if (!ac->delta)
+    return (NGX_CONF_ERROR);
+  ngx_memcpy(ac->delta, delta,
+	     ac->nb_states * ac->nb_classes * sizeof(uint32_t));
+  ngx_pfree(cf->pool, delta);
+  ngx_pfree(cf->pool, fail);
+  ngx_pfree(cf->pool, queue);
+#ifdef ac_debug
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		     "XX-ac zone %d : %d patterns, %d states, %d classes",
+		     zone, ac->nb_patterns, ac->nb_states, ac->nb_classes);
+#endif
+  return (ac);
+}
+
+/*
+** in : automaton, buffer, scratch counters (nb_patterns long, zeroed)
+** does : single pass on the buffer, counting (overlapping) occurrences
+**	  of every pattern. hits[] receives the index of each pattern
+**	  that matched, in order of first occurrence. Occurrences ending
+**	  in the first [skip] bytes are not counted.
+** returns the number of distinct patterns that matched. The caller
+** is responsible for resetting counts[hits[0..n]] to 0.
+*/
+ngx_uint_t
+ngx_http_ac_scan(ngx_http_ac_t *ac, u_char *data, size_t len, size_t skip,
+		 ngx_uint_t *counts, ngx_uint_t *hits)
+{
+  u_char		*p, *end;
+  uint32_t		s, t;
+  ngx_int_t		k;
+  ngx_uint_t		nb_hits;
+
+  nb_hits = 0;
+  s = 0;
+  end = data + len;
+  /* only walk the automaton over the skipped bytes */
+  for (p = data; p < end && p < data + skip; p++)
+    s = ac->delta[s * ac->nb_classes + ac->map[*p]];
+  for (; p < end; p++) {
+    s = ac->delta[s * ac->nb_classes + ac->map[*p]];
+    if (!s)
+      continue;
+    t = (ac->out[s] != -1) ? s : ac->dict[s];
+    while (t) {
+      for (k = ac->out[t]; k != -1; k = ac->next[k])
+	if (counts[k]++ == 0)
+	  hits[nb_hits++] = k;
+      t = ac->dict[t];
+    }
+  }
+  return (nb_hits);
+}
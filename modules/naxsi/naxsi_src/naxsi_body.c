@@ -0,0 +1,1240 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+** Streaming inspection of request bodies.
+** Instead of waiting for the whole body and copying it into one buffer
+** (which meant giving up on bodies nginx wrote to a temp file), the body
+** is parsed chunk by chunk, as nginx reads it (request body filter) or
+** as we read it back from the temp file. Parsers keep their state across
+** chunks, so a name, a value, an escape or a multipart delimiter can be
+** split anywhere.
+** Memory is bounded : a value bigger than the window is inspected in
+** several windows, each one starting with the last NAXSI_BODY_OVERLAP
+** bytes of the previous one. A pattern shorter than the overlap is
+** always seen whole, and is only counted in the window where it ends
+** past the overlap (see ctx->skip_value). A rx: match longer than the
+** overlap is missed if no window holds all of it. Var names are only
+** checked with the first window. Negative rules are decided once the
+** value ended, from every window (see ngx_http_dummy_body_negative).
+** JSON bodies are tokenized the same way, see ngx_http_dummy_body_json.
+*/
+
+#include "naxsi.h"
+
+//#define body_stream_debug
+
+enum NAXSI_BODY_STATE {
+  /* x-www-form-urlencoded */
+  NAXSI_BODY_S_NAME = 0,
+  NAXSI_BODY_S_VALUE,
+  /* multipart/form-data */
+  NAXSI_BODY_S_PREAMBLE,
+  NAXSI_BODY_S_AFTER_DELIM,
+  NAXSI_BODY_S_HEADERS,
+  NAXSI_BODY_S_DATA,
+  NAXSI_BODY_S_EPILOGUE,
+  /* application/json */
+  NAXSI_BODY_S_JVALUE,
+  NAXSI_BODY_S_JVALUE_OR_END,
+  NAXSI_BODY_S_JKEY,
+  NAXSI_BODY_S_JKEY_OR_END,
+  NAXSI_BODY_S_JCOLON,
+  NAXSI_BODY_S_JAFTER,
+  NAXSI_BODY_S_JSTRING,
+  NAXSI_BODY_S_JESCAPE,
+  NAXSI_BODY_S_JUNICODE,
+  NAXSI_BODY_S_JLITERAL,
+  NAXSI_BODY_S_JDONE
+};
+
+/* url decoding states, same as naxsi_unescape_uri() */
+enum {
+  sw_usual = 0,
+  sw_quoted,
+  sw_quoted_second
+};
+
+#if (nginx_version >= 1008000)
+static ngx_http_request_body_filter_pt	ngx_http_next_request_body_filter;
+#endif
+
+/*
+** fetch the boundary out of the content-type header.
+** boundary="foo" and boundary=foo are both valid.
+*/
+static ngx_int_t
+ngx_http_dummy_body_boundary(ngx_http_request_t *r, ngx_str_t *boundary)
+{
+  u_char	*p, *end;
+
+  p = ngx_strcasestrn(r->headers_in.content_type->value.data,
+		      "boundary=", 9 - 1);
+  if (!p)
+    return (NGX_ERROR);
+  p += 9;
+  end = r->headers_in.content_type->value.data + 
+    r->headers_in.content_type->value.len;
+  if (p < end && *p == '"') {
+    boundary->data = ++p;
+    while (p < end && *p != '"')
+      p++;
+    if (p == end)
+      return (NGX_ERROR);
+  }
+  else {
+    boundary->data = p;
+    while (p < end && *p != ';' && *p != ' ' && *p != '\t')
+      p++;
+  }
+  boundary->len = p - boundary->data;
+  if (!boundary->len || boundary->len > NAXSI_BODY_BOUNDARY_MAX)
+    return (NGX_ERROR);
+  return (NGX_OK);
+}
+
+/*
+** in : request with a content-type header
+** does : set up ctx->body according to the content-type.
+**	  an unknown content-type leaves body->type to NAXSI_BODY_NONE,
+**	  the caller decides what to do with it.
+*/
+ngx_int_t
+ngx_http_dummy_body_init(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_str_t		boundary;
+  u_char		*ct;
+  size_t		i, k;
+
+  b = ngx_pcalloc(r->pool, sizeof(ngx_http_dummy_body_t));
+  if (!b)
+    return (NGX_ERROR);
+  ctx->body = b;
+  if (!r->headers_in.content_type)
+    return (NGX_OK);
+  ct = r->headers_in.content_type->value.data;
+  //33 = echo -n "application/x-www-form-urlencoded" | wc -c
+  if (!ngx_strncasecmp(ct, (u_char *) "application/x-www-form-urlencoded", 33)) {
+    b->type = NAXSI_BODY_URLENCODED;
+    b->state = NAXSI_BODY_S_NAME;
+  }
+  //19 = echo -n "multipart/form-data" | wc -c
+  else if (!ngx_strncasecmp(ct, (u_char *) "multipart/form-data", 19)) {
+    b->type = NAXSI_BODY_MULTIPART;
+    b->state = NAXSI_BODY_S_PREAMBLE;
+  }
+  //16 = echo -n "application/json" | wc -c
+  else if (!ngx_strncasecmp(ct, (u_char *) "application/json", 16)) {
+    b->type = NAXSI_BODY_JSON;
+    b->state = NAXSI_BODY_S_JVALUE;
+  }
+  else
+    return (NGX_OK);
+  /* no need for a window bigger than the body itself */
+  b->size = NAXSI_BODY_WINDOW;
+  if (r->headers_in.content_length_n >= 0 &&
+      r->headers_in.content_length_n < NAXSI_BODY_WINDOW)
+    b->size = ngx_max((size_t) r->headers_in.content_length_n + 1,
+		      2 * NAXSI_BODY_OVERLAP);
+  b->buf = ngx_palloc(r->pool, b->size);
+  b->name = ngx_palloc(r->pool, NAXSI_BODY_NAME_MAX);
+  if (!b->buf || !b->name)
+    return (NGX_ERROR);
+  if (b->type == NAXSI_BODY_JSON) {
+    b->jpath = ngx_palloc(r->pool, (NAXSI_JSON_DEPTH_MAX + 1) * sizeof(size_t));
+    if (!b->jpath)
+      return (NGX_ERROR);
+    b->jpath[0] = 0;
+    return (NGX_OK);
+  }
+  if (b->type != NAXSI_BODY_MULTIPART)
+    return (NGX_OK);
+  b->line = ngx_palloc(r->pool, NAXSI_BODY_LINE_MAX);
+  if (!b->line)
+    return (NGX_ERROR);
+  if (ngx_http_dummy_body_boundary(r, &boundary) != NGX_OK) {
+    dummy_error_fatal(ctx, r, "no boundary present in POST data ?");
+    b->done = 1;
+    return (NGX_OK);
+  }
+  /* the body starts with "--boundary", act as if "\r\n" was already seen */
+  b->delim_len = boundary.len + 4;
+  b->delim = ngx_palloc(r->pool, b->delim_len);
+  b->kmp = ngx_palloc(r->pool, b->delim_len * sizeof(size_t));
+  if (!b->delim || !b->kmp)
+    return (NGX_ERROR);
+  ngx_memcpy(b->delim, "\r\n--", 4);
+  ngx_memcpy(b->delim + 4, boundary.data, boundary.len);
+  b->dmatch = 2;
+  /* kmp[i] : longest proper prefix of delim[0..i] that is also a suffix */
+  b->kmp[0] = 0;
+  for (i = 1, k = 0; i < b->delim_len; i++) {
+    while (k && b->delim[i] != b->delim[k])
+      k = b->kmp[k - 1];
+    if (b->delim[i] == b->delim[k])
+      k++;
+    b->kmp[i] = k;
+  }
+  return (NGX_OK);
+}
+
+/*
+** check name/value against location and main rules of the zone.
+*/
+static void
+ngx_http_dummy_body_inspect(ngx_http_request_ctx_t *ctx, 
+			    ngx_http_request_t *r,
+			    ngx_str_t *name, ngx_str_t *value,
+			    enum DUMMY_MATCH_ZONE zone)
+{
+  ngx_http_dummy_loc_conf_t	*cf;
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  cf = ngx_http_get_module_loc_conf(r, ngx_http_naxsi_module);
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  if (ctx->block && !cf->learning)
+    return ;
+#ifdef body_stream_debug
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+		"XX-body [%V]=[%V] (zone %d, skip name %d)", 
+		name, value, zone, ctx->body->windowed);
+#endif
+  ctx->skip_name = ctx->body->windowed;
+  ctx->skip_value = ctx->body->windowed ? NAXSI_BODY_OVERLAP : 0;
+  ctx->split_value = ctx->body->windowed || ctx->body->more;
+  naxsi_norm_reset(ctx);
+  if (cf->body_rules)
+    ngx_http_basestr_ruleset_n(r->pool, name, value, cf->dispatch[zone],
+			       cf->str_ac[zone], cf->rx_set[zone], r, ctx, zone);
+  if (main_cf->body_rules)
+    ngx_http_basestr_ruleset_n(r->pool, name, value, main_cf->dispatch[zone],
+			       main_cf->str_ac[zone], main_cf->rx_set[zone],
+			       r, ctx, zone);
+  if (ctx->ruleset && ctx->ruleset->body_rules)
+    ngx_http_basestr_ruleset_n(r->pool, name, value, 
+			       ctx->ruleset->dispatch[zone],
+			       ctx->ruleset->str_ac[zone], 
+			       ctx->ruleset->rx_set[zone], r, ctx, zone);
+  /* last window : forget the negative rules of this value */
+  if (ctx->split_value && !ctx->body->more && ctx->body->neg_seen)
+    ngx_memzero(ctx->body->neg_seen, 
+		(main_cf->nb_id_slots / NAXSI_IDSET_BITS + 1) * sizeof(uintptr_t));
+  ctx->skip_name = 0;
+  ctx->skip_value = 0;
+  ctx->split_value = 0;
+}
+
+/*
+** negative rule [rl] was checked against a window of the current
+** value, [rc] being what ngx_http_process_basic_rule_buffer returned.
+** A value in several windows only lacks the pattern if none of them
+** had it : returns 1 if the rule fires, on the last window only.
+*/
+int
+ngx_http_dummy_body_negative(ngx_http_request_ctx_t *ctx, 
+			     ngx_http_request_t *r,
+			     ngx_http_rule_t *rl, int rc)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_body_t		*b;
+  uintptr_t			bit;
+  ngx_uint_t			n;
+
+  b = ctx->body;
+  if (!ctx->split_value || rc == -1)
+    return (rc);
+  if (!b->neg_seen) {
+    main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+    b->neg_seen = ngx_pcalloc(r->pool, 
+			      (main_cf->nb_id_slots / NAXSI_IDSET_BITS + 1) *
+			      sizeof(uintptr_t));
+    if (!b->neg_seen)
+      return (-1);
+  }
+  n = rl->id_index / NAXSI_IDSET_BITS;
+  bit = (uintptr_t) 1 << (rl->id_index % NAXSI_IDSET_BITS);
+  if (rc == 0)
+    b->neg_seen[n] |= bit;
+  if (b->more)
+    return (0);
+  return ((b->neg_seen[n] & bit) ? 0 : 1);
+}
+
+/*
+** inspect the current value window (and the var name, the first time)
+*/
+static void
+ngx_http_dummy_body_value(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_str_t		name, value;
+
+  b = ctx->body;
+  name.data = b->name;
+  name.len = b->name_len;
+  value.data = b->buf;
+  value.len = b->len;
+  ngx_http_dummy_body_inspect(ctx, r, &name, &value, BODY);
+}
+
+/*
+** window is full : inspect it, and keep its tail as the head
+** of the next one.
+*/
+static void
+ngx_http_dummy_body_slide(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r)
+{
+  ngx_http_dummy_body_t	*b;
+
+  b = ctx->body;
+  b->more = 1;
+  ngx_http_dummy_body_value(ctx, r);
+  b->more = 0;
+  ngx_memmove(b->buf, b->buf + b->len - NAXSI_BODY_OVERLAP, 
+	      NAXSI_BODY_OVERLAP);
+  b->len = NAXSI_BODY_OVERLAP;
+  b->windowed = 1;
+}
+
+static void
+ngx_http_dummy_body_append(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			   u_char *data, size_t len)
+{
+  ngx_http_dummy_body_t	*b;
+  size_t		n;
+
+  b = ctx->body;
+  while (len) {
+    if (b->len == b->size)
+      ngx_http_dummy_body_slide(ctx, r);
+    n = ngx_min(len, b->size - b->len);
+    ngx_memcpy(b->buf + b->len, data, n);
+    b->len += n;
+    data += n;
+    len -= n;
+  }
+}
+
+static void
+ngx_http_dummy_body_putc(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			 u_char c)
+{
+  ngx_http_dummy_body_t	*b;
+
+  b = ctx->body;
+  if (b->len == b->size)
+    ngx_http_dummy_body_slide(ctx, r);
+  //tmp hack fix, avoid %00 & co (null byte) encoding :p
+  b->buf[b->len++] = c ? c : '0';
+}
+
+static ngx_int_t
+ngx_http_dummy_body_hex(u_char ch)
+{
+  u_char	c;
+
+  if (ch >= '0' && ch <= '9')
+    return (ch - '0');
+  c = (u_char) (ch | 0x20);
+  if (c >= 'a' && c <= 'f')
+    return (c - 'a' + 10);
+  return (-1);
+}
+
+/*
+** naxsi_unescape_uri(), one byte at a time.
+** an escape left unfinished at the end of the value is dropped.
+*/
+static void
+ngx_http_dummy_body_decode(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			   u_char ch)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_int_t		h;
+
+  b = ctx->body;
+  switch (b->dstate) {
+  case sw_usual:
+    if (ch == '%')
+      b->dstate = sw_quoted;
+    else
+      ngx_http_dummy_body_putc(ctx, r, ch);
+    break;
+  case sw_quoted:
+    h = ngx_http_dummy_body_hex(ch);
+    if (h >= 0) {
+      b->dhex = (u_char) h;
+      b->dstate = sw_quoted_second;
+      break;
+    }
+    /* the invalid quoted character */
+    b->dstate = sw_usual;
+    ngx_http_dummy_body_putc(ctx, r, '%');
+    ngx_http_dummy_body_putc(ctx, r, ch);
+    break;
+  case sw_quoted_second:
+    b->dstate = sw_usual;
+    h = ngx_http_dummy_body_hex(ch);
+    if (h >= 0)
+      ngx_http_dummy_body_putc(ctx, r, (u_char) ((b->dhex << 4) + h));
+    else
+      ngx_http_dummy_body_putc(ctx, r, ch);
+    break;
+  }
+}
+
+/*
+** what we took for a var name is a value : decode it.
+*/
+static void
+ngx_http_dummy_body_name_to_value(ngx_http_request_ctx_t *ctx, 
+				  ngx_http_request_t *r)
+{
+  ngx_http_dummy_body_t	*b;
+  size_t		i;
+
+  b = ctx->body;
+  for (i = 0; i < b->name_len; i++)
+    ngx_http_dummy_body_decode(ctx, r, b->name[i]);
+  b->name_len = 0;
+}
+
+/*
+** end of a name=value couple (on '&' or end of body)
+** a var without '=' is checked as a value, and if it is followed
+** by '&' while no '=' follows in the whole body, the request is weird
+** (same as ngx_http_spliturl_ruleset).
+*/
+static void
+ngx_http_dummy_body_field_end(ngx_http_request_ctx_t *ctx, 
+			      ngx_http_request_t *r, ngx_flag_t amp)
+{
+  ngx_http_dummy_body_t	*b;
+
+  b = ctx->body;
+  if (b->state == NAXSI_BODY_S_NAME) {
+    if (!b->name_len)
+      return ;
+    ngx_http_dummy_body_name_to_value(ctx, r);
+  }
+  if (b->name_len || b->len || b->windowed)
+    ngx_http_dummy_body_value(ctx, r);
+  if (amp && !b->has_eq)
+    b->pending_weird = 1;
+  b->state = NAXSI_BODY_S_NAME;
+  b->dstate = sw_usual;
+  b->name_len = b->len = 0;
+  b->windowed = b->has_eq = 0;
+}
+
+static void
+ngx_http_dummy_body_urlencoded(ngx_http_request_ctx_t *ctx, 
+			       ngx_http_request_t *r, u_char *p, u_char *end)
+{
+  ngx_http_dummy_body_t	*b;
+  u_char		c;
+
+  b = ctx->body;
+  for (; p < end; p++) {
+    c = *p;
+    if (c == '&') {
+      ngx_http_dummy_body_field_end(ctx, r, 1);
+      continue;
+    }
+    if (c == '=') {
+      b->pending_weird = 0;
+      b->has_eq = 1;
+      if (b->state == NAXSI_BODY_S_NAME) {
+	b->state = NAXSI_BODY_S_VALUE;
+	continue;
+      }
+    }
+    if (b->state == NAXSI_BODY_S_NAME) {
+      if (b->name_len < NAXSI_BODY_NAME_MAX) {
+	b->name[b->name_len++] = c;
+	continue;
+      }
+      /* too long for a var name, must be a value */
+      ngx_http_dummy_body_name_to_value(ctx, r);
+      b->state = NAXSI_BODY_S_VALUE;
+    }
+    ngx_http_dummy_body_decode(ctx, r, c);
+  }
+}
+
+/*
+** looks for [key]"..." in a content-disposition line, [key] being
+** a whole parameter name (name=" must not match filename=").
+** \" does not end the value when [esc] is set.
+*/
+static ngx_int_t
+ngx_http_dummy_body_param(u_char *line, size_t len, char *key, 
+			  ngx_flag_t esc, ngx_str_t *value)
+{
+  u_char	*p, *end, *start;
+  size_t	klen;
+
+  klen = ngx_strlen(key);
+  end = line + len;
+  for (p = line; p + klen <= end; p++) {
+    if (ngx_strncasecmp(p, (u_char *) key, klen))
+      continue;
+    if (p > line && p[-1] != ' ' && p[-1] != ';' && p[-1] != '\t')
+      continue;
+    start = p + klen;
+    for (p = start; p < end; p++)
+      if (*p == '"' && (!esc || p[-1] != '\\'))
+	break;
+    if (p == end)
+      return (NGX_ERROR);
+    value->data = start;
+    value->len = p - start;
+    return (NGX_OK);
+  }
+  return (NGX_DECLINED);
+}
+
+/*
+** one header line of a multipart part, without its '\n'.
+** we have two cases :
+** ---- file upload
+** Content-Disposition: form-data; name="somename"; filename="NetworkManager.conf"\r\n
+** Content-Type: application/octet-stream\r\n\r\n
+** <DATA>
+** ---- normal post var
+** Content-Disposition: form-data; name="lastname"\r\n\r\n
+** <DATA>
+*/
+static ngx_int_t
+ngx_http_dummy_body_part_line(ngx_http_request_ctx_t *ctx, 
+			      ngx_http_request_t *r)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_str_t		name, filename;
+  ngx_int_t		rc;
+
+  b = ctx->body;
+  if (b->nb_lines++ == 0) {
+    if (b->line_len < 30 ||
+	ngx_strncasecmp(b->line, (u_char *) "content-disposition: form-data", 30)) {
+      dummy_error_fatal(ctx, r, "POST data : unknown content-disposition");
+      return (NGX_ERROR);
+    }
+    if (ngx_http_dummy_body_param(b->line + 30, b->line_len - 30, 
+				  "name=\"", 0, &name) != NGX_OK || !name.len) {
+      dummy_error_fatal(ctx, r, "POST data : no 'name' in POST var");
+      return (NGX_ERROR);
+    }
+    b->name_len = ngx_min(name.len, NAXSI_BODY_NAME_MAX);
+    ngx_memcpy(b->name, name.data, b->name_len);
+    name.data = b->name;
+    name.len = b->name_len;
+    rc = ngx_http_dummy_body_param(b->line + 30, b->line_len - 30, 
+				   "filename=\"", 1, &filename);
+    if (rc == NGX_ERROR) {
+      dummy_error_fatal(ctx, r, "POST data : malformed 'filename' field");
+      return (NGX_ERROR);
+    }
+    if (rc == NGX_OK) {
+      b->file = 1;
+      ngx_http_dummy_body_inspect(ctx, r, &name, &filename, FILE_EXT);
+    }
+    return (NGX_OK);
+  }
+  /* the line bellow 'content-disposition' is content-type for files */
+  if (b->file && b->nb_lines == 2)
+    return (NGX_OK);
+  if (b->line_len != 1 || b->line[0] != '\r') {
+    dummy_error_fatal(ctx, r, "POST data : malformed content-disposition line");
+    return (NGX_ERROR);
+  }
+  b->state = NAXSI_BODY_S_DATA;
+  return (NGX_OK);
+}
+
+/*
+** the part data [p, q) ends in this chunk. Unless the beginning of the
+** value was buffered already, it is inspected in place, without copy.
+** File contents are not inspected.
+*/
+static void
+ngx_http_dummy_body_part_end(ngx_http_request_ctx_t *ctx, 
+			     ngx_http_request_t *r, u_char *p, u_char *q)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_str_t		name, value;
+
+  b = ctx->body;
+  if (b->file)
+    return ;
+  if (b->len || b->windowed) {
+    ngx_http_dummy_body_append(ctx, r, p, q - p);
+    ngx_http_dummy_body_value(ctx, r);
+    return ;
+  }
+  name.data = b->name;
+  name.len = b->name_len;
+  value.data = p;
+  value.len = q - p;
+  ngx_http_dummy_body_inspect(ctx, r, &name, &value, BODY);
+}
+
+/*
+** the part data ends with "\r\n--boundary". Within a chunk, it is
+** looked for with naxsi_memmem (simd, when available). Across chunks,
+** with a KMP automaton : b->dmatch bytes of the delimiter are matched so
+** far, and when a byte breaks the match, the bytes of the delimiter that
+** can't be part of it anymore are given back to the value.
+*/
+static void
+ngx_http_dummy_body_multipart(ngx_http_request_ctx_t *ctx, 
+			      ngx_http_request_t *r, u_char *p, u_char *end)
+{
+  ngx_http_dummy_body_t	*b;
+  u_char		c, *q;
+  size_t		m, rel;
+
+  b = ctx->body;
+  while (p < end && !b->done) {
+    switch (b->state) {
+
+    case NAXSI_BODY_S_PREAMBLE:
+      if (*p++ != b->delim[b->dmatch]) {
+	dummy_error_fatal(ctx, r, "POST data is malformed");
+	b->done = 1;
+	return ;
+      }
+      if (++b->dmatch == b->delim_len) {
+	b->dmatch = 0;
+	b->line_len = 0;
+	b->state = NAXSI_BODY_S_AFTER_DELIM;
+      }
+      break;
+
+    case NAXSI_BODY_S_AFTER_DELIM:
+      b->line[b->line_len++] = *p++;
+      if (b->line_len < 2)
+	break;
+      if (b->line[0] == '\r' && b->line[1] == '\n') {
+	b->state = NAXSI_BODY_S_HEADERS;
+	b->line_len = b->name_len = b->len = 0;
+	b->nb_lines = 0;
+	b->file = b->windowed = 0;
+      }
+      else if (b->line[0] == '-' && b->line[1] == '-')
+	b->state = NAXSI_BODY_S_EPILOGUE;
+      else {
+	dummy_error_fatal(ctx, r, "POST data is malformed");
+	b->done = 1;
+	return ;
+      }
+      break;
+
+    case NAXSI_BODY_S_HEADERS:
+      c = *p++;
+      if (c == '\n') {
+	if (ngx_http_dummy_body_part_line(ctx, r) != NGX_OK) {
+	  b->done = 1;
+	  return ;
+	}
+	b->line_len = 0;
+	break;
+      }
+      if (b->line_len == NAXSI_BODY_LINE_MAX) {
+	dummy_error_fatal(ctx, r, "POST data : malformed boundary line");
+	b->done = 1;
+	return ;
+      }
+      b->line[b->line_len++] = c;
+      break;
+
+    case NAXSI_BODY_S_DATA:
+      /*
+      ** nothing pending : look for the whole delimiter in the chunk. One
+      ** starting before the last delim_len - 1 bytes would have been found,
+      ** so only those bytes go through the automaton.
+      */
+      if (!b->dmatch) {
+	q = naxsi_memmem(p, end - p, b->delim, b->delim_len);
+	if (q) {
+	  ngx_http_dummy_body_part_end(ctx, r, p, q);
+	  p = q + b->delim_len;
+	  b->line_len = 0;
+	  b->state = NAXSI_BODY_S_AFTER_DELIM;
+	  break;
+	}
+	q = ((size_t) (end - p) >= b->delim_len) ? end - (b->delim_len - 1) : p;
+	if (!b->file)
+	  ngx_http_dummy_body_append(ctx, r, p, q - p);
+	p = q;
+	/* skip to the next possible delimiter */
+	q = memchr(p, '\r', end - p);
+	if (!q)
+	  q = end;
+	if (!b->file)
+	  ngx_http_dummy_body_append(ctx, r, p, q - p);
+	p = q;
+	if (p == end)
+	  break;
+      }
+      c = *p++;
+      m = b->dmatch;
+      while (b->dmatch && c != b->delim[b->dmatch])
+	b->dmatch = b->kmp[b->dmatch - 1];
+      if (c == b->delim[b->dmatch])
+	b->dmatch++;
+      rel = m + 1 - b->dmatch;
+      if (!b->file && rel) {
+	ngx_http_dummy_body_append(ctx, r, b->delim, ngx_min(rel, m));
+	if (rel > m)
+	  ngx_http_dummy_body_append(ctx, r, &c, 1);
+      }
+      if (b->dmatch == b->delim_len) {
+	if (!b->file)
+	  ngx_http_dummy_body_value(ctx, r);
+	b->dmatch = 0;
+	b->line_len = 0;
+	b->state = NAXSI_BODY_S_AFTER_DELIM;
+      }
+      break;
+
+    case NAXSI_BODY_S_EPILOGUE:
+      return ;
+    }
+  }
+}
+
+/*
+** application/json : each scalar (string, number, true/false/null) is
+** inspected as a BODY value, named after the path of keys leading to it
+** joined with '.' : {"user":{"id":"x"}} gives user.id=x. Array elements
+** take the name of their array. Nesting is limited to NAXSI_JSON_DEPTH_MAX
+** and key paths to NAXSI_BODY_NAME_MAX, values are windowed as usual.
+** A string without escapes that sits whole in the current chunk is
+** inspected in place, without being copied.
+*/
+static void
+ngx_http_dummy_json_error(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			  char *msg)
+{
+  dummy_error_fatal(ctx, r, "JSON : %s", msg);
+  ctx->body->done = 1;
+}
+
+static ngx_flag_t
+ngx_http_dummy_json_space(u_char c)
+{
+  return (c == ' ' || c == '\t' || c == '\r' || c == '\n');
+}
+
+/*
+** after a value : next element of the container, or end of body.
+*/
+static void
+ngx_http_dummy_json_next(ngx_http_dummy_body_t *b)
+{
+  b->state = b->jdepth ? NAXSI_BODY_S_JAFTER : NAXSI_BODY_S_JDONE;
+}
+
+static void
+ngx_http_dummy_json_push(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			 ngx_flag_t array)
+{
+  ngx_http_dummy_body_t	*b;
+
+  b = ctx->body;
+  if (b->jdepth == NAXSI_JSON_DEPTH_MAX) {
+    ngx_http_dummy_json_error(ctx, r, "too many nested objects");
+    return ;
+  }
+  b->jdepth++;
+  b->jpath[b->jdepth] = b->name_len;
+  if (array) {
+    b->jarray |= ((uint64_t) 1 << b->jdepth);
+    b->state = NAXSI_BODY_S_JVALUE_OR_END;
+  }
+  else {
+    b->jarray &= ~((uint64_t) 1 << b->jdepth);
+    b->state = NAXSI_BODY_S_JKEY_OR_END;
+  }
+}
+
+static void
+ngx_http_dummy_json_pop(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			u_char c)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_flag_t		array;
+
+  b = ctx->body;
+  array = (b->jarray >> b->jdepth) & 1;
+  if (!b->jdepth || array != (c == ']')) {
+    ngx_http_dummy_json_error(ctx, r, "unbalanced object/array");
+    return ;
+  }
+  b->name_len = b->jpath[b->jdepth];
+  b->jdepth--;
+  ngx_http_dummy_json_next(b);
+}
+
+static ngx_int_t
+ngx_http_dummy_json_key(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			u_char *data, size_t len)
+{
+  ngx_http_dummy_body_t	*b;
+  size_t		i;
+
+  b = ctx->body;
+  if (b->name_len + len > NAXSI_BODY_NAME_MAX) {
+    ngx_http_dummy_json_error(ctx, r, "key path too long");
+    return (NGX_ERROR);
+  }
+  //tmp hack fix, avoid \u0000 & co (null byte) encoding :p
+  for (i = 0; i < len; i++)
+    b->name[b->name_len++] = data[i] ? data[i] : '0';
+  return (NGX_OK);
+}
+
+/*
+** one decoded character of the current string, key or value.
+*/
+static void
+ngx_http_dummy_json_putc(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			 u_char c)
+{
+  if (ctx->body->jkey)
+    (void) ngx_http_dummy_json_key(ctx, r, &c, 1);
+  else
+    ngx_http_dummy_body_putc(ctx, r, c);
+}
+
+/*
+** \uXXXX, as utf-8. Surrogates are not paired, each half is
+** encoded on its own.
+*/
+static void
+ngx_http_dummy_json_utf8(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			 uint32_t code)
+{
+  if (code < 0x80)
+    ngx_http_dummy_json_putc(ctx, r, (u_char) code);
+  else if (code < 0x800) {
+    ngx_http_dummy_json_putc(ctx, r, (u_char) (0xc0 | (code >> 6)));
+    ngx_http_dummy_json_putc(ctx, r, (u_char) (0x80 | (code & 0x3f)));
+  }
+  else {
+    ngx_http_dummy_json_putc(ctx, r, (u_char) (0xe0 | (code >> 12)));
+    ngx_http_dummy_json_putc(ctx, r, (u_char) (0x80 | ((code >> 6) & 0x3f)));
+    ngx_http_dummy_json_putc(ctx, r, (u_char) (0x80 | (code & 0x3f)));
+  }
+}
+
+/*
+** end of a scalar : check it under the current key path.
+*/
+static void
+ngx_http_dummy_json_value_end(ngx_http_request_ctx_t *ctx, 
+			      ngx_http_request_t *r)
+{
+  ngx_http_dummy_body_t	*b;
+
+  b = ctx->body;
+  ngx_http_dummy_body_value(ctx, r);
+  b->len = 0;
+  b->windowed = 0;
+  ngx_http_dummy_json_next(b);
+}
+
+/*
+** inside a string : copy (or inspect in place) up to the
+** closing quote or the next escape, returns where to go on.
+*/
+static u_char *
+ngx_http_dummy_json_string(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			   u_char *p, u_char *end)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_str_t		name, value;
+  u_char		*q;
+
+  b = ctx->body;
+  for (q = p; q < end && *q != '"' && *q != '\\'; q++)
+    ;
+  if (b->jkey) {
+    if (ngx_http_dummy_json_key(ctx, r, p, q - p) != NGX_OK)
+      return (end);
+  }
+  else if (q < end && *q == '"' && !b->len && !b->windowed) {
+    name.data = b->name;
+    name.len = b->name_len;
+    value.data = p;
+    value.len = q - p;
+    ngx_http_dummy_body_inspect(ctx, r, &name, &value, BODY);
+    ngx_http_dummy_json_next(b);
+    return (q + 1);
+  }
+  else
+    ngx_http_dummy_body_append(ctx, r, p, q - p);
+  if (q == end)
+    return (end);
+  if (*q == '\\')
+    b->state = NAXSI_BODY_S_JESCAPE;
+  else if (b->jkey)
+    b->state = NAXSI_BODY_S_JCOLON;
+  else
+    ngx_http_dummy_json_value_end(ctx, r);
+  return (q + 1);
+}
+
+static void
+ngx_http_dummy_body_json(ngx_http_request_ctx_t *ctx, 
+			 ngx_http_request_t *r, u_char *p, u_char *end)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_int_t		h;
+  u_char		c;
+
+  b = ctx->body;
+  while (p < end && !b->done) {
+    c = *p;
+    switch (b->state) {
+
+    case NAXSI_BODY_S_JVALUE_OR_END:
+      if (c == ']') {
+	p++;
+	ngx_http_dummy_json_pop(ctx, r, c);
+	break;
+      }
+      /* fall through */
+    case NAXSI_BODY_S_JVALUE:
+      p++;
+      if (ngx_http_dummy_json_space(c))
+	break;
+      if (c == '"') {
+	b->jkey = 0;
+	b->state = NAXSI_BODY_S_JSTRING;
+      }
+      else if (c == '{' || c == '[')
+	ngx_http_dummy_json_push(ctx, r, c == '[');
+      else if (c == '-' || (c >= '0' && c <= '9') || 
+	       c == 't' || c == 'f' || c == 'n') {
+	b->state = NAXSI_BODY_S_JLITERAL;
+	ngx_http_dummy_body_putc(ctx, r, c);
+      }
+      else
+	ngx_http_dummy_json_error(ctx, r, "unexpected character");
+      break;
+
+    case NAXSI_BODY_S_JKEY_OR_END:
+      if (c == '}') {
+	p++;
+	ngx_http_dummy_json_pop(ctx, r, c);
+	break;
+      }
+      /* fall through */
+    case NAXSI_BODY_S_JKEY:
+      p++;
+      if (ngx_http_dummy_json_space(c))
+	break;
+      if (c != '"') {
+	ngx_http_dummy_json_error(ctx, r, "expected a key");
+	break;
+      }
+      b->name_len = b->jpath[b->jdepth];
+      if (b->name_len && ngx_http_dummy_json_key(ctx, r, (u_char *) ".", 1)
+	  != NGX_OK)
+	break;
+      b->jkey = 1;
+      b->state = NAXSI_BODY_S_JSTRING;
+      break;
+
+    case NAXSI_BODY_S_JCOLON:
+      p++;
+      if (ngx_http_dummy_json_space(c))
+	break;
+      if (c != ':') {
+	ngx_http_dummy_json_error(ctx, r, "expected ':'");
+	break;
+      }
+      b->state = NAXSI_BODY_S_JVALUE;
+      break;
+
+    case NAXSI_BODY_S_JAFTER:
+      p++;
+      if (ngx_http_dummy_json_space(c))
+	break;
+      if (c == ',')
+	b->state = ((b->jarray >> b->jdepth) & 1) ? 
+	  NAXSI_BODY_S_JVALUE : NAXSI_BODY_S_JKEY;
+      else if (c == '}' || c == ']')
+	ngx_http_dummy_json_pop(ctx, r, c);
+      else
+	ngx_http_dummy_json_error(ctx, r, "expected ',' or end of object");
+      break;
+
+    case NAXSI_BODY_S_JSTRING:
+      p = ngx_http_dummy_json_string(ctx, r, p, end);
+      break;
+
+    case NAXSI_BODY_S_JESCAPE:
+      p++;
+      b->state = NAXSI_BODY_S_JSTRING;
+      switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+	break;
+      case 'b':
+	c = '\b';
+	break;
+      case 'f':
+	c = '\f';
+	break;
+      case 'n':
+	c = '\n';
+	break;
+      case 'r':
+	c = '\r';
+	break;
+      case 't':
+	c = '\t';
+	break;
+      case 'u':
+	b->jhex_n = 0;
+	b->jcode = 0;
+	b->state = NAXSI_BODY_S_JUNICODE;
+	continue;
+      default:
+	ngx_http_dummy_json_error(ctx, r, "invalid escape");
+	continue;
+      }
+      ngx_http_dummy_json_putc(ctx, r, c);
+      break;
+
+    case NAXSI_BODY_S_JUNICODE:
+      p++;
+      h = ngx_http_dummy_body_hex(c);
+      if (h < 0) {
+	ngx_http_dummy_json_error(ctx, r, "invalid \\u escape");
+	break;
+      }
+      b->jcode = (b->jcode << 4) | h;
+      if (++b->jhex_n < 4)
+	break;
+      ngx_http_dummy_json_utf8(ctx, r, b->jcode);
+      b->state = NAXSI_BODY_S_JSTRING;
+      break;
+
+    case NAXSI_BODY_S_JLITERAL:
+      if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || 
+	  c == '.' || c == '+' || c == '-' || c == 'E') {
+	p++;
+	ngx_http_dummy_body_putc(ctx, r, c);
+	break;
+      }
+      /* whatever ends the literal is looked at again */
+      ngx_http_dummy_json_value_end(ctx, r);
+      break;
+
+    case NAXSI_BODY_S_JDONE:
+      p++;
+      if (!ngx_http_dummy_json_space(c))
+	ngx_http_dummy_json_error(ctx, r, "data after the end of the body");
+      break;
+    }
+  }
+}
+
+/*
+** in : a chunk of the request body, in order
+** does : feeds it to the parser matching the content-type.
+*/
+void
+ngx_http_dummy_body_feed(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+			 u_char *data, size_t len)
+{
+  ngx_http_dummy_body_t		*b;
+  ngx_http_dummy_loc_conf_t	*cf;
+
+  b = ctx->body;
+  if (!b)
+    return ;
+  b->fed = 1;
+  b->total += len;
+  cf = ngx_http_get_module_loc_conf(r, ngx_http_naxsi_module);
+  if (b->done || !len || (ctx->block && !cf->learning))
+    return ;
+#ifdef body_stream_debug
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+		"XX-body chunk of %uz bytes (total %O)", len, b->total);
+#endif
+  if (b->type == NAXSI_BODY_URLENCODED)
+    ngx_http_dummy_body_urlencoded(ctx, r, data, data + len);
+  else if (b->type == NAXSI_BODY_MULTIPART)
+    ngx_http_dummy_body_multipart(ctx, r, data, data + len);
+  else if (b->type == NAXSI_BODY_JSON)
+    ngx_http_dummy_body_json(ctx, r, data, data + len);
+}
+
+/*
+** feeds a whole body chain, reading back the buffers that
+** were written to a temp file.
+*/
+void
+ngx_http_dummy_body_feed_chain(ngx_http_request_ctx_t *ctx, 
+			       ngx_http_request_t *r, ngx_chain_t *cl)
+{
+  ngx_http_dummy_body_t	*b;
+  ngx_buf_t		*buf;
+  off_t			off;
+  ssize_t		n;
+
+  b = ctx->body;
+  for (; cl; cl = cl->next) {
+    buf = cl->buf;
+    if (ngx_buf_in_memory(buf) || !buf->in_file) {
+      ngx_http_dummy_body_feed(ctx, r, buf->pos, buf->last - buf->pos);
+      continue;
+    }
+    if (!b->rbuf) {
+      b->rbuf = ngx_palloc(r->pool, NAXSI_BODY_READ);
+      if (!b->rbuf) {
+	dummy_error_fatal(ctx, r, "failed alloc");
+	return ;
+      }
+    }
+    for (off = buf->file_pos; off < buf->file_last; off += n) {
+      n = ngx_read_file(buf->file, b->rbuf, 
+			(size_t) ngx_min(NAXSI_BODY_READ, buf->file_last - off),
+			off);
+      if (n <= 0) {
+	dummy_error_fatal(ctx, r, "failed to read body temp file");
+	return ;
+      }
+      ngx_http_dummy_body_feed(ctx, r, b->rbuf, n);
+    }
+  }
+}
+
+/*
+** end of body : check the last value, and see if the body was complete.
+*/
+void
+ngx_http_dummy_body_finalize(ngx_http_request_ctx_t *ctx, 
+			     ngx_http_request_t *r)
+{
+  ngx_http_dummy_body_t		*b;
+  ngx_http_dummy_loc_conf_t	*cf;
+
+  b = ctx->body;
+  if (!b || b->done)
+    return ;
+  b->done = 1;
+  cf = ngx_http_get_module_loc_conf(r, ngx_http_naxsi_module);
+  if (ctx->block && !cf->learning)
+    return ;
+  if (b->type == NAXSI_BODY_URLENCODED) {
+    ngx_http_dummy_body_field_end(ctx, r, 0);
+    if (b->pending_weird &&
+	ngx_http_dummy_is_rule_whitelisted_n(r, cf, &nx_int__weird_request, NULL, BODY, 0) == 0)
+      ctx->weird_request = 1;
+    return ;
+  }
+  if (b->type == NAXSI_BODY_JSON) {
+    /* a number or literal ends with the body */
+    if (b->state == NAXSI_BODY_S_JLITERAL)
+      ngx_http_dummy_json_value_end(ctx, r);
+    if (b->state != NAXSI_BODY_S_JDONE && b->total)
+      dummy_error_fatal(ctx, r, "JSON : truncated body");
+    return ;
+  }
+  if (b->type != NAXSI_BODY_MULTIPART)
+    return ;
+  switch (b->state) {
+  case NAXSI_BODY_S_AFTER_DELIM:
+  case NAXSI_BODY_S_EPILOGUE:
+    return ;
+  case NAXSI_BODY_S_DATA:
+    /* truncated part, still check what we got */
+    if (!b->file) {
+      ngx_http_dummy_body_append(ctx, r, b->delim, b->dmatch);
+      ngx_http_dummy_body_value(ctx, r);
+    }
+    dummy_error_fatal(ctx, r, "POST data : malformed line");
+    return ;
+  default:
+    dummy_error_fatal(ctx, r, "POST data is malformed");
+    return ;
+  }
+}
+
+#if (nginx_version >= 1008000)
+/*
+** sees the body while nginx reads it, before it is (maybe)
+** written to a temp file.
+*/
+static ngx_int_t
+ngx_http_dummy_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+  ngx_http_request_ctx_t	*ctx;
+  ngx_chain_t			*cl;
+  uint64_t			start, spent;
+
+  ctx = ngx_http_get_module_ctx(r, ngx_http_naxsi_module);
+  if (ctx && ctx->body && !ctx->body->done) {
+    start = naxsi_now_ns();
+    for (cl = in; cl; cl = cl->next)
+      if (ngx_buf_in_memory(cl->buf))
+	ngx_http_dummy_body_feed(ctx, r, cl->buf->pos, 
+				 cl->buf->last - cl->buf->pos);
+    spent = naxsi_now_ns() - start;
+    ctx->phase_ns[NAXSI_PHASE_BODY] += spent;
+    ctx->inspect_ns += spent;
+  }
+  return (ngx_http_next_request_body_filter(r, in));
+}
+#endif
+
+/*
+** postconfiguration : hook into request body filters, if any.
+** Older nginx will have ngx_http_dummy_body_parse() walk the chain.
+*/
+ngx_int_t
+ngx_http_dummy_body_filter_init(ngx_conf_t *cf)
+{
+#if (nginx_version >= 1008000)
+  ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+  ngx_http_top_request_body_filter = ngx_http_dummy_request_body_filter;
+#endif
+  return (NGX_OK);
+}
@@ -45,6 +45,7 @@ void *dummy_zone(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule);
 void *dummy_str(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule);
 void	*dummy_negative(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule);
 void	*dummy_whitelist(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule);
+void	*dummy_transform(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule);
 /*
 ** Structures related to the configuration parser
 */
@@ -64,6 +65,7 @@ static ngx_http_dummy_parser_t rule_parser[] = {
   {MATCH_ZONE_T, dummy_zone},
   {NEGATIVE_T, dummy_negative},
   {WHITELIST_T, dummy_whitelist},
+  {TRANSFORM_T, dummy_transform},
   {NULL, NULL}
 };
 
@@ -80,6 +82,52 @@ dummy_negative(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule)
   return (NGX_CONF_OK);
 }
 
+/*
+** t:urldecode|removenulls|compresswhitespace|lowercase
+** the rule is checked against the transformed name/value (see
+** ngx_http_dummy_normalize()) instead of the one every rule sees.
+*/
+void	*
+dummy_transform(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule)
+{
+  char	*tmp_ptr;
+
+  if (!rule->br)
+    return (NGX_CONF_ERROR);
+  tmp_ptr = (char *) tmp->data + strlen(TRANSFORM_T);
+  while (*tmp_ptr) {
+    if (tmp_ptr[0] == '|')
+      tmp_ptr++;
+    if (!strncasecmp(tmp_ptr, "urldecode", strlen("urldecode"))) {
+      rule->br->transform |= NAXSI_T_URLDECODE;
+      tmp_ptr += strlen("urldecode");
+    }
+    else if (!strncasecmp(tmp_ptr, "removenulls", strlen("removenulls"))) {
+      rule->br->transform |= NAXSI_T_REMOVENULLS;
+      tmp_ptr += strlen("removenulls");
+    }
+    else if (!strncasecmp(tmp_ptr, "compresswhitespace", 
+			  strlen("compresswhitespace"))) {
+      rule->br->transform |= NAXSI_T_COMPRESSWS;
+      tmp_ptr += strlen("compresswhitespace");
+    }
+    /* str: and rx: are case insensitive already, nothing to do */
+    else if (!strncasecmp(tmp_ptr, "lowercase", strlen("lowercase")))
+      tmp_ptr += strlen("lowercase");
+    else {
+      ngx_conf_log_error(NGX_LOG_EMERG, r, 0, 
+			 "unknown transform in '%V'", tmp);
+      return (NGX_CONF_ERROR);
+    }
+    if (*tmp_ptr && *tmp_ptr != '|') {
+      ngx_conf_log_error(NGX_LOG_EMERG, r, 0, 
+			 "unknown transform in '%V'", tmp);
+      return (NGX_CONF_ERROR);
+    }
+  }
+  return (NGX_CONF_OK);
+}
+
 //#define score_debug
 void	*
 dummy_score(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule)
@@ -402,6 +450,7 @@ dummy_rx(ngx_conf_t *r, ngx_str_t *tmp, ngx_http_rule_t *rule)
       return (NGX_CONF_ERROR);
     }
   rule->br->rx = rgc;
+  rule->br->rx_combinable = ngx_http_rx_combinable(rgc);
 #ifdef rx_debug
   ngx_conf_log_error(NGX_LOG_EMERG, r, 0, "XX- RX:[%V]",
 		     &(rule->br->rx->pattern));  
@@ -486,3 +535,61 @@ ngx_http_dummy_cfg_parse_one_rule(ngx_conf_t *cf,
 }
 
 
+
+/*
+** in : the words of a "CheckRule" line, a check rule to fill
+** does : parses "$TAG >= 8" "BLOCK"
+** returns NGX_CONF_ERROR on a malformed line, the caller tells.
+*/
+void *
+ngx_http_dummy_cfg_parse_check_rule(ngx_conf_t *cf, ngx_str_t *value,
+				    ngx_http_check_rule_t *rule_c)
+{
+  u_char	*var_end;
+  unsigned int	i;
+
+  i = 0;
+  memset(rule_c, 0, sizeof(ngx_http_check_rule_t));
+  /* process the first word : score rule */
+  if (value[1].data[i] != '$')
+    return (NGX_CONF_ERROR);
+  var_end = (u_char *) ngx_strchr((value[1].data)+i, ' ');
+  if (!var_end)
+    return (NGX_CONF_ERROR);
+  rule_c->sc_tag.data = ngx_pcalloc(cf->pool, var_end - value[1].data +1);
+  if (!rule_c->sc_tag.data)
+    return (NGX_CONF_ERROR);
+  memcpy(rule_c->sc_tag.data, value[1].data, (var_end - value[1].data));
+  i += (var_end - value[1].data) + 1;
+  rule_c->sc_tag.len = (var_end - value[1].data);
+  // move to next word
+  while (value[1].data[i] && value[1].data[i] == ' ')
+    i++;
+  // get the comparison type
+  if (value[1].data[i] == '>' && value[1].data[i+1] == '=')
+    rule_c->cmp = SUP_OR_EQUAL;
+  else if (value[1].data[i] == '>' && value[1].data[i+1] != '=')
+    rule_c->cmp = SUP;
+  else if (value[1].data[i] == '<' && value[1].data[i+1] == '=')
+    rule_c->cmp = INF_OR_EQUAL;
+  else if (value[1].data[i] == '<' && value[1].data[i+1] != '=')
+    rule_c->cmp = INF;
+  else
+    return (NGX_CONF_ERROR);
+  // move to next word
+  while (value[1].data[i] && !(value[1].data[i] >= '0' && 
+			       value[1].data[i] <= '9') && (value[1].data[i] != '-'))
+    i++;
+  // get the score
+  rule_c->sc_score = atoi((const char *)(value[1].data+i));
+  /* process the second word : Action rule */
+  if (!ngx_strstr(value[2].data, "BLOCK"))
+    rule_c->block = 1;
+  else if (!ngx_strstr(value[2].data, "ALLOW"))
+    rule_c->block = 1;
+  else if (!ngx_strstr(value[2].data, "LOG"))
+    rule_c->block = 1;
+  else
+    return (NGX_CONF_ERROR);
+  return (NGX_CONF_OK);
+}
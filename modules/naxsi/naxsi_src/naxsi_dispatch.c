@@ -0,0 +1,174 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+** Per zone rule dispatch.
+** A ruleset (get_rules, body_rules ...) holds rules for several match
+** zones. Rather than testing, for every name/value, the zone flags of
+** every rule and the custom locations ($ARGS_VAR:foo ...) of every
+** rule, each ruleset is compiled at configuration time, for each zone,
+** into :
+** - a dense array of the rules of the zone that are neither handled
+**   by the str: automaton nor by the combined rx: regex,
+** - a hash of the custom location rules, keyed by lowercased var name.
+*/
+
+#include "naxsi.h"
+
+//#define dispatch_debug
+
+/* var names up to this length are lowercased on the stack */
+#define NAXSI_DISPATCH_NAME_MAX	256
+
+static ngx_array_t *
+ngx_http_dummy_dispatch_key(ngx_conf_t *cf, ngx_array_t *keys, 
+			    ngx_str_t *target)
+{
+  ngx_hash_key_t	*k;
+  ngx_uint_t		i;
+
+  k = keys->elts;
+  for (i = 0; i < keys->nelts; i++)
+    if (k[i].key.len == target->len &&
+	!ngx_strncasecmp(k[i].key.data, target->data, target->len))
+      return (k[i].value);
+  k = ngx_array_push(keys);
+  if (!k)
+    return (NULL);
+  k->key = *target;
+  k->key_hash = ngx_hash_key_lc(target->data, target->len);
+  k->value = ngx_array_create(cf->pool, 2, sizeof(ngx_http_rule_t *));
+  return (k->value);
+}
+
+/*
+** in : a ruleset, a zone, and the automaton/combined regex of the zone
+** does : returns the dispatch tables of the zone, NULL if the ruleset is
+**	  empty, NGX_CONF_ERROR on failure.
+*/
+ngx_http_dummy_dispatch_t *
+ngx_http_dummy_dispatch_compile(ngx_conf_t *cf, ngx_array_t *rules,
+				enum DUMMY_MATCH_ZONE zone,
+				ngx_http_ac_t *ac, ngx_http_rx_set_t *rx)
+{
+  ngx_http_dummy_dispatch_t		*dp;
+  ngx_http_custom_rule_location_t	*loc;
+  ngx_http_rule_t			*r, **last, **p;
+  ngx_array_t				*keys, *list;
+  ngx_hash_init_t			hash_init;
+  ngx_uint_t				i, z;
+
+  if (!rules || rules->nelts == 0)
+    return (NULL);
+  r = rules->elts;
+  dp = ngx_pcalloc(cf->pool, sizeof(ngx_http_dummy_dispatch_t));
+  if (!dp)
+    return (NGX_CONF_ERROR);
+  dp->rules = ngx_palloc(cf->pool, rules->nelts * sizeof(ngx_http_rule_t *));
+  keys = ngx_array_create(cf->temp_pool, 4, sizeof(ngx_hash_key_t));
+  if (!dp->rules || !keys)
+    return (NGX_CONF_ERROR);
+  for (i = 0; i < rules->nelts; i++) {
+    if (!r[i].br)
+      continue;
+    if (r[i].br->custom_location) {
+      loc = r[i].br->custom_locations->elts;
+      for (z = 0; z < r[i].br->custom_locations->nelts; z++) {
+	list = ngx_http_dummy_dispatch_key(cf, keys, &(loc[z].target));
+	if (!list)
+	  return (NGX_CONF_ERROR);
+	/* same var name twice in one rule : check it once */
+	last = list->nelts ? (ngx_http_rule_t **) list->elts + list->nelts - 1
+	  : NULL;
+	if (last && *last == &(r[i]))
+	  continue;
+	p = ngx_array_push(list);
+	if (!p)
+	  return (NGX_CONF_ERROR);
+	*p = &(r[i]);
+	if (loc[z].target.len > dp->custom_max_len)
+	  dp->custom_max_len = loc[z].target.len;
+      }
+    }
+    if (!ngx_http_dummy_rule_in_zone(&(r[i]), zone))
+      continue;
+    /* checked by the automaton / combined regex */
+    if (ac && ngx_http_ac_rule_eligible(&(r[i]), zone))
+      continue;
+    if (rx && ngx_http_rx_rule_eligible(&(r[i]), zone))
+      continue;
+    dp->rules[dp->nb_rules++] = &(r[i]);
+  }
+  if (keys->nelts) {
+    dp->custom = ngx_pcalloc(cf->pool, sizeof(ngx_hash_t));
+    if (!dp->custom)
+      return (NGX_CONF_ERROR);
+    hash_init.hash = dp->custom;
+    hash_init.key = &ngx_hash_key_lc;
+    hash_init.pool = cf->pool;
+    hash_init.temp_pool = NULL;
+    hash_init.max_size = 1024;
+    hash_init.bucket_size = 512;
+    hash_init.name = "custom_location_hash";
+    if (ngx_hash_init(&hash_init, keys->elts, keys->nelts) != NGX_OK) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+			 "custom location hashtable init failed");
+      return (NGX_CONF_ERROR);
+    }
+  }
+#ifdef dispatch_debug
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		     "XX-dispatch zone %d : %d/%d rules, %d var names",
+		     zone, dp->nb_rules, rules->nelts, keys->nelts);
+#endif
+  return (dp);
+}
+
+/*
+** returns the custom location rules (ngx_http_rule_t *) targeting
+** the var [name], NULL if there is none.
+*/
+ngx_array_t *
+ngx_http_dummy_dispatch_find(ngx_http_dummy_dispatch_t *dp, ngx_str_t *name,
+			     ngx_pool_t *pool)
+{
+  u_char	buf[NAXSI_DISPATCH_NAME_MAX], *lc;
+  ngx_uint_t	key;
+
+  if (!dp->custom || !name || !name->len || name->len > dp->custom_max_len)
+    return (NULL);
+  lc = (name->len <= sizeof(buf)) ? buf : ngx_pnalloc(pool, name->len);
+  if (!lc)
+    return (NULL);
+  key = ngx_hash_strlow(lc, name->data, name->len);
+  return (ngx_hash_find(dp->custom, key, lc, name->len));
+}
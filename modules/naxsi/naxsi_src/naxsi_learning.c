@@ -0,0 +1,519 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+** Learning sink.
+** In learning mode, every request naxsi would have blocked used to
+** fire a post_action subrequest to DeniedUrl, carrying NAXSI_FMT, so
+** that the learning daemon gets it : one more backend request for each
+** matching request. With
+**   naxsi_learning_sink <path|unix:path> [size=<size>] [flush=<time>];
+** (http level), NAXSI_FMT lines (with the error log time and the
+** "NAXSI_FMT: " prefix, so that tools reading error logs can read them)
+** are instead copied into a ring owned by the worker, in a shared
+** memory zone of <size> bytes (default 1m). A timer (every <time>,
+** default 1s) writes them in batches, to an append only file or to a
+** unix datagram socket (one datagram per batch, events are never split).
+** Events are dropped, and counted, when the ring is full.
+** As the rings live in shared memory, a worker starting after a crash
+** or a reload takes over the ring of a dead worker and flushes what
+** was left in it.
+*/
+
+#include "naxsi.h"
+
+//#define sink_debug
+
+#define NAXSI_SINK_SHM_NAME	"naxsi_learning_sink"
+#define NAXSI_SINK_SIZE		(1024 * 1024)
+#define NAXSI_SINK_FLUSH	1000
+/* longer events are truncated, like in the error log */
+#define NAXSI_SINK_EVENT_MAX	4096
+/* biggest write / datagram */
+#define NAXSI_SINK_BATCH	32768
+/* a batch always ends with a whole event, see ngx_http_dummy_sink_flush */
+#if (NAXSI_SINK_EVENT_MAX >= NAXSI_SINK_BATCH)
+#error "NAXSI_SINK_EVENT_MAX must be smaller than NAXSI_SINK_BATCH"
+#endif
+#define NAXSI_SINK_PREFIX	" NAXSI_FMT: "
+
+/*
+** shared zone init, at (re)configuration time.
+** the rings are laid out by ngx_http_dummy_sink_init_module, once
+** worker_processes is known. On reload, the zone keeps its rings.
+*/
+static ngx_int_t
+ngx_http_dummy_sink_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_dummy_sink_t		*sink, *osink;
+  ngx_slab_pool_t		*shpool;
+
+  sink = shm_zone->data;
+  osink = data;
+  if (osink) {
+    sink->shm = osink->shm;
+    return (NGX_OK);
+  }
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  sink->shm = ngx_slab_alloc(shpool, sizeof(ngx_http_dummy_sink_shm_t));
+  if (!sink->shm)
+    return (NGX_ERROR);
+  ngx_memzero(sink->shm, sizeof(ngx_http_dummy_sink_shm_t));
+  return (NGX_OK);
+}
+
+/*
+** naxsi_learning_sink <path|unix:path> [size=<size>] [flush=<time>];
+*/
+char *
+ngx_http_dummy_learning_sink(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_dummy_main_conf_t	*main_cf = conf;
+  ngx_http_dummy_sink_t		*sink;
+  ngx_str_t			*value, name, s;
+  ssize_t			size;
+  ngx_uint_t			i;
+
+  value = cf->args->elts;
+  if (main_cf->sink)
+    return ("is duplicate");
+  sink = ngx_pcalloc(cf->pool, sizeof(ngx_http_dummy_sink_t));
+  if (!sink)
+    return (NGX_CONF_ERROR);
+  sink->fd = (ngx_socket_t) -1;
+  size = NAXSI_SINK_SIZE;
+  sink->flush = NAXSI_SINK_FLUSH;
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (!ngx_strncmp(value[i].data, "size=", 5)) {
+      s.data = value[i].data + 5;
+      s.len = value[i].len - 5;
+      size = ngx_parse_size(&s);
+      if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+			   "invalid naxsi_learning_sink size \"%V\"", &s);
+	return (NGX_CONF_ERROR);
+      }
+      continue;
+    }
+    if (!ngx_strncmp(value[i].data, "flush=", 6)) {
+      s.data = value[i].data + 6;
+      s.len = value[i].len - 6;
+      sink->flush = ngx_parse_time(&s, 0);
+      if (sink->flush == (ngx_msec_t) NGX_ERROR || !sink->flush) {
+	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+			   "invalid naxsi_learning_sink flush \"%V\"", &s);
+	return (NGX_CONF_ERROR);
+      }
+      continue;
+    }
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "invalid naxsi_learning_sink parameter \"%V\"", 
+		       &value[i]);
+    return (NGX_CONF_ERROR);
+  }
+  if (value[1].len > 5 && !ngx_strncmp(value[1].data, "unix:", 5)) {
+    if (value[1].len - 5 >= sizeof(sink->sun.sun_path)) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+			 "naxsi_learning_sink path \"%V\" is too long", 
+			 &value[1]);
+      return (NGX_CONF_ERROR);
+    }
+    sink->unix_sock = 1;
+    sink->sun.sun_family = AF_UNIX;
+    ngx_memcpy(sink->sun.sun_path, value[1].data + 5, value[1].len - 5);
+  }
+  else {
+    sink->file = ngx_conf_open_file(cf->cycle, &value[1]);
+    if (!sink->file)
+      return (NGX_CONF_ERROR);
+  }
+  ngx_str_set(&name, NAXSI_SINK_SHM_NAME);
+  sink->zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_naxsi_module);
+  if (!sink->zone)
+    return (NGX_CONF_ERROR);
+  sink->zone->init = ngx_http_dummy_sink_init_zone;
+  sink->zone->data = sink;
+  main_cf->sink = sink;
+  return (NGX_CONF_OK);
+}
+
+/*
+** master side, once the zone exists : carve it in rings.
+** twice as many rings as workers, so that the workers of a new
+** generation find free rings while the old ones are shutting down.
+** A ring layout is kept across reloads : growing worker_processes
+** needs a bigger zone (or a restart) to get one ring per worker.
+*/
+ngx_int_t
+ngx_http_dummy_sink_init_module(ngx_cycle_t *cycle,
+				ngx_http_dummy_main_conf_t *main_cf)
+{
+  ngx_http_dummy_sink_t		*sink;
+  ngx_http_dummy_sink_shm_t	*shm;
+  ngx_http_dummy_sink_ring_t	*rings;
+  ngx_slab_pool_t		*shpool;
+  ngx_core_conf_t		*ccf;
+  ngx_uint_t			i, n;
+  size_t			size;
+
+  sink = main_cf->sink;
+  if (!sink || sink->shm->nb_rings)
+    return (NGX_OK);
+  shm = sink->shm;
+  ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+  n = (ccf->worker_processes > 0) ? 2 * ccf->worker_processes : 2;
+  shpool = (ngx_slab_pool_t *) sink->zone->shm.addr;
+  /* leave room for the slab pool own bookkeeping */
+  size = sink->zone->shm.size / 64 + 8 * ngx_pagesize + 
+    n * sizeof(ngx_http_dummy_sink_ring_t);
+  size = (size < sink->zone->shm.size) ? sink->zone->shm.size - size : 0;
+  size = (size / n) & ~(ngx_pagesize - 1);
+  if (size < NAXSI_SINK_BATCH) {
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+		  "naxsi_learning_sink size is too small for %ui workers",
+		  n / 2);
+    return (NGX_ERROR);
+  }
+  rings = ngx_slab_alloc(shpool, n * sizeof(ngx_http_dummy_sink_ring_t));
+  if (!rings)
+    return (NGX_ERROR);
+  ngx_memzero(rings, n * sizeof(ngx_http_dummy_sink_ring_t));
+  for (i = 0; i < n; i++) {
+    rings[i].data = ngx_slab_alloc(shpool, size);
+    if (!rings[i].data)
+      break;
+    rings[i].size = size;
+  }
+  if (i == 0) {
+    ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+		  "naxsi_learning_sink: no room for rings");
+    return (NGX_ERROR);
+  }
+  shm->rings = rings;
+  shm->nb_rings = i;
+#ifdef sink_debug
+  ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+		"naxsi_learning_sink: %ui rings of %uz bytes", i, size);
+#endif
+  return (NGX_OK);
+}
+
+static void
+ngx_http_dummy_sink_read(ngx_http_dummy_sink_ring_t *ring, 
+			 ngx_atomic_uint_t off, u_char *dst, size_t len)
+{
+  size_t	pos, n;
+
+  pos = off % ring->size;
+  n = ngx_min(len, ring->size - pos);
+  ngx_memcpy(dst, ring->data + pos, n);
+  if (n < len)
+    ngx_memcpy(dst + n, ring->data, len - n);
+}
+
+static ngx_atomic_uint_t
+ngx_http_dummy_sink_write_ring(ngx_http_dummy_sink_ring_t *ring, 
+			       ngx_atomic_uint_t off, u_char *src, size_t len)
+{
+  size_t	pos, n;
+
+  pos = off % ring->size;
+  n = ngx_min(len, ring->size - pos);
+  ngx_memcpy(ring->data + pos, src, n);
+  if (n < len)
+    ngx_memcpy(ring->data, src + n, len - n);
+  return (off + len);
+}
+
+/*
+** sends a batch of whole events as one datagram, or in smaller ones
+** if the socket doesn't take that big.
+** returns the bytes sent or dropped, the others must be kept for the
+** next flush.
+*/
+static size_t
+ngx_http_dummy_sink_send(ngx_http_dummy_sink_t *sink, u_char *buf,
+			 size_t len, ngx_log_t *log)
+{
+  ssize_t	n;
+  size_t	done;
+  ngx_err_t	err;
+  u_char	*p;
+
+  n = sendto(sink->fd, buf, len, 0, (struct sockaddr *) &sink->sun, 
+	     sizeof(struct sockaddr_un));
+  if (n == (ssize_t) len) {
+    sink->failed = 0;
+    return (len);
+  }
+  err = ngx_socket_errno;
+  if (err == EMSGSIZE) {
+    /* split at the event closest to the middle */
+    for (p = buf + len / 2; p > buf && p[-1] != '\n'; p--)
+      ;
+    if (p == buf) {
+      ngx_log_error(NGX_LOG_ERR, log, err,
+		    "naxsi_learning_sink: %uz bytes event dropped, "
+		    "too big for \"%s\"", len, sink->sun.sun_path);
+      return (len);
+    }
+    done = ngx_http_dummy_sink_send(sink, buf, p - buf, log);
+    if (done < (size_t) (p - buf))
+      return (done);
+    return (done + ngx_http_dummy_sink_send(sink, p, buf + len - p, log));
+  }
+  /* no reader yet, or a slow one : keep events, the ring is the buffer */
+  if (err == NGX_EAGAIN || err == ENOBUFS || 
+      err == NGX_ECONNREFUSED || err == NGX_ENOENT) {
+    if (!sink->failed)
+      ngx_log_error(NGX_LOG_WARN, log, err,
+		    "naxsi_learning_sink: sendto() to \"%s\" failed",
+		    sink->sun.sun_path);
+    sink->failed = 1;
+    return (0);
+  }
+  /* won't get better by retrying */
+  ngx_log_error(NGX_LOG_ERR, log, err,
+		"naxsi_learning_sink: sendto() to \"%s\" failed, "
+		"%uz bytes of events dropped", sink->sun.sun_path, len);
+  return (len);
+}
+
+/*
+** writes a batch of whole events.
+** returns the bytes written or dropped, the others must be kept for
+** the next flush.
+*/
+static size_t
+ngx_http_dummy_sink_output(ngx_http_dummy_sink_t *sink, u_char *buf,
+			   size_t len, ngx_log_t *log)
+{
+  ssize_t	n;
+  size_t	done;
+
+  if (sink->unix_sock)
+    return (ngx_http_dummy_sink_send(sink, buf, len, log));
+  for (done = 0; done < len; done += n) {
+    n = ngx_write_fd(sink->file->fd, buf + done, len - done);
+    if (n == -1) {
+      /* a full disk won't get better by retrying, drop the batch */
+      ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+		    ngx_write_fd_n " to \"%V\" failed", &sink->file->name);
+      break;
+    }
+  }
+  return (len);
+}
+
+static void
+ngx_http_dummy_sink_flush(ngx_http_dummy_sink_t *sink, ngx_log_t *log)
+{
+  ngx_http_dummy_sink_ring_t	*ring;
+  ngx_atomic_uint_t		head, tail, dropped;
+  size_t			n, done;
+  u_char			*p;
+
+  ring = sink->ring;
+  if (!ring)
+    return ;
+  for (;;) {
+    tail = ring->tail;
+    head = ring->head;
+    /* events before head are complete */
+    ngx_memory_barrier();
+    if (head == tail)
+      break;
+    n = ngx_min(head - tail, NAXSI_SINK_BATCH);
+    ngx_http_dummy_sink_read(ring, tail, sink->batch, n);
+    if (n < head - tail) {
+      /* stop at the last whole event, events are shorter than a batch */
+      for (p = sink->batch + n; p[-1] != '\n'; p--)
+	;
+      n = p - sink->batch;
+    }
+    done = ngx_http_dummy_sink_output(sink, sink->batch, n, log);
+    ring->tail = tail + done;
+    if (done < n)
+      break;
+#ifdef sink_debug
+    ngx_log_error(NGX_LOG_NOTICE, log, 0, 
+		  "naxsi_learning_sink: flushed %uz bytes", n);
+#endif
+  }
+  dropped = ring->dropped;
+  if (dropped != sink->dropped) {
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+		  "naxsi_learning_sink: ring full, %uA events dropped",
+		  dropped - sink->dropped);
+    sink->dropped = dropped;
+  }
+}
+
+static void
+ngx_http_dummy_sink_flush_handler(ngx_event_t *ev)
+{
+  ngx_http_dummy_sink_t	*sink;
+
+  sink = ev->data;
+  ngx_http_dummy_sink_flush(sink, ev->log);
+  /* exit_process does the last flush */
+  if (ngx_exiting || ngx_quit)
+    return ;
+  ngx_add_timer(ev, sink->flush);
+}
+
+/*
+** claims a ring : a free one, or one whose owner is gone
+** (its leftovers get flushed by the new owner).
+*/
+static ngx_http_dummy_sink_ring_t *
+ngx_http_dummy_sink_claim(ngx_http_dummy_sink_shm_t *shm)
+{
+  ngx_http_dummy_sink_ring_t	*ring;
+  ngx_atomic_uint_t		pid;
+  ngx_uint_t			i;
+
+  for (i = 0; i < shm->nb_rings; i++) {
+    ring = &shm->rings[i];
+    pid = ring->pid;
+    if (pid && (kill((ngx_pid_t) pid, 0) == 0 || ngx_errno != NGX_ESRCH))
+      continue;
+    if (ngx_atomic_cmp_set(&ring->pid, pid, (ngx_atomic_uint_t) ngx_pid))
+      return (ring);
+  }
+  return (NULL);
+}
+
+ngx_int_t
+ngx_http_dummy_sink_init_process(ngx_cycle_t *cycle)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_sink_t		*sink;
+
+  if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+    return (NGX_OK);
+  main_cf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_naxsi_module);
+  if (!main_cf || !main_cf->sink)
+    return (NGX_OK);
+  sink = main_cf->sink;
+  sink->ring = ngx_http_dummy_sink_claim(sink->shm);
+  if (!sink->ring) {
+    ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+		  "naxsi_learning_sink: no free ring, "
+		  "learning events of this worker are lost");
+    return (NGX_OK);
+  }
+  sink->dropped = sink->ring->dropped;
+  sink->batch = ngx_alloc(NAXSI_SINK_BATCH, cycle->log);
+  if (!sink->batch)
+    return (NGX_ERROR);
+  if (sink->unix_sock) {
+    sink->fd = ngx_socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (sink->fd == (ngx_socket_t) -1) {
+      ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+		    ngx_socket_n " failed");
+      return (NGX_ERROR);
+    }
+    if (ngx_nonblocking(sink->fd) == -1) {
+      ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+		    ngx_nonblocking_n " failed");
+      return (NGX_ERROR);
+    }
+  }
+  sink->ev.handler = ngx_http_dummy_sink_flush_handler;
+  sink->ev.data = sink;
+  sink->ev.log = cycle->log;
+#if (nginx_version >= 1007011)
+  sink->ev.cancelable = 1;
+#endif
+  ngx_add_timer(&sink->ev, sink->flush);
+  return (NGX_OK);
+}
+
+void
+ngx_http_dummy_sink_exit_process(ngx_cycle_t *cycle)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_sink_t		*sink;
+
+  main_cf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_naxsi_module);
+  if (!main_cf || !main_cf->sink || !main_cf->sink->ring)
+    return ;
+  sink = main_cf->sink;
+  ngx_http_dummy_sink_flush(sink, cycle->log);
+  /* keep the ring while it holds events, the next owner will flush them */
+  if (sink->ring->head == sink->ring->tail)
+    sink->ring->pid = 0;
+  if (sink->fd != (ngx_socket_t) -1)
+    ngx_close_socket(sink->fd);
+}
+
+/*
+** request side : copies one event in the worker ring.
+*/
+void
+ngx_http_dummy_sink_event(ngx_http_request_t *r, ngx_str_t *fmt)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_sink_ring_t	*ring;
+  ngx_atomic_uint_t		head, tail;
+  size_t			len, flen;
+
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  if (!main_cf->sink || !main_cf->sink->ring)
+    return ;
+  ring = main_cf->sink->ring;
+  flen = fmt->len;
+  len = ngx_cached_err_log_time.len + sizeof(NAXSI_SINK_PREFIX) - 1 + 
+    flen + 1;
+  if (len > NAXSI_SINK_EVENT_MAX) {
+    flen -= len - NAXSI_SINK_EVENT_MAX;
+    len = NAXSI_SINK_EVENT_MAX;
+  }
+  head = ring->head;
+  tail = ring->tail;
+  if (len > ring->size - (head - tail)) {
+    (void) ngx_atomic_fetch_add(&ring->dropped, 1);
+    return ;
+  }
+  head = ngx_http_dummy_sink_write_ring(ring, head, 
+					ngx_cached_err_log_time.data,
+					ngx_cached_err_log_time.len);
+  head = ngx_http_dummy_sink_write_ring(ring, head, 
+					(u_char *) NAXSI_SINK_PREFIX,
+					sizeof(NAXSI_SINK_PREFIX) - 1);
+  head = ngx_http_dummy_sink_write_ring(ring, head, fmt->data, flen);
+  head = ngx_http_dummy_sink_write_ring(ring, head, (u_char *) "\n", 1);
+  /* publish the event once it is complete */
+  ngx_memory_barrier();
+  ring->head = head;
+}
@@ -0,0 +1,546 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+** Rulesets swapped without configuration reload.
+** "naxsi_ruleset <file>;" (http) loads a compiled ruleset (see
+** naxsi_ruleset.c) along with the configuration, its rules being
+** checked after the MainRules, its whitelists and CheckRules applied
+** in every location. A generation counter lives in a small shared
+** zone : "naxsi_ruleset_control;" in a location maps the file again on
+** POST and bumps the counter, GET tells the generation in use.
+** Every worker compares the counter to its own generation from a
+** timer (NAXSI_RULESET_POLL), and builds the new ruleset there, out
+** of the way of requests. Requests keep the ruleset they started
+** with, the previous one is released along with its last request.
+** Rule ids that were not known at configuration time are numbered in
+** the shared zone, in a table of the configuration's own (see
+** ngx_http_dummy_ruleset_shm_t), so that they get the same counters
+** and whitelist bits in every worker of this configuration.
+** Location BasicRules stay in the configuration.
+*/
+
+#include "naxsi.h"
+
+//#define reload_debug
+
+#define NAXSI_RULESET_ZONE	"naxsi_ruleset"
+#define NAXSI_RULESET_POOL_SIZE	16384
+/* ms between two looks at the shared generation */
+#define NAXSI_RULESET_POLL	1000
+
+/*
+** shared zone init : the generation survives configuration reloads.
+** The new configuration takes an id table no worker uses anymore, the
+** oldest one, the workers of the previous configuration keep theirs
+** until they exit.
+*/
+static ngx_int_t
+ngx_http_dummy_ruleset_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_dummy_main_conf_t	*main_cf, *omain_cf;
+  ngx_http_dummy_ruleset_shm_t	*shm;
+  ngx_http_dummy_ruleset_ids_t	*ids;
+  ngx_slab_pool_t		*shpool;
+  ngx_uint_t			i, slot;
+
+  main_cf = shm_zone->data;
+  omain_cf = data;
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  if (omain_cf && omain_cf->ruleset_shm)
+    shm = omain_cf->ruleset_shm;
+  else {
+    shm = ngx_slab_alloc(shpool, sizeof(ngx_http_dummy_ruleset_shm_t));
+    if (!shm)
+      return (NGX_ERROR);
+    ngx_memzero(shm, sizeof(ngx_http_dummy_ruleset_shm_t));
+  }
+  slot = NAXSI_RULESET_CONFS;
+  for (i = 0; i < NAXSI_RULESET_CONFS; i++)
+    if (!shm->ids[i].users &&
+	(slot == NAXSI_RULESET_CONFS || shm->ids[i].conf < shm->ids[slot].conf))
+      slot = i;
+  if (slot == NAXSI_RULESET_CONFS) {
+    /* workers of several older configurations still draining */
+    slot = 0;
+    for (i = 1; i < NAXSI_RULESET_CONFS; i++)
+      if (shm->ids[i].conf < shm->ids[slot].conf)
+	slot = i;
+    ngx_log_error(NGX_LOG_WARN, shm_zone->shm.log, 0,
+		  "naxsi_ruleset: every rule id table is in use, taking "
+		  "over the one of configuration %uA, its workers may "
+		  "count new rules under the wrong ids", shm->ids[slot].conf);
+  }
+  ids = &shm->ids[slot];
+  ids->conf = ++shm->conf;
+  ids->users = 0;
+  ids->nb_ids = 0;
+  main_cf->ruleset_shm = shm;
+  main_cf->ruleset_ids = ids;
+  main_cf->ruleset_slot = slot;
+  return (NGX_OK);
+}
+
+/*
+** naxsi_ruleset <file>; (http)
+*/
+char *
+ngx_http_dummy_ruleset(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_dummy_main_conf_t	*main_cf = conf;
+  ngx_str_t			*value, name;
+
+  value = cf->args->elts;
+  if (main_cf->ruleset_path.len)
+    return ("is duplicate");
+  main_cf->ruleset_path = value[1];
+  if (ngx_conf_full_name(cf->cycle, &main_cf->ruleset_path, 1) != NGX_OK)
+    return (NGX_CONF_ERROR);
+  ngx_str_set(&name, NAXSI_RULESET_ZONE);
+  main_cf->ruleset_zone = ngx_shared_memory_add(cf, &name, 
+						8 * ngx_pagesize +
+						sizeof(ngx_http_dummy_ruleset_shm_t),
+						&ngx_http_naxsi_module);
+  if (!main_cf->ruleset_zone)
+    return (NGX_CONF_ERROR);
+  main_cf->ruleset_zone->init = ngx_http_dummy_ruleset_init_zone;
+  main_cf->ruleset_zone->data = main_cf;
+  return (NGX_CONF_OK);
+}
+
+static void
+ngx_http_dummy_ruleset_unmap(void *data)
+{
+  ngx_http_dummy_ruleset_t	*rs = data;
+
+  munmap(rs->map, rs->size);
+}
+
+/*
+** postconfiguration, before rules are numbered : load the
+** ruleset with the configuration, it belongs to the cycle.
+*/
+ngx_int_t
+ngx_http_dummy_ruleset_init(ngx_conf_t *cf, ngx_http_dummy_main_conf_t *main_cf)
+{
+  ngx_http_dummy_ruleset_t	*rs;
+  ngx_pool_cleanup_t		*cln;
+
+  if (!main_cf->ruleset_path.len)
+    return (NGX_OK);
+  cln = ngx_pool_cleanup_add(cf->pool, 0);
+  if (!cln)
+    return (NGX_ERROR);
+  rs = ngx_http_dummy_ruleset_load(cf, &main_cf->ruleset_path);
+  if (!rs) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "naxsi_ruleset \"%V\" can't be loaded",
+		       &main_cf->ruleset_path);
+    return (NGX_ERROR);
+  }
+  rs->conf = 1;
+  cln->handler = ngx_http_dummy_ruleset_unmap;
+  cln->data = rs;
+  main_cf->ruleset = rs;
+  if (rs->ac_max_patterns > main_cf->ac_max_patterns)
+    main_cf->ac_max_patterns = rs->ac_max_patterns;
+  if (rs->rx_max_rules > main_cf->rx_max_rules)
+    main_cf->rx_max_rules = rs->rx_max_rules;
+  return (NGX_OK);
+}
+
+/*
+** init_module, once the shared zone is ready : the ruleset
+** loaded with the configuration is the current generation.
+*/
+void
+ngx_http_dummy_ruleset_init_module(ngx_cycle_t *cycle,
+				   ngx_http_dummy_main_conf_t *main_cf)
+{
+  if (!main_cf->ruleset || !main_cf->ruleset_shm)
+    return ;
+  main_cf->ruleset->generation = main_cf->ruleset_shm->generation;
+  ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+		"naxsi_ruleset \"%V\": %ui rules, generation %uA",
+		&main_cf->ruleset_path, main_cf->ruleset->nb_rules,
+		main_cf->ruleset->generation);
+}
+
+/*
+** numbers [id], that main_cf->rule_ids doesn't have, in the table of
+** this configuration. Another worker may have done it already.
+*/
+static ngx_int_t
+ngx_http_dummy_ruleset_add_id(ngx_http_dummy_main_conf_t *main_cf,
+			      ngx_int_t id, ngx_log_t *log)
+{
+  ngx_http_dummy_ruleset_ids_t	*ids;
+  ngx_slab_pool_t		*shpool;
+  ngx_uint_t			i, nb;
+
+  ids = main_cf->ruleset_ids;
+  shpool = (ngx_slab_pool_t *) main_cf->ruleset_zone->shm.addr;
+  ngx_shmtx_lock(&shpool->mutex);
+  nb = ids->nb_ids;
+  for (i = 0; i < nb; i++)
+    if (ids->ids[i] == id) {
+      ngx_shmtx_unlock(&shpool->mutex);
+      return (main_cf->nb_rule_ids + i);
+    }
+  if (nb == NAXSI_RULESET_IDS) {
+    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_log_error(NGX_LOG_ERR, log, 0, 
+		  "naxsi_ruleset \"%V\": more than %d new rule ids since "
+		  "the configuration was loaded, reload it",
+		  &main_cf->ruleset_path, NAXSI_RULESET_IDS);
+    return (NGX_ERROR);
+  }
+  /* the table may come from an older configuration */
+  ngx_http_dummy_stats_rule_reset(main_cf, main_cf->nb_rule_ids + nb);
+  ids->ids[nb] = id;
+  /* readers don't lock : the id is there before they can see it */
+  ngx_memory_barrier();
+  ids->nb_ids = nb + 1;
+  ngx_shmtx_unlock(&shpool->mutex);
+  return (main_cf->nb_rule_ids + nb);
+}
+
+/*
+** numbers the rules of a ruleset loaded at runtime, as
+** ngx_http_dummy_index_rules did at configuration time, and compiles
+** its whitelists. New score tags are added to main_cf->sc_tags, in
+** the cycle's pool.
+*/
+static ngx_int_t
+ngx_http_dummy_ruleset_index(ngx_conf_t *cf, 
+			     ngx_http_dummy_main_conf_t *main_cf,
+			     ngx_http_dummy_ruleset_t *rs)
+{
+  ngx_array_t		*sets[4];
+  ngx_http_rule_t	*r;
+  ngx_int_t		n, tag;
+  ngx_uint_t		i, k;
+
+  sets[0] = rs->get_rules;
+  sets[1] = rs->body_rules;
+  sets[2] = rs->header_rules;
+  sets[3] = rs->generic_rules;
+  for (i = 0; i < 4; i++) {
+    if (!sets[i])
+      continue;
+    r = sets[i]->elts;
+    for (k = 0; k < sets[i]->nelts; k++) {
+      n = ngx_http_dummy_rule_id_index(main_cf, r[k].rule_id);
+      if (n == NGX_ERROR)
+	n = ngx_http_dummy_ruleset_add_id(main_cf, r[k].rule_id, cf->log);
+      if (n == NGX_ERROR)
+	return (NGX_ERROR);
+      r[k].id_index = n;
+      if (!r[k].sc_tag)
+	continue;
+      tag = ngx_http_dummy_sc_tag_id(ngx_cycle->pool, main_cf, r[k].sc_tag);
+      if (tag == NGX_ERROR)
+	return (NGX_ERROR);
+      r[k].sc_tag_id = tag;
+    }
+  }
+  return (ngx_http_dummy_ruleset_whitelists(cf, ngx_cycle->pool, main_cf, rs));
+}
+
+/*
+** maps the ruleset file again, in this process, with a pool of its
+** own, and builds it up to the point requests can use it. NULL on
+** failure, the current ruleset is left untouched.
+*/
+static ngx_http_dummy_ruleset_t *
+ngx_http_dummy_ruleset_open(ngx_http_dummy_main_conf_t *main_cf, 
+			    ngx_log_t *log)
+{
+  ngx_http_dummy_ruleset_t	*rs;
+  ngx_pool_t			*pool;
+  ngx_conf_t			cf;
+
+  pool = ngx_create_pool(NAXSI_RULESET_POOL_SIZE, log);
+  if (!pool)
+    return (NULL);
+  /* ac/rx/dispatch compilers only need a pool and a log */
+  ngx_memzero(&cf, sizeof(ngx_conf_t));
+  cf.pool = pool;
+  cf.temp_pool = pool;
+  cf.log = log;
+  cf.cycle = (ngx_cycle_t *) ngx_cycle;
+  rs = ngx_http_dummy_ruleset_load(&cf, &main_cf->ruleset_path);
+  if (!rs) {
+    ngx_destroy_pool(pool);
+    return (NULL);
+  }
+  if (ngx_http_dummy_ruleset_index(&cf, main_cf, rs) != NGX_OK) {
+    ngx_http_dummy_ruleset_close(rs);
+    return (NULL);
+  }
+  ngx_http_rx_jit_rules(pool, rs->rules, rs->nb_rules);
+  return (rs);
+}
+
+/*
+** makes [rs] the ruleset of the requests to come. The previous one
+** is released now if no request uses it, else by its last request.
+*/
+static void
+ngx_http_dummy_ruleset_swap(ngx_http_dummy_main_conf_t *main_cf,
+			    ngx_http_dummy_ruleset_t *rs)
+{
+  ngx_http_dummy_ruleset_t	*old;
+
+  /* scratch space of the requests to come is sized after these */
+  if (rs->ac_max_patterns > main_cf->ac_max_patterns)
+    main_cf->ac_max_patterns = rs->ac_max_patterns;
+  if (rs->rx_max_rules > main_cf->rx_max_rules)
+    main_cf->rx_max_rules = rs->rx_max_rules;
+  old = main_cf->ruleset;
+  main_cf->ruleset = rs;
+  if (!old)
+    return ;
+  old->retired = 1;
+  if (!old->refs)
+    ngx_http_dummy_ruleset_close(old);
+}
+
+static void
+ngx_http_dummy_ruleset_unpin(void *data)
+{
+  ngx_http_dummy_ruleset_t	*rs = data;
+
+  if (--rs->refs == 0 && rs->retired)
+    ngx_http_dummy_ruleset_close(rs);
+}
+
+/*
+** timer : catch up with the shared generation if needed, the ruleset
+** is built here rather than by the first request to see the change.
+*/
+static void
+ngx_http_dummy_ruleset_poll(ngx_http_dummy_main_conf_t *main_cf, 
+			    ngx_log_t *log)
+{
+  ngx_http_dummy_ruleset_t	*rs;
+  ngx_atomic_uint_t		gen;
+  uint64_t			start;
+
+  gen = main_cf->ruleset_shm->generation;
+  if (gen == main_cf->ruleset->generation || gen == main_cf->ruleset_failed)
+    return ;
+  start = naxsi_now_ns();
+  rs = ngx_http_dummy_ruleset_open(main_cf, log);
+  if (!rs) {
+    /* don't try again before the next generation */
+    main_cf->ruleset_failed = gen;
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "naxsi_ruleset \"%V\": generation %uA failed to load, "
+		  "still using generation %uA", &main_cf->ruleset_path,
+		  gen, main_cf->ruleset->generation);
+    return ;
+  }
+  rs->generation = gen;
+  ngx_http_dummy_ruleset_swap(main_cf, rs);
+  ngx_log_error(NGX_LOG_NOTICE, log, 0,
+		"naxsi_ruleset \"%V\": generation %uA, %ui rules, "
+		"loaded in %uLus", &main_cf->ruleset_path, gen,
+		rs->nb_rules, (naxsi_now_ns() - start) / 1000);
+}
+
+static void
+ngx_http_dummy_ruleset_poll_handler(ngx_event_t *ev)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  main_cf = ev->data;
+  if (ngx_exiting || ngx_quit)
+    return ;
+  ngx_http_dummy_ruleset_poll(main_cf, ev->log);
+  ngx_add_timer(ev, NAXSI_RULESET_POLL);
+}
+
+/*
+** workers : catch up now (the master may have been told of a new
+** generation before this worker started), then from a timer.
+*/
+ngx_int_t
+ngx_http_dummy_ruleset_init_process(ngx_cycle_t *cycle)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
+    return (NGX_OK);
+  main_cf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_naxsi_module);
+  if (!main_cf || !main_cf->ruleset || !main_cf->ruleset_shm)
+    return (NGX_OK);
+  /* the id table of this configuration is kept until the last one exits */
+  (void) ngx_atomic_fetch_add(&main_cf->ruleset_ids->users, 1);
+  ngx_http_dummy_ruleset_poll(main_cf, cycle->log);
+  main_cf->ruleset_ev.handler = ngx_http_dummy_ruleset_poll_handler;
+  main_cf->ruleset_ev.data = main_cf;
+  main_cf->ruleset_ev.log = cycle->log;
+#if (nginx_version >= 1007011)
+  main_cf->ruleset_ev.cancelable = 1;
+#endif
+  ngx_add_timer(&main_cf->ruleset_ev, NAXSI_RULESET_POLL);
+  return (NGX_OK);
+}
+
+/*
+** workers : let the id table go. A worker that crashed keeps it
+** taken until the master restarts.
+*/
+void
+ngx_http_dummy_ruleset_exit_process(ngx_cycle_t *cycle)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  main_cf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_naxsi_module);
+  if (!main_cf || !main_cf->ruleset_ev.handler)
+    return ;
+  (void) ngx_atomic_fetch_add(&main_cf->ruleset_ids->users, -1);
+}
+
+/*
+** called when the request context is created : pin the current
+** ruleset for the whole request.
+*/
+ngx_int_t
+ngx_http_dummy_ruleset_request_init(ngx_http_request_t *r, 
+				    ngx_http_request_ctx_t *ctx)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_ruleset_t	*rs;
+  ngx_pool_cleanup_t		*cln;
+
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  if (!main_cf->ruleset)
+    return (NGX_OK);
+  rs = main_cf->ruleset;
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if (!cln)
+    return (NGX_ERROR);
+  cln->handler = ngx_http_dummy_ruleset_unpin;
+  cln->data = rs;
+  rs->refs++;
+  ctx->ruleset = rs;
+  return (NGX_OK);
+}
+
+/*
+** GET : current generation, POST : load the file and make every
+** worker switch to it.
+*/
+static ngx_int_t
+ngx_http_dummy_ruleset_handler(ngx_http_request_t *r)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_ruleset_t	*rs;
+  ngx_buf_t			*b;
+  ngx_chain_t			out;
+  ngx_int_t			rc;
+  ngx_uint_t			status;
+  uint64_t			start, took;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD|NGX_HTTP_POST)))
+    return (NGX_HTTP_NOT_ALLOWED);
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK)
+    return (rc);
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  if (!main_cf->ruleset)
+    return (NGX_HTTP_SERVICE_UNAVAILABLE);
+  status = NGX_HTTP_OK;
+  took = 0;
+  if (r->method == NGX_HTTP_POST) {
+    start = naxsi_now_ns();
+    rs = ngx_http_dummy_ruleset_open(main_cf, r->connection->log);
+    took = naxsi_now_ns() - start;
+    if (!rs)
+      status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    else {
+      rs->generation = ngx_atomic_fetch_add(&main_cf->ruleset_shm->generation, 1) + 1;
+      ngx_http_dummy_ruleset_swap(main_cf, rs);
+      ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+		    "naxsi_ruleset \"%V\": generation %uA, %ui rules, "
+		    "loaded in %uLus", &main_cf->ruleset_path, 
+		    rs->generation, rs->nb_rules, took / 1000);
+    }
+  }
+  rs = main_cf->ruleset;
+  b = ngx_create_temp_buf(r->pool, sizeof("ruleset  generation  rules \n"
+					  "load failed, see error log\n") +
+			  main_cf->ruleset_path.len + NGX_ATOMIC_T_LEN + 
+			  2 * NGX_INT64_LEN);
+  if (!b)
+    return (NGX_HTTP_INTERNAL_SERVER_ERROR);
+  b->last = ngx_sprintf(b->last, "ruleset %V generation %uA rules %ui\n",
+			&main_cf->ruleset_path, rs->generation, rs->nb_rules);
+  if (status != NGX_HTTP_OK)
+    b->last = ngx_cpymem(b->last, "load failed, see error log\n",
+			 sizeof("load failed, see error log\n") - 1);
+  else if (r->method == NGX_HTTP_POST)
+    b->last = ngx_sprintf(b->last, "loaded in %uLus\n", took / 1000);
+  ngx_str_set(&r->headers_out.content_type, "text/plain");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.status = status;
+  r->headers_out.content_length_n = b->last - b->pos;
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    return (rc);
+  out.buf = b;
+  out.next = NULL;
+  return (ngx_http_output_filter(r, &out));
+}
+
+/*
+** naxsi_ruleset_control; (location)
+*/
+char *
+ngx_http_dummy_ruleset_control(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_core_loc_conf_t	*clcf;
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  main_cf = ngx_http_conf_get_module_main_conf(cf, ngx_http_naxsi_module);
+  if (!main_cf->ruleset_path.len) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "naxsi_ruleset_control needs a naxsi_ruleset defined before");
+    return (NGX_CONF_ERROR);
+  }
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_dummy_ruleset_handler;
+  return (NGX_CONF_OK);
+}
@@ -0,0 +1,796 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+** Compiled rulesets (naxsi_ruleset <file>;).
+** MainRules, BasicRule whitelists and CheckRules are parsed, checked
+** and flattened offline by contrib/ruleset/naxsi_rulesc into an image
+** made of fixed size records and a string pool, only using offsets
+** (see naxsi.h). Loading it is mapping the file, validating it and
+** pointing rules at its strings : nothing is parsed, nothing is
+** copied. What can't live in a file (pcre code, automatons and
+** dispatch tables, that hold pointers) is built from the records
+** into the ruleset's pool. Whitelists and CheckRules apply in every
+** location along with the location's own : they are compiled as a
+** location's are, into rs->wl.
+** naxsi_reload.c swaps rulesets between requests.
+*/
+
+#include "naxsi.h"
+
+//#define ruleset_debug
+
+/*
+** header size is a multiple of 8, images are padded to one :
+** the checksum is computed on 64 bits words.
+*/
+#define naxsi_ruleset_align(n)	(((n) + 7) & ~((size_t) 7))
+
+/* FNV-1a, on 64 bits words rather than bytes */
+uint64_t
+ngx_http_dummy_ruleset_sum(u_char *data, size_t len)
+{
+  uint64_t	h, w;
+  size_t	i;
+
+  h = 0xcbf29ce484222325ULL;
+  for (i = 0; i + 8 <= len; i += 8) {
+    ngx_memcpy(&w, data + i, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+  }
+  return (h);
+}
+
+static void
+ngx_http_dummy_ruleset_put_str(u_char *strings, uint32_t *pos,
+			       naxsi_ruleset_str_t *s, u_char *data, size_t len)
+{
+  if (!data) {
+    s->off = 0;
+    s->len = 0;
+    return ;
+  }
+  s->off = *pos;
+  s->len = len;
+  ngx_memcpy(strings + *pos, data, len);
+  strings[*pos + len] = 0;
+  *pos += len + 1;
+}
+
+/* match zone of a rule or a whitelist, as NAXSI_RS_* flags */
+static uint32_t
+ngx_http_dummy_ruleset_zone_flags(ngx_http_basic_rule_t *br)
+{
+  return ((br->body ? NAXSI_RS_BODY : 0) |
+	  (br->body_var ? NAXSI_RS_BODY_VAR : 0) |
+	  (br->headers ? NAXSI_RS_HEADERS : 0) |
+	  (br->headers_var ? NAXSI_RS_HEADERS_VAR : 0) |
+	  (br->url ? NAXSI_RS_URL : 0) |
+	  (br->args ? NAXSI_RS_ARGS : 0) |
+	  (br->args_var ? NAXSI_RS_ARGS_VAR : 0) |
+	  (br->file_ext ? NAXSI_RS_FILE_EXT : 0) |
+	  (br->custom_location ? NAXSI_RS_CUSTOM : 0) |
+	  (br->target_name ? NAXSI_RS_NAME : 0));
+}
+
+/* string pool bytes and location records a rule or a whitelist needs */
+static size_t
+ngx_http_dummy_ruleset_locations_len(ngx_http_basic_rule_t *br,
+				     ngx_uint_t *nb_locations)
+{
+  ngx_http_custom_rule_location_t	*loc;
+  ngx_uint_t				k;
+  size_t				len;
+
+  if (!br->custom_locations)
+    return (0);
+  loc = br->custom_locations->elts;
+  for (k = 0, len = 0; k < br->custom_locations->nelts; k++)
+    len += loc[k].target.len + 1;
+  *nb_locations += br->custom_locations->nelts;
+  return (len);
+}
+
+/* writes the custom locations of [br] from rl[*nl], returns their count */
+static uint32_t
+ngx_http_dummy_ruleset_put_locations(u_char *strings, uint32_t *pos,
+				     naxsi_ruleset_location_t *rl, 
+				     uint32_t *nl, ngx_http_basic_rule_t *br)
+{
+  ngx_http_custom_rule_location_t	*loc;
+  ngx_uint_t				k;
+
+  if (!br->custom_locations)
+    return (0);
+  loc = br->custom_locations->elts;
+  for (k = 0; k < br->custom_locations->nelts; k++, (*nl)++) {
+    rl[*nl].kind = loc[k].args_var ? NAXSI_RS_ARGS_VAR :
+      loc[k].body_var ? NAXSI_RS_BODY_VAR :
+      loc[k].headers_var ? NAXSI_RS_HEADERS_VAR : NAXSI_RS_SPECIFIC_URL;
+    rl[*nl].hash = loc[k].hash;
+    ngx_http_dummy_ruleset_put_str(strings, pos, &rl[*nl].target,
+				   loc[k].target.data, loc[k].target.len);
+  }
+  return (k);
+}
+
+/*
+** in : parsed MainRules (one per line, as cfg_parse_one_rule
+**	returns them), BasicRule whitelists and CheckRules, any of
+**	them may be NULL
+** does : returns the ruleset image, allocated from [pool], and
+**	  its size. NULL on failure.
+*/
+u_char *
+ngx_http_dummy_ruleset_build(ngx_pool_t *pool, ngx_array_t *rules,
+			     ngx_array_t *whitelists, ngx_array_t *check_rules,
+			     size_t *size)
+{
+  ngx_http_rule_t			*r, *wl;
+  ngx_http_check_rule_t			*cr;
+  naxsi_ruleset_hdr_t			*hdr;
+  naxsi_ruleset_rule_t			*rr;
+  naxsi_ruleset_wl_t			*rw;
+  naxsi_ruleset_check_t			*rc;
+  naxsi_ruleset_location_t		*rl;
+  ngx_http_basic_rule_t			*br;
+  ngx_uint_t				i, k, nb_rules, nb_wl, nb_cr;
+  ngx_uint_t				nb_locations, nb_ids;
+  size_t				strings_len, len;
+  u_char				*image, *strings;
+  uint32_t				pos, nl, ni;
+  int32_t				*ids;
+
+  nb_rules = rules ? rules->nelts : 0;
+  nb_wl = whitelists ? whitelists->nelts : 0;
+  nb_cr = check_rules ? check_rules->nelts : 0;
+  r = rules ? rules->elts : NULL;
+  wl = whitelists ? whitelists->elts : NULL;
+  cr = check_rules ? check_rules->elts : NULL;
+  /* first byte of the pool is the "no string" offset */
+  strings_len = 1;
+  nb_locations = 0;
+  nb_ids = 0;
+  for (i = 0; i < nb_rules; i++) {
+    br = r[i].br;
+    if (!br)
+      return (NULL);
+    if (br->str)
+      strings_len += br->str->len + 1;
+    if (br->rx)
+      strings_len += br->rx->pattern.len + 1;
+    if (r[i].log_msg && r[i].log_msg->data)
+      strings_len += r[i].log_msg->len + 1;
+    if (r[i].sc_tag)
+      strings_len += r[i].sc_tag->len + 1;
+    if (br->custom_location)
+      strings_len += ngx_http_dummy_ruleset_locations_len(br, &nb_locations);
+  }
+  for (i = 0; i < nb_wl; i++) {
+    if (!wl[i].br || !wl[i].wl_id)
+      return (NULL);
+    strings_len += ngx_http_dummy_ruleset_locations_len(wl[i].br, 
+							&nb_locations);
+    for (k = 0; wl[i].wl_id[k] >= 0; k++)
+      nb_ids++;
+  }
+  for (i = 0; i < nb_cr; i++)
+    strings_len += cr[i].sc_tag.len + 1;
+  len = sizeof(naxsi_ruleset_hdr_t) + nb_rules * sizeof(naxsi_ruleset_rule_t) +
+    nb_wl * sizeof(naxsi_ruleset_wl_t) + nb_cr * sizeof(naxsi_ruleset_check_t) +
+    nb_locations * sizeof(naxsi_ruleset_location_t) + nb_ids * sizeof(int32_t);
+  len = naxsi_ruleset_align(len + strings_len);
+  if (len > (uint32_t) -1)
+    return (NULL);
+  image = ngx_pcalloc(pool, len);
+  if (!image)
+    return (NULL);
+  hdr = (naxsi_ruleset_hdr_t *) image;
+  ngx_memcpy(hdr->magic, NAXSI_RULESET_MAGIC, sizeof(NAXSI_RULESET_MAGIC));
+  hdr->version = NAXSI_RULESET_VERSION;
+  hdr->endian = NAXSI_RULESET_ENDIAN;
+  hdr->size = len;
+  hdr->nb_rules = nb_rules;
+  hdr->nb_whitelists = nb_wl;
+  hdr->nb_check_rules = nb_cr;
+  hdr->nb_locations = nb_locations;
+  hdr->nb_ids = nb_ids;
+  hdr->rules = sizeof(naxsi_ruleset_hdr_t);
+  hdr->whitelists = hdr->rules + nb_rules * sizeof(naxsi_ruleset_rule_t);
+  hdr->check_rules = hdr->whitelists + nb_wl * sizeof(naxsi_ruleset_wl_t);
+  hdr->locations = hdr->check_rules + nb_cr * sizeof(naxsi_ruleset_check_t);
+  hdr->ids = hdr->locations + nb_locations * sizeof(naxsi_ruleset_location_t);
+  hdr->strings = hdr->ids + nb_ids * sizeof(int32_t);
+  hdr->strings_len = strings_len;
+  rr = (naxsi_ruleset_rule_t *) (image + hdr->rules);
+  rw = (naxsi_ruleset_wl_t *) (image + hdr->whitelists);
+  rc = (naxsi_ruleset_check_t *) (image + hdr->check_rules);
+  rl = (naxsi_ruleset_location_t *) (image + hdr->locations);
+  ids = (int32_t *) (image + hdr->ids);
+  strings = image + hdr->strings;
+  pos = 1;
+  nl = 0;
+  for (i = 0; i < nb_rules; i++, rr++) {
+    br = r[i].br;
+    rr->rule_id = r[i].rule_id;
+    rr->score = r[i].score;
+    rr->sc_score = r[i].sc_score;
+    rr->transform = br->transform;
+    rr->flags = ngx_http_dummy_ruleset_zone_flags(br) |
+      (br->negative ? NAXSI_RS_NEGATIVE : 0) |
+      (r[i].block ? NAXSI_RS_BLOCK : 0) |
+      (r[i].allow ? NAXSI_RS_ALLOW : 0);
+    if (br->str)
+      ngx_http_dummy_ruleset_put_str(strings, &pos, &rr->str, 
+				     br->str->data, br->str->len);
+    if (br->rx)
+      ngx_http_dummy_ruleset_put_str(strings, &pos, &rr->rx,
+				     br->rx->pattern.data, br->rx->pattern.len);
+    if (r[i].log_msg)
+      ngx_http_dummy_ruleset_put_str(strings, &pos, &rr->msg,
+				     r[i].log_msg->data, r[i].log_msg->len);
+    if (r[i].sc_tag)
+      ngx_http_dummy_ruleset_put_str(strings, &pos, &rr->sc_tag,
+				     r[i].sc_tag->data, r[i].sc_tag->len);
+    rr->location = nl;
+    if (br->custom_location)
+      rr->nb_locations = ngx_http_dummy_ruleset_put_locations(strings, &pos, 
+							       rl, &nl, br);
+  }
+  ni = 0;
+  for (i = 0; i < nb_wl; i++, rw++) {
+    rw->flags = ngx_http_dummy_ruleset_zone_flags(wl[i].br);
+    rw->location = nl;
+    rw->nb_locations = ngx_http_dummy_ruleset_put_locations(strings, &pos, 
+							     rl, &nl, wl[i].br);
+    rw->id = ni;
+    for (k = 0; wl[i].wl_id[k] >= 0; k++)
+      ids[ni++] = wl[i].wl_id[k];
+    rw->nb_ids = k;
+  }
+  for (i = 0; i < nb_cr; i++, rc++) {
+    rc->sc_score = cr[i].sc_score;
+    rc->cmp = cr[i].cmp;
+    rc->flags = (cr[i].block ? NAXSI_RS_BLOCK : 0) |
+      (cr[i].allow ? NAXSI_RS_ALLOW : 0);
+    ngx_http_dummy_ruleset_put_str(strings, &pos, &rc->sc_tag,
+				   cr[i].sc_tag.data, cr[i].sc_tag.len);
+  }
+  hdr->checksum = ngx_http_dummy_ruleset_sum(image + sizeof(naxsi_ruleset_hdr_t),
+					     len - sizeof(naxsi_ruleset_hdr_t));
+  *size = len;
+  return (image);
+}
+
+/*
+** returns the string [s] of the image, NULL if it has none.
+** s has been checked by ngx_http_dummy_ruleset_check_str.
+*/
+static ngx_str_t *
+ngx_http_dummy_ruleset_str(ngx_pool_t *pool, u_char *strings,
+			   naxsi_ruleset_str_t *s)
+{
+  ngx_str_t	*str;
+
+  if (!s->off)
+    return (NULL);
+  str = ngx_palloc(pool, sizeof(ngx_str_t));
+  if (!str)
+    return (NULL);
+  str->data = strings + s->off;
+  str->len = s->len;
+  return (str);
+}
+
+static ngx_int_t
+ngx_http_dummy_ruleset_check_str(naxsi_ruleset_hdr_t *hdr, u_char *strings,
+				 naxsi_ruleset_str_t *s)
+{
+  if (!s->off)
+    return (s->len ? NGX_ERROR : NGX_OK);
+  if (s->off >= hdr->strings_len || s->len >= hdr->strings_len - s->off ||
+      strings[s->off + s->len] != 0)
+    return (NGX_ERROR);
+  return (NGX_OK);
+}
+
+/* a range of custom location records, as rules and whitelists have */
+static ngx_int_t
+ngx_http_dummy_ruleset_check_locations(naxsi_ruleset_hdr_t *hdr,
+				       uint32_t flags, uint32_t location,
+				       uint32_t nb_locations)
+{
+  if (location > hdr->nb_locations ||
+      nb_locations > hdr->nb_locations - location ||
+      (nb_locations && !(flags & NAXSI_RS_CUSTOM)))
+    return (NGX_ERROR);
+  return (NGX_OK);
+}
+
+/*
+** checks everything the loader relies on : header, record
+** offsets and counts, and that each string is within the pool.
+*/
+static ngx_int_t
+ngx_http_dummy_ruleset_check(ngx_conf_t *cf, ngx_str_t *path, 
+			     u_char *map, size_t size)
+{
+  naxsi_ruleset_hdr_t		*hdr;
+  naxsi_ruleset_rule_t		*rr;
+  naxsi_ruleset_wl_t		*rw;
+  naxsi_ruleset_check_t		*rc;
+  naxsi_ruleset_location_t	*rl;
+  u_char			*strings;
+  int32_t			*ids;
+  ngx_uint_t			i;
+  char				*err;
+
+  hdr = (naxsi_ruleset_hdr_t *) map;
+  err = NULL;
+  if (size < sizeof(naxsi_ruleset_hdr_t) || 
+      ngx_memcmp(hdr->magic, NAXSI_RULESET_MAGIC, 
+		 sizeof(NAXSI_RULESET_MAGIC)))
+    err = "not a naxsi ruleset";
+  else if (hdr->endian != NAXSI_RULESET_ENDIAN)
+    err = "built on a host of another byte order";
+  else if (hdr->version != NAXSI_RULESET_VERSION)
+    err = "unsupported version";
+  else if (hdr->size != size || size % 8)
+    err = "truncated";
+  else if (hdr->checksum != 
+	   ngx_http_dummy_ruleset_sum(map + sizeof(naxsi_ruleset_hdr_t),
+				      size - sizeof(naxsi_ruleset_hdr_t)))
+    err = "bad checksum";
+  else if (hdr->rules != sizeof(naxsi_ruleset_hdr_t) ||
+	   hdr->whitelists != hdr->rules + 
+	   (uint64_t) hdr->nb_rules * sizeof(naxsi_ruleset_rule_t) ||
+	   hdr->check_rules != hdr->whitelists + 
+	   (uint64_t) hdr->nb_whitelists * sizeof(naxsi_ruleset_wl_t) ||
+	   hdr->locations != hdr->check_rules + 
+	   (uint64_t) hdr->nb_check_rules * sizeof(naxsi_ruleset_check_t) ||
+	   hdr->ids != hdr->locations + 
+	   (uint64_t) hdr->nb_locations * sizeof(naxsi_ruleset_location_t) ||
+	   hdr->strings != hdr->ids + 
+	   (uint64_t) hdr->nb_ids * sizeof(int32_t) ||
+	   !hdr->strings_len || 
+	   (uint64_t) hdr->strings + hdr->strings_len > size)
+    err = "bad layout";
+  if (err) {
+    ngx_conf_log_error(NGX_LOG_ERR, cf, 0, "naxsi_ruleset \"%s\": %s",
+		       path->data, err);
+    return (NGX_ERROR);
+  }
+  rr = (naxsi_ruleset_rule_t *) (map + hdr->rules);
+  rw = (naxsi_ruleset_wl_t *) (map + hdr->whitelists);
+  rc = (naxsi_ruleset_check_t *) (map + hdr->check_rules);
+  rl = (naxsi_ruleset_location_t *) (map + hdr->locations);
+  ids = (int32_t *) (map + hdr->ids);
+  strings = map + hdr->strings;
+  for (i = 0; i < hdr->nb_rules; i++)
+    if (ngx_http_dummy_ruleset_check_str(hdr, strings, &rr[i].str) != NGX_OK ||
+	ngx_http_dummy_ruleset_check_str(hdr, strings, &rr[i].rx) != NGX_OK ||
+	ngx_http_dummy_ruleset_check_str(hdr, strings, &rr[i].msg) != NGX_OK ||
+	ngx_http_dummy_ruleset_check_str(hdr, strings, &rr[i].sc_tag) != NGX_OK ||
+	ngx_http_dummy_ruleset_check_locations(hdr, rr[i].flags, rr[i].location,
+					       rr[i].nb_locations) != NGX_OK) {
+      ngx_conf_log_error(NGX_LOG_ERR, cf, 0, 
+			 "naxsi_ruleset \"%s\": bad rule record %ui",
+			 path->data, i);
+      return (NGX_ERROR);
+    }
+  for (i = 0; i < hdr->nb_whitelists; i++)
+    if (ngx_http_dummy_ruleset_check_locations(hdr, rw[i].flags, rw[i].location,
+					       rw[i].nb_locations) != NGX_OK ||
+	!rw[i].nb_ids || rw[i].id > hdr->nb_ids ||
+	rw[i].nb_ids > hdr->nb_ids - rw[i].id) {
+      ngx_conf_log_error(NGX_LOG_ERR, cf, 0, 
+			 "naxsi_ruleset \"%s\": bad whitelist record %ui",
+			 path->data, i);
+      return (NGX_ERROR);
+    }
+  for (i = 0; i < hdr->nb_check_rules; i++)
+    if (!rc[i].sc_tag.off ||
+	ngx_http_dummy_ruleset_check_str(hdr, strings, &rc[i].sc_tag) != NGX_OK ||
+	rc[i].cmp < SUP || rc[i].cmp > INF_OR_EQUAL) {
+      ngx_conf_log_error(NGX_LOG_ERR, cf, 0, 
+			 "naxsi_ruleset \"%s\": bad CheckRule record %ui",
+			 path->data, i);
+      return (NGX_ERROR);
+    }
+  for (i = 0; i < hdr->nb_locations; i++)
+    if (!rl[i].target.off ||
+	ngx_http_dummy_ruleset_check_str(hdr, strings, &rl[i].target) != NGX_OK) {
+      ngx_conf_log_error(NGX_LOG_ERR, cf, 0, 
+			 "naxsi_ruleset \"%s\": bad location record %ui",
+			 path->data, i);
+      return (NGX_ERROR);
+    }
+  /* rule ids can't be negative, -1 ends the lists of whitelisted ids */
+  for (i = 0; i < hdr->nb_ids; i++)
+    if (ids[i] < 0) {
+      ngx_conf_log_error(NGX_LOG_ERR, cf, 0, 
+			 "naxsi_ruleset \"%s\": bad whitelisted id %ui",
+			 path->data, i);
+      return (NGX_ERROR);
+    }
+  return (NGX_OK);
+}
+
+/* sets the match zone of [br] from NAXSI_RS_* flags */
+static void
+ngx_http_dummy_ruleset_zone(ngx_http_basic_rule_t *br, uint32_t flags)
+{
+  br->body = (flags & NAXSI_RS_BODY) ? 1 : 0;
+  br->body_var = (flags & NAXSI_RS_BODY_VAR) ? 1 : 0;
+  br->headers = (flags & NAXSI_RS_HEADERS) ? 1 : 0;
+  br->headers_var = (flags & NAXSI_RS_HEADERS_VAR) ? 1 : 0;
+  br->url = (flags & NAXSI_RS_URL) ? 1 : 0;
+  br->args = (flags & NAXSI_RS_ARGS) ? 1 : 0;
+  br->args_var = (flags & NAXSI_RS_ARGS_VAR) ? 1 : 0;
+  br->file_ext = (flags & NAXSI_RS_FILE_EXT) ? 1 : 0;
+  br->custom_location = (flags & NAXSI_RS_CUSTOM) ? 1 : 0;
+  br->target_name = (flags & NAXSI_RS_NAME) ? 1 : 0;
+}
+
+/* custom locations of [br], targets pointing in the image */
+static ngx_int_t
+ngx_http_dummy_ruleset_locations(ngx_conf_t *cf, ngx_http_basic_rule_t *br,
+				 naxsi_ruleset_location_t *rl, 
+				 ngx_uint_t nb_locations, u_char *strings)
+{
+  ngx_http_custom_rule_location_t	*loc;
+  ngx_uint_t				k;
+
+  br->custom_locations = ngx_array_create(cf->pool, nb_locations ? 
+					  nb_locations : 1,
+					  sizeof(ngx_http_custom_rule_location_t));
+  if (!br->custom_locations)
+    return (NGX_ERROR);
+  for (k = 0; k < nb_locations; k++) {
+    loc = ngx_array_push(br->custom_locations);
+    if (!loc)
+      return (NGX_ERROR);
+    ngx_memzero(loc, sizeof(ngx_http_custom_rule_location_t));
+    loc->args_var = (rl[k].kind == NAXSI_RS_ARGS_VAR);
+    loc->body_var = (rl[k].kind == NAXSI_RS_BODY_VAR);
+    loc->headers_var = (rl[k].kind == NAXSI_RS_HEADERS_VAR);
+    loc->specific_url = (rl[k].kind == NAXSI_RS_SPECIFIC_URL);
+    loc->target.data = strings + rl[k].target.off;
+    loc->target.len = rl[k].target.len;
+    loc->hash = rl[k].hash;
+  }
+  return (NGX_OK);
+}
+
+/* turns the record of a rule back into what cfg_parse_one_rule makes */
+static ngx_int_t
+ngx_http_dummy_ruleset_rule(ngx_conf_t *cf, ngx_http_rule_t *r,
+			    naxsi_ruleset_rule_t *rr,
+			    naxsi_ruleset_location_t *rl, u_char *strings)
+{
+  ngx_http_basic_rule_t			*br;
+  ngx_regex_compile_t			*rgc;
+
+  br = ngx_pcalloc(cf->pool, sizeof(ngx_http_basic_rule_t));
+  if (!br)
+    return (NGX_ERROR);
+  r->type = BR;
+  r->br = br;
+  r->rule_id = rr->rule_id;
+  r->score = rr->score;
+  r->sc_score = rr->sc_score;
+  r->block = (rr->flags & NAXSI_RS_BLOCK) ? 1 : 0;
+  r->allow = (rr->flags & NAXSI_RS_ALLOW) ? 1 : 0;
+  r->log_msg = ngx_http_dummy_ruleset_str(cf->pool, strings, &rr->msg);
+  if (!r->log_msg) {
+    r->log_msg = ngx_pcalloc(cf->pool, sizeof(ngx_str_t));
+    if (!r->log_msg)
+      return (NGX_ERROR);
+  }
+  if (rr->sc_tag.off && 
+      !(r->sc_tag = ngx_http_dummy_ruleset_str(cf->pool, strings, &rr->sc_tag)))
+    return (NGX_ERROR);
+  if (rr->str.off &&
+      !(br->str = ngx_http_dummy_ruleset_str(cf->pool, strings, &rr->str)))
+    return (NGX_ERROR);
+  br->transform = rr->transform;
+  ngx_http_dummy_ruleset_zone(br, rr->flags);
+  br->negative = (rr->flags & NAXSI_RS_NEGATIVE) ? 1 : 0;
+  if (rr->rx.off) {
+    /* same as dummy_rx */
+    rgc = ngx_pcalloc(cf->pool, sizeof(ngx_regex_compile_t));
+    if (!rgc)
+      return (NGX_ERROR);
+    rgc->options = PCRE_CASELESS|PCRE_MULTILINE;
+    rgc->pattern.data = strings + rr->rx.off;
+    rgc->pattern.len = rr->rx.len;
+    rgc->pool = cf->pool;
+    if (ngx_regex_compile(rgc) != NGX_OK) {
+      ngx_conf_log_error(NGX_LOG_ERR, cf, 0, 
+			 "naxsi_ruleset: rule %d, bad rx: \"%s\"",
+			 (int) r->rule_id, rgc->pattern.data);
+      return (NGX_ERROR);
+    }
+    br->rx = rgc;
+    br->rx_combinable = ngx_http_rx_combinable(rgc);
+  }
+  if (!br->custom_location)
+    return (NGX_OK);
+  return (ngx_http_dummy_ruleset_locations(cf, br, rl, rr->nb_locations, 
+					   strings));
+}
+
+/* the record of a whitelist back into what cfg_parse_one_rule makes */
+static ngx_int_t
+ngx_http_dummy_ruleset_whitelist(ngx_conf_t *cf, ngx_http_rule_t *r,
+				 naxsi_ruleset_wl_t *rw,
+				 naxsi_ruleset_location_t *rl, int32_t *ids,
+				 u_char *strings)
+{
+  ngx_http_basic_rule_t	*br;
+  ngx_uint_t		k;
+
+  br = ngx_pcalloc(cf->pool, sizeof(ngx_http_basic_rule_t));
+  if (!br)
+    return (NGX_ERROR);
+  ngx_memzero(r, sizeof(ngx_http_rule_t));
+  r->type = BR;
+  r->br = br;
+  r->wl_id = ngx_palloc(cf->pool, (rw->nb_ids + 1) * sizeof(ngx_int_t));
+  if (!r->wl_id)
+    return (NGX_ERROR);
+  for (k = 0; k < rw->nb_ids; k++)
+    r->wl_id[k] = ids[k];
+  r->wl_id[k] = -1;
+  ngx_http_dummy_ruleset_zone(br, rw->flags);
+  /* no custom location : the ids are disabled in the zone */
+  if (!rw->nb_locations)
+    return (NGX_OK);
+  return (ngx_http_dummy_ruleset_locations(cf, br, rl, rw->nb_locations, 
+					   strings));
+}
+
+/*
+** whitelists and CheckRules of the image, in a location configuration
+** of their own : they are compiled and checked as a location's are.
+*/
+static ngx_int_t
+ngx_http_dummy_ruleset_wl(ngx_conf_t *cf, ngx_http_dummy_ruleset_t *rs,
+			  u_char *map)
+{
+  naxsi_ruleset_hdr_t		*hdr;
+  naxsi_ruleset_wl_t		*rw;
+  naxsi_ruleset_check_t		*rc;
+  naxsi_ruleset_location_t	*rl;
+  ngx_http_check_rule_t		*cr;
+  ngx_http_rule_t		*wl;
+  u_char			*strings;
+  int32_t			*ids;
+  ngx_uint_t			i;
+
+  hdr = (naxsi_ruleset_hdr_t *) map;
+  if (!hdr->nb_whitelists && !hdr->nb_check_rules)
+    return (NGX_OK);
+  rs->wl = ngx_pcalloc(cf->pool, sizeof(ngx_http_dummy_loc_conf_t));
+  if (!rs->wl)
+    return (NGX_ERROR);
+  rw = (naxsi_ruleset_wl_t *) (map + hdr->whitelists);
+  rc = (naxsi_ruleset_check_t *) (map + hdr->check_rules);
+  rl = (naxsi_ruleset_location_t *) (map + hdr->locations);
+  ids = (int32_t *) (map + hdr->ids);
+  strings = map + hdr->strings;
+  if (hdr->nb_whitelists) {
+    rs->wl->whitelist_rules = ngx_array_create(cf->pool, hdr->nb_whitelists,
+					       sizeof(ngx_http_rule_t));
+    if (!rs->wl->whitelist_rules)
+      return (NGX_ERROR);
+  }
+  for (i = 0; i < hdr->nb_whitelists; i++) {
+    wl = ngx_array_push(rs->wl->whitelist_rules);
+    if (!wl ||
+	ngx_http_dummy_ruleset_whitelist(cf, wl, &rw[i], rl + rw[i].location,
+					 ids + rw[i].id, strings) != NGX_OK)
+      return (NGX_ERROR);
+  }
+  if (hdr->nb_check_rules) {
+    rs->wl->check_rules = ngx_array_create(cf->pool, hdr->nb_check_rules,
+					   sizeof(ngx_http_check_rule_t));
+    if (!rs->wl->check_rules)
+      return (NGX_ERROR);
+  }
+  for (i = 0; i < hdr->nb_check_rules; i++) {
+    cr = ngx_array_push(rs->wl->check_rules);
+    if (!cr)
+      return (NGX_ERROR);
+    ngx_memzero(cr, sizeof(ngx_http_check_rule_t));
+    cr->sc_tag.data = strings + rc[i].sc_tag.off;
+    cr->sc_tag.len = rc[i].sc_tag.len;
+    cr->sc_score = rc[i].sc_score;
+    cr->cmp = rc[i].cmp;
+    cr->block = (rc[i].flags & NAXSI_RS_BLOCK) ? 1 : 0;
+    cr->allow = (rc[i].flags & NAXSI_RS_ALLOW) ? 1 : 0;
+  }
+  return (NGX_OK);
+}
+
+/*
+** in : a configuration (cf->pool receives everything, cf->log
+**	the errors), ruleset image path
+** does : maps the image, and builds the rules, automatons, combined
+**	  regexes and dispatch tables of each zone, whitelists and
+**	  CheckRules. rx: rules are not JIT compiled yet, rules are not
+**	  numbered nor whitelists compiled (see
+**	  ngx_http_dummy_ruleset_whitelists).
+** returns NULL on failure.
+*/
+ngx_http_dummy_ruleset_t *
+ngx_http_dummy_ruleset_load(ngx_conf_t *cf, ngx_str_t *path)
+{
+  ngx_http_dummy_ruleset_t	*rs;
+  naxsi_ruleset_hdr_t		*hdr;
+  naxsi_ruleset_rule_t		*rr;
+  naxsi_ruleset_location_t	*rl;
+  ngx_array_t			*zone_rules[UNKNOWN];
+  ngx_file_info_t		fi;
+  ngx_fd_t			fd;
+  ngx_uint_t			i;
+  u_char			*map, *strings;
+  size_t			size;
+  int				zone;
+
+  fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if (fd == NGX_INVALID_FILE) {
+    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno, 
+		       ngx_open_file_n " \"%s\" failed", path->data);
+    return (NULL);
+  }
+  if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno, 
+		       ngx_fd_info_n " \"%s\" failed", path->data);
+    ngx_close_file(fd);
+    return (NULL);
+  }
+  size = ngx_file_size(&fi);
+  map = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  ngx_close_file(fd);
+  if (map == MAP_FAILED) {
+    ngx_conf_log_error(NGX_LOG_ERR, cf, ngx_errno, 
+		       "mmap(\"%s\") failed", path->data);
+    return (NULL);
+  }
+  rs = NULL;
+  if (ngx_http_dummy_ruleset_check(cf, path, map, size) != NGX_OK)
+    goto failed;
+  hdr = (naxsi_ruleset_hdr_t *) map;
+  rs = ngx_pcalloc(cf->pool, sizeof(ngx_http_dummy_ruleset_t));
+  if (!rs)
+    goto failed;
+  rs->pool = cf->pool;
+  rs->map = map;
+  rs->size = size;
+  rs->nb_rules = hdr->nb_rules;
+  rs->rules = ngx_pcalloc(cf->pool, 
+			  (hdr->nb_rules ? hdr->nb_rules : 1) * sizeof(ngx_http_rule_t));
+  if (!rs->rules)
+    goto failed;
+  rr = (naxsi_ruleset_rule_t *) (map + hdr->rules);
+  rl = (naxsi_ruleset_location_t *) (map + hdr->locations);
+  strings = map + hdr->strings;
+  for (i = 0; i < hdr->nb_rules; i++) {
+    if (ngx_http_dummy_ruleset_rule(cf, &(rs->rules[i]), &rr[i], 
+				    rl + rr[i].location, strings) != NGX_OK ||
+	ngx_http_dummy_push_main_rule(cf->pool, &rs->get_rules, 
+				      &rs->body_rules, &rs->header_rules,
+				      &rs->generic_rules, 
+				      &(rs->rules[i])) != NGX_OK)
+      goto failed;
+  }
+  if (ngx_http_dummy_ruleset_wl(cf, rs, map) != NGX_OK)
+    goto failed;
+  /* as ngx_http_dummy_compile_zone_rules does for main_cf */
+  ngx_http_dummy_zone_rules(zone_rules, rs);
+  for (zone = HEADERS; zone < UNKNOWN; zone++) {
+    rs->str_ac[zone] = ngx_http_ac_compile(cf, zone_rules[zone], zone);
+    if (rs->str_ac[zone] == NGX_CONF_ERROR) {
+      rs->str_ac[zone] = NULL;
+      goto failed;
+    }
+    if (rs->str_ac[zone] && rs->str_ac[zone]->nb_patterns > rs->ac_max_patterns)
+      rs->ac_max_patterns = rs->str_ac[zone]->nb_patterns;
+    rs->rx_set[zone] = ngx_http_rx_compile(cf, zone_rules[zone], zone);
+    if (rs->rx_set[zone] == NGX_CONF_ERROR) {
+      rs->rx_set[zone] = NULL;
+      goto failed;
+    }
+    if (rs->rx_set[zone] && rs->rx_set[zone]->nb_rules > rs->rx_max_rules)
+      rs->rx_max_rules = rs->rx_set[zone]->nb_rules;
+    rs->dispatch[zone] = ngx_http_dummy_dispatch_compile(cf, zone_rules[zone],
+							 zone, rs->str_ac[zone],
+							 rs->rx_set[zone]);
+    if (rs->dispatch[zone] == NGX_CONF_ERROR) {
+      rs->dispatch[zone] = NULL;
+      goto failed;
+    }
+  }
+#ifdef ruleset_debug
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "XX-ruleset %s : %d rules",
+		     path->data, (int) rs->nb_rules);
+#endif
+  return (rs);
+
+ failed:
+  if (rs)
+    ngx_http_rx_release(rs->rules, 0, rs->rx_set);
+  munmap(map, size);
+  return (NULL);
+}
+
+/*
+** once the rules of [rs] are numbered (by ngx_http_dummy_index_rules
+** at configuration time, naxsi_reload.c later on) : numbers the score
+** tags of its CheckRules, in [pool] as they outlive the ruleset, and
+** compiles its whitelists as ngx_http_dummy_create_hashtables_n does
+** for locations, in cf->pool.
+*/
+ngx_int_t
+ngx_http_dummy_ruleset_whitelists(ngx_conf_t *cf, ngx_pool_t *pool,
+				  ngx_http_dummy_main_conf_t *main_cf,
+				  ngx_http_dummy_ruleset_t *rs)
+{
+  ngx_http_check_rule_t	*cr;
+  ngx_int_t		tag;
+  ngx_uint_t		i;
+
+  if (!rs->wl)
+    return (NGX_OK);
+  cr = rs->wl->check_rules ? rs->wl->check_rules->elts : NULL;
+  for (i = 0; cr && i < rs->wl->check_rules->nelts; i++) {
+    tag = ngx_http_dummy_sc_tag_id(pool, main_cf, &(cr[i].sc_tag));
+    if (tag == NGX_ERROR)
+      return (NGX_ERROR);
+    cr[i].sc_tag_id = tag;
+  }
+  return (ngx_http_dummy_create_hashtables_n(rs->wl, cf, main_cf));
+}
+
+/*
+** releases a ruleset loaded at runtime, once no request uses it.
+** the ones loaded with the configuration go away with the cycle.
+*/
+void
+ngx_http_dummy_ruleset_close(ngx_http_dummy_ruleset_t *rs)
+{
+  if (rs->conf)
+    return ;
+  ngx_http_rx_release(rs->rules, rs->nb_rules, rs->rx_set);
+  munmap(rs->map, rs->size);
+  ngx_destroy_pool(rs->pool);
+}
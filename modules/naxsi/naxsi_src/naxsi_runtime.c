@@ -48,7 +48,9 @@ ngx_http_rule_t nx_int__weird_request = {/*type*/ 0, /*whitelist flag*/ 0,
 					 /*sc_block*/ 0,  /*sc_allow*/ 0, 
 					 /*block*/ 1,  /*allow*/ 0, 
 					 /*lnk_to & from*/ 0, 0,
-					 /*fr & br ptrs*/ NULL, NULL};
+					 /*fr & br ptrs*/ NULL, NULL,
+					 /*id_index, set at init*/ 0,
+					 /*sc_tag_id*/ 0};
 ngx_http_rule_t nx_int__big_request = {/*type*/ 0, /*whitelist flag*/ 0, 
 				       /*wl_id ptr*/ NULL, /*rule_id*/ 2,
 				       /*log_msg*/ NULL, /*score*/ 0, 
@@ -56,29 +58,15 @@ ngx_http_rule_t nx_int__big_request = {/*type*/ 0, /*whitelist flag*/ 0,
 				       /*sc_block*/ 0,  /*sc_allow*/ 0, 
 				       /*block*/ 1,  /*allow*/ 0, 
 				       /*lnk_to & from*/ 0, 0,
-				       /*fr & br ptrs*/ NULL, NULL};
-
-#define dummy_error_fatal(ctx, r, ...) do {				\
-    if (ctx) ctx->block = 1;						\
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,  "XX-******** NGINX NAXSI INTERNAL ERROR ********"); \
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, __VA_ARGS__); \
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "XX-func:%s file:%s line:%d", __func__, __FILE__, __LINE__); \
-    if (r && r->uri.data) ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "XX-uri:%s", r->uri.data); \
-  } while (0)
-
-
+				       /*fr & br ptrs*/ NULL, NULL,
+				       /*id_index, set at init*/ 0,
+				       /*sc_tag_id*/ 0};
 
 void			ngx_http_dummy_update_current_ctx_status(ngx_http_request_ctx_t	*ctx, 
 								 ngx_http_dummy_loc_conf_t	*cf, ngx_http_request_t *r);
-int			ngx_http_process_basic_rule_buffer(ngx_str_t *str, ngx_http_rule_t *rl, ngx_int_t *match);
+int			ngx_http_process_basic_rule_buffer(ngx_str_t *str, ngx_http_rule_t *rl, 
+							   ngx_int_t *match, size_t skip);
 void			ngx_http_dummy_payload_handler(ngx_http_request_t *r);
-int			ngx_http_basestr_ruleset_n(ngx_pool_t *pool,
-						   ngx_str_t	*name,
-						   ngx_str_t	*value,
-						   ngx_array_t *rules,
-						   ngx_http_request_t *req,
-						   ngx_http_request_ctx_t *ctx,
-						   enum DUMMY_MATCH_ZONE zone);
 void			ngx_http_dummy_body_parse(ngx_http_request_ctx_t *ctx, 
 						  ngx_http_request_t	 *r,
 						  ngx_http_dummy_loc_conf_t *cf,
@@ -91,59 +79,53 @@ void			ngx_http_dummy_body_parse(ngx_http_request_ctx_t *ctx,
 ** in : string to inspect, associated rule
 ** does : apply the rule on the string, return 1 if matched, 
 **	  0 else and -1 on error
+**	  matches ending in the first [skip] bytes of the string were
+**	  already counted (previous body window) : they are left out of
+**	  nb_match, and only tell a negative rule that it did not fire.
+**	  A negative rule is only decided for this window : see
+**	  ngx_http_dummy_body_negative for values in several windows.
 */
 int	
 ngx_http_process_basic_rule_buffer(ngx_str_t *str,
 				   ngx_http_rule_t *rl,
-				   ngx_int_t	*nb_match)
+				   ngx_int_t	*nb_match,
+				   size_t	skip)
   
 {
-  ngx_int_t	match, tmp_idx, len, i;
+  ngx_int_t	match, tmp_idx, len, i, seen;
   unsigned char *ret;
   int		captures[6];
   if (!rl->br || !nb_match) return (-1);
   
   
   *nb_match = 0;
+  seen = 0;
   if (rl->br->rx) {
     tmp_idx = 0;
     len = str->len;
-    while 
-#if defined nginx_version && (nginx_version > 1001011)
-      (tmp_idx < len && 
-       (match = pcre_exec(rl->br->rx->regex->pcre, 0, 
-			  (const char *) str->data, str->len, tmp_idx, 0, 
-			  captures, 6)) >= 0)
-#elif defined nginx_version && (nginx_version <= 1001011)
-      (tmp_idx < len && 
-       (match = pcre_exec(rl->br->rx->regex, 0, 
-			  (const char *) str->data, str->len, 
-			  tmp_idx, 0, captures, 6)) >= 0)
-#elif defined nginx_version
-#error "Inconsistent nginx version."
-	(0)
-#else
-#error "nginx_version not defined."
-	(0)
-#endif
+    while (tmp_idx < len && 
+	   (match = pcre_exec(naxsi_rx_code(rl->br->rx), 
+			      naxsi_rx_extra(rl->br->rx), 
+			      (const char *) str->data, str->len, tmp_idx, 0, 
+			      captures, 6)) >= 0)
 	{
-	  for(i = 0; i < match; ++i)
-	    *nb_match += 1;
-	  tmp_idx = captures[1];
+	  seen = 1;
+	  if ((size_t) captures[1] > skip) {
+	    for(i = 0; i < match; ++i)
+	      *nb_match += 1;
+	    /* 0 : matched, but too many groups for captures[] */
+	    if (match == 0)
+	      *nb_match += 1;
+	  }
+	  /* empty match, move on or we would loop forever */
+	  if (captures[1] == captures[0])
+	    tmp_idx = captures[1] + 1;
+	  else
+	    tmp_idx = captures[1];
 	}
-    if (*nb_match > 0) {
-      if (rl->br->negative)
-	return (0);
-      else 
-	return (1);
-    }
-    else if (*nb_match == 0) {
-      if (rl->br->negative)
-	return (1);
-      else
-	return (0);
-    }
-    return (-1);
+    if (rl->br->negative)
+      return (seen ? 0 : 1);
+    return (*nb_match > 0 ? 1 : 0);
   }
   else if (rl->br->str) {
     match = 0;
@@ -154,8 +136,11 @@ ngx_http_process_basic_rule_buffer(ngx_str_t *str,
 					 (unsigned char *)rl->br->str->data,
 					 (unsigned int)rl->br->str->len);
       if (ret) {
-	match = 1;
-	*nb_match = *nb_match+1;
+	seen = 1;
+	if ((size_t) (ret - str->data) + rl->br->str->len > skip) {
+	  match = 1;
+	  *nb_match = *nb_match+1;
+	}
       }
       else
 	break;
@@ -167,18 +152,9 @@ ngx_http_process_basic_rule_buffer(ngx_str_t *str,
       else
 	break;
     }
-    if (match) {
-      if (rl->br->negative)
-	return (0);
-      else
-	return (1);
-    }
-    else {
-      if (rl->br->negative)
-	return (1);
-      else
-	return (0);
-    }
+    if (rl->br->negative)
+      return (seen ? 0 : 1);
+    return (match);
   }
   return (0);
 }
@@ -208,8 +184,6 @@ ngx_http_dummy_is_whitelist_adapted(ngx_http_whitelist_rule_t *b,
 				    ngx_http_request_t	*req,
 				    enum MATCH_TYPE type,
 				    ngx_int_t target_name) {
-  unsigned int i;
-  
   /* if something was found, check the rule ID */
   if (!b) return (0);
 
@@ -245,16 +219,13 @@ ngx_http_dummy_is_whitelist_adapted(ngx_http_whitelist_rule_t *b,
       return (0);
     }
     
-    for (i = 0; i < b->ids->nelts; i++) {
-      if ( ((int *)b->ids->elts)[i] == r->rule_id ||
-	   ((int *)b->ids->elts)[i] == 0) {
+    if (naxsi_idset_test(b->idset, r->id_index)) {
 #ifdef whitelist_debug
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
-		      "WhiteListing0 rule %d on var [%V] at uri [%V] (dst id:%d)",
-		      r->rule_id, name, &(req->uri), ((int *)b->ids->elts)[i]);
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
+		    "WhiteListing0 rule %d on var [%V] at uri [%V]",
+		    r->rule_id, name, &(req->uri));
 #endif
-	return (1);
-      }
+      return (1);
     }
     return (0);
   }
@@ -274,22 +245,15 @@ ngx_http_dummy_is_whitelist_adapted(ngx_http_whitelist_rule_t *b,
       return (0);
     }
     
-    for (i = 0; i < b->ids->nelts; i++) {
-#ifdef whitelist_heavy_debug
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
-		    "wl : %d, matched rule : %d", ((int *)b->ids->elts)[i], r->rule_id);
-#endif      
-      if ( ((int *)b->ids->elts)[i] == r->rule_id || 
-	   ((int *)b->ids->elts)[i] == 0) { 
+    if (naxsi_idset_test(b->idset, r->id_index)) {
 #ifdef whitelist_debug
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
-		      "WhiteListing1 rule %d/ wl[%d] = %d (wl had %d wl ids) on var [%V] at uri [%V] (zone:%s)",
-		      r->rule_id, i, ((int *)b->ids->elts)[i], b->ids->nelts, name, &(req->uri), 
-		      zone == HEADERS ? "HEADERS" : zone == URL ? "URL" : zone == BODY ? "BODY" :
-		      zone == ARGS ? "ARGS" : "UNKNOWN!!!!");
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
+		    "WhiteListing1 rule %d on var [%V] at uri [%V] (zone:%s)",
+		    r->rule_id, name, &(req->uri), 
+		    zone == HEADERS ? "HEADERS" : zone == URL ? "URL" : zone == BODY ? "BODY" :
+		    zone == ARGS ? "ARGS" : "UNKNOWN!!!!");
 #endif
-	return (1);
-      }
+      return (1);
     }
     return (0);
   }
@@ -298,16 +262,15 @@ ngx_http_dummy_is_whitelist_adapted(ngx_http_whitelist_rule_t *b,
 
 //#define whitelist_debug
 
-int	
-ngx_http_dummy_is_rule_whitelisted_n(ngx_http_request_t *req, 
-				     ngx_http_dummy_loc_conf_t *cf, 
-				     ngx_http_rule_t *r, ngx_str_t *name, 
-				     enum DUMMY_MATCH_ZONE zone,
-				     ngx_int_t target_name) {
+static int	
+ngx_http_dummy_is_rule_whitelisted_loc(ngx_http_request_t *req, 
+				       ngx_http_dummy_loc_conf_t *cf, 
+				       ngx_http_rule_t *r, ngx_str_t *name, 
+				       enum DUMMY_MATCH_ZONE zone,
+				       ngx_int_t target_name) {
   ngx_int_t			k;
   ngx_http_whitelist_rule_t	*b = NULL;
-  unsigned int		i, z;
-  ngx_http_rule_t	**dr;
+  unsigned int		i;
   ngx_str_t tmp_hashname;
   ngx_str_t nullname = ngx_null_string;
   
@@ -323,43 +286,13 @@ ngx_http_dummy_is_rule_whitelisted_n(ngx_http_request_t *req,
   tmp_hashname.data = NULL;
   
   /* Check if the rule is part of disabled rules for this location */
-  if (cf->disabled_rules) {
-    dr = cf->disabled_rules->elts;
-    for (i = 0; i < cf->disabled_rules->nelts; i++) {
+  if (zone < UNKNOWN && cf->disabled[zone][target_name ? 1 : 0] &&
+      naxsi_idset_test(cf->disabled[zone][target_name ? 1 : 0], r->id_index)) {
 #ifdef whitelist_debug
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, "id:%d", i);
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		  "rule %d disabled in this location", r->rule_id);
 #endif
-      for (z = 0; dr[i]->wl_id[z] >= 0; z++) {
-	/* if it's the same ID or that the WL id is 0 (which means ALL RULES), it's whitelisted ! */
-	/* TODO : test case for WL on rule_id 0 */
-	if (dr[i]->wl_id[z] == r->rule_id || dr[i]->wl_id[z] == 0) {
-	  /* matched in args zone and whitelisted in full args zone */
-	  if (zone == ARGS && dr[i]->br && dr[i]->br->args) {
-	    if (dr[i]->br->target_name && target_name)
-	      return (1);
-	    if (!dr[i]->br->target_name && !target_name)
-	      return (1);
-	  }
-	  /* matched in headers zone and whitelisted in full headers zone */
-	  else if (zone == HEADERS && dr[i]->br && dr[i]->br->headers) {
-	    if (dr[i]->br->target_name && target_name)
-	      return (1);
-	    if (!dr[i]->br->target_name && !target_name)
-	      return (1);
-	  }
-	  else if (zone == BODY && dr[i]->br && dr[i]->br->body) {
-	    if (dr[i]->br->target_name && target_name)
-	      return (1);
-	    if (!dr[i]->br->target_name && !target_name)
-	      return (1);
-	  }
-	  else if (zone == URL && dr[i]->br && dr[i]->br->url) return (1);
-	  /* this one, with no match zone at all, means the rule is purely disabled */
-	  else if (dr[i]->br && !(dr[i]->br->args ||  dr[i]->br->headers ||
-				  dr[i]->br->body ||  dr[i]->br->url)) return (1);
-	}
-      }
-    }
+    return (1);
   }
 #ifdef whitelist_debug
   ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
@@ -491,131 +424,154 @@ ngx_http_dummy_is_rule_whitelisted_n(ngx_http_request_t *req,
   return (0);
 }
 
+/*
+** the location's whitelists first, then naxsi_ruleset's, if the
+** request has one.
+*/
+int	
+ngx_http_dummy_is_rule_whitelisted_n(ngx_http_request_t *req, 
+				     ngx_http_dummy_loc_conf_t *cf, 
+				     ngx_http_rule_t *r, ngx_str_t *name, 
+				     enum DUMMY_MATCH_ZONE zone,
+				     ngx_int_t target_name) {
+  ngx_http_request_ctx_t	*ctx;
+  int				rc;
+
+  rc = ngx_http_dummy_is_rule_whitelisted_loc(req, cf, r, name, zone, 
+					      target_name);
+  if (rc != 0)
+    return (rc);
+  ctx = ngx_http_get_module_ctx(req, ngx_http_naxsi_module);
+  if (!ctx || !ctx->ruleset || !ctx->ruleset->wl)
+    return (0);
+  return (ngx_http_dummy_is_rule_whitelisted_loc(req, ctx->ruleset->wl, r, 
+						 name, zone, target_name));
+}
+
+
+/* bound of one "&zoneN=...&idN=...&var_nameN=" */
+#define NAXSI_FMT_RM_LEN	(sizeof("&zone=&id=&var_name=") - 1 +	\
+				 3 * NGX_INT_T_LEN +			\
+				 sizeof("BODYARGSHEADERSURL") - 1)
+
+/*
+** builds NAXSI_FMT in one pass : its size is bounded first,
+** it is then written straight to its buffer.
+*/
+static ngx_int_t
+ngx_http_dummy_fmt(ngx_http_request_ctx_t *ctx, ngx_http_request_t *r,
+		   ngx_http_dummy_loc_conf_t *cf, ngx_str_t *uri,
+		   ngx_str_t *fmt)
+{
+  ngx_http_matched_rule_t	*mr;
+  ngx_int_t			processed, blocked;
+  ngx_uint_t			i;
+  size_t			len;
+  u_char			*p;
+
+  ngx_http_dummy_stats_totals(r, cf, &processed, &blocked);
+  len = sizeof("ip=&server=&uri=&total_processed=&total_blocked=") - 1 +
+    r->connection->addr_text.len + r->headers_in.server.len + uri->len +
+    2 * NGX_INT_T_LEN;
+  if (ctx->matched) {
+    for (mr = ctx->matched; mr; mr = mr->next)
+      len += NAXSI_FMT_RM_LEN + mr->name.len;
+  }
+  else
+    len += 2 * (NAXSI_FMT_RM_LEN + sizeof("BIG_REQUEST") - 1);
+  p = ngx_pnalloc(r->pool, len);
+  if (!p)
+    return (NGX_ERROR);
+  fmt->data = p;
+  p = ngx_sprintf(p, "ip=%V&server=%V&uri=%V&total_processed=%i"
+		  "&total_blocked=%i", &(r->connection->addr_text),
+		  &(r->headers_in.server), uri, processed, blocked);
+  if (ctx->matched) {
+    for (mr = ctx->matched, i = 0; mr; mr = mr->next, i++) {
+#ifdef output_forbidden
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+		    "zones:H:%d/U:%d/A:%d/B:%d", mr->headers_var ,
+		    mr->url, mr->args_var , mr->body_var );
+#endif
+      p = ngx_sprintf(p, "&zone%ui=", i);
+      if (mr->body_var) 
+	p = ngx_cpymem(p, "BODY", 4);
+      if (mr->args_var) 
+	p = ngx_cpymem(p, "ARGS", 4);
+      if (mr->headers_var) 
+	p = ngx_cpymem(p, "HEADERS", 7);
+      if (mr->url)
+	p = ngx_cpymem(p, "URL", 3);
+      p = ngx_sprintf(p, "&id%ui=%i&var_name%ui=%V", i, mr->rule->rule_id,
+		      i, &(mr->name));
+    }
+  }
+  else {
+    if (ctx->weird_request)
+      p = ngx_sprintf(p, "&zone0=REQUEST&id0=%d&var_name0=WEIRD",
+		      WEIRD_REQUEST_INTERNAL_RULE_ID);
+    if (ctx->big_request)
+      p = ngx_sprintf(p, "&zone0=REQUEST&id0=%d&var_name0=BIG_REQUEST",
+		      BIG_BODY_INTERNAL_RULE_ID);
+  }
+  fmt->len = p - fmt->data;
+  return (NGX_OK);
+}
+
+static void
+ngx_http_dummy_push_header(ngx_http_request_t *r, const char *key,
+			   ngx_str_t *value)
+{
+  ngx_table_elt_t	*h;
+
+  h = ngx_list_push(&(r->headers_in.headers));
+  if (!h)
+    return ;
+  h->key.len = strlen(key);
+  h->key.data = (u_char *) key;
+  h->value = *value;
+}
 
 //#define output_forbidden
 ngx_int_t  
 ngx_http_output_forbidden_page(ngx_http_request_ctx_t *ctx, 
 			       ngx_http_request_t *r)
 {
-  ngx_int_t     rc, w;
-  u_int		i;
-  char		*fmt;
-  const char 	*fmt_base = "ip=%.*s&server=%.*s&uri=%.*s&total_processed=%lld&total_blocked=%lld";
-  const char	*fmt_rm = "&zone%d=%s&id%d=%d&var_name%d=%.*s";
   ngx_str_t	denied_args, tmp_uri;
   ngx_http_dummy_loc_conf_t	*cf;
-  ngx_http_matched_rule_t	*mr;
+  ngx_http_dummy_main_conf_t	*main_cf;
   
   /*
     create output message
   */
   cf = ngx_http_get_module_loc_conf(r, ngx_http_naxsi_module);
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
 #ifdef output_forbidden
   ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "#Forbidding page");
 #endif
   tmp_uri.len = r->uri.len + (2 * ngx_escape_uri(NULL, r->uri.data, r->uri.len,
 						 NGX_ESCAPE_ARGS));
-  tmp_uri.data = ngx_pcalloc(r->pool, tmp_uri.len+1);
+  tmp_uri.data = ngx_pnalloc(r->pool, tmp_uri.len);
+  if (!tmp_uri.data)
+    return (NGX_ERROR);
   ngx_escape_uri(tmp_uri.data, r->uri.data, r->uri.len, NGX_ESCAPE_ARGS);
-  rc = snprintf(0, 0, fmt_base, r->connection->addr_text.len,
-		r->connection->addr_text.data,
-		r->headers_in.server.len, r->headers_in.server.data,
-		tmp_uri.len, tmp_uri.data,
-		cf->request_processed, cf->request_blocked);
-
-  
-  if (ctx->matched) {
-    mr = ctx->matched->elts;
-    for (i = 0; i < ctx->matched->nelts; i++)
-      rc += snprintf(0, 0, fmt_rm, i, 
-		     "-----BODY|ARGS|HEADERS|URL----", 
-		     i, mr[i].rule->rule_id, i, mr[i].name->len, 
-		     mr[i].name->data);
-  }
-  else {
-    if (ctx->weird_request || ctx->big_request)
-      rc += snprintf(0, 0, fmt_rm, 99, 
-		     "-----BODY|ARGS|HEADERS|URL----", 
-		     99, 99, 99, 99, 
-		     "REQUEST_LONG_LONG");
-  }
-  fmt = ngx_pcalloc(r->pool, rc+2);
-  if (!fmt)
+  if (ngx_http_dummy_fmt(ctx, r, cf, &tmp_uri, &denied_args) != NGX_OK)
     return (NGX_ERROR);
-  w = snprintf(fmt, rc, fmt_base, r->connection->addr_text.len,
-	       r->connection->addr_text.data,
-	       r->headers_in.server.len, r->headers_in.server.data,
-	       tmp_uri.len, tmp_uri.data,
-	       cf->request_processed, cf->request_blocked);
-  
-  char	tmp_zone[30]; 
-  /*<- should be a dynamic allocation, no bof here, just mem waste
-    , but i'm lazy :) */
-  if (ctx->matched) {
-    mr = ctx->matched->elts;
-    for (i = 0; i < ctx->matched->nelts; i++) {
-      memset(tmp_zone, 0, 30);
-#ifdef output_forbidden
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		    "----"); 
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		    "zones:H:%d/U:%d/A:%d/B:%d", mr[i].headers_var ,
-		    mr[i].url, mr[i].args_var , mr[i].body_var );
-#endif
-      //zone = UNKNOWN;
-      if (mr[i].body_var) 
-	strcat(tmp_zone, "BODY");
-      if (mr[i].args_var) 
-	strcat(tmp_zone, "ARGS");
-      if (mr[i].headers_var) 
-	strcat(tmp_zone, "HEADERS");
-      if (mr[i].url)
-	strcat(tmp_zone, "URL");
-      w += snprintf(fmt+w, rc, fmt_rm, i, tmp_zone, i, 
-		    mr[i].rule->rule_id, i, mr[i].name->len, 
-		    mr[i].name->data);
-#ifdef whitelist_debug
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		    "FMT (sub) (%d) LEN:%s", i, fmt); 
-#endif
-    }
-  }
-  else {
-    if (ctx->weird_request)
-      w += snprintf(fmt+w, rc, fmt_rm, 0, "REQUEST", 0, 1, 0, 5, "WEIRD");
-    if (ctx->big_request)
-      w += snprintf(fmt+w, rc, fmt_rm, 0, "REQUEST", 0, 2, 0, 8, "BIG_REQUEST");
-  }
-  denied_args.data = (unsigned char *)fmt;
-  denied_args.len = w;
+  ngx_log_error(NGX_LOG_ERR, r->connection->log, 
+		0, "NAXSI_FMT: %V", &denied_args);
+  if (main_cf->sink)
+    ngx_http_dummy_sink_event(r, &denied_args);
+  /* 
+  ** learning with a sink : the event is already on its way,
+  ** no subrequest to DeniedUrl, nor headers for it.
+  */
+  if (cf->learning && main_cf->sink)
+    return (NGX_DECLINED);
   /* add headers with original url and arguments */
-  ngx_table_elt_t	    *h;
-  
-  
-  if(r->headers_in.headers.last)  {
-    
-    h = ngx_list_push(&(r->headers_in.headers));
-    h->key.len = strlen("orig_url");
-    h->key.data = ngx_pcalloc(r->pool, strlen("orig_url")+1);
-    memcpy(h->key.data, "orig_url", strlen("orig_url"));
-    h->value.len = tmp_uri.len;
-    h->value.data = ngx_pcalloc(r->pool, tmp_uri.len+1);
-    memcpy(h->value.data, tmp_uri.data, tmp_uri.len);
-    
-    h = ngx_list_push(&(r->headers_in.headers));
-    h->key.len = strlen("orig_args");
-    h->key.data = ngx_pcalloc(r->pool, strlen("orig_args")+1);
-    memcpy(h->key.data, "orig_args", strlen("orig_args"));
-    h->value.len = r->args.len;
-    h->value.data = ngx_pcalloc(r->pool, r->args.len+1);
-    memcpy(h->value.data, r->args.data, r->args.len);
-    
-    h = ngx_list_push(&(r->headers_in.headers));
-    h->key.len = strlen("naxsi_sig");
-    h->key.data = ngx_pcalloc(r->pool, strlen("naxsi_sig")+1);
-    memcpy(h->key.data, "naxsi_sig", strlen("naxsi_sig"));
-    h->value.len = denied_args.len;
-    h->value.data = denied_args.data;
+  if (r->headers_in.headers.last)  {
+    ngx_http_dummy_push_header(r, "orig_url", &tmp_uri);
+    ngx_http_dummy_push_header(r, "orig_args", &(r->args));
+    ngx_http_dummy_push_header(r, "naxsi_sig", &denied_args);
   }
   else if (cf->learning)
     ngx_log_error(NGX_LOG_ERR, r->connection->log, 
@@ -626,22 +582,77 @@ ngx_http_output_forbidden_page(ngx_http_request_ctx_t *ctx,
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
     clcf->post_action.data = cf->denied_url->data;
     clcf->post_action.len = cf->denied_url->len;
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 
-		  0, "NAXSI_FMT: %s", fmt);
     return (NGX_DECLINED);
   }
-  else {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 
-		  0, "NAXSI_FMT: %s", fmt);
-    rc = ngx_http_internal_redirect(r, cf->denied_url,  
-				    &denied_args); 
-    return (NGX_HTTP_OK);
+  ngx_http_internal_redirect(r, cf->denied_url, &denied_args); 
+  return (NGX_HTTP_OK);
+}
+
+/*
+** per-request bump allocator for match records : chunks are taken
+** from the request pool and never freed one by one.
+*/
+#define NAXSI_ARENA_CHUNK	1024
+
+static void *
+ngx_http_dummy_arena_alloc(ngx_http_request_ctx_t *ctx, 
+			   ngx_http_request_t *r, size_t size)
+{
+  u_char	*p;
+  size_t	chunk;
+
+  size = ngx_align(size, sizeof(void *));
+  if ((size_t) (ctx->arena_end - ctx->arena_pos) < size) {
+    chunk = ngx_max(size, NAXSI_ARENA_CHUNK);
+    p = ngx_palloc(r->pool, chunk);
+    if (!p)
+      return (NULL);
+    ctx->arena_pos = p;
+    ctx->arena_end = p + chunk;
+  }
+  p = ctx->arena_pos;
+  ctx->arena_pos += size;
+  return (p);
+}
+
+/*
+** applies CheckRule [cr] to the current score of its tag.
+*/
+static void
+ngx_http_dummy_check_score(ngx_http_request_ctx_t *ctx, 
+			   ngx_http_check_rule_t *cr, 
+			   ngx_http_special_score_t *sc)
+{
+  ngx_flag_t	matched;
+
+  matched = 0;
+  // huglier than your mom :)
+  switch (cr->cmp) {
+  case SUP:
+    matched = sc->sc_score > cr->sc_score ? 1 : 0;
+    break;
+  case SUP_OR_EQUAL:
+    matched = sc->sc_score >= cr->sc_score ? 1 : 0;
+    break;
+  case INF:
+    matched = sc->sc_score < cr->sc_score ? 1 : 0;
+    break;
+  case INF_OR_EQUAL:
+    matched = sc->sc_score <= cr->sc_score ? 1 : 0;
+    break;
   }
-  return (NGX_ERROR);
+  if (!matched)
+    return ;
+  if (cr->block)
+    ctx->block = 1;
+  if (cr->allow)
+    ctx->allow = 1;
 }
 
 /*
 ** new rulematch, less arguments ^
+** as soon as a CheckRule blocks, ctx->block is set and
+** callers stop checking rules and zones (unless learning).
 */
 /* #define whitelist_debug */
 /* #define whitelist_light_debug */
@@ -653,16 +664,23 @@ ngx_http_apply_rulematch_v_n(ngx_http_rule_t *r, ngx_http_request_ctx_t *ctx,
 			     ngx_str_t *value, enum DUMMY_MATCH_ZONE zone, 
 			     ngx_int_t nb_match, ngx_int_t target_name)
 {
-  unsigned int		found = 0, i;
+  ngx_uint_t			i;
+  size_t			size;
   ngx_http_special_score_t	*sc;
+  ngx_http_check_rule_t		*cr;
+  ngx_array_t			*rcr;
   ngx_http_dummy_loc_conf_t	*cf;
+  ngx_http_dummy_main_conf_t	*main_cf;
   ngx_http_matched_rule_t	*mr;
   
   cf = ngx_http_get_module_loc_conf(req, ngx_http_naxsi_module);
   if (!cf || !ctx )
     return ;
-  if (ngx_http_dummy_is_rule_whitelisted_n(req, cf, r, name, zone, target_name) == 1)
+  if (ngx_http_dummy_is_rule_whitelisted_n(req, cf, r, name, zone, target_name) == 1) {
+    ngx_http_dummy_stats_rule_hit(req, r, 1);
     return ;
+  }
+  ngx_http_dummy_stats_rule_hit(req, r, 0);
   if (nb_match == 0)
     nb_match = 1;
   /* it was not whitelisted, apply score and stuff */
@@ -688,13 +706,9 @@ ngx_http_apply_rulematch_v_n(ngx_http_rule_t *r, ngx_http_request_ctx_t *ctx,
 
   }
 #endif
-  if (!ctx->matched)
-    ctx->matched = ngx_array_create(req->pool, 2, 
-				    sizeof(ngx_http_matched_rule_t));
+  mr = ngx_http_dummy_arena_alloc(ctx, req, 
+				   sizeof(ngx_http_matched_rule_t) + name->len);
   /* log stuff, cause this case sux */
-  if (!ctx->matched)
-    return ;
-  mr = ngx_array_push(ctx->matched);
   if (!mr)
     return ;
   memset(mr, 0, sizeof(ngx_http_matched_rule_t));
@@ -716,53 +730,44 @@ ngx_http_apply_rulematch_v_n(ngx_http_rule_t *r, ngx_http_request_ctx_t *ctx,
   };
   mr->rule = r;
   // the current "name" ptr will be free by caller, so make a copy
-  mr->name = ngx_pcalloc(req->pool, sizeof(ngx_str_t));
   if (name->len > 0) {
-    mr->name->data = ngx_pcalloc(req->pool, name->len+1);
-    memcpy(mr->name->data, name->data, name->len);
-    mr->name->len = name->len; 
-  }
-  else {
-    mr->name->data = NULL; 
-    mr->name->len = 0; 
+    mr->name.data = (u_char *) (mr + 1);
+    memcpy(mr->name.data, name->data, name->len);
+    mr->name.len = name->len; 
   }
+  if (!ctx->matched_last)
+    ctx->matched_last = &(ctx->matched);
+  *(ctx->matched_last) = mr;
+  ctx->matched_last = &(mr->next);
   /* apply special score on rulematch */
   if (r->sc_tag) {
-      
-    found = 0;
-    if (!ctx->special_scores) //create the list
-      ctx->special_scores = ngx_array_create(req->pool, 1, sizeof(ngx_http_special_score_t));
-    else {
-      //search into the list for matching special score
-      sc = ctx->special_scores->elts;
-      for (i = 0; i < ctx->special_scores->nelts; i++) {
-	if (sc[i].sc_tag->len == r->sc_tag->len && 
-	    !ngx_strcmp(sc[i].sc_tag->data, r->sc_tag->data)) {
-#ifdef whitelist_debug
-	  ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-			"Special Score (%V) actual=%d,next=%d", r->sc_tag, 
-			sc[i].sc_score, sc[i].sc_score+(r->sc_score * nb_match));
-#endif
-	  sc[i].sc_score += (r->sc_score * nb_match);
-	  found = 1;
-	  break;
-	}
-      }
+    main_cf = ngx_http_get_module_main_conf(req, ngx_http_naxsi_module);
+    if (!ctx->special_scores) {
+      size = main_cf->sc_tags->nelts * sizeof(ngx_http_special_score_t);
+      ctx->special_scores = ngx_http_dummy_arena_alloc(ctx, req, size);
+      if (!ctx->special_scores)
+	return ;
+      memset(ctx->special_scores, 0, size);
     }
-    //else push it.
-    if (!found) {
+    sc = &(ctx->special_scores[r->sc_tag_id]);
 #ifdef whitelist_debug
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		    "Special Score (%s) actual=%d,next=%d", r->sc_tag->data, 
-		    0, r->sc_score);
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		  "Special Score (%V) actual=%d,next=%d", r->sc_tag, 
+		  sc->sc_score, sc->sc_score+(r->sc_score * nb_match));
 #endif
-      sc = ngx_array_push(ctx->special_scores);
-      if (!sc)
-	return ;
-      memset(sc, 0, sizeof(ngx_http_special_score_t));
-      sc->sc_tag = r->sc_tag;
-      sc->sc_score = (r->sc_score * nb_match);
-    }
+    sc->sc_score += (r->sc_score * nb_match);
+    sc->hit = 1;
+    /* only the CheckRules on this tag can change */
+    cr = cf->check_rules ? cf->check_rules->elts : NULL;
+    for (i = 0; cr && i < cf->check_rules->nelts; i++)
+      if (cr[i].sc_tag_id == r->sc_tag_id)
+	ngx_http_dummy_check_score(ctx, &(cr[i]), sc);
+    /* naxsi_ruleset's apply too */
+    rcr = (ctx->ruleset && ctx->ruleset->wl) ? ctx->ruleset->wl->check_rules : NULL;
+    cr = rcr ? rcr->elts : NULL;
+    for (i = 0; cr && i < rcr->nelts; i++)
+      if (cr[i].sc_tag_id == r->sc_tag_id)
+	ngx_http_dummy_check_score(ctx, &(cr[i]), sc);
   }
   else {
     /* else, apply normal score */
@@ -772,8 +777,6 @@ ngx_http_apply_rulematch_v_n(ngx_http_rule_t *r, ngx_http_request_ctx_t *ctx,
     if (r->allow)
       ctx->allow = 1;
   }
-  
-  ngx_http_dummy_update_current_ctx_status(ctx, cf, req);
   return ;
 }
 
@@ -795,14 +798,13 @@ ngx_http_spliturl_ruleset(ngx_pool_t *pool,
 			  enum DUMMY_MATCH_ZONE	zone)
 {
   ngx_str_t	name, val;
-  unsigned int		i;
   char		*eq, *ev, *orig;
   int		len, full_len;
   ngx_http_dummy_loc_conf_t	*cf;   
-  unsigned char			*dst, *src;
-
+  ngx_http_dummy_main_conf_t	*main_cf;
   
   cf = ngx_http_get_module_loc_conf(req, ngx_http_naxsi_module);
+  main_cf = ngx_http_get_module_main_conf(req, ngx_http_naxsi_module);
     
 #ifdef spliturl_ruleset_debug
   ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
@@ -867,25 +869,18 @@ ngx_http_spliturl_ruleset(ngx_pool_t *pool,
       name.len = eq - str - 1;
     }
     if (val.len || name.len) {
-      //start
-      dst = val.data;
-      src = val.data;
-      /* ngx_unescape_uri(&src, &dst, */
-      /* 		       val.len, NGX_UNESCAPE_URI);       */
-      naxsi_unescape_uri(&src, &dst,
-			 val.len, 0);      
-      val.len =  src - val.data;
-      //tmp hack fix, avoid %00 & co (null byte) encoding :p
-      for (i = 0; i < val.len; i++)
-	if (val.data[i] == 0x0)
-	  val.data[i] = '0';
-      //end
+      /* decode in place, avoiding %00 & co (null byte) encoding */
+      val.len = ngx_http_dummy_normalize(val.data, val.data, val.len,
+					 NAXSI_T_URLDECODE|NAXSI_T_NULLZERO);
+      naxsi_norm_reset(ctx);
 #ifdef spliturl_ruleset_debug
       ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
 		    "XX-extract  [%V]=[%V]", &(name), &(val));
 #endif
       if (rules)
-	ngx_http_basestr_ruleset_n(pool, &name, &val, rules, req,  ctx, zone);
+	ngx_http_basestr_ruleset_n(pool, &name, &val, cf->dispatch[zone],
+				   cf->str_ac[zone], cf->rx_set[zone], req, ctx,
+				   zone);
 #ifdef spliturl_ruleset_debug
       else
 	ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
@@ -894,13 +889,20 @@ ngx_http_spliturl_ruleset(ngx_pool_t *pool,
 
 	
       if (main_rules)
-	ngx_http_basestr_ruleset_n(pool, &name, &val, main_rules, req,  ctx, 
-				   zone);
+	ngx_http_basestr_ruleset_n(pool, &name, &val, main_cf->dispatch[zone], 
+				   main_cf->str_ac[zone], main_cf->rx_set[zone],
+				   req, ctx, zone);
 #ifdef spliturl_ruleset_debug
       else
 	ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
 		      "XX-no main rules ?");
 #endif	  
+      /* naxsi_ruleset rules, if any for this zone */
+      if (ctx->ruleset && ctx->ruleset->dispatch[zone])
+	ngx_http_basestr_ruleset_n(pool, &name, &val, 
+				   ctx->ruleset->dispatch[zone], 
+				   ctx->ruleset->str_ac[zone],
+				   ctx->ruleset->rx_set[zone], req, ctx, zone);
     }
     str += len; 
   }
@@ -908,397 +910,357 @@ ngx_http_spliturl_ruleset(ngx_pool_t *pool,
   return (0);
 }
 
-/*
-** check variable + name against a set of rules, checking against 'custom' location rules too.
-*/
 #define basestr_ruleset_debug
 
-int 
-ngx_http_basestr_ruleset_n(ngx_pool_t *pool,
-			   ngx_str_t	*name,
-			   ngx_str_t	*value,
-			   ngx_array_t *rules,
-			   ngx_http_request_t *req,
-			   ngx_http_request_ctx_t *ctx,
-			   enum DUMMY_MATCH_ZONE	zone)
+/*
+** runs the str: rules automaton of the zone on value, then on name,
+** and applies every rule that matched.
+*/
+static void
+ngx_http_basestr_ac_n(ngx_http_ac_t *ac,
+		      ngx_str_t	*name,
+		      ngx_str_t	*value,
+		      ngx_http_request_t *req,
+		      ngx_http_request_ctx_t *ctx,
+		      enum DUMMY_MATCH_ZONE	zone)
 {
-  ngx_http_rule_t		   *r;
-  unsigned int			   i, ret, z;
-  ngx_int_t			   nb_match;
-  ngx_http_custom_rule_location_t *location;
+  ngx_http_dummy_main_conf_t	*main_cf;
   ngx_http_dummy_loc_conf_t	*cf;
-  
-#ifdef basestr_ruleset_debug
-  ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		"XX-check check [%V]=[%V] in zone %s", name, value,
-		zone == BODY ? "BODY" : zone == HEADERS ? "HEADERS" : zone == URL ? "URL" :
-		zone == ARGS ? "ARGS" : "UNKNOWN"); 
-#endif
-  
-  if (!rules) {
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		  "XX-no rules, wtf ?!"); 
-    return (0);
-  }
-  r = rules->elts;
+  ngx_uint_t			i, k, nb_hits, nb_match;
+
   cf = ngx_http_get_module_loc_conf(req, ngx_http_naxsi_module);
-#ifdef basestr_ruleset_debug 
-  ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		"XX-checking rules ..."); 
-#endif
-  
-  for (i = 0; i < rules->nelts && (!ctx->block || cf->learning) ; i++) {
-#ifdef basestr_ruleset_debug 
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		  "XX-rule %d (%V=%V)", r[i].rule_id, name, value); 
-#endif
-      
-    /* does the rule have a custom location ? custom location means checking only on a specific argument */
-    if (name && name->len > 0 && r[i].br->custom_location) {
-      location = r[i].br->custom_locations->elts;
-      /* for each custom location */
-      for (z = 0; z < r[i].br->custom_locations->nelts; z++) {
-	/* if the name are the same, check */
-	if (name->len == location[z].target.len &&
-	    !strncasecmp((const char *)name->data, 
-			 (const char *) location[z].target.data, 
-			 location[z].target.len)) {
-	    
-#ifdef basestr_ruleset_debug
-	  ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
-			"XX-[SPECIFIC] check one rule [%d] iteration %d * %d", r[i].rule_id, i, z);
-#endif
-	  /* match rule against var content, */
-	  ret = ngx_http_process_basic_rule_buffer(value, &(r[i]), &nb_match);
-	  //if our rule matched, apply effects (score etc.)
-	  if (ret == 1) {
+  if (!ctx->ac_counts) {
+    main_cf = ngx_http_get_module_main_conf(req, ngx_http_naxsi_module);
+    ctx->ac_counts = ngx_pcalloc(req->pool, main_cf->ac_max_patterns * 
+				 sizeof(ngx_uint_t));
+    ctx->ac_hits = ngx_palloc(req->pool, main_cf->ac_max_patterns * 
+			      sizeof(ngx_uint_t));
+    if (!ctx->ac_counts || !ctx->ac_hits) {
+      dummy_error_fatal(ctx, req, "failed alloc");
+      return ;
+    }
+  }
+  /* match rules against var content */
+  nb_hits = ngx_http_ac_scan(ac, value->data, value->len, ctx->skip_value,
+			     ctx->ac_counts, ctx->ac_hits);
+  for (i = 0; i < nb_hits; i++) {
+    k = ctx->ac_hits[i];
+    nb_match = ctx->ac_counts[k];
+    ctx->ac_counts[k] = 0;
+    if (ctx->block && !cf->learning)
+      continue;
 #ifdef basestr_ruleset_debug
-	    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-			  "XX-apply rulematch!! [%V]=[%V] [rule=%d] (match %d times)", name, value, r[i].rule_id, nb_match); 
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		  "XX-apply rulematch!ac [%V]=[%V] [rule=%d] (match %d times)", 
+		  name, value, ac->rules[k]->rule_id, nb_match); 
 #endif
-	    ngx_http_apply_rulematch_v_n(&(r[i]), ctx, req, name, value, zone, nb_match, 0);	    
-	  }
-	  
-	  if (!r[i].br->negative) {  
-	    /* match rule against var name, */
-	    ret = ngx_http_process_basic_rule_buffer(name, &(r[i]), &nb_match);
-	    //if our rule matched, apply effects (score etc.)
-	    if (ret == 1) {
+    ngx_http_apply_rulematch_v_n(ac->rules[k], ctx, req, name, value, zone, 
+				 nb_match, 0);
+  }
+  if (!name || !name->len || ctx->skip_name)
+    return ;
+  /* match rules against var name */
+  nb_hits = ngx_http_ac_scan(ac, name->data, name->len, 0,
+			     ctx->ac_counts, ctx->ac_hits);
+  for (i = 0; i < nb_hits; i++) {
+    k = ctx->ac_hits[i];
+    nb_match = ctx->ac_counts[k];
+    ctx->ac_counts[k] = 0;
+    if (ctx->block && !cf->learning)
+      continue;
 #ifdef basestr_ruleset_debug
-	      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-			    "XX-apply rulematch[in name] [%V]=[%V] [rule=%d] (match %d times)", name, value, r[i].rule_id, nb_match); 
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		  "XX-apply rulematch[in name]!ac [%V]=[%V] [rule=%d] (match %d times)", 
+		  name, value, ac->rules[k]->rule_id, nb_match); 
 #endif
-	      ngx_http_apply_rulematch_v_n(&(r[i]), ctx, req, name, name, zone, nb_match, 1);
-	    }
-	  }
-	  
-	}
-      }
-      
-    }
-    
-    
-    
-    /*
-    ** check against the rule if the current zone is matching 
-    ** the zone the rule is meant to be check against
-    */
-    if ( (zone == HEADERS && r[i].br->headers) ||
-	 (zone == URL && r[i].br->url) ||
-	 (zone == ARGS && r[i].br->args) ||
-	 (zone == BODY && r[i].br->body && !r[i].br->file_ext) ||
-	 (zone == FILE_EXT && r[i].br->file_ext) ) {
-
-      /* #ifdef basestr_ruleset_debug */
-      /* 	ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,  */
-      /* 		      "XX-check [%V]=[%V] [rule=%d] (%d times)", name, value, r[i].rule_id, nb_match);  */
-      /* #endif */
+    ngx_http_apply_rulematch_v_n(ac->rules[k], ctx, req, name, value, zone, 
+				 nb_match, 1);
+  }
+}
+
+/*
+** one pass of the combined rx: regex on var content, then on var name.
+** the rules that fired are only run again on their own when the match
+** count matters (scored rules), or if the combined regex bailed out.
+*/
+static void
+ngx_http_basestr_rx_n(ngx_http_rx_set_t *rx,
+		      ngx_str_t	*name,
+		      ngx_str_t	*value,
+		      ngx_http_request_t *req,
+		      ngx_http_request_ctx_t *ctx,
+		      enum DUMMY_MATCH_ZONE	zone)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_loc_conf_t	*cf;
+  ngx_http_rule_t		*rl;
+  ngx_str_t			*target;
+  ngx_int_t			nb_hits, nb_match;
+  ngx_uint_t			i, k, target_name;
+  size_t			skip;
 
+  cf = ngx_http_get_module_loc_conf(req, ngx_http_naxsi_module);
+  if (!ctx->rx_fired) {
+    main_cf = ngx_http_get_module_main_conf(req, ngx_http_naxsi_module);
+    ctx->rx_fired = ngx_pcalloc(req->pool, main_cf->rx_max_rules);
+    ctx->rx_hits = ngx_palloc(req->pool, main_cf->rx_max_rules * 
+			      sizeof(ngx_uint_t));
+    if (!ctx->rx_fired || !ctx->rx_hits) {
+      dummy_error_fatal(ctx, req, "failed alloc");
+      return ;
+    }
+  }
+  /* var content first, then var name */
+  for (target_name = 0; target_name < 2; target_name++) {
+    target = target_name ? name : value;
+    if (!target || !target->len || (target_name && ctx->skip_name))
+      continue;
+    skip = target_name ? 0 : ctx->skip_value;
+    nb_hits = ngx_http_rx_scan(rx, target->data, target->len, skip,
+			       ctx->rx_fired, ctx->rx_hits);
+    /* pcre gave up, check every rule of the set */
+    if (nb_hits == NGX_ERROR) {
+      for (k = 0; k < rx->nb_rules && (!ctx->block || cf->learning); k++)
+	if (ngx_http_process_basic_rule_buffer(target, rx->rules[k],
+					       &nb_match, skip) == 1)
+	  ngx_http_apply_rulematch_v_n(rx->rules[k], ctx, req, name, value, 
+				       zone, nb_match, target_name);
+      continue;
+    }
+    for (i = 0; i < (ngx_uint_t) nb_hits; i++) {
+      k = ctx->rx_hits[i];
+      ctx->rx_fired[k] = 0;
+      if (ctx->block && !cf->learning)
+	continue;
+      rl = rx->rules[k];
+      nb_match = 1;
+      if (rl->sc_score)
+	ngx_http_process_basic_rule_buffer(target, rl, &nb_match, skip);
+      if (!nb_match)
+	continue;
 #ifdef basestr_ruleset_debug
       ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		    "XX-test rulematch!1 [%V]=[%V] [rule=%d] (%d times)", name, value, r[i].rule_id, nb_match); 
-#endif
-    
-      /* check the rule against the value*/
-      ret = ngx_http_process_basic_rule_buffer(value, &(r[i]), &nb_match);
-      /*if our rule matched, apply effects (score etc.)*/
-      if (ret == 1) {
-#ifdef basestr_ruleset_debug
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		      "XX-apply rulematch!1 [%V]=[%V] [rule=%d] (%d times)", name, value, r[i].rule_id, nb_match); 
+		    "XX-apply rulematch%s!rx [%V]=[%V] [rule=%d] (match %d times)", 
+		    target_name ? "[in name]" : "", name, value, 
+		    rl->rule_id, nb_match); 
 #endif
-	ngx_http_apply_rulematch_v_n(&(r[i]), ctx, req, name, value, zone, nb_match, 0);
-      }
-    
-      if (!r[i].br->negative) {
-#ifdef basestr_ruleset_debug
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-		      "XX-test rulematch!1 [%V]=[%V] [rule=%d] (%d times)", name, value, r[i].rule_id, nb_match); 
-#endif
-	/* check the rule against the name*/
-	ret = ngx_http_process_basic_rule_buffer(name, &(r[i]), &nb_match);
-	/*if our rule matched, apply effects (score etc.)*/
-	if (ret == 1) {
-#ifdef basestr_ruleset_debug
-	  ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
-			"XX-apply rulematch!1 [%V]=[%V] [rule=%d] (%d times)", name, value, r[i].rule_id, nb_match); 
-#endif
-	  ngx_http_apply_rulematch_v_n(&(r[i]), ctx, req, name, value, zone, nb_match, 1);
-	}
-      }
+      ngx_http_apply_rulematch_v_n(rl, ctx, req, name, value, zone, 
+				   nb_match, target_name);
     }
   }
-  return (0);
 }
-  
-
 
+/*
+** returns [str] as seen by the rules asking for the [flags] transforms.
+** the result is shared by every rule of the var with the same transforms,
+** until naxsi_norm_reset() is called for the next var.
+** [skip], if not NULL, receives ctx->skip_value in the transformed string.
+*/
+static ngx_str_t *
+ngx_http_dummy_transform(ngx_http_request_ctx_t *ctx,
+			 ngx_http_request_t *req,
+			 ngx_str_t *str,
+			 ngx_uint_t flags,
+			 size_t *skip)
+{
+  ngx_http_dummy_norm_t	*n;
+  ngx_uint_t		i;
+  size_t		size;
 
-  /*
-  ** does : parse body data, a.k.a POST/PUT datas. identifies content-type,
-  **	  and, if appropriate, boundary. then parse the stuff if multipart/for..
-  **	  or rely on spliturl if application/x-w..
-  ** [XXX] : this function sucks ! I don't parse bigger-than-body-size posts that 
-  **	   are partially stored in files, TODO ;)
+  if (!ctx->norm) {
+    ctx->norm = ngx_pcalloc(req->pool, NAXSI_NORM_SLOTS * 
+			    sizeof(ngx_http_dummy_norm_t));
+    if (!ctx->norm)
+      return (NULL);
+  }
+  for (i = 0; i < ctx->norm_used; i++) {
+    n = &(ctx->norm[i]);
+    if (n->src == str->data && n->src_len == str->len && n->flags == flags) {
+      if (skip)
+	*skip = n->skip;
+      return (&(n->out));
+    }
+  }
+  /* 
+  ** once all slots are used, recycle them in turn : the name and the
+  ** value of a rule never evict each other.
   */
-  //#define post_heavy_debug
-  //#define dummy_body_parse_debug
-void	ngx_http_dummy_multipart_parse(ngx_http_request_ctx_t *ctx, 
-				       ngx_http_request_t	 *r,
-				       u_char			*src,
-				       u_int			 len)
+  if (ctx->norm_used < NAXSI_NORM_SLOTS)
+    n = &(ctx->norm[ctx->norm_used++]);
+  else {
+    n = &(ctx->norm[ctx->norm_next]);
+    ctx->norm_next = (ctx->norm_next + 1) % NAXSI_NORM_SLOTS;
+  }
+  if (n->size < str->len) {
+    size = ngx_max(str->len, 256);
+    if (n->buf)
+      ngx_pfree(req->pool, n->buf);
+    n->buf = ngx_palloc(req->pool, size);
+    n->size = n->buf ? size : 0;
+    if (!n->buf) {
+      n->src = NULL;
+      return (NULL);
+    }
+  }
+  n->src = str->data;
+  n->src_len = str->len;
+  n->flags = flags;
+  n->out.data = n->buf;
+  /* 
+  ** where the bytes already inspected end, once transformed. An escape
+  ** cut by the boundary can move it by a few bytes.
+  */
+  n->skip = 0;
+  if (ctx->skip_value)
+    n->skip = ngx_http_dummy_normalize(n->buf, str->data, 
+				       ngx_min(ctx->skip_value, str->len), flags);
+  n->out.len = ngx_http_dummy_normalize(n->buf, str->data, str->len, flags);
+  if (skip)
+    *skip = n->skip;
+  return (&(n->out));
+}
+
+/*
+** checks value, then name, against one rule.
+** rules with t: transforms are checked against the transformed
+** name/value, the original ones are kept for logging.
+*/
+static void
+ngx_http_basestr_rule_n(ngx_http_rule_t *rl,
+			ngx_str_t *name,
+			ngx_str_t *value,
+			ngx_http_request_t *req,
+			ngx_http_request_ctx_t *ctx,
+			enum DUMMY_MATCH_ZONE zone)
 {
-  ngx_str_t				final_var, final_data;
-  char				*boundary, *varn_start, *varn_end;
-  char				*filen_start, *filen_end;
-  char				*end, *line_end;
-  u_int				boundary_len, varn_len, varc_len, idx;
-  ngx_http_dummy_loc_conf_t		*cf;
-  ngx_http_dummy_main_conf_t		*main_cf;
-  
-  cf = ngx_http_get_module_loc_conf(r, ngx_http_naxsi_module);
-  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
-  
-#ifdef post_heavy_debug
-  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		"XX-multipart/form-data");
-#endif
-  /* So far, I have noticed to correct ways of putting the boundary in a multipart post :
-  ** 1: in the content-type header, after multipart/form-data
-  ** 2: at the very begining of the body. */
-  /*extract boundary*/
-  boundary = ngx_strstr(src, "boundary=");
-  if (!boundary)
-    boundary = ngx_strstr(r->headers_in.content_type->value.data, "boundary=");
-  if (!boundary)
-    {
-      dummy_error_fatal(ctx, r, "no boundary present in POST data ?");
+  ngx_int_t	nb_match;
+  ngx_str_t	*target;
+  size_t	skip;
+  int		rc;
+
+  target = value;
+  skip = ctx->skip_value;
+  if (rl->br->transform) {
+    target = ngx_http_dummy_transform(ctx, req, value, rl->br->transform,
+				      &skip);
+    if (!target) {
+      dummy_error_fatal(ctx, req, "failed alloc");
       return ;
     }
-  boundary += 9; //strlen ("boundary=")
-  boundary_len = strlen(boundary);
-   
-  /* fetch every line starting with boundary */
-  idx = 0;
-  while (idx < len) {
-#ifdef post_heavy_debug
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		  "XX-POST data : (%s)", src+idx);
-#endif
-    //dummy_error_fatal(ctx, r, "POST data : (%s)", src+idx);
-    /* if we've reached the last boundary '--' + boundary + '--' + '\r\n'*/
-    if (idx+boundary_len+6 >= len)
-      {
-#ifdef post_heavy_debug
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		      "XX-reached end, not enough len");
+  }
+  /* check the rule against the value*/
+  rc = ngx_http_process_basic_rule_buffer(target, rl, &nb_match, skip);
+  if (rl->br->negative)
+    rc = ngx_http_dummy_body_negative(ctx, req, rl, rc);
+  if (rc == 1) {
+#ifdef basestr_ruleset_debug
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		  "XX-apply rulematch!1 [%V]=[%V] [rule=%d] (%d times)", 
+		  name, value, rl->rule_id, nb_match); 
 #endif
-	break;
-      }
-    //check if line starts with -- (pre-boundary stuff) 
-    if (src[idx] != '-' || src[idx+1] != '-' || 
-	//and if it's really followed by a boundary
-	ngx_strncmp(src+idx+2, boundary, boundary_len) || 
-	//and if it's not the last boundary of the buffer
-	idx+boundary_len + 2 + 2  >= len ||  
-	//and if it's followed by \r\n
-	src[idx+boundary_len+2] != '\r' || src[idx+boundary_len+3] != '\n') {
-      
-      dummy_error_fatal(ctx, r, "POST data is malformed (%s)", src+idx);
-      return ;
-    }
-    idx += boundary_len + 4;
-    /* we have two cases :
-    ** ---- file upload
-    ** Content-Disposition: form-data; name="somename"; filename="NetworkManager.conf"\r\n
-    ** Content-Type: application/octet-stream\r\n\r\n
-    ** <DATA>
-    ** ---- normal post var
-    ** Content-Disposition: form-data; name="lastname"\r\n\r\n
-    ** <DATA>
-    */
-    if (ngx_strncasecmp(src+idx, 
-			(u_char *) "content-disposition: form-data;", 30)) {
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		    "Unknown content-type: [%s]", src+idx);
-      dummy_error_fatal(ctx, r, "POST data : unknown content-disposition");
-      
-      return ;
-    }
-    idx += 30;
-    line_end = ngx_strchr(src+idx, '\n');
-    if (!line_end) {
-      dummy_error_fatal(ctx, r, "POST data : malformed boundary line");
-      return ;
-    }
-    // seek for name="<var>" and filename="<var>" in the current line
-    // verify that the name/filename tag founds are present
-    varn_end = filen_end = NULL;
-    varn_start = ngx_strstr(src+idx, "name=\"");
-    if (varn_start && varn_start < line_end) {
-      varn_start += 6;
-      varn_end = ngx_strchr(varn_start, '"');
-    }
-    else
-      varn_start = NULL;
-    filen_start = ngx_strstr(src+idx, "filename=\"");
-    if (filen_start && filen_start < line_end) {
-      filen_start += 10;
-      /* avoid being bypassed by filenames like bla\"aa.php */
-      filen_end = filen_start;
-      do {
-	filen_end = ngx_strchr(filen_end, '"');
-	if (*(filen_end - 1) != '\\')
-	  break;
-	filen_end++;
-      } while (filen_end < line_end);
-      /* here add support :
-      ** - when a file is here, the line bellow 'content-disposition' is content-type.
-      ** - skip this line. we should probably parse it ... to make regex on it :D
-      */
-      line_end = ngx_strchr(line_end+1, '\n');
-      if (!line_end) {
-	dummy_error_fatal(ctx, r, "POST data : malformed 'filename' field");
-	return ;
-      }
-    }
-    else
-      filen_start = NULL;
-	  
-    // check that var name is present and not malformed
-    if (!varn_start || !varn_end || varn_end <= varn_start) {
-      dummy_error_fatal(ctx, r, "POST data : no 'name' in POST var");
-      return ;
-    }
-    varn_len = varn_end - varn_start;
-    // now idx point to the end of the
-    // content-disposition: form-data; filename="" name=""
-    idx += (u_char *)line_end - (src+idx) + 1;
-    if (src[idx] != '\r' || src[idx+1] != '\n') {
-      dummy_error_fatal(ctx, r, "POST data : malformed content-disposition line");
-      return ;
-    }
-    idx += 2;
-    // seek the end of the data too
-    end = NULL;
-    while (idx < len) {
-      end = ngx_strstr(src+idx, "\r\n--");
-      if (!end) {
-	dummy_error_fatal(ctx, r, "POST data : malformed content-disposition line");
-	return ;
-      }
-      if (!ngx_strncmp(end+4, boundary, boundary_len))
-	break;
-      else {
-	idx += ((u_char *) end - (src+idx)) + 1;
-	end = NULL;
-      }
-    }
-    if (!end) {
-      dummy_error_fatal(ctx, r, "POST data : malformed line");
+    ngx_http_apply_rulematch_v_n(rl, ctx, req, name, value, zone, nb_match, 0);
+  }
+  if (rl->br->negative || ctx->skip_name || !name || !name->len)
+    return ;
+  target = name;
+  if (rl->br->transform) {
+    target = ngx_http_dummy_transform(ctx, req, name, rl->br->transform,
+				      NULL);
+    if (!target) {
+      dummy_error_fatal(ctx, req, "failed alloc");
       return ;
     }
-    if (filen_start) {
-      final_var.data = (unsigned char *)varn_start;
-      final_var.len = varn_len;
-      final_data.data = (unsigned char *)filen_start;
-      final_data.len = filen_end - filen_start;
-#ifdef post_heavy_debug
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		    "[POST] checking filename [%V] = [%V]",
-		    &final_var, &final_data);
+  }
+  /* check the rule against the name*/
+  if (ngx_http_process_basic_rule_buffer(target, rl, &nb_match, 0) == 1) {
+#ifdef basestr_ruleset_debug
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		  "XX-apply rulematch[in name] [%V]=[%V] [rule=%d] (%d times)", 
+		  name, value, rl->rule_id, nb_match); 
 #endif
-      /* here we got val name + val content !*/	      
-      if (cf->body_rules)
-	ngx_http_basestr_ruleset_n(r->pool, &final_var, &final_data,
-				   cf->body_rules, r, ctx, FILE_EXT);
-#ifdef post_heavy_debug
-      else
-	/* here we got val name + val content !*/	      
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		      "No local body rules ?!");
+    ngx_http_apply_rulematch_v_n(rl, ctx, req, name, value, zone, nb_match, 1);
+  }
+}
+
+/*
+** check variable + name against a set of rules, checking against 'custom' location rules too.
+** str: rules matching the zone are not checked one by one, but all at once with [ac],
+** and so are rx: rules with [rx]. [dp] holds the remaining rules of the zone, and
+** the custom location rules indexed by var name (see naxsi_dispatch.c).
+*/
+int 
+ngx_http_basestr_ruleset_n(ngx_pool_t *pool,
+			   ngx_str_t	*name,
+			   ngx_str_t	*value,
+			   ngx_http_dummy_dispatch_t *dp,
+			   ngx_http_ac_t *ac,
+			   ngx_http_rx_set_t *rx,
+			   ngx_http_request_t *req,
+			   ngx_http_request_ctx_t *ctx,
+			   enum DUMMY_MATCH_ZONE	zone)
+{
+  ngx_http_rule_t		**r;
+  ngx_array_t			*custom;
+  ngx_uint_t			i;
+  ngx_http_dummy_loc_conf_t	*cf;
+  uint64_t			start;
+  
+#ifdef basestr_ruleset_debug
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		"XX-check check [%V]=[%V] in zone %s", name, value,
+		zone == BODY ? "BODY" : zone == HEADERS ? "HEADERS" : zone == URL ? "URL" :
+		zone == ARGS ? "ARGS" : "UNKNOWN"); 
 #endif
-		
-      if (main_cf->body_rules)
-	ngx_http_basestr_ruleset_n(r->pool, &final_var, &final_data,
-				   main_cf->body_rules, r, ctx, FILE_EXT);
-#ifdef post_heavy_debug
-      else
-	/* here we got val name + val content !*/	      
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		      "No main body rules ?!");
+  cf = ngx_http_get_module_loc_conf(req, ngx_http_naxsi_module);
+  if (ac && (!ctx->block || cf->learning)) {
+    start = naxsi_cost_start(ctx);
+    ngx_http_basestr_ac_n(ac, name, value, req, ctx, zone);
+    naxsi_cost_end(ctx, NAXSI_COST_AC, start);
+  }
+  if (rx && (!ctx->block || cf->learning)) {
+    start = naxsi_cost_start(ctx);
+    ngx_http_basestr_rx_n(rx, name, value, req, ctx, zone);
+    naxsi_cost_end(ctx, NAXSI_COST_RX, start);
+  }
+  if (!dp)
+    return (0);
+  /* custom location means checking only on a specific argument */
+  custom = ngx_http_dummy_dispatch_find(dp, name, pool);
+  if (custom) {
+    r = custom->elts;
+    for (i = 0; i < custom->nelts && (!ctx->block || cf->learning); i++) {
+#ifdef basestr_ruleset_debug
+      ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0,
+		    "XX-[SPECIFIC] check one rule [%d]", r[i]->rule_id);
 #endif
-      
-      idx += (u_char *) end - (src+idx);
+      start = naxsi_cost_start(ctx);
+      ngx_http_basestr_rule_n(r[i], name, value, req, ctx, zone);
+      naxsi_cost_end(ctx, NAXSI_COST_RULES + r[i]->id_index, start);
     }
-    else
-      if (varn_start) {
-	varc_len = (u_char *) end - (src+idx);
-	final_var.data = (unsigned char *)varn_start;
-	final_var.len = varn_len;
-	final_data.data = src+idx;
-	final_data.len = varc_len;
-#ifdef post_heavy_debug
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		      "[POST] [%V]=[%V]",
-		      &final_var, &final_data);
-#endif
-	/* here we got val name + val content !*/	      
-	if (cf->body_rules)
-	  ngx_http_basestr_ruleset_n(r->pool, &final_var, &final_data,
-				     cf->body_rules, r, ctx, BODY);
-#ifdef post_heavy_debug
-	else
-	  /* here we got val name + val content !*/	      
-	  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-			"No local body rules ?!");
-#endif
-		
-	if (main_cf->body_rules)
-	  ngx_http_basestr_ruleset_n(r->pool, &final_var, &final_data,
-				     main_cf->body_rules, r, ctx, BODY);
-#ifdef post_heavy_debug
-	else
-	  /* here we got val name + val content !*/	      
-	  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-			"No main body rules ?!");
+  }
+  r = dp->rules;
+  for (i = 0; i < dp->nb_rules && (!ctx->block || cf->learning); i++) {
+#ifdef basestr_ruleset_debug 
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, req->connection->log, 0, 
+		  "XX-rule %d (%V=%V)", r[i]->rule_id, name, value); 
 #endif
-	      
-	idx += (u_char *) end - (src+idx);
-      }
-      else {
-	ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		      "(multipart) : ");
-
-      }
-    if (!ngx_strncmp(end, "\r\n", 2))
-      idx += 2;
+    start = naxsi_cost_start(ctx);
+    ngx_http_basestr_rule_n(r[i], name, value, req, ctx, zone);
+    naxsi_cost_end(ctx, NAXSI_COST_RULES + r[i]->id_index, start);
   }
-  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		"(multipart) : OVER");
-
+  return (0);
 }
+  
 
+
+
+  /*
+  ** does : parse body data, a.k.a POST/PUT datas. the body has usually
+  **	  been inspected while nginx was reading it (see naxsi_body.c),
+  **	  we only have to close the inspection and check the length here.
+  **	  Otherwise (no request body filters), walk the body chain, reading
+  **	  the parts that were written to a temp file.
+  */
   //#define dummy_body_parse_debug
 
 void	
@@ -1307,13 +1269,6 @@ ngx_http_dummy_body_parse(ngx_http_request_ctx_t *ctx,
 			  ngx_http_dummy_loc_conf_t *cf,
 			  ngx_http_dummy_main_conf_t *main_cf)
 {
-  u_char			*src; 
-  ngx_str_t			tmp;
-  ngx_chain_t			*bb;
-  u_char			*full_body;
-  u_int				full_body_len;
-  
-  
 #ifdef dummy_body_parse_debug
   ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
 		"XX-BODY PARSE");
@@ -1327,93 +1282,32 @@ ngx_http_dummy_body_parse(ngx_http_request_ctx_t *ctx,
       ctx->weird_request = 1;
     return ;
   }
-
-  if (r->request_body->temp_file) {
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		  "naxsi: POST REQUEST to temp_file, partially parsed.");
-    if (ngx_http_dummy_is_rule_whitelisted_n(r, cf, &nx_int__big_request, NULL, BODY, 0) == 0)
-      ctx->big_request = 1;
+  if (!ctx->body && ngx_http_dummy_body_init(ctx, r) != NGX_OK) {
+    dummy_error_fatal(ctx, r, "failed alloc");
     return ;
   }
-
-#ifdef dummy_body_parse_debug
-  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		"XX-VALID BODY");
-#endif
-  /* request body in single buffer */
-  if (r->request_body->bufs->next == NULL) {
-    full_body_len = (u_int) (r->request_body->bufs->buf->last - 
-			     r->request_body->bufs->buf->pos);
-    full_body =  ngx_pcalloc(r->pool, (u_int) (full_body_len+1));
-    memcpy(full_body, r->request_body->bufs->buf->pos, full_body_len);
-  }
-  /* request body in chain */
-  else {
-#ifdef dummy_body_parse_debug
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		  "[POST] REQUEST BODY IN CHAIN !");
-#endif
-    for (full_body_len = 0, bb = r->request_body->bufs; bb; bb = bb->next)
-      full_body_len += (bb->buf->last - bb->buf->pos);
-    full_body = ngx_pcalloc(r->pool, full_body_len+1);
-    src = full_body;
-    if (!full_body) 
-      return ;
-    for(bb = r->request_body->bufs ; bb ; bb = bb->next)
-      full_body = ngx_cpymem(full_body, bb->buf->pos, 
-			     bb->buf->last - bb->buf->pos);
-    full_body = src;
-#ifdef dummy_body_parse_debug
+  if (ctx->body->type == NAXSI_BODY_NONE) {
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		  "[POST] REQUEST BODY IN CHAIN [%s] (len=%d)", 
-		  full_body, full_body_len);
-#endif
-  }
-#ifdef dummy_body_parse_debug
-  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		"content-len header (%d) mismatch actual len (%d) ??", 
-		r->headers_in.content_length_n, full_body_len);
-#endif
-  /* File probably got buffered. */
-  if (r->headers_in.content_length_n != full_body_len) {
+		  "[POST] Unknown content-type, gtfo");
     if (ngx_http_dummy_is_rule_whitelisted_n(r, cf, &nx_int__weird_request, NULL, BODY, 0) == 0)
       ctx->weird_request = 1;
     return ;
   }
-  /* x-www-form-urlencoded POSTs */
-  //33 = echo -n "application/x-www-form-urlencoded" | wc -c
-  if (!ngx_strncasecmp(r->headers_in.content_type->value.data, 
-		       (u_char *)"application/x-www-form-urlencoded", 33)) {
-#ifdef post_heavy_debug
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		  "XX-application/x-www..");
-#endif
-    tmp.len = full_body_len;
-    tmp.data = full_body;
-
-#ifdef post_heavy_debug
+  if (!ctx->body->fed) {
+#ifdef dummy_body_parse_debug
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		  "XX-POST DATA [%V]", &tmp);
-#endif
-    if(ngx_http_spliturl_ruleset(r->pool, (char *)tmp.data, 
-				 cf->body_rules, main_cf->body_rules, 
-				 r, ctx, BODY)) {
-#ifdef post_heavy_debug
-      dummy_error_fatal(ctx, r, "spliturl failed, someone is trying to trick us");
+		  "XX-body not seen by the filter, reading chain (temp file:%d)",
+		  r->request_body->temp_file ? 1 : 0);
 #endif
-      if (ngx_http_dummy_is_rule_whitelisted_n(r, cf, &nx_int__weird_request, NULL, BODY, 0) == 0)
-	ctx->weird_request = 1;
-      return ;
-    }
+    ngx_http_dummy_body_feed_chain(ctx, r, r->request_body->bufs);
   }
-  //19 = echo -n "multipart/form-data" | wc -c
-  else if (!ngx_strncasecmp(r->headers_in.content_type->value.data, 
-			    (u_char *) "multipart/form-data", 19)) {
-    ngx_http_dummy_multipart_parse(ctx, r, full_body, full_body_len);
-  }
-  else {
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		  "[POST] Unknown content-type, gtfo");
+  ngx_http_dummy_body_finalize(ctx, r);
+#ifdef dummy_body_parse_debug
+  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
+		"content-len header (%O) vs actual len (%O)", 
+		r->headers_in.content_length_n, ctx->body->total);
+#endif
+  if (r->headers_in.content_length_n != ctx->body->total) {
     if (ngx_http_dummy_is_rule_whitelisted_n(r, cf, &nx_int__weird_request, NULL, BODY, 0) == 0)
       ctx->weird_request = 1;
   }
@@ -1440,7 +1334,8 @@ ngx_http_dummy_uri_parse(ngx_http_dummy_main_conf_t *main_cf,
     return ;
   if (ctx->block && !cf->learning)
     return ;
-  if (!main_cf->generic_rules && !cf->generic_rules) {
+  if (!main_cf->generic_rules && !cf->generic_rules &&
+      !(ctx->ruleset && ctx->ruleset->generic_rules)) {
     dummy_error_fatal(ctx, r, "no generic rules ?!");
     return ;
   }
@@ -1453,12 +1348,19 @@ ngx_http_dummy_uri_parse(ngx_http_dummy_main_conf_t *main_cf,
   memcpy(tmp.data, r->uri.data, r->uri.len);
   name.data = NULL;
   name.len = 0;
+  naxsi_norm_reset(ctx);
   if (cf->generic_rules)
-    ngx_http_basestr_ruleset_n(r->pool, &name, &tmp, cf->generic_rules, 
-			       r, ctx, URL);
+    ngx_http_basestr_ruleset_n(r->pool, &name, &tmp, cf->dispatch[URL], 
+			       cf->str_ac[URL], cf->rx_set[URL], r, ctx, URL);
   if (main_cf->generic_rules)
-    ngx_http_basestr_ruleset_n(r->pool, &name, &tmp, main_cf->generic_rules, 
+    ngx_http_basestr_ruleset_n(r->pool, &name, &tmp, main_cf->dispatch[URL], 
+			       main_cf->str_ac[URL], main_cf->rx_set[URL],
 			       r, ctx, URL);
+  if (ctx->ruleset && ctx->ruleset->generic_rules)
+    ngx_http_basestr_ruleset_n(r->pool, &name, &tmp, 
+			       ctx->ruleset->dispatch[URL], 
+			       ctx->ruleset->str_ac[URL], 
+			       ctx->ruleset->rx_set[URL], r, ctx, URL);
   ngx_pfree(r->pool, tmp.data);
 }
 
@@ -1473,7 +1375,8 @@ ngx_http_dummy_args_parse(ngx_http_dummy_main_conf_t *main_cf,
     return ;
   if (!r->args.len)
     return ;
-  if (!cf->get_rules && !main_cf->get_rules)
+  if (!cf->get_rules && !main_cf->get_rules &&
+      !(ctx->ruleset && ctx->ruleset->get_rules))
     return ;
   tmp.len = r->args.len;
   tmp.data = ngx_pcalloc(r->pool, r->args.len+1);
@@ -1501,7 +1404,8 @@ ngx_http_dummy_headers_parse(ngx_http_dummy_main_conf_t *main_cf,
   ngx_table_elt_t	    *h;
   unsigned int		     i;
 
-  if (!cf->header_rules && !main_cf->header_rules)
+  if (!cf->header_rules && !main_cf->header_rules &&
+      !(ctx->ruleset && ctx->ruleset->header_rules))
     return ;
   // this check may be removed, as it shouldn't be needed anymore !
   if (ctx->block && !cf->learning)
@@ -1517,12 +1421,20 @@ ngx_http_dummy_headers_parse(ngx_http_dummy_main_conf_t *main_cf,
       h = part->elts;
       i = 0;
     }
+    naxsi_norm_reset(ctx);
     if (cf->header_rules)
       ngx_http_basestr_ruleset_n(r->pool, &(h[i].key), &(h[i].value), 
-				 cf->header_rules, r, ctx, HEADERS);
+				 cf->dispatch[HEADERS], cf->str_ac[HEADERS], 
+				 cf->rx_set[HEADERS], r, ctx, HEADERS);
     if (main_cf->header_rules)
       ngx_http_basestr_ruleset_n(r->pool, &(h[i].key), &(h[i].value), 
-				 main_cf->header_rules, r, ctx, HEADERS);
+				 main_cf->dispatch[HEADERS], main_cf->str_ac[HEADERS],
+				 main_cf->rx_set[HEADERS], r, ctx, HEADERS);
+    if (ctx->ruleset && ctx->ruleset->header_rules)
+      ngx_http_basestr_ruleset_n(r->pool, &(h[i].key), &(h[i].value), 
+				 ctx->ruleset->dispatch[HEADERS], 
+				 ctx->ruleset->str_ac[HEADERS],
+				 ctx->ruleset->rx_set[HEADERS], r, ctx, HEADERS);
   }
   return ;
 }
@@ -1534,6 +1446,7 @@ ngx_http_dummy_data_parse(ngx_http_request_ctx_t *ctx,
   ngx_http_dummy_loc_conf_t	*cf;
   ngx_http_dummy_main_conf_t	*main_cf;
   ngx_http_core_main_conf_t  *cmcf;
+  uint64_t			start, now;
 
   cf = ngx_http_get_module_loc_conf(r, ngx_http_naxsi_module);
   cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
@@ -1545,18 +1458,31 @@ ngx_http_dummy_data_parse(ngx_http_request_ctx_t *ctx,
   }
   /* process rules only if request is not already blocked or if
      the learning mode is enabled */
+  start = naxsi_now_ns();
   ngx_http_dummy_headers_parse(main_cf, cf, ctx, r);
+  now = naxsi_now_ns();
+  ctx->phase_ns[NAXSI_PHASE_HEADERS] += now - start;
   //check uri
+  start = now;
   ngx_http_dummy_uri_parse(main_cf, cf, ctx, r);
+  now = naxsi_now_ns();
+  ctx->phase_ns[NAXSI_PHASE_URI] += now - start;
   //check args
+  start = now;
   ngx_http_dummy_args_parse(main_cf, cf, ctx, r);
+  now = naxsi_now_ns();
+  ctx->phase_ns[NAXSI_PHASE_ARGS] += now - start;
   // check method
   if ((r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT) && 
       //presence of body rules (POST/PUT rules)
-      (cf->body_rules || main_cf->body_rules) && 
+      (cf->body_rules || main_cf->body_rules ||
+       (ctx->ruleset && ctx->ruleset->body_rules)) && 
       //and the presence of data to parse
-      r->request_body && (!ctx->block || cf->learning)) 
+      r->request_body && (!ctx->block || cf->learning)) {
+    start = now;
     ngx_http_dummy_body_parse(ctx, r, cf, main_cf);
+    ctx->phase_ns[NAXSI_PHASE_BODY] += naxsi_now_ns() - start;
+  }
   ngx_http_dummy_update_current_ctx_status(ctx, cf, r);
 }
 
@@ -1568,8 +1494,9 @@ ngx_http_dummy_data_parse(ngx_http_request_ctx_t *ctx,
 					     ngx_http_dummy_loc_conf_t	*cf, 
 					     ngx_http_request_t *r)
   {
-    unsigned int	i, z, matched;
+    unsigned int	i, k;
     ngx_http_check_rule_t		*cr;
+    ngx_array_t			*check_rules[2];
     ngx_http_special_score_t	*sc;
     /* ngx_http_whitelist_rule_t	*b; */
     /* //ngx_http_whitelist_location_t	*cl; */
@@ -1628,58 +1555,31 @@ ngx_http_dummy_data_parse(ngx_http_request_ctx_t *ctx,
 #endif
       ctx->block = 1;
     }
-    /*cr, sc, cf, ctx*/
-    if (cf->check_rules && ctx->special_scores) {
+    /*cr, sc, cf, ctx : the location's, then naxsi_ruleset's */
+    check_rules[0] = cf->check_rules;
+    check_rules[1] = (ctx->ruleset && ctx->ruleset->wl) ? 
+      ctx->ruleset->wl->check_rules : NULL;
+    for (k = 0; k < 2 && ctx->special_scores; k++) {
+      if (!check_rules[k])
+	continue;
 #ifdef custom_score_debug
       ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 		    "XX-we have custom check rules and CTX got special score :)");
 #endif
-      cr = cf->check_rules->elts;
-      sc = ctx->special_scores->elts;
-      for (z = 0; z < ctx->special_scores->nelts; z++)
-	for (i = 0; i < cf->check_rules->nelts; i++) {
-#ifdef custom_score_debug
-	  ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			"XX- rule says :(%s:%d) vs current context:(%s:%d) (flag=%d)",
-			cr[i].sc_tag.data, cr[i].sc_score,
-			sc[z].sc_tag->data, sc[z].sc_score, cr[i].cmp);
-#endif
-	  if (!ngx_strcmp(sc[z].sc_tag->data, cr[i].sc_tag.data)) {
+      cr = check_rules[k]->elts;
+      for (i = 0; i < check_rules[k]->nelts; i++) {
+	sc = &(ctx->special_scores[cr[i].sc_tag_id]);
+	/* no rule scored on this tag */
+	if (!sc->hit)
+	  continue;
 #ifdef custom_score_debug
-	    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			  "XX- rule says :(%s:%d) vs current context:(%s:%d) (flag=%d)",
-			  cr[i].sc_tag.data, cr[i].sc_score,
-			  sc[z].sc_tag->data, sc[z].sc_score, cr[i].cmp);
+	ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+		      "XX- rule says :(%s:%d) vs current context:(%d) (flag=%d)",
+		      cr[i].sc_tag.data, cr[i].sc_score,
+		      sc->sc_score, cr[i].cmp);
 #endif
-	    matched=0;
-	    // huglier than your mom :)
-	    switch (cr[i].cmp) {
-	    case SUP:
-	      matched = sc[z].sc_score > cr[i].sc_score ? 1 : 0;
-	      break;
-	    case SUP_OR_EQUAL:
-	      matched = sc[z].sc_score >= cr[i].sc_score ? 1 : 0;
-	      break;
-	    case INF:
-	      matched = sc[z].sc_score < cr[i].sc_score ? 1 : 0;
-	      break;
-	    case INF_OR_EQUAL:
-	      matched = sc[z].sc_score <= cr[i].sc_score ? 1 : 0;
-	      break;
-	    }
-	    if (matched) {
-#ifdef custom_score_debug
-	      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-			    "XX- custom score rule triggered ..");
-#endif
-
-	      if (cr[i].block)
-		ctx->block = 1;
-	      if (cr[i].allow)
-		ctx->allow = 1;
-	    }
-	  }
-	}
+	ngx_http_dummy_check_score(ctx, &(cr[i]), sc);
+      }
     }
   }
 
@@ -0,0 +1,548 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+** Combined regex for rx: rules.
+** All the (combinable) rx: rules of a ruleset that apply to a given
+** match zone are compiled, and JIT compiled when pcre supports it,
+** into a single alternation, each rule being followed by a callout :
+**   (?>rx1)(?C)|(?>rx2)(?C)|...
+** The callout records which rule just matched and makes the match
+** fail, so that pcre keeps on trying every rule at every position :
+** one pcre_exec() tells all the rules that fired. Rules are only run
+** on their own afterwards, when their score needs the match count.
+*/
+
+#include "naxsi.h"
+
+//#define rx_debug
+
+/*
+** nginx installs its own pcre_malloc, that only works while
+** ngx_regex_compile() runs. Use our pool based one meanwhile.
+*/
+static ngx_pool_t	*ngx_http_rx_pool;
+static void		*(*ngx_http_rx_old_malloc)(size_t);
+static void		(*ngx_http_rx_old_free)(void *);
+
+static void *
+ngx_http_rx_malloc(size_t size)
+{
+  if (ngx_http_rx_pool)
+    return (ngx_palloc(ngx_http_rx_pool, size));
+  return (NULL);
+}
+
+static void
+ngx_http_rx_free(void *p)
+{
+  /* memory belongs to the pool */
+  return ;
+}
+
+static void
+ngx_http_rx_malloc_init(ngx_pool_t *pool)
+{
+  ngx_http_rx_pool = pool;
+  ngx_http_rx_old_malloc = pcre_malloc;
+  ngx_http_rx_old_free = pcre_free;
+  pcre_malloc = ngx_http_rx_malloc;
+  pcre_free = ngx_http_rx_free;
+}
+
+static void
+ngx_http_rx_malloc_done(void)
+{
+  pcre_malloc = ngx_http_rx_old_malloc;
+  pcre_free = ngx_http_rx_old_free;
+  ngx_http_rx_pool = NULL;
+}
+
+/*
+** returns 1 if the regex keeps its meaning once embedded in
+** the combined one : no back references or recursion (group
+** numbers are shifted), no named groups (names may clash),
+** no verbs (a (*COMMIT) would stop the other rules) and no
+** callouts of its own.
+*/
+ngx_flag_t
+ngx_http_rx_combinable(ngx_regex_compile_t *rx)
+{
+  u_char	*p, *end;
+  int		backrefs;
+
+  backrefs = 0;
+  if (pcre_fullinfo(naxsi_rx_code(rx), NULL, PCRE_INFO_BACKREFMAX,
+		    &backrefs) != 0 || backrefs)
+    return (0);
+  p = rx->pattern.data;
+  end = p + rx->pattern.len;
+  for (; p < end; p++) {
+    if (*p == '\\' && p + 1 < end) {
+      p++;
+      if ((*p >= '1' && *p <= '9') || *p == 'g' || *p == 'k')
+	return (0);
+      continue;
+    }
+    if (*p != '(' || p + 2 >= end)
+      continue;
+    if (p[1] == '*')
+      return (0);
+    if (p[1] != '?')
+      continue;
+    switch (p[2]) {
+    case 'R': case 'C': case 'P': case '&': case '\'': case '+': case '-':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      return (0);
+    case '<':
+      /* (?<= and (?<! are lookbehinds, anything else a named group */
+      if (p + 3 >= end || (p[3] != '=' && p[3] != '!'))
+	return (0);
+      break;
+    default:
+      break;
+    }
+  }
+  return (1);
+}
+
+/*
+** returns 1 if the rule can be handled by the combined regex
+** instead of being checked on its own.
+*/
+int
+ngx_http_rx_rule_eligible(ngx_http_rule_t *r, enum DUMMY_MATCH_ZONE zone)
+{
+  if (!ngx_http_dummy_rule_in_zone(r, zone))
+    return (0);
+  /* 
+  ** negative rules match on absence, and rules with transforms look at
+  ** another buffer, leave them to the slow path
+  */
+  if (!r->br->rx || !r->br->rx_combinable || r->br->negative ||
+      r->br->transform)
+    return (0);
+  return (1);
+}
+
+/*
+** in : a ruleset (array of ngx_http_rule_t) and a zone
+** does : builds the combined regex of every eligible rx: rule,
+**	  returns NULL if there is less than two of them,
+**	  NGX_CONF_ERROR on failure.
+*/
+ngx_http_rx_set_t *
+ngx_http_rx_compile(ngx_conf_t *cf, ngx_array_t *rules,
+		    enum DUMMY_MATCH_ZONE zone)
+{
+  ngx_http_rx_set_t	*set;
+  ngx_http_rule_t	*r;
+  ngx_str_t		*pat;
+  ngx_uint_t		i, k, nb_rules;
+  size_t		len;
+  u_char		*pattern, *p;
+  const char		*err;
+  int			erroff, jit;
+
+  if (!rules || rules->nelts == 0)
+    return (NULL);
+  r = rules->elts;
+  nb_rules = 0;
+  len = 0;
+  for (i = 0; i < rules->nelts; i++) {
+    if (!ngx_http_rx_rule_eligible(&(r[i]), zone))
+      continue;
+    nb_rules++;
+    len += r[i].br->rx->pattern.len + sizeof("|(?>)(?C)") - 1;
+  }
+  if (nb_rules < 2)
+    return (NULL);
+  set = ngx_pcalloc(cf->pool, sizeof(ngx_http_rx_set_t));
+  if (!set)
+    return (NGX_CONF_ERROR);
+  set->rules = ngx_pcalloc(cf->pool, nb_rules * sizeof(ngx_http_rule_t *));
+  set->callout_pos = ngx_pcalloc(cf->pool, nb_rules * sizeof(int));
+  pattern = ngx_pcalloc(cf->pool, len + 1);
+  if (!set->rules || !set->callout_pos || !pattern)
+    return (NGX_CONF_ERROR);
+  p = pattern;
+  for (i = 0, k = 0; i < rules->nelts; i++) {
+    if (!ngx_http_rx_rule_eligible(&(r[i]), zone))
+      continue;
+    pat = &(r[i].br->rx->pattern);
+    if (k)
+      *p++ = '|';
+    p = ngx_cpymem(p, "(?>", 3);
+    p = ngx_cpymem(p, pat->data, pat->len);
+    p = ngx_cpymem(p, ")(?C)", 5);
+    set->callout_pos[k] = p - pattern;
+    set->rules[k++] = &(r[i]);
+  }
+  *p = 0;
+  set->nb_rules = nb_rules;
+  /* same options as dummy_rx() */
+  ngx_http_rx_malloc_init(cf->pool);
+  set->code = pcre_compile((const char *) pattern, PCRE_CASELESS|PCRE_MULTILINE,
+			   &err, &erroff, NULL);
+  if (!set->code) {
+    ngx_http_rx_malloc_done();
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		       "combined rx: compilation failed: %s at offset %d",
+		       err, erroff);
+    return (NGX_CONF_ERROR);
+  }
+  err = NULL;
+#if (NAXSI_HAVE_PCRE_JIT)
+  set->extra = pcre_study(set->code, PCRE_STUDY_JIT_COMPILE, &err);
+#else
+  set->extra = pcre_study(set->code, 0, &err);
+#endif
+  jit = 0;
+#if (NAXSI_HAVE_PCRE_JIT)
+  if (set->extra)
+    pcre_fullinfo(set->code, set->extra, PCRE_INFO_JIT, &jit);
+#endif
+  ngx_http_rx_malloc_done();
+  if (err)
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+		       "combined rx: study failed: %s", err);
+  set->jit = jit;
+#ifdef rx_debug
+  ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+		     "XX-rx zone %d : %d rules, jit %d, [%s]",
+		     zone, set->nb_rules, set->jit, pattern);
+#endif
+  return (set);
+}
+
+typedef struct
+{
+  ngx_http_rx_set_t	*set;
+  u_char		*fired;
+  ngx_uint_t		*hits;
+  ngx_uint_t		nb_hits;
+  size_t		skip;
+} ngx_http_rx_scan_ctx_t;
+
+/*
+** called by pcre each time a rule of the set matched.
+** pattern_position is the offset following the callout.
+*/
+static int
+ngx_http_rx_callout(pcre_callout_block *cb)
+{
+  ngx_http_rx_scan_ctx_t	*sc;
+  ngx_uint_t			lo, hi, mid;
+
+  sc = cb->callout_data;
+  /* not one of ours, behave as if there was no callout function */
+  if (!sc)
+    return (0);
+  /* ends in the skipped bytes, try the next rule / position */
+  if ((size_t) cb->current_position <= sc->skip)
+    return (1);
+  lo = 0;
+  hi = sc->set->nb_rules;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (sc->set->callout_pos[mid] < cb->pattern_position)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo < sc->set->nb_rules && !sc->fired[lo]) {
+    sc->fired[lo] = 1;
+    sc->hits[sc->nb_hits++] = lo;
+    /* every rule fired, no need to go further */
+    if (sc->nb_hits == sc->set->nb_rules)
+      return (PCRE_ERROR_NOMATCH);
+  }
+  /* fail here, and backtrack to the next rule / position */
+  return (1);
+}
+
+/*
+** in : rx set, buffer, scratch flags (nb_rules long, zeroed)
+** does : single pcre_exec() on the buffer. hits[] receives the
+**	  index of each rule that matched, in order of first match.
+** Matches ending in the first [skip] bytes are ignored.
+** returns the number of rules that matched, or NGX_ERROR if pcre
+** gave up (match or JIT stack limit), in which case the caller has
+** to check the rules one by one. The caller is responsible for
+** resetting fired[hits[0..n]] to 0.
+*/
+ngx_int_t
+ngx_http_rx_scan(ngx_http_rx_set_t *set, u_char *data, size_t len,
+		 size_t skip, u_char *fired, ngx_uint_t *hits)
+{
+  ngx_http_rx_scan_ctx_t	sc;
+  pcre_extra			extra;
+  int				rc;
+
+  sc.set = set;
+  sc.fired = fired;
+  sc.hits = hits;
+  sc.nb_hits = 0;
+  sc.skip = skip;
+  /* the study data is shared, callout_data is per call */
+  if (set->extra)
+    extra = *set->extra;
+  else
+    ngx_memzero(&extra, sizeof(pcre_extra));
+  extra.flags |= PCRE_EXTRA_CALLOUT_DATA;
+  extra.callout_data = &sc;
+  pcre_callout = ngx_http_rx_callout;
+  rc = pcre_exec(set->code, &extra, (const char *) data, len, 0, 0, NULL, 0);
+  if (rc != PCRE_ERROR_NOMATCH) {
+    /* pcre bailed out (match or stack limit), caller checks one by one */
+    while (sc.nb_hits > 0)
+      fired[hits[--sc.nb_hits]] = 0;
+    return (NGX_ERROR);
+  }
+  return (sc.nb_hits);
+}
+
+/*
+** JIT compiles a rx: rule's regex. nginx studies every regex
+** after postconfiguration (with JIT only if "pcre_jit on"), so
+** this has to be done from init_module, after ngx_regex_module.
+*/
+static void
+ngx_http_rx_jit_rule(ngx_http_rule_t *r, ngx_uint_t *nb_jit)
+{
+#if (NAXSI_HAVE_PCRE_JIT && NAXSI_RX_HAVE_EXTRA)
+  pcre_extra	*extra;
+  const char	*err;
+  int		jit;
+
+  jit = 0;
+  pcre_fullinfo(naxsi_rx_code(r->br->rx), naxsi_rx_extra(r->br->rx),
+		PCRE_INFO_JIT, &jit);
+  if (!jit) {
+    err = NULL;
+    extra = pcre_study(naxsi_rx_code(r->br->rx), PCRE_STUDY_JIT_COMPILE, &err);
+    if (extra) {
+      naxsi_rx_extra(r->br->rx) = extra;
+      pcre_fullinfo(naxsi_rx_code(r->br->rx), extra, PCRE_INFO_JIT, &jit);
+    }
+  }
+  if (jit)
+    (*nb_jit)++;
+#endif
+}
+
+static ngx_int_t
+ngx_http_rx_jit_ruleset(ngx_array_t *rules, ngx_array_t *seen,
+			ngx_uint_t *nb_rules, ngx_uint_t *nb_jit)
+{
+  ngx_http_rule_t	*r;
+  ngx_http_basic_rule_t	**br;
+  ngx_uint_t		i, j;
+
+  if (!rules)
+    return (NGX_OK);
+  r = rules->elts;
+  for (i = 0; i < rules->nelts; i++) {
+    if (!r[i].br || !r[i].br->rx)
+      continue;
+    /* rules are copied in several rulesets, but share br */
+    br = seen->elts;
+    for (j = 0; j < seen->nelts; j++)
+      if (br[j] == r[i].br)
+	break;
+    if (j < seen->nelts)
+      continue;
+    br = ngx_array_push(seen);
+    if (!br)
+      return (NGX_ERROR);
+    *br = r[i].br;
+    (*nb_rules)++;
+    ngx_http_rx_jit_rule(&(r[i]), nb_jit);
+  }
+  return (NGX_OK);
+}
+
+/*
+** JIT compiles the rx: rules of a ruleset loaded at runtime (see
+** naxsi_ruleset.c), [pool] holding pcre's allocations.
+** returns the number of rules that got JIT compiled.
+*/
+ngx_uint_t
+ngx_http_rx_jit_rules(ngx_pool_t *pool, ngx_http_rule_t *rules,
+		      ngx_uint_t nb_rules)
+{
+  ngx_uint_t	i, nb_jit;
+
+  nb_jit = 0;
+  ngx_http_rx_malloc_init(pool);
+  for (i = 0; i < nb_rules; i++)
+    if (rules[i].br && rules[i].br->rx)
+      ngx_http_rx_jit_rule(&(rules[i]), &nb_jit);
+  ngx_http_rx_malloc_done();
+  return (nb_jit);
+}
+
+/*
+** JIT code lives outside of the pools : releases the one of [rules]
+** and of the combined sets, before the pool of a ruleset loaded at
+** runtime is destroyed.
+*/
+void
+ngx_http_rx_release(ngx_http_rule_t *rules, ngx_uint_t nb_rules,
+		    ngx_http_rx_set_t **rx_set)
+{
+#if (NAXSI_HAVE_PCRE_JIT)
+  ngx_uint_t	i;
+
+  /* the pcre_extra themselves belong to the pool, make pcre_free a no-op */
+  ngx_http_rx_malloc_init(NULL);
+#if (NAXSI_RX_HAVE_EXTRA)
+  for (i = 0; i < nb_rules; i++) {
+    if (!rules[i].br || !rules[i].br->rx || !naxsi_rx_extra(rules[i].br->rx))
+      continue;
+    pcre_free_study(naxsi_rx_extra(rules[i].br->rx));
+    naxsi_rx_extra(rules[i].br->rx) = NULL;
+  }
+#endif
+  for (i = HEADERS; i < UNKNOWN; i++) {
+    if (!rx_set[i] || !rx_set[i]->extra)
+      continue;
+    pcre_free_study(rx_set[i]->extra);
+    rx_set[i]->extra = NULL;
+  }
+  ngx_http_rx_malloc_done();
+#endif
+}
+
+/* counts the distinct rx sets of a configuration */
+static ngx_int_t
+ngx_http_rx_count_sets(ngx_http_rx_set_t **rx_set, ngx_array_t *seen,
+		       ngx_uint_t *nb_sets, ngx_uint_t *nb_jit)
+{
+  ngx_http_rx_set_t	**s;
+  ngx_uint_t		zone, j;
+
+  for (zone = HEADERS; zone < UNKNOWN; zone++) {
+    if (!rx_set[zone])
+      continue;
+    s = seen->elts;
+    for (j = 0; j < seen->nelts; j++)
+      if (s[j] == rx_set[zone])
+	break;
+    if (j < seen->nelts)
+      continue;
+    s = ngx_array_push(seen);
+    if (!s)
+      return (NGX_ERROR);
+    *s = rx_set[zone];
+    (*nb_sets)++;
+    if (rx_set[zone]->jit)
+      (*nb_jit)++;
+  }
+  return (NGX_OK);
+}
+
+/*
+** in : cycle, naxsi main configuration
+** does : JIT compiles every rx: rule (main & locations),
+**	  and logs the JIT status of rules and combined sets.
+*/
+ngx_int_t
+ngx_http_rx_jit_compile(ngx_cycle_t *cycle,
+			ngx_http_dummy_main_conf_t *main_cf)
+{
+  ngx_http_dummy_loc_conf_t	**loc_cf, *c;
+  ngx_array_t			*seen_br, *seen_set;
+  ngx_uint_t			i, nb_rules, nb_jit, nb_sets, nb_sets_jit;
+  ngx_int_t			rc;
+
+  seen_br = ngx_array_create(cycle->pool, 64, sizeof(ngx_http_basic_rule_t *));
+  seen_set = ngx_array_create(cycle->pool, 8, sizeof(ngx_http_rx_set_t *));
+  if (!seen_br || !seen_set)
+    return (NGX_ERROR);
+  nb_rules = nb_jit = nb_sets = nb_sets_jit = 0;
+  rc = NGX_OK;
+  ngx_http_rx_malloc_init(cycle->pool);
+  if (ngx_http_rx_jit_ruleset(main_cf->get_rules, seen_br, 
+			      &nb_rules, &nb_jit) != NGX_OK ||
+      ngx_http_rx_jit_ruleset(main_cf->body_rules, seen_br, 
+			      &nb_rules, &nb_jit) != NGX_OK ||
+      ngx_http_rx_jit_ruleset(main_cf->header_rules, seen_br, 
+			      &nb_rules, &nb_jit) != NGX_OK ||
+      ngx_http_rx_jit_ruleset(main_cf->generic_rules, seen_br, 
+			      &nb_rules, &nb_jit) != NGX_OK ||
+      ngx_http_rx_count_sets(main_cf->rx_set, seen_set,
+			     &nb_sets, &nb_sets_jit) != NGX_OK)
+    rc = NGX_ERROR;
+  if (rc == NGX_OK && main_cf->ruleset &&
+      (ngx_http_rx_jit_ruleset(main_cf->ruleset->get_rules, seen_br, 
+			       &nb_rules, &nb_jit) != NGX_OK ||
+       ngx_http_rx_jit_ruleset(main_cf->ruleset->body_rules, seen_br, 
+			       &nb_rules, &nb_jit) != NGX_OK ||
+       ngx_http_rx_jit_ruleset(main_cf->ruleset->header_rules, seen_br, 
+			       &nb_rules, &nb_jit) != NGX_OK ||
+       ngx_http_rx_jit_ruleset(main_cf->ruleset->generic_rules, seen_br, 
+			       &nb_rules, &nb_jit) != NGX_OK ||
+       ngx_http_rx_count_sets(main_cf->ruleset->rx_set, seen_set,
+			      &nb_sets, &nb_sets_jit) != NGX_OK))
+    rc = NGX_ERROR;
+  loc_cf = main_cf->locations->elts;
+  for (i = 0; rc == NGX_OK && i < main_cf->locations->nelts; i++) {
+    c = loc_cf[i];
+    if (ngx_http_rx_jit_ruleset(c->get_rules, seen_br, 
+				&nb_rules, &nb_jit) != NGX_OK ||
+	ngx_http_rx_jit_ruleset(c->body_rules, seen_br, 
+				&nb_rules, &nb_jit) != NGX_OK ||
+	ngx_http_rx_jit_ruleset(c->header_rules, seen_br, 
+				&nb_rules, &nb_jit) != NGX_OK ||
+	ngx_http_rx_jit_ruleset(c->generic_rules, seen_br, 
+				&nb_rules, &nb_jit) != NGX_OK ||
+	ngx_http_rx_count_sets(c->rx_set, seen_set,
+			       &nb_sets, &nb_sets_jit) != NGX_OK)
+      rc = NGX_ERROR;
+  }
+  ngx_http_rx_malloc_done();
+  if (rc != NGX_OK)
+    return (rc);
+#if (NAXSI_HAVE_PCRE_JIT)
+  ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+		"naxsi: pcre JIT enabled for %ui/%ui rx: rules, "
+		"%ui/%ui combined rx sets", nb_jit, nb_rules,
+		nb_sets_jit, nb_sets);
+#else
+  ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+		"naxsi: pcre JIT not available, %ui rx: rules, "
+		"%ui combined rx sets", nb_rules, nb_sets);
+#endif
+  return (NGX_OK);
+}
@@ -56,6 +56,9 @@ static char		*ngx_http_dummy_read_main_conf(ngx_conf_t *cf,
 						       ngx_command_t *cmd, 
 						       void *conf);
 static ngx_int_t	ngx_http_dummy_init(ngx_conf_t *cf);
+static ngx_int_t	ngx_http_dummy_init_module(ngx_cycle_t *cycle);
+static ngx_int_t	ngx_http_dummy_init_process(ngx_cycle_t *cycle);
+static void		ngx_http_dummy_exit_process(ngx_cycle_t *cycle);
 static char		*ngx_http_dummy_read_conf(ngx_conf_t *cf, 
 						  ngx_command_t *cmd,
 						  void *conf);
@@ -124,6 +127,48 @@ static ngx_command_t  ngx_http_dummy_commands[] =  {
     NGX_HTTP_LOC_CONF_OFFSET,
     0,
     NULL },
+  /* naxsi_stats_zone */
+  { ngx_string(TOP_STATS_ZONE_T),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+    ngx_http_dummy_stats_zone,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* naxsi_stats */
+  { ngx_string(TOP_STATS_T),
+    NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+    ngx_http_dummy_stats,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
+  /* naxsi_learning_sink */
+  { ngx_string(TOP_LEARNING_SINK_T),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+    ngx_http_dummy_learning_sink,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* naxsi_slow_log */
+  { ngx_string(TOP_SLOW_LOG_T),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_http_dummy_slow_log,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* naxsi_ruleset */
+  { ngx_string(TOP_RULESET_T),
+    NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+    ngx_http_dummy_ruleset,
+    NGX_HTTP_MAIN_CONF_OFFSET,
+    0,
+    NULL },
+  /* naxsi_ruleset_control */
+  { ngx_string(TOP_RULESET_CONTROL_T),
+    NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+    ngx_http_dummy_ruleset_control,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL },
   ngx_null_command
 };
 
@@ -149,11 +194,11 @@ ngx_module_t ngx_http_naxsi_module = {
   ngx_http_dummy_commands, /* module directives */
   NGX_HTTP_MODULE, /* module type */
   NULL, /* init master */
-  NULL, /* init module */
-  NULL, /* init process */
+  ngx_http_dummy_init_module, /* init module */
+  ngx_http_dummy_init_process, /* init process */
   NULL, /* init thread */
   NULL, /* exit thread */
-  NULL, /* exit process */
+  ngx_http_dummy_exit_process, /* exit process */
   NULL, /* exit master */
   NGX_MODULE_V1_PADDING
 };
@@ -189,6 +234,50 @@ ngx_http_dummy_create_loc_conf(ngx_conf_t *cf)
   return (conf);
 }
 
+/*
+** builds the str: rules automaton, the rx: rules combined regex and
+** the dispatch tables of each match zone. if the ruleset of a zone is
+** shared with the parent configuration, the parent's ones are reused.
+*/
+static ngx_int_t
+ngx_http_dummy_compile_zone_rules(ngx_conf_t *cf, ngx_http_ac_t **str_ac,
+				  ngx_http_rx_set_t **rx_set,
+				  ngx_http_dummy_dispatch_t **dispatch,
+				  ngx_array_t **zone_rules,
+				  ngx_http_ac_t **prev_ac,
+				  ngx_http_rx_set_t **prev_rx,
+				  ngx_http_dummy_dispatch_t **prev_dispatch,
+				  ngx_array_t **prev_rules)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  int				zone;
+
+  main_cf = ngx_http_conf_get_module_main_conf(cf, ngx_http_naxsi_module);
+  for (zone = HEADERS; zone < UNKNOWN; zone++) {
+    if (prev_rules && prev_rules[zone] == zone_rules[zone]) {
+      str_ac[zone] = prev_ac[zone];
+      rx_set[zone] = prev_rx[zone];
+      dispatch[zone] = prev_dispatch[zone];
+      continue;
+    }
+    str_ac[zone] = ngx_http_ac_compile(cf, zone_rules[zone], zone);
+    if (str_ac[zone] == NGX_CONF_ERROR)
+      return (NGX_ERROR);
+    if (str_ac[zone] && str_ac[zone]->nb_patterns > main_cf->ac_max_patterns)
+      main_cf->ac_max_patterns = str_ac[zone]->nb_patterns;
+    rx_set[zone] = ngx_http_rx_compile(cf, zone_rules[zone], zone);
+    if (rx_set[zone] == NGX_CONF_ERROR)
+      return (NGX_ERROR);
+    if (rx_set[zone] && rx_set[zone]->nb_rules > main_cf->rx_max_rules)
+      main_cf->rx_max_rules = rx_set[zone]->nb_rules;
+    dispatch[zone] = ngx_http_dummy_dispatch_compile(cf, zone_rules[zone], zone,
+						     str_ac[zone], rx_set[zone]);
+    if (dispatch[zone] == NGX_CONF_ERROR)
+      return (NGX_ERROR);
+  }
+  return (NGX_OK);
+}
+
 /* merge loc conf */
 /* NOTE/WARNING : This function wasn't tested correctly. 
  Actually, we shouldn't merge anything, as configuration is 
@@ -199,6 +288,7 @@ ngx_http_dummy_merge_loc_conf(ngx_conf_t *cf, void *parent,
 {
   ngx_http_dummy_loc_conf_t  *prev = parent;
   ngx_http_dummy_loc_conf_t  *conf = child;
+  ngx_array_t		     *prev_rules[UNKNOWN], *conf_rules[UNKNOWN];
 
   if (conf->whitelist_rules == NULL) 
     conf->whitelist_rules = prev->whitelist_rules;
@@ -210,6 +300,17 @@ ngx_http_dummy_merge_loc_conf(ngx_conf_t *cf, void *parent,
     conf->header_rules = prev->header_rules;
   if (conf->generic_rules == NULL) 
     conf->generic_rules = prev->generic_rules;
+  /* rules are final for this location, compile them. */
+  ngx_http_dummy_zone_rules(prev_rules, prev);
+  ngx_http_dummy_zone_rules(conf_rules, conf);
+  if (ngx_http_dummy_compile_zone_rules(cf, conf->str_ac, conf->rx_set,
+					conf->dispatch, conf_rules,
+					prev->str_ac, prev->rx_set,
+					prev->dispatch, prev_rules) != NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "str:/rx: rules compilation failed");
+    return (NGX_CONF_ERROR);
+  }
   return NGX_CONF_OK;
 }
 
@@ -226,6 +327,7 @@ ngx_http_dummy_init(ngx_conf_t *cf)
   ngx_http_core_main_conf_t *cmcf;
   ngx_http_dummy_main_conf_t *main_cf;
   ngx_http_dummy_loc_conf_t **loc_cf;
+  ngx_array_t			*main_rules[UNKNOWN];
   unsigned int 				i;
   
   cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
@@ -233,24 +335,91 @@ ngx_http_dummy_init(ngx_conf_t *cf)
   if (cmcf == NULL || 
       main_cf == NULL)
     return (NGX_ERROR);
+  /* compile MainRule str:/rx: rules, locations were done at merge time. */
+  ngx_http_dummy_zone_rules(main_rules, main_cf);
+  if (ngx_http_dummy_compile_zone_rules(cf, main_cf->str_ac, main_cf->rx_set,
+					main_cf->dispatch, main_rules, 
+					NULL, NULL, NULL, NULL) != NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "str:/rx: rules compilation failed");
+    return (NGX_ERROR);
+  }
   /* Register for access phase */
   //h = ngx_array_push(&cmcf->phases[NGX_HTTP_ACCESS_PHASE].handlers);
   h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
   if (h == NULL) 
     return (NGX_ERROR);
   *h = ngx_http_dummy_access_handler;
+  /* inspect request bodies while they are read */
+  if (ngx_http_dummy_body_filter_init(cf) != NGX_OK)
+    return (NGX_ERROR);
+  /* naxsi_ruleset rules are numbered along with the others */
+  if (ngx_http_dummy_ruleset_init(cf, main_cf) != NGX_OK)
+    return (NGX_ERROR);
+  /* number rules by id, for whitelist bitsets and stats */
+  if (ngx_http_dummy_index_rules(cf, main_cf) != NGX_OK)
+    return (NGX_ERROR);
+  nx_int__weird_request.id_index = 
+    ngx_http_dummy_rule_id_index(main_cf, WEIRD_REQUEST_INTERNAL_RULE_ID);
+  nx_int__big_request.id_index = 
+    ngx_http_dummy_rule_id_index(main_cf, BIG_BODY_INTERNAL_RULE_ID);
   /* Go with each locations registred in the srv_conf. */
   loc_cf = main_cf->locations->elts;
   for (i = 0; i < main_cf->locations->nelts; i++) {
-    if(ngx_http_dummy_create_hashtables_n(loc_cf[i], cf) != NGX_OK) {
+    if(ngx_http_dummy_create_hashtables_n(loc_cf[i], cf, main_cf) != NGX_OK) {
       ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
 			 "WhiteList Hash building failed");
       return (NGX_ERROR);
     }
   }
+  /* and naxsi_ruleset's, that apply everywhere */
+  if (main_cf->ruleset &&
+      ngx_http_dummy_ruleset_whitelists(cf, cf->pool, main_cf, 
+					main_cf->ruleset) != NGX_OK) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "naxsi_ruleset WhiteList Hash building failed");
+    return (NGX_ERROR);
+  }
   return (NGX_OK);
 }
 
+/*
+** runs once the configuration is loaded, after ngx_regex_module
+** studied the regexes : JIT compile rx: rules and log the result.
+*/
+static ngx_int_t
+ngx_http_dummy_init_module(ngx_cycle_t *cycle)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  main_cf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_naxsi_module);
+  if (!main_cf)
+    return (NGX_OK);
+  if (ngx_http_dummy_sink_init_module(cycle, main_cf) != NGX_OK)
+    return (NGX_ERROR);
+  ngx_http_dummy_ruleset_init_module(cycle, main_cf);
+  return (ngx_http_rx_jit_compile(cycle, main_cf));
+}
+
+/*
+** workers : start the learning sink flush timer and the
+** naxsi_ruleset generation polling.
+*/
+static ngx_int_t
+ngx_http_dummy_init_process(ngx_cycle_t *cycle)
+{
+  if (ngx_http_dummy_sink_init_process(cycle) != NGX_OK)
+    return (NGX_ERROR);
+  return (ngx_http_dummy_ruleset_init_process(cycle));
+}
+
+static void
+ngx_http_dummy_exit_process(ngx_cycle_t *cycle)
+{
+  ngx_http_dummy_sink_exit_process(cycle);
+  ngx_http_dummy_ruleset_exit_process(cycle);
+}
+
 /*
 ** my hugly configuration parsing function.
 ** should be rewritten, cause code is hugly and not bof proof at all
@@ -263,14 +432,13 @@ ngx_http_dummy_read_conf(ngx_conf_t *cf, ngx_command_t *cmd,
 			 void *conf)
 {
   ngx_http_dummy_loc_conf_t	*alcf = conf, **bar;
-  
+  ngx_http_core_loc_conf_t	*clcf;
   ngx_http_dummy_main_conf_t	*main_cf;
   ngx_str_t			*value;
   ngx_http_rule_t		rule, *rule_r;
   ngx_http_check_rule_t		*rule_c;
   ngx_http_custom_rule_location_t	*location;
   unsigned int	i;
-  u_char			*var_end;
   
 #ifdef readconf_debug
   if (cf) {
@@ -289,6 +457,10 @@ ngx_http_dummy_read_conf(ngx_conf_t *cf, ngx_command_t *cmd,
       return (NGX_CONF_ERROR);
     *bar = alcf;
     alcf->pushed = 1;
+    alcf->stats_index = main_cf->locations->nelts - 1;
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    if (clcf)
+      alcf->loc_name = clcf->name;
   }
   /* store denied URL for location */
   if (!ngx_strcmp(value[0].data, TOP_DENIED_URL_T) && value[1].len) {
@@ -465,13 +637,11 @@ ngx_http_dummy_read_conf(ngx_conf_t *cf, ngx_command_t *cmd,
     }
     return (NGX_CONF_OK);
   }
-  /* this should be moved in a function, plus this code is not safe. */
   else if (!ngx_strcmp(value[0].data, TOP_CHECK_RULE_T)) {
 #ifdef readconf_debug
     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
 		       "pushing rule %d in check rules", rule.rule_id);  
 #endif
-    i = 0;
     if (!alcf->check_rules)
       alcf->check_rules = ngx_array_create(cf->pool, 2, 
 					   sizeof(ngx_http_check_rule_t));
@@ -479,63 +649,7 @@ ngx_http_dummy_read_conf(ngx_conf_t *cf, ngx_command_t *cmd,
       return (NGX_CONF_ERROR);
     rule_c = ngx_array_push(alcf->check_rules);
     if (!rule_c) return (NGX_CONF_ERROR);
-    memset(rule_c, 0, sizeof(ngx_http_check_rule_t));
-    /* process the first word : score rule */
-    if (value[1].data[i] == '$') {
-#ifdef MDBG
-	ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "XX-special score rule !");
-#endif
-	var_end = (u_char *) ngx_strchr((value[1].data)+i, ' ');
-	if (!var_end) {
-	  ngx_http_dummy_line_conf_error(cf, value);
-	  return (NGX_CONF_ERROR);
-	}
-	rule_c->sc_tag.data = ngx_pcalloc(cf->pool, var_end - value[1].data +1);
-	if (!rule_c->sc_tag.data)
-	  return (NGX_CONF_ERROR);
-	memcpy(rule_c->sc_tag.data, value[1].data, (var_end - value[1].data));
-	i += (var_end - value[1].data) + 1;
-	rule_c->sc_tag.len = (var_end - value[1].data);
-      }
-    else {
-      ngx_http_dummy_line_conf_error(cf, value);
-      return (NGX_CONF_ERROR);
-    }
-    // move to next word
-    while (value[1].data[i] && value[1].data[i] == ' ')
-      i++;
-    // get the comparison type
-    if (value[1].data[i] == '>' && value[1].data[i+1] == '=')
-      rule_c->cmp = SUP_OR_EQUAL;
-    else if (value[1].data[i] == '>' && value[1].data[i+1] != '=')
-      rule_c->cmp = SUP;
-    else if (value[1].data[i] == '<' && value[1].data[i+1] == '=')
-      rule_c->cmp = INF_OR_EQUAL;
-    else if (value[1].data[i] == '<' && value[1].data[i+1] != '=')
-      rule_c->cmp = INF;
-    else {
-      ngx_http_dummy_line_conf_error(cf, value);
-      return (NGX_CONF_ERROR);
-    }
-    // move to next word
-    while (value[1].data[i] && !(value[1].data[i] >= '0' && 
-				 value[1].data[i] <= '9') && (value[1].data[i] != '-'))
-      i++;
-#ifdef readconf_debug
-    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
-		       "XX-special score in checkrule:%s from (%d)", 
-		       value[1].data, atoi((const char *)value[1].data+i));
-#endif
-    // get the score
-    rule_c->sc_score = atoi((const char *)(value[1].data+i));
-    /* process the second word : Action rule */
-    if (!ngx_strstr(value[2].data, "BLOCK"))
-      rule_c->block = 1;
-    else if (!ngx_strstr(value[2].data, "ALLOW"))
-      rule_c->block = 1;
-    else if (!ngx_strstr(value[2].data, "LOG"))
-      rule_c->block = 1;
-    else {
+    if (ngx_http_dummy_cfg_parse_check_rule(cf, value, rule_c) != NGX_CONF_OK) {
       ngx_http_dummy_line_conf_error(cf, value);
       return (NGX_CONF_ERROR);
     }
@@ -552,9 +666,8 @@ ngx_http_dummy_read_main_conf(ngx_conf_t *cf, ngx_command_t *cmd,
 {
   ngx_http_dummy_main_conf_t	*alcf = conf;
   ngx_str_t			*value;
-  ngx_http_rule_t		rule, *rule_r;
-  ngx_http_custom_rule_location_t	*location;
-  unsigned int	i;
+  ngx_http_rule_t		rule;
+
   if (!alcf || !cf)
     return (NGX_CONF_ERROR);  /* alloc a new rule */
   value = cf->args->elts;
@@ -571,115 +684,14 @@ ngx_http_dummy_read_main_conf(ngx_conf_t *cf, ngx_command_t *cmd,
       return (NGX_CONF_ERROR);
     }
 
-    if (rule.br->headers) {
-#ifdef main_conf_debug
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
-			 "pushing rule %d in header rules", rule.rule_id);  
-#endif
-      if (alcf->header_rules == NULL) {
-	alcf->header_rules = ngx_array_create(cf->pool, 2,
-					      sizeof(ngx_http_rule_t));
-	if (alcf->header_rules == NULL) 
-	  return NGX_CONF_ERROR;
-      }
-      rule_r = ngx_array_push(alcf->header_rules);
-      if (!rule_r) return (NGX_CONF_ERROR);
-      memcpy(rule_r, &rule, sizeof(ngx_http_rule_t));
-    }
-    /* push in body match rules (POST/PUT) */
-    if (rule.br->body || rule.br->body_var) {
-#ifdef main_conf_debug
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
-			 "pushing rule %d in body rules", rule.rule_id);  
-#endif
-      if (alcf->body_rules == NULL) {
-	alcf->body_rules = ngx_array_create(cf->pool, 2,
-					    sizeof(ngx_http_rule_t));
-	if (alcf->body_rules == NULL) 
-	  return NGX_CONF_ERROR;
-      }
-      rule_r = ngx_array_push(alcf->body_rules);
-      if (!rule_r) return (NGX_CONF_ERROR);
-      memcpy(rule_r, &rule, sizeof(ngx_http_rule_t));
-    }
-    /* push in generic rules, as it's matching the URI */
-    if (rule.br->url)	{
-#ifdef main_conf_debug
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-			 "pushing rule %d in generic rules", rule.rule_id);  
-#endif
-      if (alcf->generic_rules == NULL) {
-	alcf->generic_rules = ngx_array_create(cf->pool, 2,
-					       sizeof(ngx_http_rule_t));
-	if (alcf->generic_rules == NULL) 
-	  return NGX_CONF_ERROR;
-      }
-      rule_r = ngx_array_push(alcf->generic_rules);
-      if (!rule_r) return (NGX_CONF_ERROR);
-      memcpy(rule_r, &rule, sizeof(ngx_http_rule_t));
-    }
-    /* push in GET arg rules, but we should push in POST rules too  */
-    if (rule.br->args_var || rule.br->args) {
 #ifdef main_conf_debug
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
-			 "pushing rule %d in GET rules", rule.rule_id);  
-#endif
-      if (alcf->get_rules == NULL) {
-	alcf->get_rules = ngx_array_create(cf->pool, 2,
-					   sizeof(ngx_http_rule_t));
-	if (alcf->get_rules == NULL) 
-	  return NGX_CONF_ERROR;
-      }
-      rule_r = ngx_array_push(alcf->get_rules);
-      if (!rule_r) return (NGX_CONF_ERROR);
-      memcpy(rule_r, &rule, sizeof(ngx_http_rule_t));
-    }
-    /* push in custom locations. It's a rule matching a VAR_NAME or an EXACT_URI :
-       - GET_VAR, POST_VAR, URI */
-    if (rule.br->custom_location) {
-#ifdef main_conf_debug
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
-			 "pushing rule %d in custom_location rules", 
-			 rule.rule_id);  
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "pushing rule %d in main rules", rule.rule_id);  
 #endif
-      location = rule.br->custom_locations->elts;
-      for (i = 0; i < rule.br->custom_locations->nelts; i++) {
-	if (location[i].args_var)	{
-	  if (alcf->get_rules == NULL) {
-	    alcf->get_rules = ngx_array_create(cf->pool, 2,
-					       sizeof(ngx_http_rule_t));
-	    if (alcf->get_rules == NULL) 
-	      return NGX_CONF_ERROR;
-	  }
-	  rule_r = ngx_array_push(alcf->get_rules);
-	  if (!rule_r) return (NGX_CONF_ERROR);
-	  memcpy(rule_r, &rule, sizeof(ngx_http_rule_t));
-	}
-	if (location[i].body_var)	{
-	  if (alcf->body_rules == NULL) {
-	    alcf->body_rules = ngx_array_create(cf->pool, 2,
-						sizeof(ngx_http_rule_t));
-	    if (alcf->body_rules == NULL) 
-	      return NGX_CONF_ERROR;
-	  }
-	  rule_r = ngx_array_push(alcf->body_rules);
-	  if (!rule_r) return (NGX_CONF_ERROR);
-	  memcpy(rule_r, &rule, sizeof(ngx_http_rule_t));
-		      
-	}
-	if (location[i].headers_var) {
-	  if (alcf->header_rules == NULL) {
-	    alcf->header_rules = ngx_array_create(cf->pool, 2,
-						  sizeof(ngx_http_rule_t));
-	    if (alcf->header_rules == NULL) 
-	      return NGX_CONF_ERROR;
-	  }
-	  rule_r = ngx_array_push(alcf->header_rules);
-	  if (!rule_r) return (NGX_CONF_ERROR);
-	  memcpy(rule_r, &rule, sizeof(ngx_http_rule_t));
-	}
-      }
-    }
+    if (ngx_http_dummy_push_main_rule(cf->pool, &alcf->get_rules, 
+				      &alcf->body_rules, &alcf->header_rules,
+				      &alcf->generic_rules, &rule) != NGX_OK)
+      return (NGX_CONF_ERROR);
     return (NGX_CONF_OK);
   }
   ngx_http_dummy_line_conf_error(cf, value);
@@ -701,9 +713,9 @@ static ngx_int_t ngx_http_dummy_access_handler(ngx_http_request_t *r)
   ngx_http_request_ctx_t	*ctx;
   ngx_int_t			rc;
   ngx_http_dummy_loc_conf_t	*cf;
+  ngx_http_dummy_main_conf_t	*main_cf;
   ngx_http_core_loc_conf_t  *clcf;
-  struct tms		 tmsstart, tmsend;
-  clock_t		 start, end;
+  uint64_t		 start_ns;
   
   ctx = ngx_http_get_module_ctx(r, ngx_http_naxsi_module);
   cf = ngx_http_get_module_loc_conf(r, ngx_http_naxsi_module);
@@ -753,12 +765,23 @@ static ngx_int_t ngx_http_dummy_access_handler(ngx_http_request_t *r)
     if (ctx == NULL)
       return NGX_ERROR;
     ngx_http_set_ctx(r, ctx, ngx_http_naxsi_module);
+    if (ngx_http_dummy_stats_request_init(r, ctx) != NGX_OK)
+      return (NGX_ERROR);
+    if (ngx_http_dummy_ruleset_request_init(r, ctx) != NGX_OK)
+      return (NGX_ERROR);
     if  ((r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT) 
 	 && !ctx->ready) {
 #ifdef mechanics_debug
       ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
 		    "XX-dummy : body_request : before !");
 #endif
+      /* set up streaming inspection before nginx starts reading the body */
+      main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+      if ((cf->body_rules || main_cf->body_rules || 
+	   (ctx->ruleset && ctx->ruleset->body_rules)) && 
+	  r->headers_in.content_type &&
+	  ngx_http_dummy_body_init(ctx, r) != NGX_OK)
+	return (NGX_ERROR);
       rc = ngx_http_read_client_request_body(r, ngx_http_dummy_payload_handler);
       /* this might happen quite often, especially with big files / 
       ** low network speed. our handler is called when headers are read, 
@@ -792,21 +815,15 @@ static ngx_int_t ngx_http_dummy_access_handler(ngx_http_request_t *r)
       ctx->ready = 1;
   }
   if (ctx && ctx->ready && !ctx->over) {
-    if ((start = times(&tmsstart)) == -1)
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-		    "XX-dummy : Failed to get time");
+    start_ns = naxsi_now_ns();
     ngx_http_dummy_data_parse(ctx, r);
+    ctx->inspect_ns += naxsi_now_ns() - start_ns;
     cf->request_processed++;
-    if ((end = times(&tmsend)) == -1)
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-		    "XX-dummy : Failed to get time");
-    if (end - start > 0)
-      ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, 
-		    "[MORE THAN 1MS] times : start:%l end:%l diff:%l",
-		    start, end, (end-start));
     ctx->over = 1;
-    if (ctx->block) {
+    if (ctx->block)
       cf->request_blocked++;
+    ngx_http_dummy_stats_request(r, ctx, cf);
+    if (ctx->block) {
       rc = ngx_http_output_forbidden_page(ctx, r);
       //nothing:      return (NGX_OK);
       //redirect : return (NGX_HTTP_OK);
@@ -0,0 +1,617 @@
+/*
+ * NAXSI, a web application firewall for NGINX
+ * Copyright (C) 2011, Thibault 'bui' Koechlin
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+** Statistics shared by all workers.
+** request_processed/request_blocked of the location configuration are
+** per worker, so they don't mean much as soon as there is more than
+** one worker. With "naxsi_stats_zone name size;" (http level), every
+** worker updates, with atomic adds, counters living in a shared memory
+** zone :
+** - per location (the ones of main_cf->locations) : processed and
+**   blocked requests, time spent inspecting them.
+** - per rule id : matches, blocked requests it matched in, and matches
+**   that were whitelisted.
+** - per location and inspection phase (headers, uri, args, body, and
+**   the whole request) : time spent, and a log2 histogram of it.
+** "naxsi_stats;" in a location dumps them, as text or, with
+** ?format=json, as JSON.
+** "naxsi_slow_log time;" (http level) logs, at warn level, the requests
+** whose inspection took longer, with the rules that cost the most.
+** It is independent from the zone, but has a cost : every rule check
+** is timed while it is set.
+*/
+
+#include "naxsi.h"
+
+//#define stats_debug
+
+/* "%uA" of an ngx_atomic_t */
+#define NAXSI_STATS_NUM_LEN	NGX_ATOMIC_T_LEN
+/* rules listed in the slow log */
+#define NAXSI_SLOW_TOP		5
+
+static char *ngx_http_dummy_phase_names[] = {
+  "headers", "uri", "args", "body", "total"
+};
+
+/*
+** position of the counters of id_index [n] in st->rules : those of
+** main_cf->rule_ids come first, then one range of NAXSI_RULESET_IDS
+** per naxsi_ruleset id table, so that workers of different
+** configurations never share the counters of runtime ids.
+*/
+static ngx_uint_t
+ngx_http_dummy_stats_pos(ngx_http_dummy_main_conf_t *main_cf, ngx_uint_t n)
+{
+  if (n < main_cf->nb_rule_ids)
+    return (n);
+  return (n + main_cf->ruleset_slot * NAXSI_RULESET_IDS);
+}
+
+/*
+** shared zone init, at (re)configuration time.
+** counters survive a reload, unless the locations or the rule ids
+** changed, in which case they are reset. Those of the ids numbered
+** at runtime (naxsi_ruleset) are, when the id is numbered.
+*/
+static ngx_int_t
+ngx_http_dummy_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_http_dummy_main_conf_t	*main_cf, *omain_cf;
+  ngx_http_dummy_stats_t	*st;
+  ngx_slab_pool_t		*shpool;
+  ngx_int_t			*ids;
+  ngx_uint_t			nb_ids, nb_rules;
+  size_t			size;
+
+  main_cf = shm_zone->data;
+  omain_cf = data;
+  /* rules[] is indexed by rule->id_index (see ngx_http_dummy_stats_pos) */
+  ids = main_cf->rule_ids;
+  nb_ids = main_cf->nb_rule_ids;
+  nb_rules = nb_ids + 
+    (main_cf->ruleset_path.len ? NAXSI_RULESET_CONFS * NAXSI_RULESET_IDS : 0);
+  shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+  st = omain_cf ? omain_cf->stats : NULL;
+  if (st) {
+    if (st->nb_locations == main_cf->locations->nelts &&
+	st->nb_rules == nb_rules && st->nb_ids == nb_ids &&
+	!ngx_memcmp(st->ids, ids, nb_ids * sizeof(ngx_int_t))) {
+      main_cf->stats = st;
+      return (NGX_OK);
+    }
+    ngx_slab_free(shpool, st);
+  }
+  size = sizeof(ngx_http_dummy_stats_t) + nb_ids * sizeof(ngx_int_t) +
+    main_cf->locations->nelts * sizeof(ngx_http_dummy_loc_stats_t) +
+    nb_rules * sizeof(ngx_http_dummy_rule_stats_t);
+  st = ngx_slab_alloc(shpool, size);
+  if (!st) {
+    ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+		  "naxsi_stats_zone \"%V\" is too small for %ui locations "
+		  "and %ui rules, %uz bytes needed", &shm_zone->shm.name,
+		  main_cf->locations->nelts, nb_rules, size);
+    return (NGX_ERROR);
+  }
+  ngx_memzero(st, size);
+  st->nb_locations = main_cf->locations->nelts;
+  st->nb_rules = nb_rules;
+  st->nb_ids = nb_ids;
+  st->locations = (ngx_http_dummy_loc_stats_t *) (st + 1);
+  st->rules = (ngx_http_dummy_rule_stats_t *) (st->locations + st->nb_locations);
+  st->ids = (ngx_int_t *) (st->rules + st->nb_rules);
+  ngx_memcpy(st->ids, ids, nb_ids * sizeof(ngx_int_t));
+  main_cf->stats = st;
+  return (NGX_OK);
+}
+
+/*
+** naxsi_stats_zone <name> <size>;
+*/
+char *
+ngx_http_dummy_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_dummy_main_conf_t	*main_cf = conf;
+  ngx_str_t			*value;
+  ssize_t			size;
+
+  value = cf->args->elts;
+  if (main_cf->stats_zone)
+    return ("is duplicate");
+  size = ngx_parse_size(&value[2]);
+  if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "invalid naxsi_stats_zone size \"%V\"", &value[2]);
+    return (NGX_CONF_ERROR);
+  }
+  main_cf->stats_zone = ngx_shared_memory_add(cf, &value[1], size, 
+					      &ngx_http_naxsi_module);
+  if (!main_cf->stats_zone)
+    return (NGX_CONF_ERROR);
+  if (main_cf->stats_zone->data) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "naxsi_stats_zone \"%V\" is already used", &value[1]);
+    return (NGX_CONF_ERROR);
+  }
+  main_cf->stats_zone->init = ngx_http_dummy_stats_init_zone;
+  main_cf->stats_zone->data = main_cf;
+  return (NGX_CONF_OK);
+}
+
+/*
+** naxsi_slow_log <time>; (http)
+** time is an nginx time (5ms, 1s), or microseconds with "us" (500us).
+*/
+char *
+ngx_http_dummy_slow_log(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_dummy_main_conf_t	*main_cf = conf;
+  ngx_str_t			*value;
+  ngx_int_t			n;
+  uint64_t			unit;
+
+  value = cf->args->elts;
+  if (main_cf->slow_ns)
+    return ("is duplicate");
+  if (value[1].len > 2 && 
+      !ngx_strncmp(value[1].data + value[1].len - 2, "us", 2)) {
+    n = ngx_atoi(value[1].data, value[1].len - 2);
+    unit = 1000;
+  }
+  else {
+    n = ngx_parse_time(&value[1], 0);
+    unit = 1000000;
+  }
+  if (n == NGX_ERROR || n <= 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "invalid naxsi_slow_log time \"%V\"", &value[1]);
+    return (NGX_CONF_ERROR);
+  }
+  main_cf->slow_ns = (uint64_t) n * unit;
+  return (NGX_CONF_OK);
+}
+
+/*
+** called when the request context is created : rule costs
+** are only accounted for the slow log.
+*/
+ngx_int_t
+ngx_http_dummy_stats_request_init(ngx_http_request_t *r, 
+				  ngx_http_request_ctx_t *ctx)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  if (!main_cf->slow_ns)
+    return (NGX_OK);
+  ctx->rule_ns = ngx_pcalloc(r->pool, (NAXSI_COST_RULES + main_cf->nb_id_slots)
+			     * sizeof(uint64_t));
+  if (!ctx->rule_ns)
+    return (NGX_ERROR);
+  return (NGX_OK);
+}
+
+static ngx_uint_t
+ngx_http_dummy_stats_bucket(uint64_t ns)
+{
+  ngx_uint_t	k;
+
+  for (k = 0, ns >>= 10; ns && k < NAXSI_HIST_BUCKETS - 1; ns >>= 1)
+    k++;
+  return (k);
+}
+
+/*
+** the request went over naxsi_slow_log : log where the time went.
+*/
+static void
+ngx_http_dummy_stats_slow(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx,
+			  ngx_http_dummy_main_conf_t *main_cf)
+{
+  ngx_uint_t	top[NAXSI_SLOW_TOP], nb_top, i, k;
+  uint64_t	*cost;
+  u_char	rules[NAXSI_SLOW_TOP * (NGX_INT_T_LEN + NGX_INT64_LEN + 4)];
+  u_char	*p;
+
+  nb_top = 0;
+  cost = ctx->rule_ns + NAXSI_COST_RULES;
+  for (i = 0; i < main_cf->nb_id_slots; i++) {
+    if (!cost[i] || 
+	(nb_top == NAXSI_SLOW_TOP && cost[i] <= cost[top[nb_top - 1]]))
+      continue;
+    if (nb_top < NAXSI_SLOW_TOP)
+      nb_top++;
+    for (k = nb_top - 1; k > 0 && cost[top[k - 1]] < cost[i]; k--)
+      top[k] = top[k - 1];
+    top[k] = i;
+  }
+  p = rules;
+  for (k = 0; k < nb_top; k++)
+    p = ngx_sprintf(p, " %i:%uLns", ngx_http_dummy_rule_id(main_cf, top[k]),
+		    cost[top[k]]);
+  ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+		"naxsi slow request : %uLns (headers:%uL uri:%uL args:%uL "
+		"body:%uL) uri:\"%V\" body:%O bytes, str:%uLns rx:%uLns, "
+		"top rules:%*s", ctx->inspect_ns, 
+		ctx->phase_ns[NAXSI_PHASE_HEADERS], ctx->phase_ns[NAXSI_PHASE_URI],
+		ctx->phase_ns[NAXSI_PHASE_ARGS], ctx->phase_ns[NAXSI_PHASE_BODY],
+		&r->uri, ctx->body ? ctx->body->total : (off_t) 0,
+		ctx->rule_ns[NAXSI_COST_AC], ctx->rule_ns[NAXSI_COST_RX],
+		(size_t) (p - rules), rules);
+}
+
+static ngx_http_dummy_rule_stats_t *
+ngx_http_dummy_stats_find_rule(ngx_http_dummy_main_conf_t *main_cf,
+			       ngx_http_dummy_stats_t *st, 
+			       ngx_http_rule_t *rule)
+{
+  ngx_uint_t	pos;
+
+  pos = ngx_http_dummy_stats_pos(main_cf, rule->id_index);
+  if (pos >= st->nb_rules)
+    return (NULL);
+  return (&st->rules[pos]);
+}
+
+/*
+** id_index [n] was just numbered at runtime (see naxsi_reload.c) :
+** its counters may be those of an id of an older configuration.
+*/
+void
+ngx_http_dummy_stats_rule_reset(ngx_http_dummy_main_conf_t *main_cf,
+				ngx_uint_t n)
+{
+  ngx_http_dummy_rule_stats_t	*rs;
+  ngx_uint_t			pos;
+
+  if (!main_cf->stats)
+    return ;
+  pos = ngx_http_dummy_stats_pos(main_cf, n);
+  if (pos >= main_cf->stats->nb_rules)
+    return ;
+  rs = &main_cf->stats->rules[pos];
+  rs->hits = 0;
+  rs->blocked = 0;
+  rs->whitelisted = 0;
+}
+
+/*
+** called on every rule match, whitelisted or not.
+*/
+void
+ngx_http_dummy_stats_rule_hit(ngx_http_request_t *r, ngx_http_rule_t *rule,
+			      ngx_flag_t whitelisted)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_rule_stats_t	*rs;
+
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  if (!main_cf->stats)
+    return ;
+  rs = ngx_http_dummy_stats_find_rule(main_cf, main_cf->stats, rule);
+  if (!rs)
+    return ;
+  if (whitelisted)
+    (void) ngx_atomic_fetch_add(&rs->whitelisted, 1);
+  else
+    (void) ngx_atomic_fetch_add(&rs->hits, 1);
+}
+
+/*
+** called once the request was inspected.
+*/
+void
+ngx_http_dummy_stats_request(ngx_http_request_t *r, 
+			     ngx_http_request_ctx_t *ctx,
+			     ngx_http_dummy_loc_conf_t *cf)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_stats_t	*st;
+  ngx_http_dummy_loc_stats_t	*ls;
+  ngx_http_dummy_rule_stats_t	*rs;
+  ngx_http_matched_rule_t	*mr, *prev;
+  ngx_flag_t			slow;
+  ngx_uint_t			k;
+
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  slow = (main_cf->slow_ns && ctx->rule_ns && 
+	  ctx->inspect_ns >= main_cf->slow_ns);
+  if (slow)
+    ngx_http_dummy_stats_slow(r, ctx, main_cf);
+  st = main_cf->stats;
+  if (!st || !cf->pushed || cf->stats_index >= st->nb_locations)
+    return ;
+  ls = &st->locations[cf->stats_index];
+  (void) ngx_atomic_fetch_add(&ls->processed, 1);
+  (void) ngx_atomic_fetch_add(&ls->inspect_ns, ctx->inspect_ns);
+  if (slow)
+    (void) ngx_atomic_fetch_add(&ls->slow, 1);
+  /* phases that did not run (no body ...) are not counted */
+  for (k = 0; k < NAXSI_PHASE_TOTAL; k++) {
+    if (!ctx->phase_ns[k])
+      continue;
+    (void) ngx_atomic_fetch_add(&ls->phase_ns[k], ctx->phase_ns[k]);
+    (void) ngx_atomic_fetch_add(
+      &ls->hist[k][ngx_http_dummy_stats_bucket(ctx->phase_ns[k])], 1);
+  }
+  (void) ngx_atomic_fetch_add(
+    &ls->hist[NAXSI_PHASE_TOTAL][ngx_http_dummy_stats_bucket(ctx->inspect_ns)], 1);
+  if (ctx->weird_request)
+    ngx_http_dummy_stats_rule_hit(r, &nx_int__weird_request, 0);
+  if (ctx->big_request)
+    ngx_http_dummy_stats_rule_hit(r, &nx_int__big_request, 0);
+  if (!ctx->block)
+    return ;
+  (void) ngx_atomic_fetch_add(&ls->blocked, 1);
+  if (ctx->weird_request &&
+      (rs = ngx_http_dummy_stats_find_rule(main_cf, st, &nx_int__weird_request)))
+    (void) ngx_atomic_fetch_add(&rs->blocked, 1);
+  if (ctx->big_request &&
+      (rs = ngx_http_dummy_stats_find_rule(main_cf, st, &nx_int__big_request)))
+    (void) ngx_atomic_fetch_add(&rs->blocked, 1);
+  if (!ctx->matched)
+    return ;
+  /* once per rule, even if it matched several vars */
+  for (mr = ctx->matched; mr; mr = mr->next) {
+    for (prev = ctx->matched; prev != mr; prev = prev->next)
+      if (prev->rule->id_index == mr->rule->id_index)
+	break;
+    if (prev != mr)
+      continue;
+    rs = ngx_http_dummy_stats_find_rule(main_cf, st, mr->rule);
+    if (rs)
+      (void) ngx_atomic_fetch_add(&rs->blocked, 1);
+  }
+}
+
+/*
+** totals reported in NAXSI_FMT : shared ones if possible.
+*/
+void
+ngx_http_dummy_stats_totals(ngx_http_request_t *r, 
+			    ngx_http_dummy_loc_conf_t *cf,
+			    ngx_int_t *processed, ngx_int_t *blocked)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_stats_t	*st;
+
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  st = main_cf->stats;
+  if (!st || !cf->pushed || cf->stats_index >= st->nb_locations) {
+    *processed = cf->request_processed;
+    *blocked = cf->request_blocked;
+    return ;
+  }
+  *processed = st->locations[cf->stats_index].processed;
+  *blocked = st->locations[cf->stats_index].blocked;
+}
+
+/*
+** location names may be regexes : escape them for JSON.
+** returns the length of the escaped string, writes it if dst is set.
+*/
+static size_t
+ngx_http_dummy_stats_json_str(u_char *dst, ngx_str_t *s)
+{
+  size_t	i, len;
+  u_char	c;
+
+  for (i = 0, len = 0; i < s->len; i++) {
+    c = s->data[i];
+    if (c == '"' || c == '\\') {
+      if (dst) {
+	dst[len] = '\\';
+	dst[len + 1] = c;
+      }
+      len += 2;
+      continue;
+    }
+    if (dst)
+      dst[len] = (c < 0x20) ? ' ' : c;
+    len++;
+  }
+  return (len);
+}
+
+/*
+** time spent in each phase of a location, and its histograms. JSON
+** lists every bucket (see "hist_le_ns" for their bounds), text only
+** the ones that are not empty, as <upper bound, ns>:<count>.
+*/
+static u_char *
+ngx_http_dummy_stats_phases(u_char *p, ngx_http_dummy_loc_stats_t *ls,
+			    ngx_str_t *name, ngx_flag_t json)
+{
+  ngx_uint_t	k, i;
+
+  for (k = 0; k <= NAXSI_PHASE_TOTAL; k++) {
+    if (json) {
+      p = ngx_sprintf(p, "%s\"%s\":{", k ? "," : "", 
+		      ngx_http_dummy_phase_names[k]);
+      if (k < NAXSI_PHASE_TOTAL)
+	p = ngx_sprintf(p, "\"ns\":%uA,", ls->phase_ns[k]);
+      p = ngx_cpymem(p, "\"hist\":[", sizeof("\"hist\":[") - 1);
+      for (i = 0; i < NAXSI_HIST_BUCKETS; i++)
+	p = ngx_sprintf(p, "%s%uA", i ? "," : "", ls->hist[k][i]);
+      p = ngx_cpymem(p, "]}", 2);
+      continue;
+    }
+    p = ngx_sprintf(p, "location %V phase %s", name, 
+		    ngx_http_dummy_phase_names[k]);
+    if (k < NAXSI_PHASE_TOTAL)
+      p = ngx_sprintf(p, " ns %uA", ls->phase_ns[k]);
+    p = ngx_cpymem(p, " hist", sizeof(" hist") - 1);
+    for (i = 0; i < NAXSI_HIST_BUCKETS; i++) {
+      if (!ls->hist[k][i])
+	continue;
+      if (i == NAXSI_HIST_BUCKETS - 1)
+	p = ngx_sprintf(p, " inf:%uA", ls->hist[k][i]);
+      else
+	p = ngx_sprintf(p, " %uL:%uA", (uint64_t) 1 << (10 + i), 
+			ls->hist[k][i]);
+    }
+    *p++ = '\n';
+  }
+  return (p);
+}
+
+static ngx_int_t
+ngx_http_dummy_stats_handler(ngx_http_request_t *r)
+{
+  ngx_http_dummy_main_conf_t	*main_cf;
+  ngx_http_dummy_loc_conf_t	**loc;
+  ngx_http_dummy_stats_t	*st;
+  ngx_http_dummy_loc_stats_t	*ls;
+  ngx_http_dummy_rule_stats_t	*rs;
+  ngx_str_t			arg;
+  ngx_buf_t			*b;
+  ngx_chain_t			out;
+  ngx_int_t			rc, id;
+  ngx_flag_t			json, first;
+  ngx_uint_t			i, pos;
+  size_t			size;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD)))
+    return (NGX_HTTP_NOT_ALLOWED);
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK)
+    return (rc);
+  main_cf = ngx_http_get_module_main_conf(r, ngx_http_naxsi_module);
+  st = main_cf->stats;
+  if (!st)
+    return (NGX_HTTP_SERVICE_UNAVAILABLE);
+  json = (ngx_http_arg(r, (u_char *) "format", 6, &arg) == NGX_OK &&
+	  arg.len == 4 && !ngx_strncmp(arg.data, "json", 4));
+  loc = main_cf->locations->elts;
+  /* enough for the fixed parts (json or text), names are added below */
+  size = sizeof("{\"hist_le_ns\":[],\"locations\":[],\"rules\":[]}\n") +
+    NAXSI_HIST_BUCKETS * (NGX_INT64_LEN + 1) +
+    st->nb_locations * (sizeof(",{\"name\":\"\",\"processed\":,\"blocked\":,\"inspect_ns\":,\"slow\":,\"phases\":{}}\n") +
+			4 * NAXSI_STATS_NUM_LEN +
+			(NAXSI_PHASE_TOTAL + 1) * 
+			(sizeof("location  phase headers ns  hist\n") +
+			 NAXSI_STATS_NUM_LEN + NAXSI_HIST_BUCKETS * 
+			 (sizeof(" 4294967296:") + NAXSI_STATS_NUM_LEN))) +
+    st->nb_rules * (sizeof(",{\"id\":,\"hits\":,\"blocked\":,\"whitelisted\":}\n") +
+		    4 * NAXSI_STATS_NUM_LEN);
+  for (i = 0; i < st->nb_locations && i < main_cf->locations->nelts; i++)
+    size += (NAXSI_PHASE_TOTAL + 2) * 
+      ngx_http_dummy_stats_json_str(NULL, &loc[i]->loc_name);
+  b = ngx_create_temp_buf(r->pool, size);
+  if (!b)
+    return (NGX_HTTP_INTERNAL_SERVER_ERROR);
+  if (json) {
+    b->last = ngx_cpymem(b->last, "{\"hist_le_ns\":[", sizeof("{\"hist_le_ns\":[") - 1);
+    for (i = 0; i < NAXSI_HIST_BUCKETS - 1; i++)
+      b->last = ngx_sprintf(b->last, "%s%uL", i ? "," : "", 
+			    (uint64_t) 1 << (10 + i));
+    b->last = ngx_cpymem(b->last, "],\"locations\":[", sizeof("],\"locations\":[") - 1);
+  }
+  for (i = 0; i < st->nb_locations && i < main_cf->locations->nelts; i++) {
+    ls = &st->locations[i];
+    if (json) {
+      b->last = ngx_sprintf(b->last, "%s{\"name\":\"", i ? "," : "");
+      b->last += ngx_http_dummy_stats_json_str(b->last, &loc[i]->loc_name);
+      b->last = ngx_sprintf(b->last, "\",\"processed\":%uA,\"blocked\":%uA,"
+			    "\"inspect_ns\":%uA,\"slow\":%uA,\"phases\":{", 
+			    ls->processed, ls->blocked, ls->inspect_ns, 
+			    ls->slow);
+      b->last = ngx_http_dummy_stats_phases(b->last, ls, NULL, 1);
+      b->last = ngx_cpymem(b->last, "}}", 2);
+    }
+    else {
+      b->last = ngx_sprintf(b->last, "location %V processed %uA blocked %uA"
+			    " inspect_ns %uA slow %uA\n", &loc[i]->loc_name, 
+			    ls->processed, ls->blocked, ls->inspect_ns, 
+			    ls->slow);
+      b->last = ngx_http_dummy_stats_phases(b->last, ls, &loc[i]->loc_name, 0);
+    }
+  }
+  if (json)
+    b->last = ngx_cpymem(b->last, "],\"rules\":[", sizeof("],\"rules\":[") - 1);
+  /* runtime ids (naxsi_ruleset) that are not numbered yet are left out */
+  first = 1;
+  for (i = 0; i < main_cf->nb_id_slots; i++) {
+    id = ngx_http_dummy_rule_id(main_cf, i);
+    pos = ngx_http_dummy_stats_pos(main_cf, i);
+    if (id == NGX_ERROR || pos >= st->nb_rules)
+      continue;
+    rs = &st->rules[pos];
+    if (json)
+      b->last = ngx_sprintf(b->last, "%s{\"id\":%i,\"hits\":%uA,\"blocked\":%uA,"
+			    "\"whitelisted\":%uA}", first ? "" : ",", id,
+			    rs->hits, rs->blocked, rs->whitelisted);
+    else
+      b->last = ngx_sprintf(b->last, "rule %i hits %uA blocked %uA"
+			    " whitelisted %uA\n", id, rs->hits, 
+			    rs->blocked, rs->whitelisted);
+    first = 0;
+  }
+  if (json)
+    b->last = ngx_cpymem(b->last, "]}\n", sizeof("]}\n") - 1);
+  if (json)
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+  else
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+  r->headers_out.content_type_len = r->headers_out.content_type.len;
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = b->last - b->pos;
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+    return (rc);
+  out.buf = b;
+  out.next = NULL;
+  return (ngx_http_output_filter(r, &out));
+}
+
+/*
+** naxsi_stats; (location)
+*/
+char *
+ngx_http_dummy_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_core_loc_conf_t	*clcf;
+  ngx_http_dummy_main_conf_t	*main_cf;
+
+  main_cf = ngx_http_conf_get_module_main_conf(cf, ngx_http_naxsi_module);
+  if (!main_cf->stats_zone) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, 
+		       "naxsi_stats needs a naxsi_stats_zone defined before");
+    return (NGX_CONF_ERROR);
+  }
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_http_dummy_stats_handler;
+  return (NGX_CONF_OK);
+}
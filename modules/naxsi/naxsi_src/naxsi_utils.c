@@ -55,31 +55,326 @@ strncasechr(const char *s, int c, int len)
 /*
 ** strstr: faster, stronger, harder
 ** (because strstr from libc is very slow)
+**
+** Case insensitive search of needle in haystack, returns a pointer
+** on the first occurrence or NULL. Several kernels are available,
+** the best one supported by the CPU is picked (CPUID) on first call :
+** - avx2 / sse2 : compare 32/16 haystack positions at once against the
+**   case-folded first and last bytes of the needle, and only verify
+**   the middle of the needle on candidates.
+** - scalar : same first/last byte filter, one position at a time.
+** The whole haystack is scanned, embedded NUL bytes don't stop the search.
+*/
+
+/*
+** needle bytes are case-folded by forcing bit 0x20 on letters,
+** so that (c | fold) == byte matches both cases.
 */
+#define naxsi_fold(c) ((ngx_tolower(c) >= 'a' && ngx_tolower(c) <= 'z') ? 0x20 : 0)
+
+static ngx_inline int
+strfaststr_verify(unsigned char *s, unsigned char *needle, unsigned int len)
+{
+  unsigned int	i;
+
+  for (i = 0; i < len; i++)
+    if (ngx_tolower(s[i]) != ngx_tolower(needle[i]))
+      return (0);
+  return (1);
+}
+
+static char *
+strfaststr_scalar_from(unsigned char *haystack, unsigned int hl, 
+		       unsigned char *needle, unsigned int nl, unsigned int i)
+{
+  u_char	first, last, ff, lf;
+
+  first = ngx_tolower(needle[0]);
+  last = ngx_tolower(needle[nl-1]);
+  ff = naxsi_fold(first);
+  lf = naxsi_fold(last);
+  for (; i + nl <= hl; i++) {
+    if ((haystack[i] | ff) != first || (haystack[i+nl-1] | lf) != last)
+      continue;
+    if (nl <= 2 || strfaststr_verify(haystack+i+1, needle+1, nl-2))
+      return ((char *) haystack+i);
+  }
+  return (NULL);
+}
+
 char *
-strfaststr(unsigned char *haystack, unsigned int hl, 
-		 unsigned char *needle, unsigned int nl)
+strfaststr_scalar(unsigned char *haystack, unsigned int hl, 
+		  unsigned char *needle, unsigned int nl)
 {
-  char	*cpt, *found, *end;
   if (hl < nl || !haystack || !needle || !nl || !hl) return (NULL);
-  cpt = (char *) haystack;
-  end = (char *) haystack + hl;
-  while (cpt < end) {
-      found = strncasechr((const char *) cpt, (int) needle[0], hl);
-      if (!found) return (NULL);
-      if (nl == 1) return (found);
-      if (!strncasecmp((const char *)found+1, (const char *) needle+1, nl-1))
-	return ((char *) found);
-      else {
-	  if (found+nl >= end)
-	    break;
-	  if (found+nl < end)
-	    cpt = found+1;
-	}
-    }
+  return (strfaststr_scalar_from(haystack, hl, needle, nl, 0));
+}
+
+/*
+** Case sensitive counterparts, for multipart delimiters : same first/last
+** byte filter, candidates are verified with memcmp.
+*/
+static u_char *
+naxsi_memmem_scalar_from(u_char *haystack, size_t hl, 
+			 u_char *needle, size_t nl, size_t i)
+{
+  u_char	first, last;
+
+  first = needle[0];
+  last = needle[nl-1];
+  for (; i + nl <= hl; i++) {
+    if (haystack[i] != first || haystack[i+nl-1] != last)
+      continue;
+    if (nl <= 2 || !ngx_memcmp(haystack+i+1, needle+1, nl-2))
+      return (haystack+i);
+  }
   return (NULL);
 }
 
+u_char *
+naxsi_memmem_scalar(u_char *haystack, size_t hl, u_char *needle, size_t nl)
+{
+  if (hl < nl || !haystack || !needle || !nl || !hl) return (NULL);
+  return (naxsi_memmem_scalar_from(haystack, hl, needle, nl, 0));
+}
+
+#if (NAXSI_HAVE_SIMD)
+
+__attribute__((target("sse2")))
+u_char *
+naxsi_memmem_sse2(u_char *haystack, size_t hl, u_char *needle, size_t nl)
+{
+  __m128i	first, last, bf, bl, eq;
+  unsigned int	mask, bit;
+  size_t	i;
+
+  if (hl < nl || !haystack || !needle || !nl || !hl) return (NULL);
+  first = _mm_set1_epi8((char) needle[0]);
+  last = _mm_set1_epi8((char) needle[nl-1]);
+  for (i = 0; i + nl - 1 + 16 <= hl; i += 16) {
+    bf = _mm_loadu_si128((const __m128i *) (haystack+i));
+    bl = _mm_loadu_si128((const __m128i *) (haystack+i+nl-1));
+    eq = _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last));
+    mask = (unsigned int) _mm_movemask_epi8(eq);
+    while (mask) {
+      bit = __builtin_ctz(mask);
+      if (nl <= 2 || !ngx_memcmp(haystack+i+bit+1, needle+1, nl-2))
+	return (haystack+i+bit);
+      mask &= mask - 1;
+    }
+  }
+  return (naxsi_memmem_scalar_from(haystack, hl, needle, nl, i));
+}
+
+__attribute__((target("avx2")))
+u_char *
+naxsi_memmem_avx2(u_char *haystack, size_t hl, u_char *needle, size_t nl)
+{
+  __m256i	first, last, bf, bl, eq;
+  unsigned int	mask, bit;
+  size_t	i;
+
+  if (hl < nl || !haystack || !needle || !nl || !hl) return (NULL);
+  first = _mm256_set1_epi8((char) needle[0]);
+  last = _mm256_set1_epi8((char) needle[nl-1]);
+  for (i = 0; i + nl - 1 + 32 <= hl; i += 32) {
+    bf = _mm256_loadu_si256((const __m256i *) (haystack+i));
+    bl = _mm256_loadu_si256((const __m256i *) (haystack+i+nl-1));
+    eq = _mm256_and_si256(_mm256_cmpeq_epi8(bf, first), 
+			  _mm256_cmpeq_epi8(bl, last));
+    mask = (unsigned int) _mm256_movemask_epi8(eq);
+    while (mask) {
+      bit = __builtin_ctz(mask);
+      if (nl <= 2 || !ngx_memcmp(haystack+i+bit+1, needle+1, nl-2))
+	return (haystack+i+bit);
+      mask &= mask - 1;
+    }
+  }
+  return (naxsi_memmem_scalar_from(haystack, hl, needle, nl, i));
+}
+
+__attribute__((target("sse2")))
+char *
+strfaststr_sse2(unsigned char *haystack, unsigned int hl, 
+		unsigned char *needle, unsigned int nl)
+{
+  __m128i	first, last, ff, lf, bf, bl, eq;
+  unsigned int	i, mask, bit;
+
+  if (hl < nl || !haystack || !needle || !nl || !hl) return (NULL);
+  first = _mm_set1_epi8((char) ngx_tolower(needle[0]));
+  last = _mm_set1_epi8((char) ngx_tolower(needle[nl-1]));
+  ff = _mm_set1_epi8((char) naxsi_fold(needle[0]));
+  lf = _mm_set1_epi8((char) naxsi_fold(needle[nl-1]));
+  for (i = 0; i + nl - 1 + 16 <= hl; i += 16) {
+    bf = _mm_loadu_si128((const __m128i *) (haystack+i));
+    bl = _mm_loadu_si128((const __m128i *) (haystack+i+nl-1));
+    eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(bf, ff), first),
+		       _mm_cmpeq_epi8(_mm_or_si128(bl, lf), last));
+    mask = (unsigned int) _mm_movemask_epi8(eq);
+    while (mask) {
+      bit = __builtin_ctz(mask);
+      if (nl <= 2 || strfaststr_verify(haystack+i+bit+1, needle+1, nl-2))
+	return ((char *) haystack+i+bit);
+      mask &= mask - 1;
+    }
+  }
+  return (strfaststr_scalar_from(haystack, hl, needle, nl, i));
+}
+
+__attribute__((target("avx2")))
+char *
+strfaststr_avx2(unsigned char *haystack, unsigned int hl, 
+		unsigned char *needle, unsigned int nl)
+{
+  __m256i	first, last, ff, lf, bf, bl, eq;
+  unsigned int	i, mask, bit;
+
+  if (hl < nl || !haystack || !needle || !nl || !hl) return (NULL);
+  first = _mm256_set1_epi8((char) ngx_tolower(needle[0]));
+  last = _mm256_set1_epi8((char) ngx_tolower(needle[nl-1]));
+  ff = _mm256_set1_epi8((char) naxsi_fold(needle[0]));
+  lf = _mm256_set1_epi8((char) naxsi_fold(needle[nl-1]));
+  for (i = 0; i + nl - 1 + 32 <= hl; i += 32) {
+    bf = _mm256_loadu_si256((const __m256i *) (haystack+i));
+    bl = _mm256_loadu_si256((const __m256i *) (haystack+i+nl-1));
+    eq = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_or_si256(bf, ff), first),
+			  _mm256_cmpeq_epi8(_mm256_or_si256(bl, lf), last));
+    mask = (unsigned int) _mm256_movemask_epi8(eq);
+    while (mask) {
+      bit = __builtin_ctz(mask);
+      if (nl <= 2 || strfaststr_verify(haystack+i+bit+1, needle+1, nl-2))
+	return ((char *) haystack+i+bit);
+      mask &= mask - 1;
+    }
+  }
+  return (strfaststr_scalar_from(haystack, hl, needle, nl, i));
+}
+
+/* XCR0 must have SSE and AVX state enabled by the OS for ymm registers */
+static int
+naxsi_os_has_avx(void)
+{
+  unsigned int	lo, hi;
+
+  __asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+  return ((lo & 0x6) == 0x6);
+}
+
+#endif
+
+/*
+** returns the kernels usable on this CPU, best one last,
+** terminated by a NULL entry.
+*/
+naxsi_strstr_kernel_t *
+naxsi_strstr_kernels(void)
+{
+  static naxsi_strstr_kernel_t	kernels[4];
+  static int			done;
+  int				n;
+#if (NAXSI_HAVE_SIMD)
+  unsigned int			eax, ebx, ecx, edx;
+  int				has_avx;
+#endif
+
+  if (done)
+    return (kernels);
+  n = 0;
+  kernels[n].name = "scalar";
+  kernels[n].find = naxsi_memmem_scalar;
+  kernels[n++].search = strfaststr_scalar;
+#if (NAXSI_HAVE_SIMD)
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    has_avx = (ecx & bit_OSXSAVE) && (ecx & bit_AVX) && naxsi_os_has_avx();
+    if (edx & bit_SSE2) {
+      kernels[n].name = "sse2";
+      kernels[n].find = naxsi_memmem_sse2;
+      kernels[n++].search = strfaststr_sse2;
+    }
+    if (has_avx && __get_cpuid_max(0, NULL) >= 7) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      if (ebx & bit_AVX2) {
+	kernels[n].name = "avx2";
+	kernels[n].find = naxsi_memmem_avx2;
+	kernels[n++].search = strfaststr_avx2;
+      }
+    }
+  }
+#endif
+  kernels[n].name = NULL;
+  kernels[n].search = NULL;
+  kernels[n].find = NULL;
+  done = 1;
+  return (kernels);
+}
+
+static char	*strfaststr_select(unsigned char *haystack, unsigned int hl, 
+				   unsigned char *needle, unsigned int nl);
+
+static char	*(*strfaststr_kernel)(unsigned char *, unsigned int, 
+				      unsigned char *, unsigned int) = strfaststr_select;
+
+/* first call : pick the best kernel, and use it from now on. */
+static char *
+strfaststr_select(unsigned char *haystack, unsigned int hl, 
+		  unsigned char *needle, unsigned int nl)
+{
+  naxsi_strstr_kernel_t	*k;
+
+  for (k = naxsi_strstr_kernels(); k[1].search; k++)
+    ;
+  strfaststr_kernel = k->search;
+  return (strfaststr_kernel(haystack, hl, needle, nl));
+}
+
+static u_char	*naxsi_memmem_select(u_char *haystack, size_t hl, 
+				     u_char *needle, size_t nl);
+
+static u_char	*(*naxsi_memmem_kernel)(u_char *, size_t, 
+					u_char *, size_t) = naxsi_memmem_select;
+
+static u_char *
+naxsi_memmem_select(u_char *haystack, size_t hl, u_char *needle, size_t nl)
+{
+  naxsi_strstr_kernel_t	*k;
+
+  for (k = naxsi_strstr_kernels(); k[1].search; k++)
+    ;
+  naxsi_memmem_kernel = k->find;
+  return (naxsi_memmem_kernel(haystack, hl, needle, nl));
+}
+
+/*
+** Case sensitive search of needle in haystack, with the best
+** kernel available (see strfaststr).
+*/
+u_char *
+naxsi_memmem(u_char *haystack, size_t hl, u_char *needle, size_t nl)
+{
+  return (naxsi_memmem_kernel(haystack, hl, needle, nl));
+}
+
+char *
+strfaststr(unsigned char *haystack, unsigned int hl, 
+	   unsigned char *needle, unsigned int nl)
+{
+  return (strfaststr_kernel(haystack, hl, needle, nl));
+}
+
+/*
+** monotonic clock, in nanoseconds. used to account inspection time,
+** ngx_current_msec being both too coarse and only updated per event loop.
+*/
+uint64_t
+naxsi_now_ns(void)
+{
+  struct timespec	ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
 /*
 ** Patched ngx_unescape_uri : 
 ** The original one does not care if the character following % is in valid range.
@@ -216,6 +511,100 @@ done:
     *src = s;
 }
 
+static ngx_inline ngx_int_t
+naxsi_hexval(u_char ch)
+{
+  u_char	c;
+
+  if (ch >= '0' && ch <= '9')
+    return (ch - '0');
+  c = (u_char) (ch | 0x20);
+  if (c >= 'a' && c <= 'f')
+    return (c - 'a' + 10);
+  return (-1);
+}
+
+static ngx_inline u_char *
+naxsi_norm_put(u_char *d, u_char ch, ngx_uint_t flags, ngx_uint_t *space)
+{
+  if (!ch) {
+    if (flags & NAXSI_T_REMOVENULLS)
+      return (d);
+    if (flags & NAXSI_T_NULLZERO)
+      ch = '0';
+  }
+  if (flags & NAXSI_T_COMPRESSWS) {
+    if (ch == ' ' || (ch >= '\t' && ch <= '\r')) {
+      if (*space)
+	return (d);
+      *space = 1;
+      ch = ' ';
+    }
+    else
+      *space = 0;
+  }
+  if (flags & NAXSI_T_LOWERCASE)
+    ch = ngx_tolower(ch);
+  *d++ = ch;
+  return (d);
+}
+
+/*
+** in : [len] bytes at [src], NAXSI_T_* [flags]
+** does : in a single pass, url decoding (invalid or truncated escapes
+**	  are handled the way naxsi_unescape_uri() does), null bytes
+**	  removal or replacement by '0', whitespace runs collapsing and
+**	  lowercasing. The output is never longer than the input, so
+**	  [dst] may be [src].
+** returns the length of the output.
+*/
+size_t
+ngx_http_dummy_normalize(u_char *dst, u_char *src, size_t len,
+			 ngx_uint_t flags)
+{
+  u_char	*d, *end, ch;
+  ngx_int_t	hi, lo;
+  ngx_uint_t	space, fast;
+
+  d = dst;
+  end = src + len;
+  space = 0;
+  /* without those, only '%' and null bytes need a closer look */
+  fast = !(flags & (NAXSI_T_COMPRESSWS|NAXSI_T_LOWERCASE));
+  while (src < end) {
+    if (fast) {
+      while (src < end && *src != '%' && *src)
+	*d++ = *src++;
+      if (src == end)
+	break;
+    }
+    ch = *src++;
+    if (ch != '%' || !(flags & NAXSI_T_URLDECODE)) {
+      d = naxsi_norm_put(d, ch, flags, &space);
+      continue;
+    }
+    if (src == end)
+      break;
+    ch = *src++;
+    hi = naxsi_hexval(ch);
+    if (hi == -1) {
+      d = naxsi_norm_put(d, '%', flags, &space);
+      d = naxsi_norm_put(d, ch, flags, &space);
+      continue;
+    }
+    if (src == end)
+      break;
+    ch = *src++;
+    lo = naxsi_hexval(ch);
+    if (lo == -1) {
+      d = naxsi_norm_put(d, ch, flags, &space);
+      continue;
+    }
+    d = naxsi_norm_put(d, (u_char) ((hi << 4) + lo), flags, &space);
+  }
+  return (d - dst);
+}
+
 //#define whitelist_heavy_debug
 
 #ifdef whitelist_heavy_debug
@@ -259,7 +648,7 @@ ngx_http_wlr_merge(ngx_conf_t *cf, ngx_http_whitelist_rule_t *father_wl,
   
   if (!father_wl->ids)
     {
-      father_wl->ids = ngx_array_create(cf->pool, 3, sizeof(int));
+      father_wl->ids = ngx_array_create(cf->pool, 3, sizeof(ngx_int_t));
       if (!father_wl->ids)
 	return (NGX_ERROR);
     }
@@ -492,8 +881,8 @@ ngx_http_wlr_finalize_hashtables(ngx_conf_t *cf, ngx_http_dummy_loc_conf_t  *dlc
 		        ((ngx_http_whitelist_rule_t *) dlc->tmp_wlr->elts)[i].ids->nelts);
     unsigned int z;
     for (z = 0; z < ((ngx_http_whitelist_rule_t *) dlc->tmp_wlr->elts)[i].ids->nelts; z++)
-      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "id:%d",
-    			 ((int *)((ngx_http_whitelist_rule_t *) dlc->tmp_wlr->elts)[i].ids->elts)[z]);
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "id:%i",
+    			 ((ngx_int_t *)((ngx_http_whitelist_rule_t *) dlc->tmp_wlr->elts)[i].ids->elts)[z]);
 #endif    
   }
   hash_init.key = &ngx_hash_key_lc;
@@ -567,6 +956,373 @@ ngx_http_wlr_finalize_hashtables(ngx_conf_t *cf, ngx_http_dummy_loc_conf_t  *dlc
 }
 
 
+/* pushes a copy of [rule] in *set, creating it if needed */
+static ngx_int_t
+ngx_http_dummy_push_rule(ngx_pool_t *pool, ngx_array_t **set, 
+			 ngx_http_rule_t *rule)
+{
+  ngx_http_rule_t	*rule_r;
+
+  if (*set == NULL) {
+    *set = ngx_array_create(pool, 2, sizeof(ngx_http_rule_t));
+    if (*set == NULL)
+      return (NGX_ERROR);
+  }
+  rule_r = ngx_array_push(*set);
+  if (!rule_r)
+    return (NGX_ERROR);
+  memcpy(rule_r, rule, sizeof(ngx_http_rule_t));
+  return (NGX_OK);
+}
+
+/*
+** in : a parsed MainRule, and the main rulesets (main_cf's or
+**	naxsi_ruleset's)
+** does : pushes a copy of the rule in the ruleset of each zone it
+**	  applies to, custom locations (GET_VAR, POST_VAR ...) included.
+*/
+ngx_int_t
+ngx_http_dummy_push_main_rule(ngx_pool_t *pool, ngx_array_t **get_rules,
+			      ngx_array_t **body_rules,
+			      ngx_array_t **header_rules,
+			      ngx_array_t **generic_rules,
+			      ngx_http_rule_t *rule)
+{
+  ngx_http_custom_rule_location_t	*location;
+  ngx_uint_t				i;
+
+  if (rule->br->headers && 
+      ngx_http_dummy_push_rule(pool, header_rules, rule) != NGX_OK)
+    return (NGX_ERROR);
+  /* push in body match rules (POST/PUT) */
+  if ((rule->br->body || rule->br->body_var) &&
+      ngx_http_dummy_push_rule(pool, body_rules, rule) != NGX_OK)
+    return (NGX_ERROR);
+  /* push in generic rules, as it's matching the URI */
+  if (rule->br->url && 
+      ngx_http_dummy_push_rule(pool, generic_rules, rule) != NGX_OK)
+    return (NGX_ERROR);
+  /* push in GET arg rules, but we should push in POST rules too  */
+  if ((rule->br->args_var || rule->br->args) &&
+      ngx_http_dummy_push_rule(pool, get_rules, rule) != NGX_OK)
+    return (NGX_ERROR);
+  /* push in custom locations. It's a rule matching a VAR_NAME or an EXACT_URI :
+     - GET_VAR, POST_VAR, URI */
+  if (!rule->br->custom_location)
+    return (NGX_OK);
+  location = rule->br->custom_locations->elts;
+  for (i = 0; i < rule->br->custom_locations->nelts; i++) {
+    if (location[i].args_var &&
+	ngx_http_dummy_push_rule(pool, get_rules, rule) != NGX_OK)
+      return (NGX_ERROR);
+    if (location[i].body_var &&
+	ngx_http_dummy_push_rule(pool, body_rules, rule) != NGX_OK)
+      return (NGX_ERROR);
+    if (location[i].headers_var &&
+	ngx_http_dummy_push_rule(pool, header_rules, rule) != NGX_OK)
+      return (NGX_ERROR);
+  }
+  return (NGX_OK);
+}
+
+static int ngx_libc_cdecl
+ngx_http_dummy_cmp_id(const void *a, const void *b)
+{
+  ngx_int_t	x, y;
+
+  x = *(ngx_int_t *) a;
+  y = *(ngx_int_t *) b;
+  return (x < y ? -1 : (x > y ? 1 : 0));
+}
+
+/*
+** returns the position of [id] in main_cf->rule_ids, or after them
+** for the ids numbered at runtime (main_cf->ruleset_ids), NGX_ERROR
+** if no rule has this id.
+*/
+ngx_int_t
+ngx_http_dummy_rule_id_index(ngx_http_dummy_main_conf_t *main_cf, ngx_int_t id)
+{
+  ngx_uint_t	lo, hi, mid, nb;
+
+  lo = 0;
+  hi = main_cf->nb_rule_ids;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (main_cf->rule_ids[mid] == id)
+      return (mid);
+    if (main_cf->rule_ids[mid] < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!main_cf->ruleset_ids)
+    return (NGX_ERROR);
+  nb = main_cf->ruleset_ids->nb_ids;
+  ngx_memory_barrier();
+  for (lo = 0; lo < nb; lo++)
+    if (main_cf->ruleset_ids->ids[lo] == id)
+      return (main_cf->nb_rule_ids + lo);
+  return (NGX_ERROR);
+}
+
+/*
+** returns the id numbered [n] (see ngx_http_dummy_rule_id_index),
+** NGX_ERROR if none is.
+*/
+ngx_int_t
+ngx_http_dummy_rule_id(ngx_http_dummy_main_conf_t *main_cf, ngx_uint_t n)
+{
+  if (n < main_cf->nb_rule_ids)
+    return (main_cf->rule_ids[n]);
+  n -= main_cf->nb_rule_ids;
+  if (!main_cf->ruleset_ids || n >= main_cf->ruleset_ids->nb_ids)
+    return (NGX_ERROR);
+  ngx_memory_barrier();
+  return (main_cf->ruleset_ids->ids[n]);
+}
+
+/*
+** returns the id of score tag [tag] in main_cf->sc_tags,
+** adding it if needed, NGX_ERROR on failure.
+** the tag is copied in [pool] : it may come from a ruleset that
+** goes away before the configuration (see naxsi_ruleset.c).
+*/
+ngx_int_t
+ngx_http_dummy_sc_tag_id(ngx_pool_t *pool, ngx_http_dummy_main_conf_t *main_cf,
+			 ngx_str_t *tag)
+{
+  ngx_str_t	*tags;
+  ngx_uint_t	i;
+
+  if (!main_cf->sc_tags) {
+    main_cf->sc_tags = ngx_array_create(pool, 4, sizeof(ngx_str_t));
+    if (!main_cf->sc_tags)
+      return (NGX_ERROR);
+  }
+  tags = main_cf->sc_tags->elts;
+  for (i = 0; i < main_cf->sc_tags->nelts; i++)
+    if (tags[i].len == tag->len &&
+	!ngx_strncmp(tags[i].data, tag->data, tag->len))
+      return (i);
+  tags = ngx_array_push(main_cf->sc_tags);
+  if (!tags)
+    return (NGX_ERROR);
+  tags->data = ngx_pnalloc(pool, tag->len);
+  if (!tags->data) {
+    main_cf->sc_tags->nelts--;
+    return (NGX_ERROR);
+  }
+  ngx_memcpy(tags->data, tag->data, tag->len);
+  tags->len = tag->len;
+  return (i);
+}
+
+/*
+** in : main configuration, once every rule is loaded
+** does : builds main_cf->rule_ids, the sorted, deduplicated, ids of every
+**	  rule of main and location rulesets (internal ones included),
+**	  and sets the id_index of the rules of these rulesets.
+**	  Score tags of rules and CheckRules are numbered as well,
+**	  so that scores can be kept in a fixed array at runtime.
+**	  With naxsi_ruleset, its rules are numbered too, along with the
+**	  ids named by location whitelists : a rule of a ruleset loaded
+**	  later on finds its bit in their sets. Ids no rule had at
+**	  configuration time are numbered after these, at runtime (see
+**	  naxsi_reload.c), main_cf->nb_id_slots counts both.
+*/
+ngx_int_t
+ngx_http_dummy_index_rules(ngx_conf_t *cf, ngx_http_dummy_main_conf_t *main_cf)
+{
+  ngx_http_dummy_loc_conf_t	**loc;
+  ngx_array_t			**sets;
+  ngx_http_rule_t		*r, *wl;
+  ngx_http_check_rule_t		*cr;
+  ngx_int_t			*ids, tag;
+  ngx_uint_t			i, k, j, n, nb_sets;
+
+  /* every ruleset, main ones first, naxsi_ruleset last */
+  nb_sets = 4 * (main_cf->locations->nelts + 1);
+  sets = ngx_palloc(cf->temp_pool, (nb_sets + 4) * sizeof(ngx_array_t *));
+  if (!sets)
+    return (NGX_ERROR);
+  sets[0] = main_cf->get_rules;
+  sets[1] = main_cf->body_rules;
+  sets[2] = main_cf->header_rules;
+  sets[3] = main_cf->generic_rules;
+  loc = main_cf->locations->elts;
+  for (i = 0; i < main_cf->locations->nelts; i++) {
+    sets[4 * i + 4] = loc[i]->get_rules;
+    sets[4 * i + 5] = loc[i]->body_rules;
+    sets[4 * i + 6] = loc[i]->header_rules;
+    sets[4 * i + 7] = loc[i]->generic_rules;
+  }
+  if (main_cf->ruleset) {
+    sets[nb_sets++] = main_cf->ruleset->get_rules;
+    sets[nb_sets++] = main_cf->ruleset->body_rules;
+    sets[nb_sets++] = main_cf->ruleset->header_rules;
+    sets[nb_sets++] = main_cf->ruleset->generic_rules;
+  }
+  /* internal rules (weird/big request) */
+  n = 2;
+  for (i = 0; i < nb_sets; i++)
+    n += sets[i] ? sets[i]->nelts : 0;
+  for (i = 0; main_cf->ruleset_path.len && i < main_cf->locations->nelts; i++) {
+    wl = loc[i]->whitelist_rules ? loc[i]->whitelist_rules->elts : NULL;
+    for (k = 0; wl && k < loc[i]->whitelist_rules->nelts; k++)
+      for (j = 0; wl[k].wl_id && wl[k].wl_id[j] >= 0; j++)
+	n++;
+  }
+  ids = ngx_palloc(cf->pool, n * sizeof(ngx_int_t));
+  if (!ids)
+    return (NGX_ERROR);
+  ids[0] = WEIRD_REQUEST_INTERNAL_RULE_ID;
+  ids[1] = BIG_BODY_INTERNAL_RULE_ID;
+  n = 2;
+  for (i = 0; i < nb_sets; i++) {
+    if (!sets[i])
+      continue;
+    r = sets[i]->elts;
+    for (k = 0; k < sets[i]->nelts; k++)
+      ids[n++] = r[k].rule_id;
+  }
+  /* wl:0 is every rule, not an id */
+  for (i = 0; main_cf->ruleset_path.len && i < main_cf->locations->nelts; i++) {
+    wl = loc[i]->whitelist_rules ? loc[i]->whitelist_rules->elts : NULL;
+    for (k = 0; wl && k < loc[i]->whitelist_rules->nelts; k++)
+      for (j = 0; wl[k].wl_id && wl[k].wl_id[j] >= 0; j++)
+	if (wl[k].wl_id[j])
+	  ids[n++] = wl[k].wl_id[j];
+  }
+  ngx_qsort(ids, n, sizeof(ngx_int_t), ngx_http_dummy_cmp_id);
+  for (i = 1, k = 1; i < n; i++)
+    if (ids[i] != ids[k - 1])
+      ids[k++] = ids[i];
+  main_cf->rule_ids = ids;
+  main_cf->nb_rule_ids = k;
+  main_cf->nb_id_slots = k + (main_cf->ruleset_path.len ? NAXSI_RULESET_IDS : 0);
+  /* and number the rules */
+  for (i = 0; i < nb_sets; i++) {
+    if (!sets[i])
+      continue;
+    r = sets[i]->elts;
+    for (k = 0; k < sets[i]->nelts; k++) {
+      r[k].id_index = ngx_http_dummy_rule_id_index(main_cf, r[k].rule_id);
+      if (!r[k].sc_tag)
+	continue;
+      tag = ngx_http_dummy_sc_tag_id(cf->pool, main_cf, r[k].sc_tag);
+      if (tag == NGX_ERROR)
+	return (NGX_ERROR);
+      r[k].sc_tag_id = tag;
+    }
+  }
+  /* a CheckRule on a tag no rule uses still gets an id */
+  for (i = 0; i < main_cf->locations->nelts; i++) {
+    if (!loc[i]->check_rules)
+      continue;
+    cr = loc[i]->check_rules->elts;
+    for (k = 0; k < loc[i]->check_rules->nelts; k++) {
+      tag = ngx_http_dummy_sc_tag_id(cf->pool, main_cf, &(cr[k].sc_tag));
+      if (tag == NGX_ERROR)
+	return (NGX_ERROR);
+      cr[k].sc_tag_id = tag;
+    }
+  }
+  return (NGX_OK);
+}
+
+static ngx_http_dummy_idset_t *
+ngx_http_dummy_idset_create(ngx_conf_t *cf, ngx_http_dummy_main_conf_t *main_cf)
+{
+  ngx_http_dummy_idset_t	*set;
+
+  set = ngx_pcalloc(cf->pool, sizeof(ngx_http_dummy_idset_t));
+  if (!set)
+    return (NULL);
+  set->bits = ngx_pcalloc(cf->pool, 
+			  (main_cf->nb_id_slots / NAXSI_IDSET_BITS + 1) * 
+			  sizeof(uintptr_t));
+  if (!set->bits)
+    return (NULL);
+  return (set);
+}
+
+/*
+** adds ids (-1 terminated) to the set, 0 meaning every rule.
+** ids no rule has can't be matched, they are left out.
+*/
+static void
+ngx_http_dummy_idset_add(ngx_http_dummy_main_conf_t *main_cf,
+			 ngx_http_dummy_idset_t *set, ngx_int_t *ids, 
+			 ngx_uint_t nb)
+{
+  ngx_uint_t	i;
+  ngx_int_t	n;
+
+  for (i = 0; i < nb && ids[i] >= 0; i++) {
+    if (ids[i] == 0) {
+      set->all = 1;
+      continue;
+    }
+    n = ngx_http_dummy_rule_id_index(main_cf, ids[i]);
+    if (n == NGX_ERROR)
+      continue;
+    set->bits[n / NAXSI_IDSET_BITS] |= (uintptr_t) 1 << (n % NAXSI_IDSET_BITS);
+  }
+}
+
+/*
+** rules disabled in a location (whitelists without $URL/$*_VAR), 
+** as one set per zone and target (content/name) :
+** - ARGS, HEADERS, BODY : matches in that zone, on content or on names, 
+**   depending on the whitelist NAME flag,
+** - URL : matches in the URL,
+** - no zone at all : matches anywhere.
+*/
+static ngx_int_t
+ngx_http_dummy_compile_disabled(ngx_conf_t *cf, 
+				ngx_http_dummy_main_conf_t *main_cf,
+				ngx_http_dummy_loc_conf_t *dlc)
+{
+  ngx_http_rule_t	**dr;
+  ngx_http_basic_rule_t	*br;
+  ngx_uint_t		i, nb_ids, z, t, zones[UNKNOWN][2];
+
+  dr = dlc->disabled_rules->elts;
+  for (i = 0; i < dlc->disabled_rules->nelts; i++) {
+    br = dr[i]->br;
+    if (!br)
+      continue;
+    ngx_memzero(zones, sizeof(zones));
+    if (br->args)
+      zones[ARGS][br->target_name ? 1 : 0] = 1;
+    if (br->headers)
+      zones[HEADERS][br->target_name ? 1 : 0] = 1;
+    if (br->body)
+      zones[BODY][br->target_name ? 1 : 0] = 1;
+    if (br->url)
+      zones[URL][0] = zones[URL][1] = 1;
+    if (!(br->args || br->headers || br->body || br->url))
+      for (z = 0; z < UNKNOWN; z++)
+	zones[z][0] = zones[z][1] = 1;
+    for (nb_ids = 0; dr[i]->wl_id[nb_ids] >= 0; nb_ids++)
+      ;
+    for (z = 0; z < UNKNOWN; z++)
+      for (t = 0; t < 2; t++) {
+	if (!zones[z][t])
+	  continue;
+	if (!dlc->disabled[z][t]) {
+	  dlc->disabled[z][t] = ngx_http_dummy_idset_create(cf, main_cf);
+	  if (!dlc->disabled[z][t])
+	    return (NGX_ERROR);
+	}
+	ngx_http_dummy_idset_add(main_cf, dlc->disabled[z][t], dr[i]->wl_id, 
+				 nb_ids);
+      }
+  }
+  return (NGX_OK);
+}
+
 /*
 ** This function will take the whitelist basicrules generated during the configuration
 ** parsing phase, and aggregate them to build hashtables according to the matchzones.
@@ -584,11 +1340,12 @@ ngx_http_wlr_finalize_hashtables(ngx_conf_t *cf, ngx_http_dummy_loc_conf_t  *dlc
 //#define whitelist_heavy_debug
 ngx_int_t
 ngx_http_dummy_create_hashtables_n(ngx_http_dummy_loc_conf_t *dlc, 
-				   ngx_conf_t *cf)
+				   ngx_conf_t *cf,
+				   ngx_http_dummy_main_conf_t *main_cf)
 {
   int				zone, uri_idx, name_idx, ret;
   ngx_http_rule_t		*curr_r/*, *father_r*/;
-  ngx_http_whitelist_rule_t	*father_wlr;
+  ngx_http_whitelist_rule_t	*father_wlr, *wlr;
   unsigned char			*fullname;
   uint	i;
 
@@ -664,6 +1421,18 @@ ngx_http_dummy_create_hashtables_n(ngx_http_dummy_loc_conf_t *dlc,
       return (NGX_ERROR);
   }
   
+  /* compile whitelisted ids */
+  wlr = dlc->tmp_wlr->elts;
+  for (i = 0; i < dlc->tmp_wlr->nelts; i++) {
+    wlr[i].idset = ngx_http_dummy_idset_create(cf, main_cf);
+    if (!wlr[i].idset)
+      return (NGX_ERROR);
+    ngx_http_dummy_idset_add(main_cf, wlr[i].idset, wlr[i].ids->elts, 
+			     wlr[i].ids->nelts);
+  }
+  if (dlc->disabled_rules && 
+      ngx_http_dummy_compile_disabled(cf, main_cf, dlc) != NGX_OK)
+    return (NGX_ERROR);
   /* and finally, build the hashtables for various zones. */
   if (ngx_http_wlr_finalize_hashtables(cf, dlc) != NGX_OK)
     return (NGX_ERROR);
@@ -27,9 +27,7 @@ ngx_http_lua_ngx_req_set_uri_args(lua_State *L) {
                 lua_gettop(L));
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -97,9 +95,7 @@ ngx_http_lua_ngx_req_get_uri_args(lua_State *L) {
         max = NGX_HTTP_LUA_MAX_ARGS;
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -154,9 +150,7 @@ ngx_http_lua_ngx_req_get_post_args(lua_State *L)
         max = NGX_HTTP_LUA_MAX_ARGS;
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
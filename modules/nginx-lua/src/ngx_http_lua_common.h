@@ -30,6 +30,11 @@
             return luaL_error(L, "coroutine aborted"); \
         }
 
+#define NGX_HTTP_LUA_CHECK_TIMER(L, ctx) \
+        if (ctx && ctx->timer) { \
+            return luaL_error(L, "API disabled in the context of ngx.timer"); \
+        }
+
 /* Nginx HTTP Lua Inline tag prefix */
 
 #define NGX_HTTP_LUA_INLINE_TAG "nhli_"
@@ -82,6 +87,19 @@ typedef struct {
 
     ngx_array_t     *shm_zones;  /* of ngx_shm_zone_t* */
 
+    ngx_int_t        coroutine_pool_size;
+    ngx_array_t     *coroutine_pool;  /* of int, the NGX_LUA_CORT_REF refs
+                                         of the idle coroutines */
+
+    ngx_int_t        max_pending_timers;
+    ngx_int_t        pending_timers;    /* per worker */
+
+    ngx_int_t        max_running_timers;
+    ngx_int_t        running_timers;    /* per worker */
+
+    ngx_connection_t *watcher;  /* fake idle connection that tells us when
+                                   the worker is shutting down */
+
     unsigned    postponed_to_rewrite_phase_end:1;
     unsigned    postponed_to_access_phase_end:1;
 
@@ -127,6 +145,13 @@ typedef struct {
     u_char                 *header_filter_src_key;
                                     /* cached key for header_filter_src */
 
+    ngx_msec_t              socket_connect_timeout;
+    ngx_msec_t              socket_send_timeout;
+    ngx_msec_t              socket_read_timeout;
+    size_t                  socket_buffer_size;
+    ngx_msec_t              socket_keepalive_timeout;
+    ngx_uint_t              socket_pool_size;
+
 } ngx_http_lua_loc_conf_t;
 
 
@@ -199,6 +224,15 @@ typedef struct {
 
     unsigned         waiting_flush:1;
     unsigned         aborted:1;
+
+    unsigned         socket_busy:1;   /* waiting for a tcp socket */
+    unsigned         socket_ready:1;  /* the tcp socket operation is done */
+
+    unsigned         timer:1;         /* running an ngx.timer.at callback
+                                         on a fake request */
+
+    void            *socket;  /* the ngx_http_lua_socket_upstream_t being
+                                 waited for */
 } ngx_http_lua_ctx_t;
 
 
@@ -228,6 +262,9 @@ extern ngx_module_t ngx_http_lua_module;
 extern ngx_http_output_header_filter_pt ngx_http_lua_next_header_filter;
 extern ngx_http_output_body_filter_pt ngx_http_lua_next_body_filter;
 
+/*  the request whose Lua code is running, see ngx_http_lua_set_req() */
+extern ngx_http_request_t *ngx_http_lua_cur_req;
+
 
 /*  user code cache table key in Lua vm registry */
 #define LUA_CODE_CACHE_KEY "ngx_http_lua_code_cache"
@@ -235,18 +272,48 @@ extern ngx_http_output_body_filter_pt ngx_http_lua_next_body_filter;
 /*  coroutine anchoring table key in Lua vm registry */
 #define NGX_LUA_CORT_REF "ngx_lua_cort_ref"
 
+/*  metatable of the coroutine globals tables in Lua vm registry */
+#define NGX_LUA_GLOBALS_MT "ngx_lua_globals_mt"
+
 /*  request ctx data anchoring table key in Lua vm registry */
 #define NGX_LUA_REQ_CTX_REF "ngx_lua_req_ctx_ref"
 
 /*  regex cache table key in Lua vm registry */
 #define NGX_LUA_REGEX_CACHE "ngx_lua_regex_cache"
 
-/*  globals symbol to hold nginx request pointer */
-#define GLOBALS_SYMBOL_REQUEST    "ngx._req"
+/*  tcp socket connection pools table key in Lua vm registry */
+#define NGX_LUA_SOCKET_POOL "ngx_lua_socket_pool"
 
 /*  globals symbol to hold code chunk handling nginx request */
 #define GLOBALS_SYMBOL_RUNCODE    "ngx._code"
 
 
+/*
+ * A worker runs one piece of Lua code at a time, so the request the Lua
+ * API functions work on is kept in a C variable instead of the globals
+ * table of the running coroutine. It is set by whoever enters the VM for
+ * a request and restored when the VM returns, which keeps nested entries
+ * (a header filter run by ngx.send_headers, say) and coroutines created
+ * by user code right.
+ */
+static ngx_inline ngx_http_request_t *
+ngx_http_lua_get_req(lua_State *L)
+{
+    return ngx_http_lua_cur_req;
+}
+
+
+static ngx_inline ngx_http_request_t *
+ngx_http_lua_set_req(ngx_http_request_t *r)
+{
+    ngx_http_request_t      *old;
+
+    old = ngx_http_lua_cur_req;
+    ngx_http_lua_cur_req = r;
+
+    return old;
+}
+
+
 #endif /* NGX_HTTP_LUA_COMMON_H */
 
@@ -26,10 +26,17 @@ ngx_http_lua_create_main_conf(ngx_conf_t *cf)
      *      lmcf->lua_cpath = { 0, NULL };
      *      lmcf->regex_cache_entries = 0;
      *      lmcf->shm_zones = NULL;
+     *      lmcf->coroutine_pool = NULL;
+     *      lmcf->pending_timers = 0;
+     *      lmcf->running_timers = 0;
+     *      lmcf->watcher = NULL;
      */
 
     lmcf->pool = cf->pool;
     lmcf->regex_cache_max_entries = NGX_CONF_UNSET;
+    lmcf->coroutine_pool_size = NGX_CONF_UNSET;
+    lmcf->max_pending_timers = NGX_CONF_UNSET;
+    lmcf->max_running_timers = NGX_CONF_UNSET;
 
     dd("nginx Lua module main config structure initialized!");
 
@@ -46,6 +53,27 @@ ngx_http_lua_init_main_conf(ngx_conf_t *cf, void *conf)
         lmcf->regex_cache_max_entries = 1024;
     }
 
+    if (lmcf->coroutine_pool_size == NGX_CONF_UNSET) {
+        lmcf->coroutine_pool_size = 64;
+    }
+
+    if (lmcf->coroutine_pool_size > 0) {
+        lmcf->coroutine_pool = ngx_array_create(cf->pool,
+                                                lmcf->coroutine_pool_size,
+                                                sizeof(int));
+        if (lmcf->coroutine_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (lmcf->max_pending_timers == NGX_CONF_UNSET) {
+        lmcf->max_pending_timers = 1024;
+    }
+
+    if (lmcf->max_running_timers == NGX_CONF_UNSET) {
+        lmcf->max_running_timers = 256;
+    }
+
     if (lmcf->lua == NULL) {
         if (ngx_http_lua_init_vm(cf, lmcf) != NGX_CONF_OK) {
             ngx_conf_log_error(NGX_ERROR, cf, 0, "Failed to initialize Lua VM");
@@ -87,6 +115,13 @@ ngx_http_lua_create_loc_conf(ngx_conf_t *cf)
 
     conf->force_read_body   = NGX_CONF_UNSET;
     conf->enable_code_cache = NGX_CONF_UNSET;
+
+    conf->socket_connect_timeout = NGX_CONF_UNSET_MSEC;
+    conf->socket_send_timeout = NGX_CONF_UNSET_MSEC;
+    conf->socket_read_timeout = NGX_CONF_UNSET_MSEC;
+    conf->socket_buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->socket_keepalive_timeout = NGX_CONF_UNSET_MSEC;
+    conf->socket_pool_size = NGX_CONF_UNSET_UINT;
     conf->tag = (ngx_buf_tag_t) &ngx_http_lua_module;
 
     return conf;
@@ -126,6 +161,20 @@ ngx_http_lua_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->force_read_body, prev->force_read_body, 0);
     ngx_conf_merge_value(conf->enable_code_cache, prev->enable_code_cache, 1);
 
+    ngx_conf_merge_msec_value(conf->socket_connect_timeout,
+                              prev->socket_connect_timeout, 60000);
+    ngx_conf_merge_msec_value(conf->socket_send_timeout,
+                              prev->socket_send_timeout, 60000);
+    ngx_conf_merge_msec_value(conf->socket_read_timeout,
+                              prev->socket_read_timeout, 60000);
+    ngx_conf_merge_size_value(conf->socket_buffer_size,
+                              prev->socket_buffer_size,
+                              (size_t) ngx_pagesize);
+    ngx_conf_merge_msec_value(conf->socket_keepalive_timeout,
+                              prev->socket_keepalive_timeout, 60000);
+    ngx_conf_merge_uint_value(conf->socket_pool_size,
+                              prev->socket_pool_size, 30);
+
     return NGX_CONF_OK;
 }
 
@@ -67,10 +67,6 @@ ngx_http_lua_content_by_chunk(lua_State *L, ngx_http_request_t *r)
     /*  save reference of code to ease forcing stopping */
     lua_pushvalue(cc, -1);
     lua_setglobal(cc, GLOBALS_SYMBOL_RUNCODE);
-
-    /*  save nginx request in coroutine globals table */
-    lua_pushlightuserdata(cc, r);
-    lua_setglobal(cc, GLOBALS_SYMBOL_REQUEST);
     /*  }}} */
 
     ctx->cc = cc;
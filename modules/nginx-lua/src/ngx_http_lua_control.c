@@ -108,9 +108,7 @@ ngx_http_lua_ngx_exec(lua_State *L)
                 n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -138,6 +136,8 @@ ngx_http_lua_ngx_exec(lua_State *L)
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
+    NGX_HTTP_LUA_CHECK_TIMER(L, ctx);
+
     if (ngx_http_parse_unsafe_uri(r, &uri, &args, &flags)
         != NGX_OK)
     {
@@ -248,9 +248,7 @@ ngx_http_lua_ngx_redirect(lua_State *L)
         rc = NGX_HTTP_MOVED_TEMPORARILY;
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -261,6 +259,8 @@ ngx_http_lua_ngx_redirect(lua_State *L)
         return luaL_error(L, "no request ctx found");
     }
 
+    NGX_HTTP_LUA_CHECK_TIMER(L, ctx);
+
     if (ctx->headers_sent) {
         return luaL_error(L, "attempt to call ngx.redirect after sending out "
                 "the headers");
@@ -317,9 +317,7 @@ ngx_http_lua_ngx_exit(lua_State *L)
         return luaL_error(L, "expecting one argument");
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -332,6 +330,11 @@ ngx_http_lua_ngx_exit(lua_State *L)
 
     rc = (ngx_int_t) luaL_checkinteger(L, 1);
 
+    if (ctx->timer) {
+        /* there is no response to finish, just quit the callback */
+        rc = NGX_OK;
+    }
+
     if (rc >= NGX_HTTP_SPECIAL_RESPONSE && ctx->headers_sent) {
         return luaL_error(L, "attempt to call ngx.exit after sending "
                 "out the headers");
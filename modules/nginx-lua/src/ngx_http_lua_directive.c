@@ -33,10 +33,16 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_lua_main_conf_t *lmcf = conf;
 
-    ngx_str_t                  *value, name;
+    ngx_str_t                  *value, name, zname;
     ngx_shm_zone_t             *zone;
-    ngx_shm_zone_t            **zp;
-    ngx_http_lua_shdict_ctx_t  *ctx;
+    ngx_shm_zone_t            **zp, **shards;
+    ngx_http_lua_shdict_ctx_t  *ctx, *sctx;
+    ngx_int_t                   nshards, i;
+    ngx_uint_t                  n;
+    ngx_flag_t                  read_mostly;
+    ngx_int_t                   high_water;
+    ngx_msec_t                  sweep, persist_interval;
+    ngx_str_t                   s, persist, persist_tmp;
     ssize_t                     size;
 
     if (lmcf->shm_zones == NULL) {
@@ -68,33 +74,228 @@ ngx_http_lua_shared_dict(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
-    ctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_shdict_ctx_t));
-    if (ctx == NULL) {
-        return NGX_CONF_ERROR;
+    nshards = 1;
+    read_mostly = 0;
+    high_water = 0;
+    sweep = 0;
+    persist_interval = 60000;
+    ngx_str_null(&persist);
+    ngx_str_null(&persist_tmp);
+
+    for (n = 3; n < cf->args->nelts; n++) {
+
+        if (ngx_strcmp(value[n].data, "read_mostly") == 0) {
+            read_mostly = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[n].data, "sweep=", sizeof("sweep=") - 1) == 0) {
+
+            s.data = value[n].data + sizeof("sweep=") - 1;
+            s.len = value[n].len - (sizeof("sweep=") - 1);
+
+            sweep = ngx_parse_time(&s, 0);
+
+            if (sweep == (ngx_msec_t) NGX_ERROR || sweep == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict sweep interval "
+                                   "\"%V\"", &value[n]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[n].data, "persist=", sizeof("persist=") - 1)
+            == 0)
+        {
+            persist.data = value[n].data + sizeof("persist=") - 1;
+            persist.len = value[n].len - (sizeof("persist=") - 1);
+
+            if (persist.len == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid parameter \"%V\"", &value[n]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_conf_full_name(cf->cycle, &persist, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            persist_tmp.len = persist.len + sizeof(".tmp") - 1;
+            persist_tmp.data = ngx_pnalloc(cf->pool, persist_tmp.len + 1);
+            if (persist_tmp.data == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_sprintf(persist_tmp.data, "%V.tmp%Z", &persist);
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[n].data, "persist_interval=",
+                        sizeof("persist_interval=") - 1) == 0)
+        {
+            s.data = value[n].data + sizeof("persist_interval=") - 1;
+            s.len = value[n].len - (sizeof("persist_interval=") - 1);
+
+            persist_interval = ngx_parse_time(&s, 0);
+
+            if (persist_interval == (ngx_msec_t) NGX_ERROR
+                || persist_interval == 0)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict persist "
+                                   "interval \"%V\"", &value[n]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[n].data, "high_water=",
+                        sizeof("high_water=") - 1) == 0)
+        {
+            s.data = value[n].data + sizeof("high_water=") - 1;
+            s.len = value[n].len - (sizeof("high_water=") - 1);
+
+            if (s.len && s.data[s.len - 1] == '%') {
+                s.len--;
+            }
+
+            high_water = ngx_atoi(s.data, s.len);
+
+            if (high_water == NGX_ERROR || high_water == 0
+                || high_water > 100)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid lua shared dict high water mark "
+                                   "\"%V\", must be between 1%% and 100%%",
+                                   &value[n]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (value[n].len <= sizeof("shards=") - 1
+            || ngx_strncmp(value[n].data, "shards=", sizeof("shards=") - 1)
+               != 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[n]);
+            return NGX_CONF_ERROR;
+        }
+
+        nshards = ngx_atoi(value[n].data + sizeof("shards=") - 1,
+                           value[n].len - (sizeof("shards=") - 1));
+
+        if (nshards == NGX_ERROR || nshards == 0
+            || nshards > NGX_HTTP_LUA_SHDICT_MAX_SHARDS)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid number of lua shared dict shards "
+                               "\"%V\", must be between 1 and %d",
+                               &value[n], NGX_HTTP_LUA_SHDICT_MAX_SHARDS);
+            return NGX_CONF_ERROR;
+        }
     }
 
-    ctx->name = name;
+    if (nshards > 1) {
 
-    zone = ngx_shared_memory_add(cf, &name, (size_t) size,
-                                     &ngx_http_lua_module);
-    if (zone == NULL) {
-        return NGX_CONF_ERROR;
+        /* every shard gets its own slab pool of size / nshards */
+
+        if (size / nshards <= 8191) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "lua shared dict size \"%V\" is too small "
+                               "for %i shards", &value[2], nshards);
+            return NGX_CONF_ERROR;
+        }
+
+        size /= nshards;
     }
 
-    if (zone->data) {
-        ctx = zone->data;
+    shards = NULL;
 
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                   "lua_shared_dict \"%V\" is already defined as \"%V\"",
-                   &name, &ctx->name);
-        return NGX_CONF_ERROR;
+    if (nshards > 1) {
+        shards = ngx_palloc(cf->pool, nshards * sizeof(ngx_shm_zone_t *));
+        if (shards == NULL) {
+            return NGX_CONF_ERROR;
+        }
     }
 
-    zone->init = ngx_http_lua_shdict_init_zone;
-    zone->data = ctx;
+    /*
+     * shard 0 is the zone named <name>, the one ngx.shared.<name> refers
+     * to, the others are independent zones named <name>#1, <name>#2, ...
+     * each one with its own rbtree, LRU queue and lock.
+     */
+
+    for (i = 0; i < nshards; i++) {
+
+        if (i == 0) {
+            zname = name;
+
+        } else {
+            zname.data = ngx_pnalloc(cf->pool, name.len + 1 + NGX_INT_T_LEN);
+            if (zname.data == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            zname.len = ngx_sprintf(zname.data, "%V#%i", &name, i)
+                        - zname.data;
+        }
+
+        sctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_lua_shdict_ctx_t));
+        if (sctx == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        sctx->name = name;
+        sctx->read_mostly = read_mostly;
+        sctx->sweep = sweep;
+        sctx->high_water = high_water;
+        sctx->nshards = nshards;
+        sctx->shard = i;
+        sctx->persist = persist;
+        sctx->persist_tmp = persist_tmp;
+        sctx->persist_interval = persist_interval;
+
+        zone = ngx_shared_memory_add(cf, &zname, (size_t) size,
+                                         &ngx_http_lua_module);
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (zone->data) {
+            ctx = zone->data;
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "lua_shared_dict \"%V\" is already defined as \"%V\"",
+                       &zname, &ctx->name);
+            return NGX_CONF_ERROR;
+        }
+
+        zone->init = ngx_http_lua_shdict_init_zone;
+        zone->data = sctx;
+
+        if (shards) {
+            shards[i] = zone;
+        }
+
+        if (i == 0) {
+            ctx = sctx;
+
+            zp = ngx_array_push(lmcf->shm_zones);
+            if (zp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            *zp = zone;
+        }
+    }
 
-    zp = ngx_array_push(lmcf->shm_zones);
-    *zp = zone;
+    ctx->nshards = nshards;
+    ctx->shards = shards;
 
     return NGX_CONF_OK;
 }
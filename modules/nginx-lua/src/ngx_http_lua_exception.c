@@ -16,8 +16,8 @@ jmp_buf ngx_http_lua_exception;
  * 
  * @param L Lua state pointer
  * @retval Long jump to the nearest jmp-mark, never returns.
- * @note nginx request pointer should be stored in Lua thread's globals table
- * in order to make logging working.
+ * @note the current request has to be set with ngx_http_lua_set_req() in
+ * order to make logging working.
  * */
 int
 ngx_http_lua_atpanic(lua_State *L)
@@ -25,9 +25,7 @@ ngx_http_lua_atpanic(lua_State *L)
     const char              *s;
     ngx_http_request_t      *r;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     /*  log Lua VM crashing reason to error log */
     if (r && r->connection && r->connection->log) {
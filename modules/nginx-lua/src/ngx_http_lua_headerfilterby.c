@@ -43,10 +43,6 @@ ngx_http_lua_header_filter_by_lua_env(lua_State *L, ngx_http_request_t *r)
 
     lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
 
-    /*  set nginx request pointer to current lua thread's globals table */
-    lua_pushlightuserdata(L, r);
-    lua_setglobal(L, GLOBALS_SYMBOL_REQUEST);
-
     /**
      * we want to create empty environment for current script
      *
@@ -103,6 +99,7 @@ ngx_http_lua_header_filter_by_chunk(lua_State *L, ngx_http_request_t *r)
 {
     ngx_int_t        rc;
     u_char          *err_msg;
+    ngx_http_request_t  *old_req;
 #if (NGX_PCRE)
     ngx_pool_t      *old_pool;
 #endif
@@ -118,9 +115,13 @@ ngx_http_lua_header_filter_by_chunk(lua_State *L, ngx_http_request_t *r)
     old_pool = ngx_http_lua_pcre_malloc_init(r->pool);
 #endif
 
+    old_req = ngx_http_lua_set_req(r);
+
     /*  protected call user code */
     rc = lua_pcall(L, 0, 1, 0);
 
+    ngx_http_lua_set_req(old_req);
+
 #if (NGX_PCRE)
     /* XXX: work-around to nginx regex subsystem */
     ngx_http_lua_pcre_malloc_done(old_pool);
@@ -41,9 +41,7 @@ ngx_http_lua_ngx_req_get_headers(lua_State *L) {
         max = NGX_HTTP_LUA_MAX_HEADERS;
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -99,9 +97,7 @@ ngx_http_lua_ngx_header_get(lua_State *L)
     ngx_uint_t                   i;
     size_t                       len;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -147,9 +143,7 @@ ngx_http_lua_ngx_header_set(lua_State *L)
     ngx_int_t                    rc;
     ngx_uint_t                   n;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -297,9 +291,7 @@ ngx_http_lua_ngx_req_header_set_helper(lua_State *L)
     ngx_int_t                    rc;
     ngx_uint_t                   n;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
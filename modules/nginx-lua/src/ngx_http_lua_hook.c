@@ -70,9 +70,7 @@ ngx_http_lua_atpanic(lua_State *L)
     const char *s = luaL_checkstring(L, 1);
     ngx_http_request_t *r;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     /*  log Lua VM crashing reason to error log */
     if (r && r->connection && r->connection->log) {
@@ -157,9 +155,7 @@ ngx_http_lua_ngx_log(lua_State *L)
 {
     ngx_http_request_t *r;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r && r->connection && r->connection->log) {
         int level = luaL_checkint(L, 1);
@@ -188,9 +184,7 @@ ngx_http_lua_print(lua_State *L)
 {
     ngx_http_request_t *r;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r && r->connection && r->connection->log) {
         log_wrapper(r, "lua print: ", NGX_LOG_NOTICE, L);
@@ -213,9 +207,7 @@ ngx_http_lua_ngx_send_headers(lua_State *L)
     ngx_http_request_t *r;
     ngx_http_lua_ctx_t *ctx;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r) {
         ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
@@ -260,9 +252,7 @@ ngx_http_lua_ngx_echo(lua_State *L, ngx_flag_t newline)
     int                          i;
     int                          nargs;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -339,9 +329,7 @@ ngx_http_lua_ngx_exit(lua_State *L)
         return luaL_error(L, "expecting one argument");
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -379,9 +367,7 @@ ngx_http_lua_ngx_flush(lua_State *L)
     ngx_chain_t                 *cl;
     ngx_int_t                    rc;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -431,9 +417,7 @@ ngx_http_lua_ngx_eof(lua_State *L)
     ngx_http_lua_ctx_t      *ctx;
     ngx_int_t                rc;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -527,9 +511,7 @@ ngx_http_lua_ngx_location_capture_multi(lua_State *L)
         return luaL_error(L, "at least one subrequest should be specified");
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1057,9 +1039,7 @@ ngx_http_lua_ngx_escape_uri(lua_State *L)
     uintptr_t                escape;
     u_char                  *src, *dst;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1106,9 +1086,7 @@ ngx_http_lua_ngx_unescape_uri(lua_State *L)
     u_char                  *p;
     u_char                  *src, *dst;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1283,9 +1261,7 @@ ngx_http_lua_ngx_quote_sql_str(lua_State *L)
     u_char                  *p;
     u_char                  *src, *dst;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1429,9 +1405,7 @@ ngx_http_lua_ngx_md5(lua_State *L)
     u_char                   md5_buf[MD5_DIGEST_LENGTH];
     u_char                   hex_buf[2 * sizeof(md5_buf)];
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1471,9 +1445,7 @@ ngx_http_lua_ngx_md5_bin(lua_State *L)
     ngx_md5_t                md5;
     u_char                   md5_buf[MD5_DIGEST_LENGTH];
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1509,9 +1481,7 @@ ngx_http_lua_ngx_decode_base64(lua_State *L)
     ngx_http_request_t      *r;
     ngx_str_t                p, src;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1557,9 +1527,7 @@ ngx_http_lua_ngx_encode_base64(lua_State *L)
     ngx_http_request_t      *r;
     ngx_str_t                p, src;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1601,9 +1569,7 @@ ngx_http_lua_ngx_today(lua_State *L)
     ngx_tm_t                 tm;
     u_char                   buf[sizeof("2010-11-19") - 1];
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1633,9 +1599,7 @@ ngx_http_lua_ngx_localtime(lua_State *L)
 
     u_char buf[sizeof("2010-11-19 20:56:31") - 1];
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1662,9 +1626,7 @@ ngx_http_lua_ngx_time(lua_State *L)
 {
     ngx_http_request_t      *r;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1688,9 +1650,7 @@ ngx_http_lua_ngx_utctime(lua_State *L)
 
     u_char buf[sizeof("2010-11-19 20:56:31") - 1];
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -1872,9 +1832,7 @@ ngx_http_lua_ngx_get(lua_State *L) {
     if (len == sizeof("status") - 1 &&
             ngx_strncmp(p, "status", sizeof("status") - 1) == 0)
     {
-        lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-        r = lua_touserdata(L, -1);
-        lua_pop(L, 1);
+        r = ngx_http_lua_get_req(L);
 
         if (r == NULL) {
             return luaL_error(L, "no request object found");
@@ -1887,9 +1845,7 @@ ngx_http_lua_ngx_get(lua_State *L) {
     if (len == sizeof("is_subrequest") - 1 &&
             ngx_strncmp(p, "is_subrequest", sizeof("is_subrequest") - 1) == 0)
     {
-        lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-        r = lua_touserdata(L, -1);
-        lua_pop(L, 1);
+        r = ngx_http_lua_get_req(L);
 
         if (r == NULL) {
             return luaL_error(L, "no request object found");
@@ -1919,9 +1875,7 @@ ngx_http_lua_ngx_set(lua_State *L) {
     if (len == sizeof("status") - 1 &&
             ngx_strncmp(p, "status", sizeof("status") - 1) == 0)
     {
-        lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-        r = lua_touserdata(L, -1);
-        lua_pop(L, 1);
+        r = ngx_http_lua_get_req(L);
 
         if (r == NULL) {
             return luaL_error(L, "no request object found");
@@ -1954,9 +1908,7 @@ ngx_http_lua_ngx_req_get_headers(lua_State *L) {
                 lua_gettop(L));
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -2064,9 +2016,7 @@ ngx_http_lua_ngx_header_set(lua_State *L)
     ngx_int_t                    rc;
     ngx_uint_t                   n;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -2209,9 +2159,7 @@ ngx_http_lua_ngx_req_header_set_helper(lua_State *L)
     ngx_int_t                    rc;
     ngx_uint_t                   n;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -2321,9 +2269,7 @@ ngx_http_lua_ngx_exec(lua_State *L)
                 n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -2504,9 +2450,7 @@ ngx_http_lua_run_set_var_directive(lua_State *L)
     arg.data = (u_char *) luaL_checklstring(L, 1, &len);
     arg.len = len;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -2719,9 +2663,7 @@ ngx_http_lua_ngx_redirect(lua_State *L)
         rc = NGX_HTTP_MOVED_TEMPORARILY;
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
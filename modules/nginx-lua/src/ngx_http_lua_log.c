@@ -27,9 +27,7 @@ ngx_http_lua_ngx_log(lua_State *L)
 {
     ngx_http_request_t          *r;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r && r->connection && r->connection->log) {
         int level = luaL_checkint(L, 1);
@@ -58,9 +56,7 @@ ngx_http_lua_print(lua_State *L)
 {
     ngx_http_request_t          *r;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r && r->connection && r->connection->log) {
         return log_wrapper(r, "lua print: ", NGX_LOG_NOTICE, L);
@@ -0,0 +1,413 @@
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_lrucache.h"
+
+
+/*
+ * A cache is a full userdata holding the LRU queue of its nodes, node i
+ * (starting from 1) being the one at nodes[i - 1]. Keys and values stay
+ * in Lua, in the environment table of the userdata:
+ *
+ *   env[1] = { [key] = i }     lookup
+ *   env[2] = { [i] = key }     to drop the lookup entry on eviction
+ *   env[3] = { [i] = value }
+ */
+
+
+#define NGX_HTTP_LUA_LRUCACHE_MT      "ngx_lua_lrucache_mt"
+
+#define NGX_HTTP_LUA_LRUCACHE_INDEX   1
+#define NGX_HTTP_LUA_LRUCACHE_KEYS    2
+#define NGX_HTTP_LUA_LRUCACHE_VALUES  3
+
+#define NGX_HTTP_LUA_LRUCACHE_MAX_SIZE  (1 << 24)
+
+
+static int ngx_http_lua_lrucache_new(lua_State *L);
+static int ngx_http_lua_lrucache_get(lua_State *L);
+static int ngx_http_lua_lrucache_set(lua_State *L);
+static int ngx_http_lua_lrucache_delete(lua_State *L);
+static int ngx_http_lua_lrucache_flush_all(lua_State *L);
+static int ngx_http_lua_lrucache_count(lua_State *L);
+static void ngx_http_lua_lrucache_init(lua_State *L,
+    ngx_http_lua_lrucache_t *c);
+static ngx_http_lua_lrucache_node_t *ngx_http_lua_lrucache_lookup(
+    lua_State *L, ngx_http_lua_lrucache_t *c);
+static void ngx_http_lua_lrucache_remove(lua_State *L,
+    ngx_http_lua_lrucache_t *c, ngx_http_lua_lrucache_node_t *node);
+
+
+void
+ngx_http_lua_inject_lrucache_api(lua_State *L)
+{
+    luaL_newmetatable(L, NGX_HTTP_LUA_LRUCACHE_MT); /* mt */
+
+    lua_createtable(L, 0, 5 /* nrec */); /* mt methods */
+
+    lua_pushcfunction(L, ngx_http_lua_lrucache_get);
+    lua_setfield(L, -2, "get");
+
+    lua_pushcfunction(L, ngx_http_lua_lrucache_set);
+    lua_setfield(L, -2, "set");
+
+    lua_pushcfunction(L, ngx_http_lua_lrucache_delete);
+    lua_setfield(L, -2, "delete");
+
+    lua_pushcfunction(L, ngx_http_lua_lrucache_flush_all);
+    lua_setfield(L, -2, "flush_all");
+
+    lua_pushcfunction(L, ngx_http_lua_lrucache_count);
+    lua_setfield(L, -2, "count");
+
+    lua_setfield(L, -2, "__index"); /* mt */
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 1 /* nrec */);    /* ngx.lrucache */
+
+    lua_pushcfunction(L, ngx_http_lua_lrucache_new);
+    lua_setfield(L, -2, "new");
+
+    lua_setfield(L, -2, "lrucache");
+}
+
+
+static int
+ngx_http_lua_lrucache_new(lua_State *L)
+{
+    lua_Number                n;
+    ngx_uint_t                size;
+    ngx_http_lua_lrucache_t  *c;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting exactly one argument, but seen %d",
+                          lua_gettop(L));
+    }
+
+    n = luaL_checknumber(L, 1);
+
+    if (n < 1 || n > NGX_HTTP_LUA_LRUCACHE_MAX_SIZE) {
+        return luaL_error(L, "bad cache size: %f, must be between 1 and %d",
+                          (double) n, NGX_HTTP_LUA_LRUCACHE_MAX_SIZE);
+    }
+
+    size = (ngx_uint_t) n;
+
+    c = lua_newuserdata(L, offsetof(ngx_http_lua_lrucache_t, nodes)
+                           + size * sizeof(ngx_http_lua_lrucache_node_t));
+                                                            /* size c */
+    c->size = size;
+
+    ngx_http_lua_lrucache_init(L, c);    /* size c env */
+
+    lua_setfenv(L, -2);    /* size c */
+
+    luaL_getmetatable(L, NGX_HTTP_LUA_LRUCACHE_MT);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+
+/* empties the cache and pushes a new environment table for it */
+static void
+ngx_http_lua_lrucache_init(lua_State *L, ngx_http_lua_lrucache_t *c)
+{
+    ngx_uint_t  i;
+
+    c->count = 0;
+
+    ngx_queue_init(&c->used);
+    ngx_queue_init(&c->free);
+
+    for (i = 0; i < c->size; i++) {
+        ngx_queue_insert_tail(&c->free, &c->nodes[i].queue);
+    }
+
+    lua_createtable(L, 3 /* narr */, 0);
+
+    lua_createtable(L, 0, (int) c->size);
+    lua_rawseti(L, -2, NGX_HTTP_LUA_LRUCACHE_INDEX);
+
+    lua_createtable(L, (int) c->size, 0);
+    lua_rawseti(L, -2, NGX_HTTP_LUA_LRUCACHE_KEYS);
+
+    lua_createtable(L, (int) c->size, 0);
+    lua_rawseti(L, -2, NGX_HTTP_LUA_LRUCACHE_VALUES);
+}
+
+
+/*
+ * looks up the key at index 2, with the environment table of the cache
+ * on the top of the stack; expired items are removed and not returned
+ */
+static ngx_http_lua_lrucache_node_t *
+ngx_http_lua_lrucache_lookup(lua_State *L, ngx_http_lua_lrucache_t *c)
+{
+    ngx_int_t                      i;
+    ngx_time_t                    *tp;
+    ngx_msec_t                     now;
+    ngx_http_lua_lrucache_node_t  *node;
+
+    lua_rawgeti(L, -1, NGX_HTTP_LUA_LRUCACHE_INDEX); /* env index */
+    lua_pushvalue(L, 2); /* env index key */
+    lua_rawget(L, -2); /* env index i */
+
+    i = (ngx_int_t) lua_tointeger(L, -1);
+
+    lua_pop(L, 2); /* env */
+
+    if (i == 0) {
+        return NULL;
+    }
+
+    node = &c->nodes[i - 1];
+
+    if (node->expires != 0) {
+        tp = ngx_timeofday();
+
+        now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+        if ((ngx_msec_int_t) (node->expires - now) < 0) {
+            dd("lrucache item %d expired", (int) i);
+            ngx_http_lua_lrucache_remove(L, c, node);
+            return NULL;
+        }
+    }
+
+    return node;
+}
+
+
+/* with the environment table of the cache on the top of the stack */
+static void
+ngx_http_lua_lrucache_remove(lua_State *L, ngx_http_lua_lrucache_t *c,
+    ngx_http_lua_lrucache_node_t *node)
+{
+    int  i;
+
+    i = (int) (node - c->nodes) + 1;
+
+    lua_rawgeti(L, -1, NGX_HTTP_LUA_LRUCACHE_INDEX); /* env index */
+    lua_rawgeti(L, -2, NGX_HTTP_LUA_LRUCACHE_KEYS); /* env index keys */
+    lua_rawgeti(L, -1, i); /* env index keys key */
+    lua_pushnil(L);
+    lua_rawset(L, -4); /* env index keys */
+    lua_pushnil(L);
+    lua_rawseti(L, -2, i); /* env index keys */
+    lua_pop(L, 2); /* env */
+
+    lua_rawgeti(L, -1, NGX_HTTP_LUA_LRUCACHE_VALUES); /* env values */
+    lua_pushnil(L);
+    lua_rawseti(L, -2, i);
+    lua_pop(L, 1); /* env */
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&c->free, &node->queue);
+
+    c->count--;
+}
+
+
+static int
+ngx_http_lua_lrucache_get(lua_State *L)
+{
+    ngx_http_lua_lrucache_t       *c;
+    ngx_http_lua_lrucache_node_t  *node;
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting exactly two arguments, "
+                          "but only seen %d", lua_gettop(L));
+    }
+
+    c = luaL_checkudata(L, 1, NGX_HTTP_LUA_LRUCACHE_MT);
+
+    if (lua_isnil(L, 2)) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    lua_getfenv(L, 1); /* c key env */
+
+    node = ngx_http_lua_lrucache_lookup(L, c);
+    if (node == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&c->used, &node->queue);
+
+    lua_rawgeti(L, -1, NGX_HTTP_LUA_LRUCACHE_VALUES); /* c key env values */
+    lua_rawgeti(L, -1, (int) (node - c->nodes) + 1);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_lrucache_set(lua_State *L)
+{
+    int                            n, i;
+    lua_Number                     ttl;
+    ngx_time_t                    *tp;
+    ngx_queue_t                   *q;
+    ngx_http_lua_lrucache_t       *c;
+    ngx_http_lua_lrucache_node_t  *node;
+
+    n = lua_gettop(L);
+
+    if (n != 3 && n != 4) {
+        return luaL_error(L, "expecting 3 or 4 arguments, "
+                          "but only seen %d", n);
+    }
+
+    c = luaL_checkudata(L, 1, NGX_HTTP_LUA_LRUCACHE_MT);
+
+    if (lua_isnil(L, 2)) {
+        return luaL_error(L, "attempt to use nil keys");
+    }
+
+    ttl = 0;
+
+    if (n == 4) {
+        ttl = luaL_checknumber(L, 4);
+    }
+
+    lua_settop(L, 3); /* c key value */
+
+    lua_getfenv(L, 1); /* c key value env */
+
+    node = ngx_http_lua_lrucache_lookup(L, c);
+
+    if (lua_isnil(L, 3)) {
+        if (node) {
+            ngx_http_lua_lrucache_remove(L, c, node);
+        }
+
+        return 0;
+    }
+
+    if (node == NULL) {
+
+        if (ngx_queue_empty(&c->free)) {
+            /* evict the least recently used item */
+            q = ngx_queue_last(&c->used);
+            ngx_http_lua_lrucache_remove(L, c,
+                ngx_queue_data(q, ngx_http_lua_lrucache_node_t, queue));
+        }
+
+        /* the lookup entry first, as a NaN key or no memory throws */
+
+        q = ngx_queue_head(&c->free);
+
+        node = ngx_queue_data(q, ngx_http_lua_lrucache_node_t, queue);
+
+        i = (int) (node - c->nodes) + 1;
+
+        lua_rawgeti(L, -1, NGX_HTTP_LUA_LRUCACHE_INDEX); /* ... env index */
+        lua_pushvalue(L, 2);
+        lua_pushinteger(L, i);
+        lua_rawset(L, -3);
+        lua_pop(L, 1); /* ... env */
+
+        lua_rawgeti(L, -1, NGX_HTTP_LUA_LRUCACHE_KEYS); /* ... env keys */
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, i);
+        lua_pop(L, 1); /* ... env */
+
+        ngx_queue_remove(q);
+
+        c->count++;
+
+    } else {
+        ngx_queue_remove(&node->queue);
+        i = (int) (node - c->nodes) + 1;
+    }
+
+    ngx_queue_insert_head(&c->used, &node->queue);
+
+    lua_rawgeti(L, -1, NGX_HTTP_LUA_LRUCACHE_VALUES); /* ... env values */
+    lua_pushvalue(L, 3);
+    lua_rawseti(L, -2, i);
+
+    if (ttl > 0) {
+        tp = ngx_timeofday();
+        node->expires = (ngx_msec_t) (tp->sec * 1000 + tp->msec)
+                        + (ngx_msec_t) (ttl * 1000);
+
+    } else {
+        node->expires = 0;
+    }
+
+    return 0;
+}
+
+
+static int
+ngx_http_lua_lrucache_delete(lua_State *L)
+{
+    ngx_http_lua_lrucache_t       *c;
+    ngx_http_lua_lrucache_node_t  *node;
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting exactly two arguments, "
+                          "but only seen %d", lua_gettop(L));
+    }
+
+    c = luaL_checkudata(L, 1, NGX_HTTP_LUA_LRUCACHE_MT);
+
+    if (lua_isnil(L, 2)) {
+        return 0;
+    }
+
+    lua_getfenv(L, 1); /* c key env */
+
+    node = ngx_http_lua_lrucache_lookup(L, c);
+    if (node) {
+        ngx_http_lua_lrucache_remove(L, c, node);
+    }
+
+    return 0;
+}
+
+
+static int
+ngx_http_lua_lrucache_flush_all(lua_State *L)
+{
+    ngx_http_lua_lrucache_t  *c;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting exactly one argument, "
+                          "but seen %d", lua_gettop(L));
+    }
+
+    c = luaL_checkudata(L, 1, NGX_HTTP_LUA_LRUCACHE_MT);
+
+    ngx_http_lua_lrucache_init(L, c); /* c env */
+
+    lua_setfenv(L, 1);
+
+    return 0;
+}
+
+
+static int
+ngx_http_lua_lrucache_count(lua_State *L)
+{
+    ngx_http_lua_lrucache_t  *c;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting exactly one argument, "
+                          "but seen %d", lua_gettop(L));
+    }
+
+    c = luaL_checkudata(L, 1, NGX_HTTP_LUA_LRUCACHE_MT);
+
+    lua_pushinteger(L, (lua_Integer) c->count);
+
+    return 1;
+}
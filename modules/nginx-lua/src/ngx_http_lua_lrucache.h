@@ -0,0 +1,26 @@
+#ifndef NGX_HTTP_LUA_LRUCACHE_H
+#define NGX_HTTP_LUA_LRUCACHE_H
+
+
+#include "ngx_http_lua_common.h"
+
+
+typedef struct {
+    ngx_queue_t                   queue;
+    ngx_msec_t                    expires;  /* 0: never expires */
+} ngx_http_lua_lrucache_node_t;
+
+
+typedef struct {
+    ngx_uint_t                    size;     /* max number of items */
+    ngx_uint_t                    count;
+    ngx_queue_t                   used;     /* most recently used first */
+    ngx_queue_t                   free;
+    ngx_http_lua_lrucache_node_t  nodes[1];
+} ngx_http_lua_lrucache_t;
+
+
+void ngx_http_lua_inject_lrucache_api(lua_State *L);
+
+
+#endif /* NGX_HTTP_LUA_LRUCACHE_H */
@@ -7,6 +7,7 @@
 #include "ngx_http_lua_rewriteby.h"
 #include "ngx_http_lua_accessby.h"
 #include "ngx_http_lua_headerfilterby.h"
+#include "ngx_http_lua_shdict.h"
 
 
 #if !defined(nginx_version) || nginx_version < 8054
@@ -16,12 +17,14 @@
 
 static ngx_int_t ngx_http_lua_init(ngx_conf_t *cf);
 static ngx_int_t ngx_http_lua_pre_config(ngx_conf_t *cf);
+static ngx_int_t ngx_http_lua_init_process(ngx_cycle_t *cycle);
+static void ngx_http_lua_exit_master(ngx_cycle_t *cycle);
 
 
 static ngx_command_t ngx_http_lua_cmds[] = {
 
     { ngx_string("lua_shared_dict"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_lua_shared_dict,
       0,
       0,
@@ -36,6 +39,33 @@ static ngx_command_t ngx_http_lua_cmds[] = {
         NULL
     },
 
+    {
+        ngx_string("lua_coroutine_pool_size"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_lua_main_conf_t, coroutine_pool_size),
+        NULL
+    },
+
+    {
+        ngx_string("lua_max_pending_timers"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_lua_main_conf_t, max_pending_timers),
+        NULL
+    },
+
+    {
+        ngx_string("lua_max_running_timers"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        offsetof(ngx_http_lua_main_conf_t, max_running_timers),
+        NULL
+    },
+
     {
         ngx_string("lua_package_cpath"),
         NGX_HTTP_MAIN_CONF | NGX_CONF_TAKE1,
@@ -74,6 +104,66 @@ static ngx_command_t ngx_http_lua_cmds[] = {
         NULL
     },
 
+    {
+        ngx_string("lua_socket_connect_timeout"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+            NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_lua_loc_conf_t, socket_connect_timeout),
+        NULL
+    },
+
+    {
+        ngx_string("lua_socket_send_timeout"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+            NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_lua_loc_conf_t, socket_send_timeout),
+        NULL
+    },
+
+    {
+        ngx_string("lua_socket_read_timeout"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+            NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_lua_loc_conf_t, socket_read_timeout),
+        NULL
+    },
+
+    {
+        ngx_string("lua_socket_buffer_size"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+            NGX_CONF_TAKE1,
+        ngx_conf_set_size_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_lua_loc_conf_t, socket_buffer_size),
+        NULL
+    },
+
+    {
+        ngx_string("lua_socket_keepalive_timeout"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+            NGX_CONF_TAKE1,
+        ngx_conf_set_msec_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_lua_loc_conf_t, socket_keepalive_timeout),
+        NULL
+    },
+
+    {
+        ngx_string("lua_socket_pool_size"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF |
+            NGX_CONF_TAKE1,
+        ngx_conf_set_num_slot,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        offsetof(ngx_http_lua_loc_conf_t, socket_pool_size),
+        NULL
+    },
+
 #if defined(NDK) && NDK
     /* set_by_lua $res <inline script> [$arg1 [$arg2 [...]]] */
     {
@@ -206,11 +296,11 @@ ngx_module_t ngx_http_lua_module = {
     NGX_HTTP_MODULE,            /*  module type */
     NULL,                       /*  init master */
     NULL,                       /*  init module */
-    NULL,                       /*  init process */
+    ngx_http_lua_init_process,  /*  init process */
     NULL,                       /*  init thread */
     NULL,                       /*  exit thread */
     NULL,                       /*  exit process */
-    NULL,                       /*  exit master */
+    ngx_http_lua_exit_master,   /*  exit master */
     NGX_MODULE_V1_PADDING
 };
 
@@ -258,6 +348,28 @@ ngx_http_lua_init(ngx_conf_t *cf)
 }
 
 
+static ngx_int_t
+ngx_http_lua_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_lua_main_conf_t   *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
+
+    return ngx_http_lua_shdict_init_process(cycle, lmcf);
+}
+
+
+static void
+ngx_http_lua_exit_master(ngx_cycle_t *cycle)
+{
+    ngx_http_lua_main_conf_t   *lmcf;
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_lua_module);
+
+    ngx_http_lua_shdict_exit_master(cycle, lmcf);
+}
+
+
 static ngx_int_t
 ngx_http_lua_pre_config(ngx_conf_t *cf)
 {
@@ -84,9 +84,7 @@ ngx_http_lua_run_set_var_directive(lua_State *L)
     arg.data = (u_char *) luaL_checklstring(L, 1, &len);
     arg.len = len;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -51,9 +51,7 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
     int                          type;
     const char                  *msg;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -65,6 +63,8 @@ ngx_http_lua_ngx_echo(lua_State *L, unsigned newline)
         return luaL_error(L, "no request ctx found");
     }
 
+    NGX_HTTP_LUA_CHECK_TIMER(L, ctx);
+
     if ((r->method & NGX_HTTP_HEAD) || r->header_only) {
         return 0;
     }
@@ -367,9 +367,7 @@ ngx_http_lua_ngx_flush(lua_State *L)
                 "or 1", n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (n == 1 && r == r->main) {
         luaL_checktype(L, 1, LUA_TBOOLEAN);
@@ -381,6 +379,8 @@ ngx_http_lua_ngx_flush(lua_State *L)
         return luaL_error(L, "no request ctx found");
     }
 
+    NGX_HTTP_LUA_CHECK_TIMER(L, ctx);
+
     if ((r->method & NGX_HTTP_HEAD) || r->header_only) {
         return 0;
     }
@@ -460,9 +460,7 @@ ngx_http_lua_ngx_eof(lua_State *L)
     ngx_http_lua_ctx_t      *ctx;
     ngx_int_t                rc;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -474,6 +472,8 @@ ngx_http_lua_ngx_eof(lua_State *L)
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
+    NGX_HTTP_LUA_CHECK_TIMER(L, ctx);
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "lua send eof");
 
@@ -516,13 +516,13 @@ ngx_http_lua_ngx_send_headers(lua_State *L)
     ngx_http_request_t      *r;
     ngx_http_lua_ctx_t      *ctx;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r) {
         ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
 
+        NGX_HTTP_LUA_CHECK_TIMER(L, ctx);
+
         if (ctx && ctx->headers_sent == 0) {
             ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "lua send headers");
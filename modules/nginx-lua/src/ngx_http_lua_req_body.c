@@ -55,9 +55,7 @@ ngx_http_lua_ngx_req_read_body(lua_State *L)
         return luaL_error(L, "expecting 0 arguments but seen %d", n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     r->request_body_in_single_buf = 1;
     r->request_body_in_persistent_file = 1;
@@ -74,6 +72,8 @@ ngx_http_lua_ngx_req_read_body(lua_State *L)
         return luaL_error(L, "request context is null");
     }
 
+    NGX_HTTP_LUA_CHECK_TIMER(L, ctx);
+
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
             "lua start to read buffered request body");
 
@@ -145,9 +145,7 @@ ngx_http_lua_ngx_req_discard_body(lua_State *L)
         return luaL_error(L, "expecting 0 arguments but seen %d", n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     rc = ngx_http_discard_request_body(r);
 
@@ -172,9 +170,7 @@ ngx_http_lua_ngx_req_get_body_data(lua_State *L)
         return luaL_error(L, "expecting 0 arguments but seen %d", n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r->request_body == NULL
         || r->request_body->temp_file
@@ -208,9 +204,7 @@ ngx_http_lua_ngx_req_get_body_file(lua_State *L)
         return luaL_error(L, "expecting 0 arguments but seen %d", n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r->request_body == NULL || r->request_body->temp_file == NULL) {
         lua_pushnil(L);
@@ -256,9 +250,7 @@ ngx_http_lua_ngx_req_set_body_data(lua_State *L)
 
     body.data = (u_char *) luaL_checklstring(L, 1, &body.len);
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r->request_body == NULL) {
 
@@ -469,9 +461,7 @@ ngx_http_lua_ngx_req_set_body_file(lua_State *L)
 
     dd("clean: %d", (int) clean);
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r->request_body == NULL) {
 
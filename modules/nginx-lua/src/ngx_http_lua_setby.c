@@ -36,6 +36,7 @@ ngx_http_lua_set_by_chunk(lua_State *L, ngx_http_request_t *r, ngx_str_t *val,
     u_char          *err_msg;
     size_t           rlen;
     u_char          *rdata;
+    ngx_http_request_t  *old_req;
 #if (NGX_PCRE)
     ngx_pool_t      *old_pool;
 #endif
@@ -56,9 +57,13 @@ ngx_http_lua_set_by_chunk(lua_State *L, ngx_http_request_t *r, ngx_str_t *val,
     old_pool = ngx_http_lua_pcre_malloc_init(r->pool);
 #endif
 
+    old_req = ngx_http_lua_set_req(r);
+
     /*  protected call user code */
     rc = lua_pcall(L, nargs, 1, 0);
 
+    ngx_http_lua_set_req(old_req);
+
 #if (NGX_PCRE)
     /* XXX: work-around to nginx regex subsystem */
     ngx_http_lua_pcre_malloc_done(old_pool);
@@ -172,10 +177,6 @@ ngx_http_lua_set_by_lua_env(lua_State *L, ngx_http_request_t *r, size_t nargs,
 
     lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
 
-    /*  set nginx request pointer to current lua thread's globals table */
-    lua_pushlightuserdata(L, r);
-    lua_setglobal(L, GLOBALS_SYMBOL_REQUEST);
-
     /**
      * we want to create empty environment for current script
      *
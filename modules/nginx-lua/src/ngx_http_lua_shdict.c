@@ -19,230 +19,1266 @@ static int ngx_http_lua_shdict_add(lua_State *L);
 static int ngx_http_lua_shdict_replace(lua_State *L);
 static int ngx_http_lua_shdict_incr(lua_State *L);
 static int ngx_http_lua_shdict_delete(lua_State *L);
+static ngx_inline ngx_shm_zone_t *ngx_http_lua_shdict_shard(
+    ngx_shm_zone_t *zone, uint32_t hash);
+static ngx_int_t ngx_http_lua_shdict_lookup_nolock(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t hash, u_char *kdata,
+    size_t klen, ngx_http_lua_shdict_node_t **sdp);
+static ngx_int_t ngx_http_lua_shdict_get_nolock(lua_State *L,
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t hash, ngx_str_t *key);
+static ngx_inline void ngx_http_lua_shdict_write_begin(
+    ngx_http_lua_shdict_ctx_t *ctx);
+static ngx_inline void ngx_http_lua_shdict_write_end(
+    ngx_http_lua_shdict_ctx_t *ctx);
+static ngx_inline void ngx_http_lua_shdict_skip_cursors(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_queue_t *q);
+static ngx_inline void ngx_http_lua_shdict_touch(
+    ngx_http_lua_shdict_ctx_t *ctx, ngx_http_lua_shdict_node_t *sd);
+static int ngx_http_lua_shdict_stats(lua_State *L);
+static ngx_inline size_t ngx_http_lua_shdict_slab_size(size_t size);
+static void ngx_http_lua_shdict_free_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd);
+static ngx_uint_t ngx_http_lua_shdict_evict(ngx_http_lua_shdict_ctx_t *ctx,
+    size_t size, ngx_uint_t max);
+static void ngx_http_lua_shdict_sweep(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_uint_t batch);
+static void ngx_http_lua_shdict_sweep_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_lua_shdict_persist(ngx_shm_zone_t *zone,
+    ngx_log_t *log);
+static void ngx_http_lua_shdict_restore(ngx_shm_zone_t *shm_zone);
+static void ngx_http_lua_shdict_persist_handler(ngx_event_t *ev);
 
 
 #define NGX_HTTP_LUA_SHDICT_ADD         0x0001
 #define NGX_HTTP_LUA_SHDICT_REPLACE     0x0002
 
+/* read_mostly dicts */
+#define NGX_HTTP_LUA_SHDICT_READ_TRIES      4
+#define NGX_HTTP_LUA_SHDICT_MAX_DEPTH       64
+#define NGX_HTTP_LUA_SHDICT_PROMOTE_RATE    16  /* a power of 2 */
+
+/* nodes looked at per sweep, nodes evicted per set above high_water */
+#define NGX_HTTP_LUA_SHDICT_SWEEP_BATCH     256
+#define NGX_HTTP_LUA_SHDICT_EVICT_BATCH     8
+
+
+static ngx_uint_t  ngx_http_lua_shdict_hits;
+
 
 ngx_int_t
 ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_lua_shdict_ctx_t  *octx = data;
 
-    size_t                      len;
-    ngx_http_lua_shdict_ctx_t  *ctx;
+    size_t                      len;
+    ngx_http_lua_shdict_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        goto done;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        goto done;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_lua_shdict_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_lua_shdict_rbtree_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    ctx->sh->seq = 0;
+    ctx->sh->sweep = NULL;
+    ctx->sh->items = 0;
+    ctx->sh->used = 0;
+    ctx->sh->expirations = 0;
+    ctx->sh->evictions = 0;
+    ctx->sh->persist = NULL;
+    ctx->sh->persist_lock = 0;
+    ctx->sh->persisted = ngx_time();
+
+    len = sizeof(" in lua_shared_dict zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in lua_shared_dict zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    if (ctx->persist.len) {
+        ngx_http_lua_shdict_restore(shm_zone);
+    }
+
+done:
+
+    ctx->high_water_size = (size_t) (ctx->shpool->end - ctx->shpool->start)
+                           / 100 * ctx->high_water;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_http_lua_shdict_node_t   *sdn, *sdnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            sdn = (ngx_http_lua_shdict_node_t *) &node->color;
+            sdnt = (ngx_http_lua_shdict_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(sdn->data, sdnt->data, sdn->key_len,
+                sdnt->key_len) < 0) ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+/*
+ * returns the sub-zone holding keys of the given hash for dicts declared
+ * with shards=N, or the zone itself
+ */
+static ngx_inline ngx_shm_zone_t *
+ngx_http_lua_shdict_shard(ngx_shm_zone_t *zone, uint32_t hash)
+{
+    ngx_http_lua_shdict_ctx_t   *ctx;
+
+    ctx = zone->data;
+
+    if (ctx->shards == NULL) {
+        return zone;
+    }
+
+    return ctx->shards[hash % ctx->nshards];
+}
+
+
+/*
+ * writers bump the zone sequence around every change to the rbtree or
+ * to a node, so that read_mostly gets can tell they raced with one;
+ * the LRU queue is never read without the mutex and needs no bump
+ */
+static ngx_inline void
+ngx_http_lua_shdict_write_begin(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    ctx->sh->seq++;
+    ngx_memory_barrier();
+}
+
+
+static ngx_inline void
+ngx_http_lua_shdict_write_end(ngx_http_lua_shdict_ctx_t *ctx)
+{
+    ngx_memory_barrier();
+    ctx->sh->seq++;
+}
+
+
+/*
+ * the sweeper and the snapshot writer walk the LRU queue from the tail
+ * across lock releases: a node leaving its place hands their cursor over
+ * to the next one
+ */
+static ngx_inline void
+ngx_http_lua_shdict_skip_cursors(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_queue_t *q)
+{
+    if (ctx->sh->sweep == q) {
+        ctx->sh->sweep = ngx_queue_prev(q);
+    }
+
+    if (ctx->sh->persist == q) {
+        ctx->sh->persist = ngx_queue_prev(q);
+    }
+}
+
+
+static ngx_inline void
+ngx_http_lua_shdict_touch(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    ngx_http_lua_shdict_skip_cursors(ctx, &sd->queue);
+
+    ngx_queue_remove(&sd->queue);
+    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+}
+
+
+static ngx_int_t
+ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
+    u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
+{
+    ngx_int_t                    rc;
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    ctx = shm_zone->data;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        do {
+            sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+            rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+
+            if (rc == 0) {
+                ngx_http_lua_shdict_touch(ctx, sd);
+
+                *sdp = sd;
+
+                if (sd->expires != 0) {
+                    tp = ngx_timeofday();
+
+                    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+                    ms = (ngx_msec_int_t) (sd->expires - now);
+
+                    if (ms < 0) {
+                        /* already expired */
+                        return NGX_DONE;
+                    }
+                }
+
+                return NGX_OK;
+            }
+
+            node = (rc < 0) ? node->left : node->right;
+
+        } while (node != sentinel && hash == node->key);
+
+        break;
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+}
+
+
+/*
+ * same as ngx_http_lua_shdict_lookup, without the zone mutex and without
+ * touching the LRU queue: writers may be rebalancing the tree or freeing
+ * nodes meanwhile, so the walk is bounded and every node is checked to
+ * lie in the slab pool before being read. The result is only meaningful
+ * if the zone sequence did not change meanwhile.
+ */
+static ngx_int_t
+ngx_http_lua_shdict_lookup_nolock(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash, u_char *kdata, size_t klen,
+    ngx_http_lua_shdict_node_t **sdp)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   depth;
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_lua_shdict_node_t  *sd;
+    u_char                      *start, *end;
+
+    start = ctx->shpool->start;
+    end = ctx->shpool->end;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    for (depth = 0; node != sentinel; depth++) {
+
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
+
+        if (depth == NGX_HTTP_LUA_SHDICT_MAX_DEPTH
+            || (u_char *) node < start
+            || sd->data > end)
+        {
+            return NGX_ERROR;
+        }
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        if ((size_t) (end - sd->data)
+            < (size_t) sd->key_len + sd->value_len)
+        {
+            return NGX_ERROR;
+        }
+
+        rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+
+        if (rc == 0) {
+            *sdp = sd;
+
+            if (sd->expires != 0) {
+                tp = ngx_timeofday();
+
+                now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+                ms = (ngx_msec_int_t) (sd->expires - now);
+
+                if (ms < 0) {
+                    /* already expired */
+                    return NGX_DONE;
+                }
+            }
+
+            return NGX_OK;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    *sdp = NULL;
+
+    return NGX_DECLINED;
+}
+
+
+/*
+ * seqlock read of a read_mostly dict: pushes the value and returns NGX_OK,
+ * returns NGX_DECLINED if the key is missing or expired, or NGX_AGAIN if
+ * writers kept racing with us, or the entry looks bad, and the caller
+ * has to take the mutex. Hits relink the node at the head of the LRU
+ * queue only once every NGX_HTTP_LUA_SHDICT_PROMOTE_RATE times, and only
+ * if the mutex is free.
+ */
+static ngx_int_t
+ngx_http_lua_shdict_get_nolock(lua_State *L, ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_uint_t hash, ngx_str_t *key)
+{
+    ngx_int_t                    rc;
+    ngx_uint_t                   i, seq;
+    ngx_http_lua_shdict_node_t  *sd;
+    u_char                      *data;
+    size_t                       len;
+    lua_Number                   num;
+    ngx_flag_t                   pushed;
+
+    for (i = 0; i < NGX_HTTP_LUA_SHDICT_READ_TRIES; i++) {
+
+        seq = ctx->sh->seq;
+
+        if (seq & 1) {
+            /* a writer is in the middle of an update */
+            ngx_cpu_pause();
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        rc = ngx_http_lua_shdict_lookup_nolock(ctx, hash, key->data, key->len,
+                                               &sd);
+
+        pushed = 0;
+
+        if (rc == NGX_OK) {
+            data = sd->data + sd->key_len;
+            len = (size_t) sd->value_len;
+
+            if (data + len > ctx->shpool->end) {
+                rc = NGX_ERROR;
+
+            } else {
+
+                switch (sd->value_type) {
+                case LUA_TSTRING:
+                    lua_pushlstring(L, (char *) data, len);
+                    pushed = 1;
+                    break;
+
+                case LUA_TNUMBER:
+                    if (len != sizeof(lua_Number)) {
+                        rc = NGX_ERROR;
+                        break;
+                    }
+
+                    ngx_memcpy(&num, data, sizeof(lua_Number));
+                    lua_pushnumber(L, num);
+                    pushed = 1;
+                    break;
+
+                case LUA_TBOOLEAN:
+                    if (len != sizeof(u_char)) {
+                        rc = NGX_ERROR;
+                        break;
+                    }
+
+                    lua_pushboolean(L, *data ? 1 : 0);
+                    pushed = 1;
+                    break;
+
+                default:
+                    rc = NGX_ERROR;
+                }
+            }
+        }
+
+        ngx_memory_barrier();
+
+        if (ctx->sh->seq != seq) {
+            dd("shdict read raced with a writer, retrying");
+
+            if (pushed) {
+                lua_pop(L, 1);
+            }
+
+            continue;
+        }
+
+        if (rc == NGX_ERROR) {
+            /* let the locked path report it */
+            return NGX_AGAIN;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_DECLINED;
+        }
+
+        if ((++ngx_http_lua_shdict_hits
+             & (NGX_HTTP_LUA_SHDICT_PROMOTE_RATE - 1)) == 0
+            && ngx_shmtx_trylock(&ctx->shpool->mutex))
+        {
+            /* the node cannot have been freed if seq did not move */
+
+            if (ctx->sh->seq == seq) {
+                ngx_http_lua_shdict_touch(ctx, sd);
+            }
+
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+        }
+
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static int
+ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
+{
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_queue_t                 *q;
+    ngx_flag_t                   expired;
+    ngx_http_lua_shdict_node_t  *sd;
+    int                          freed = 0;
+
+    tp = ngx_timeofday();
+
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    /*
+     * n == 1 deletes one or two expired entries
+     * n == 0 deletes oldest entry by force
+     *        and one or two zero rate entries
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&ctx->sh->queue)) {
+            return freed;
+        }
+
+        q = ngx_queue_last(&ctx->sh->queue);
+
+        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+        expired = sd->expires != 0
+                  && (ngx_msec_int_t) (sd->expires - now) <= 0;
+
+        if (n++ != 0 && !expired) {
+            return freed;
+        }
+
+        if (expired) {
+            ctx->sh->expirations++;
+
+        } else {
+            ctx->sh->evictions++;
+        }
+
+        ngx_http_lua_shdict_free_node(ctx, sd);
+
+        freed++;
+    }
+
+    return freed;
+}
+
+
+/* what ngx_slab_alloc_locked really takes for a size bytes node */
+static ngx_inline size_t
+ngx_http_lua_shdict_slab_size(size_t size)
+{
+    size_t  s;
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_align(size, ngx_pagesize);
+    }
+
+    for (s = 8; s < size; s <<= 1) { /* void */ }
+
+    return s;
+}
+
+
+static void
+ngx_http_lua_shdict_free_node(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_http_lua_shdict_node_t *sd)
+{
+    ngx_rbtree_node_t  *node;
+
+    ngx_http_lua_shdict_skip_cursors(ctx, &sd->queue);
+
+    ngx_queue_remove(&sd->queue);
+
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+
+    ctx->sh->items--;
+    ctx->sh->used -= ngx_http_lua_shdict_slab_size(
+                         offsetof(ngx_rbtree_node_t, color)
+                         + offsetof(ngx_http_lua_shdict_node_t, data)
+                         + sd->key_len + sd->value_len);
+
+    ngx_http_lua_shdict_write_begin(ctx);
+
+    ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+    ngx_slab_free_locked(ctx->shpool, node);
+
+    ngx_http_lua_shdict_write_end(ctx);
+}
+
+
+/*
+ * evicts least recently used nodes until size more bytes fit under the
+ * high_water mark, at most max times, and returns the number of unexpired
+ * nodes evicted
+ */
+static ngx_uint_t
+ngx_http_lua_shdict_evict(ngx_http_lua_shdict_ctx_t *ctx, size_t size,
+    ngx_uint_t max)
+{
+    ngx_uint_t  evictions;
+
+    evictions = ctx->sh->evictions;
+
+    while (max-- && ctx->sh->used + size > ctx->high_water_size) {
+        if (ngx_http_lua_shdict_expire(ctx, 0) == 0) {
+            break;
+        }
+    }
+
+    return ctx->sh->evictions - evictions;
+}
+
+
+/*
+ * frees the expired nodes among the next batch ones, walking the LRU
+ * queue from the tail and resuming where the previous sweep stopped, then
+ * brings the zone back under its high_water mark
+ */
+static void
+ngx_http_lua_shdict_sweep(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t batch)
+{
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_uint_t                   i;
+    ngx_queue_t                 *q, *prev;
+    ngx_http_lua_shdict_node_t  *sd;
+
+    tp = ngx_timeofday();
+
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    q = ctx->sh->sweep ? ctx->sh->sweep : ngx_queue_last(&ctx->sh->queue);
+
+    for (i = 0; i < batch && q != ngx_queue_sentinel(&ctx->sh->queue); i++) {
+        prev = ngx_queue_prev(q);
+
+        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+        if (sd->expires != 0 && (ngx_msec_int_t) (sd->expires - now) <= 0) {
+            ctx->sh->expirations++;
+            ngx_http_lua_shdict_free_node(ctx, sd);
+        }
+
+        q = prev;
+    }
+
+    ctx->sh->sweep = (q == ngx_queue_sentinel(&ctx->sh->queue)) ? NULL : q;
+
+    if (ctx->high_water_size) {
+        (void) ngx_http_lua_shdict_evict(ctx, 0, batch);
+    }
+}
+
+
+static void
+ngx_http_lua_shdict_sweep_handler(ngx_event_t *ev)
+{
+    ngx_http_lua_shdict_ctx_t  *ctx = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    /* every worker sweeps, so a busy zone is simply skipped this time */
+
+    if (ngx_shmtx_trylock(&ctx->shpool->mutex)) {
+        ngx_http_lua_shdict_sweep(ctx, NGX_HTTP_LUA_SHDICT_SWEEP_BATCH);
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+    }
+
+    ngx_add_timer(ev, ctx->sweep);
+}
+
+
+ngx_int_t
+ngx_http_lua_shdict_init_process(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_uint_t                   i, j;
+    ngx_event_t                 *ev;
+    ngx_shm_zone_t             **zone, *sz;
+    ngx_http_lua_shdict_ctx_t   *ctx, *sctx;
+
+    if (lmcf == NULL || lmcf->shm_zones == NULL) {
+        return NGX_OK;
+    }
+
+    zone = lmcf->shm_zones->elts;
+
+    for (i = 0; i < lmcf->shm_zones->nelts; i++) {
+        ctx = zone[i]->data;
+
+        if (ctx->persist.len) {
+            ev = &ctx->persist_event;
+
+            ev->handler = ngx_http_lua_shdict_persist_handler;
+            ev->data = zone[i];
+            ev->log = cycle->log;
+#if defined(nginx_version) && nginx_version >= 1007011
+            ev->cancelable = 1;
+#endif
+
+            ngx_add_timer(ev, ctx->persist_interval);
+        }
+
+        if (ctx->sweep == 0) {
+            continue;
+        }
+
+        for (j = 0; j < ctx->nshards; j++) {
+            sz = ctx->shards ? ctx->shards[j] : zone[i];
+            sctx = sz->data;
+
+            ev = &sctx->sweep_event;
+
+            ev->handler = ngx_http_lua_shdict_sweep_handler;
+            ev->data = sctx;
+            ev->log = cycle->log;
+#if defined(nginx_version) && nginx_version >= 1007011
+            ev->cancelable = 1;
+#endif
+
+            /* spread the workers' sweeps over the interval */
+
+            ngx_add_timer(ev, ctx->sweep + ngx_random() % ctx->sweep);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * snapshot files: a header then, for every live item from the least to
+ * the most recently used one, an entry followed by the key and the value
+ * bytes, all in the host byte order
+ */
+
+#define NGX_HTTP_LUA_SHDICT_PERSIST_MAGIC   "ngxlsd01"
+#define NGX_HTTP_LUA_SHDICT_PERSIST_BATCH   256
+#define NGX_HTTP_LUA_SHDICT_PERSIST_BUF     65536
+
+
+typedef struct {
+    u_char                        magic[8];
+    uint32_t                      byte_order;  /* 0x01020304 */
+    uint32_t                      crc32;       /* of the entries */
+    uint64_t                      entries;
+    uint64_t                      size;        /* bytes of entries */
+    uint64_t                      saved;       /* msec since the epoch */
+} ngx_http_lua_shdict_persist_header_t;
+
+
+typedef struct {
+    uint64_t                      ttl;      /* msec left, 0: never expires */
+    uint32_t                      value_len;
+    uint16_t                      key_len;
+    uint8_t                       value_type;
+    uint8_t                       reserved;
+} ngx_http_lua_shdict_persist_entry_t;
+
+
+static uint64_t
+ngx_http_lua_shdict_persist_now(void)
+{
+    ngx_time_t  *tp;
+
+    tp = ngx_timeofday();
+
+    return (uint64_t) tp->sec * 1000 + tp->msec;
+}
+
+
+/*
+ * writes the snapshot of all the shards of a dict to a temporary file
+ * renamed over the previous one; the zone locks are only held while a
+ * batch of items is copied to the buffer
+ */
+static ngx_int_t
+ngx_http_lua_shdict_persist(ngx_shm_zone_t *zone, ngx_log_t *log)
+{
+    u_char                                *buf, *p;
+    size_t                                 size, len;
+    off_t                                  offset;
+    uint32_t                               crc;
+    uint64_t                               now, entries;
+    ngx_uint_t                             i, j, visited, limit;
+    ngx_msec_t                             expires;
+    ngx_file_t                             file;
+    ngx_flag_t                             done;
+    ngx_queue_t                           *q;
+    ngx_shm_zone_t                        *sz;
+    ngx_http_lua_shdict_ctx_t             *ctx, *sctx;
+    ngx_http_lua_shdict_node_t            *sd;
+    ngx_http_lua_shdict_persist_entry_t    entry;
+    ngx_http_lua_shdict_persist_header_t   header;
+
+    ctx = zone->data;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = ctx->persist_tmp;
+    file.log = log;
+
+    file.fd = ngx_open_file(ctx->persist_tmp.data, NGX_FILE_WRONLY,
+                            NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &ctx->persist_tmp);
+        return NGX_ERROR;
+    }
+
+    size = NGX_HTTP_LUA_SHDICT_PERSIST_BUF;
+
+    buf = ngx_alloc(size, log);
+    if (buf == NULL) {
+        goto failed;
+    }
+
+    now = ngx_http_lua_shdict_persist_now();
+
+    offset = sizeof(ngx_http_lua_shdict_persist_header_t);
+    entries = 0;
+
+    ngx_crc32_init(crc);
+
+    for (i = 0; i < ctx->nshards; i++) {
+        sz = ctx->shards ? ctx->shards[i] : zone;
+        sctx = sz->data;
+
+        ngx_shmtx_lock(&sctx->shpool->mutex);
+
+        sctx->sh->persist = ngx_queue_last(&sctx->sh->queue);
+
+        /* items moved to the head meanwhile may come again */
+        limit = 2 * sctx->sh->items + NGX_HTTP_LUA_SHDICT_PERSIST_BATCH;
+
+        ngx_shmtx_unlock(&sctx->shpool->mutex);
+
+        visited = 0;
+
+        do {
+            p = buf;
+
+            ngx_shmtx_lock(&sctx->shpool->mutex);
+
+            q = sctx->sh->persist;
+
+            for (j = 0;
+                 j < NGX_HTTP_LUA_SHDICT_PERSIST_BATCH
+                 && q != ngx_queue_sentinel(&sctx->sh->queue)
+                 && visited < limit;
+                 j++, visited++)
+            {
+                sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
+
+                len = sizeof(ngx_http_lua_shdict_persist_entry_t)
+                      + sd->key_len + sd->value_len;
+
+                if (len > size - (p - buf)) {
+                    if (p != buf) {
+                        break;
+                    }
+
+                    /* an item larger than the buffer, alone in the batch */
+
+                    ngx_free(buf);
+
+                    buf = ngx_alloc(len, log);
+                    if (buf == NULL) {
+                        ngx_shmtx_unlock(&sctx->shpool->mutex);
+                        goto failed;
+                    }
+
+                    p = buf;
+                    size = len;
+                }
+
+                q = ngx_queue_prev(q);
+
+                entry.ttl = 0;
+
+                if (sd->expires != 0) {
+                    expires = sd->expires - (ngx_msec_t) now;
+
+                    if ((ngx_msec_int_t) expires <= 0) {
+                        continue;
+                    }
+
+                    entry.ttl = expires;
+                }
+
+                entry.value_len = sd->value_len;
+                entry.key_len = sd->key_len;
+                entry.value_type = sd->value_type;
+                entry.reserved = 0;
+
+                p = ngx_cpymem(p, &entry, sizeof(entry));
+                p = ngx_cpymem(p, sd->data, sd->key_len + sd->value_len);
+
+                entries++;
+            }
+
+            done = (q == ngx_queue_sentinel(&sctx->sh->queue)
+                    || visited >= limit);
 
-    ctx = shm_zone->data;
+            sctx->sh->persist = done ? NULL : q;
 
-    if (octx) {
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+            ngx_shmtx_unlock(&sctx->shpool->mutex);
 
-        return NGX_OK;
+            if (p == buf) {
+                continue;
+            }
+
+            ngx_crc32_update(&crc, buf, p - buf);
+
+            if (ngx_write_file(&file, buf, p - buf, offset) == NGX_ERROR) {
+                goto failed;
+            }
+
+            offset += p - buf;
+
+        } while (!done);
     }
 
-    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    ngx_crc32_final(crc);
 
-    if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+    ngx_memcpy(header.magic, NGX_HTTP_LUA_SHDICT_PERSIST_MAGIC,
+               sizeof(header.magic));
+    header.byte_order = 0x01020304;
+    header.crc32 = crc;
+    header.entries = entries;
+    header.size = offset - sizeof(ngx_http_lua_shdict_persist_header_t);
+    header.saved = now;
 
-        return NGX_OK;
+    if (ngx_write_file(&file, (u_char *) &header, sizeof(header), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_lua_shdict_shctx_t));
-    if (ctx->sh == NULL) {
+    ngx_free(buf);
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->persist_tmp);
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
+    if (ngx_rename_file(ctx->persist_tmp.data, ctx->persist.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%V\" to \"%V\" failed",
+                      &ctx->persist_tmp, &ctx->persist);
+        return NGX_ERROR;
+    }
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_lua_shdict_rbtree_insert_value);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "lua shared dict \"%V\": %uL items saved to \"%V\"",
+                   &ctx->name, entries, &ctx->persist);
 
-    ngx_queue_init(&ctx->sh->queue);
+    return NGX_OK;
 
-    len = sizeof(" in lua_shared_dict zone \"\"") + shm_zone->shm.name.len;
+failed:
 
-    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
-    if (ctx->shpool->log_ctx == NULL) {
-        return NGX_ERROR;
+    if (buf) {
+        ngx_free(buf);
     }
 
-    ngx_sprintf(ctx->shpool->log_ctx, " in lua_shared_dict zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    ngx_close_file(file.fd);
+    ngx_delete_file(ctx->persist_tmp.data);
 
-    return NGX_OK;
+    return NGX_ERROR;
 }
 
 
-void
-ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+/*
+ * bulk-loads the items of the snapshot file belonging to a newly created
+ * zone, the snapshot of a sharded dict being shared by all its shards
+ */
+static void
+ngx_http_lua_shdict_restore(ngx_shm_zone_t *shm_zone)
 {
-    ngx_rbtree_node_t          **p;
-    ngx_http_lua_shdict_node_t   *sdn, *sdnt;
+    u_char                                *start, *p, *last;
+    size_t                                 n;
+    uint32_t                               crc, hash;
+    uint64_t                               now, elapsed;
+    ngx_fd_t                               fd;
+    ngx_log_t                             *log;
+    ngx_uint_t                             loaded;
+    ngx_file_info_t                        fi;
+    ngx_rbtree_node_t                     *node;
+    ngx_http_lua_shdict_ctx_t             *ctx;
+    ngx_http_lua_shdict_node_t            *sd;
+    ngx_http_lua_shdict_persist_entry_t    entry;
+    ngx_http_lua_shdict_persist_header_t   header;
 
-    for ( ;; ) {
+    ctx = shm_zone->data;
+    log = shm_zone->shm.log;
 
-        if (node->key < temp->key) {
+    fd = ngx_open_file(ctx->persist.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
-            p = &temp->left;
+    if (fd == NGX_INVALID_FILE) {
+        if (ngx_errno != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_open_file_n " \"%V\" failed", &ctx->persist);
+        }
 
-        } else if (node->key > temp->key) {
+        return;
+    }
 
-            p = &temp->right;
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &ctx->persist);
+        goto close;
+    }
 
-        } else { /* node->key == temp->key */
+    n = (size_t) ngx_file_size(&fi);
 
-            sdn = (ngx_http_lua_shdict_node_t *) &node->color;
-            sdnt = (ngx_http_lua_shdict_node_t *) &temp->color;
+    if (n < sizeof(ngx_http_lua_shdict_persist_header_t)) {
+        goto invalid;
+    }
 
-            p = (ngx_memn2cmp(sdn->data, sdnt->data, sdn->key_len,
-                sdnt->key_len) < 0) ? &temp->left : &temp->right;
-        }
+    start = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
 
-        if (*p == sentinel) {
-            break;
-        }
+    if (start == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      "mmap(%uz) \"%V\" failed", n, &ctx->persist);
+        goto close;
+    }
 
-        temp = *p;
+    ngx_memcpy(&header, start, sizeof(header));
+
+    p = start + sizeof(header);
+    last = start + n;
+
+    if (ngx_memcmp(header.magic, NGX_HTTP_LUA_SHDICT_PERSIST_MAGIC,
+                   sizeof(header.magic)) != 0
+        || header.byte_order != 0x01020304
+        || header.size != (uint64_t) (last - p))
+    {
+        munmap(start, n);
+        goto invalid;
     }
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
-}
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, p, last - p);
+    ngx_crc32_final(crc);
 
+    if (crc != header.crc32) {
+        munmap(start, n);
+        goto invalid;
+    }
 
-static ngx_int_t
-ngx_http_lua_shdict_lookup(ngx_shm_zone_t *shm_zone, ngx_uint_t hash,
-    u_char *kdata, size_t klen, ngx_http_lua_shdict_node_t **sdp)
-{
-    ngx_int_t                    rc;
-    ngx_time_t                  *tp;
-    ngx_msec_t                   now;
-    ngx_msec_int_t               ms;
-    ngx_rbtree_node_t           *node, *sentinel;
-    ngx_http_lua_shdict_ctx_t   *ctx;
-    ngx_http_lua_shdict_node_t  *sd;
+    now = ngx_http_lua_shdict_persist_now();
+    elapsed = now > header.saved ? now - header.saved : 0;
 
-    ctx = shm_zone->data;
+    loaded = 0;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    while (p < last) {
 
-    while (node != sentinel) {
+        if ((size_t) (last - p) < sizeof(entry)) {
+            break;
+        }
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
+        ngx_memcpy(&entry, p, sizeof(entry));
+
+        p += sizeof(entry);
+
+        if (entry.key_len == 0
+            || (size_t) (last - p) < (size_t) entry.key_len + entry.value_len)
+        {
+            break;
         }
 
-        if (hash > node->key) {
-            node = node->right;
+        hash = ngx_crc32_short(p, entry.key_len);
+
+        if (ctx->nshards > 1 && hash % ctx->nshards != ctx->shard) {
+            p += entry.key_len + entry.value_len;
             continue;
         }
 
-        /* hash == node->key */
+        /*
+         * an item set or moved to the head of the queue while the snapshot
+         * was written comes again later in the file: the last copy wins
+         */
+        if (ngx_http_lua_shdict_lookup(shm_zone, hash, p, entry.key_len, &sd)
+            != NGX_DECLINED)
+        {
+            ngx_http_lua_shdict_free_node(ctx, sd);
+            loaded--;
+        }
 
-        do {
-            sd = (ngx_http_lua_shdict_node_t *) &node->color;
+        if (entry.ttl && entry.ttl <= elapsed) {
+            p += entry.key_len + entry.value_len;
+            continue;
+        }
 
-            rc = ngx_memn2cmp(kdata, sd->data, klen, (size_t) sd->key_len);
+        n = offsetof(ngx_rbtree_node_t, color)
+            + offsetof(ngx_http_lua_shdict_node_t, data)
+            + entry.key_len
+            + entry.value_len;
 
-            if (rc == 0) {
-                ngx_queue_remove(&sd->queue);
-                ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+        node = ngx_slab_alloc_locked(ctx->shpool, n);
 
-                *sdp = sd;
+        if (node == NULL) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "lua shared dict \"%V\" is full, snapshot \"%V\" "
+                          "only partly restored", &ctx->name, &ctx->persist);
+            break;
+        }
 
-                if (sd->expires != 0) {
-                    tp = ngx_timeofday();
+        sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
-                    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
-                    ms = (ngx_msec_int_t) (sd->expires - now);
+        node->key = hash;
+        sd->key_len = entry.key_len;
+        sd->value_len = entry.value_len;
+        sd->value_type = entry.value_type;
+        sd->expires = entry.ttl
+                      ? (ngx_msec_t) (now + entry.ttl - elapsed) : 0;
 
-                    if (ms < 0) {
-                        /* already expired */
-                        return NGX_DONE;
-                    }
-                }
+        ngx_memcpy(sd->data, p, entry.key_len + entry.value_len);
 
-                return NGX_OK;
-            }
+        p += entry.key_len + entry.value_len;
 
-            node = (rc < 0) ? node->left : node->right;
+        ngx_rbtree_insert(&ctx->sh->rbtree, node);
+        ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
 
-        } while (node != sentinel && hash == node->key);
+        ctx->sh->items++;
+        ctx->sh->used += ngx_http_lua_shdict_slab_size(n);
 
-        break;
+        loaded++;
     }
 
-    *sdp = NULL;
+    munmap(start, (size_t) ngx_file_size(&fi));
 
-    return NGX_DECLINED;
+    ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                  "lua shared dict \"%V\": %ui items restored from \"%V\"",
+                  &ctx->name, loaded, &ctx->persist);
+
+    goto close;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "lua shared dict \"%V\": invalid snapshot \"%V\" ignored",
+                  &ctx->name, &ctx->persist);
+
+close:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%V\" failed", &ctx->persist);
+    }
 }
 
 
-static int
-ngx_http_lua_shdict_expire(ngx_http_lua_shdict_ctx_t *ctx, ngx_uint_t n)
+/*
+ * A worker that died while writing the snapshot left its pid in the
+ * lock: take the lock over rather than never writing again.
+ */
+static ngx_int_t
+ngx_http_lua_shdict_persist_trylock(ngx_http_lua_shdict_ctx_t *ctx,
+    ngx_log_t *log)
 {
-    ngx_time_t                  *tp;
-    ngx_msec_t                   now;
-    ngx_queue_t                 *q;
-    ngx_msec_int_t               ms;
-    ngx_rbtree_node_t           *node;
-    ngx_http_lua_shdict_node_t  *sd;
-    int                          freed = 0;
+    ngx_pid_t       pid;
 
-    tp = ngx_timeofday();
+    pid = (ngx_pid_t) ctx->sh->persist_lock;
 
-    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+    if (pid == 0) {
+        return ngx_atomic_cmp_set(&ctx->sh->persist_lock, 0, ngx_pid);
+    }
 
-    /*
-     * n == 1 deletes one or two expired entries
-     * n == 0 deletes oldest entry by force
-     *        and one or two zero rate entries
-     */
+    if (pid == ngx_pid || kill(pid, 0) != -1 || ngx_errno != NGX_ESRCH) {
+        return 0;
+    }
 
-    while (n < 3) {
+    if (!ngx_atomic_cmp_set(&ctx->sh->persist_lock, pid, ngx_pid)) {
+        return 0;
+    }
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
-            return freed;
-        }
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "lua shared dict \"%V\": process %P died while writing "
+                  "snapshot \"%V\", taking its lock over",
+                  &ctx->name, pid, &ctx->persist);
 
-        q = ngx_queue_last(&ctx->sh->queue);
+    return 1;
+}
 
-        sd = ngx_queue_data(q, ngx_http_lua_shdict_node_t, queue);
 
-        if (n++ != 0) {
+static void
+ngx_http_lua_shdict_persist_handler(ngx_event_t *ev)
+{
+    ngx_shm_zone_t             *zone = ev->data;
 
-            if (sd->expires == 0) {
-                return freed;
-            }
+    ngx_http_lua_shdict_ctx_t  *ctx;
 
-            ms = (ngx_msec_int_t) (sd->expires - now);
-            if (ms > 0) {
-                return freed;
-            }
-        }
+    ctx = zone->data;
 
-        ngx_queue_remove(q);
+    if (ngx_exiting) {
+        return;
+    }
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
+    /* the first worker to find the snapshot too old writes it */
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    if (ngx_time() - ctx->sh->persisted
+            >= (time_t) (ctx->persist_interval / 1000)
+        && ngx_http_lua_shdict_persist_trylock(ctx, ev->log))
+    {
+        (void) ngx_http_lua_shdict_persist(zone, ev->log);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ctx->sh->persisted = ngx_time();
 
-        freed++;
+        ngx_unlock(&ctx->sh->persist_lock);
     }
 
-    return freed;
+    ngx_add_timer(ev, ctx->persist_interval);
+}
+
+
+void
+ngx_http_lua_shdict_exit_master(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_uint_t                   i;
+    ngx_shm_zone_t             **zone;
+    ngx_http_lua_shdict_ctx_t   *ctx;
+
+    if (lmcf == NULL || lmcf->shm_zones == NULL) {
+        return;
+    }
+
+    /* the workers are gone, the last snapshot is written by the master */
+
+    zone = lmcf->shm_zones->elts;
+
+    for (i = 0; i < lmcf->shm_zones->nelts; i++) {
+        ctx = zone[i]->data;
+
+        if (ctx->persist.len == 0) {
+            continue;
+        }
+
+        ctx->sh->persist_lock = ngx_pid;
+
+        (void) ngx_http_lua_shdict_persist(zone[i], cycle->log);
+
+        ngx_unlock(&ctx->sh->persist_lock);
+    }
 }
 
 
@@ -276,6 +1312,9 @@ ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf, lua_State *L)
         lua_pushcfunction(L, ngx_http_lua_shdict_delete);
         lua_setfield(L, -2, "delete");
 
+        lua_pushcfunction(L, ngx_http_lua_shdict_stats);
+        lua_setfield(L, -2, "stats");
+
         lua_pushvalue(L, -1); /* shared mt mt */
         lua_setfield(L, -2, "__index"); /* shared mt */
 
@@ -355,15 +1394,31 @@ ngx_http_lua_shdict_get(lua_State *L)
 
     hash = ngx_crc32_short(key.data, key.len);
 
+    zone = ngx_http_lua_shdict_shard(zone, hash);
+    ctx = zone->data;
+
 #if (NGX_DEBUG)
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "fetching key \"%V\" in shared dict \"%V\"", &key, &name);
 #endif /* NGX_DEBUG */
 
+    if (ctx->read_mostly) {
+        rc = ngx_http_lua_shdict_get_nolock(L, ctx, hash, &key);
+
+        if (rc == NGX_OK) {
+            return 1;
+        }
+
+        if (rc == NGX_DECLINED) {
+            lua_pushnil(L);
+            return 1;
+        }
+
+        /* rc == NGX_AGAIN */
+    }
+
     ngx_shmtx_lock(&ctx->shpool->mutex);
 
 #if 1
@@ -528,9 +1583,7 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
     name = ctx->name;
 
 #if (NGX_DEBUG)
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 #endif
 
     key.data = (u_char *) luaL_checklstring(L, 2, &key.len);
@@ -547,6 +1600,9 @@ ngx_http_lua_shdict_set_helper(lua_State *L, int flags)
 
     hash = ngx_crc32_short(key.data, key.len);
 
+    zone = ngx_http_lua_shdict_shard(zone, hash);
+    ctx = zone->data;
+
     value_type = lua_type(L, 3);
 
     switch (value_type) {
@@ -654,8 +1710,9 @@ replace:
                 "lua shared dict set: found old entry and value size matched, "
                 "reusing it");
 
-            ngx_queue_remove(&sd->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+            ngx_http_lua_shdict_touch(ctx, sd);
+
+            ngx_http_lua_shdict_write_begin(ctx);
 
             sd->key_len = key.len;
 
@@ -677,6 +1734,8 @@ replace:
             p = ngx_copy(sd->data, key.data, key.len);
             ngx_memcpy(p, value.data, value.len);
 
+            ngx_http_lua_shdict_write_end(ctx);
+
             ngx_shmtx_unlock(&ctx->shpool->mutex);
 
             lua_pushboolean(L, 1);
@@ -690,15 +1749,7 @@ replace:
             "removing it first");
 
 remove:
-        ngx_queue_remove(&sd->queue);
-
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) sd - offsetof(ngx_rbtree_node_t, color));
-
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
-
-        ngx_slab_free_locked(ctx->shpool, node);
-
+        ngx_http_lua_shdict_free_node(ctx, sd);
     }
 
 insert:
@@ -721,6 +1772,17 @@ insert:
         + key.len
         + value.len;
 
+    if (ctx->high_water_size
+        && ctx->sh->used + ngx_http_lua_shdict_slab_size(n)
+           > ctx->high_water_size)
+    {
+        if (ngx_http_lua_shdict_evict(ctx, ngx_http_lua_shdict_slab_size(n),
+                                      NGX_HTTP_LUA_SHDICT_EVICT_BATCH))
+        {
+            forcible = 1;
+        }
+    }
+
     node = ngx_slab_alloc_locked(ctx->shpool, n);
 
     if (node == NULL) {
@@ -753,6 +1815,9 @@ insert:
 allocated:
     sd = (ngx_http_lua_shdict_node_t *) &node->color;
 
+    ctx->sh->items++;
+    ctx->sh->used += ngx_http_lua_shdict_slab_size(n);
+
     node->key = hash;
     sd->key_len = key.len;
 
@@ -774,8 +1839,12 @@ allocated:
     p = ngx_copy(sd->data, key.data, key.len);
     ngx_memcpy(p, value.data, value.len);
 
+    ngx_http_lua_shdict_write_begin(ctx);
+
     ngx_rbtree_insert(&ctx->sh->rbtree, node);
 
+    ngx_http_lua_shdict_write_end(ctx);
+
     ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
 
     ngx_shmtx_unlock(&ctx->shpool->mutex);
@@ -831,6 +1900,9 @@ ngx_http_lua_shdict_incr(lua_State *L)
 
     hash = ngx_crc32_short(key.data, key.len);
 
+    zone = ngx_http_lua_shdict_shard(zone, hash);
+    ctx = zone->data;
+
     value = luaL_checknumber(L, 3);
 
     dd("looking up key %.*s in shared dict %.*s", (int) key.len, key.data,
@@ -865,8 +1937,7 @@ ngx_http_lua_shdict_incr(lua_State *L)
         return 2;
     }
 
-    ngx_queue_remove(&sd->queue);
-    ngx_queue_insert_head(&ctx->sh->queue, &sd->queue);
+    ngx_http_lua_shdict_touch(ctx, sd);
 
     dd("setting value type to %d", (int) sd->value_type);
 
@@ -876,8 +1947,12 @@ ngx_http_lua_shdict_incr(lua_State *L)
 
     num += value;
 
+    ngx_http_lua_shdict_write_begin(ctx);
+
     ngx_memcpy(p, (lua_Number *) &num, sizeof(lua_Number));
 
+    ngx_http_lua_shdict_write_end(ctx);
+
     ngx_shmtx_unlock(&ctx->shpool->mutex);
 
     lua_pushnumber(L, num);
@@ -885,3 +1960,93 @@ ngx_http_lua_shdict_incr(lua_State *L)
     return 2;
 }
 
+
+
+static int
+ngx_http_lua_shdict_stats(lua_State *L)
+{
+    int                          n;
+    size_t                       capacity, used, free_size;
+    ngx_uint_t                   i, items, expirations, evictions;
+    ngx_shm_zone_t              *zone, *sz;
+    ngx_slab_page_t             *page;
+    ngx_http_lua_shdict_ctx_t   *ctx, *sctx;
+
+    n = lua_gettop(L);
+
+    if (n != 1) {
+        return luaL_error(L, "expecting exactly one argument, "
+                "but seen %d", n);
+    }
+
+    luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+
+    zone = lua_touserdata(L, 1);
+    if (zone == NULL) {
+        return luaL_error(L, "bad user data for the ngx_shm_zone_t pointer");
+    }
+
+    ctx = zone->data;
+
+    capacity = 0;
+    used = 0;
+    free_size = 0;
+    items = 0;
+    expirations = 0;
+    evictions = 0;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        sz = ctx->shards ? ctx->shards[i] : zone;
+        sctx = sz->data;
+
+        ngx_shmtx_lock(&sctx->shpool->mutex);
+
+        capacity += sctx->shpool->end - sctx->shpool->start;
+        used += sctx->sh->used;
+        items += sctx->sh->items;
+        expirations += sctx->sh->expirations;
+        evictions += sctx->sh->evictions;
+
+        for (page = sctx->shpool->free.next;
+             page != &sctx->shpool->free;
+             page = page->next)
+        {
+            free_size += page->slab * ngx_pagesize;
+        }
+
+        ngx_shmtx_unlock(&sctx->shpool->mutex);
+    }
+
+    lua_createtable(L, 0, 7 /* nrec */);
+
+    lua_pushinteger(L, (lua_Integer) items);
+    lua_setfield(L, -2, "items");
+
+    lua_pushnumber(L, (lua_Number) capacity);
+    lua_setfield(L, -2, "capacity");
+
+    lua_pushnumber(L, (lua_Number) used);
+    lua_setfield(L, -2, "used");
+
+    lua_pushnumber(L, (lua_Number) free_size);
+    lua_setfield(L, -2, "free");
+
+    lua_pushnumber(L, (lua_Number) expirations);
+    lua_setfield(L, -2, "expirations");
+
+    lua_pushnumber(L, (lua_Number) evictions);
+    lua_setfield(L, -2, "evictions");
+
+    /* the share of the pages in use not holding node bytes */
+
+    if (capacity - free_size > used) {
+        lua_pushnumber(L, 1 - (lua_Number) used / (capacity - free_size));
+
+    } else {
+        lua_pushnumber(L, 0);
+    }
+
+    lua_setfield(L, -2, "fragmentation");
+
+    return 1;
+}
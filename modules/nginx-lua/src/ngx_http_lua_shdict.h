@@ -21,13 +21,43 @@ typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+    ngx_atomic_t                  seq;      /* odd while the rbtree or a
+                                               node is being modified */
+    ngx_queue_t                  *sweep;    /* next node the sweeper looks
+                                               at, NULL: the LRU tail */
+    ngx_uint_t                    items;
+    size_t                        used;     /* slab bytes held by nodes */
+    ngx_uint_t                    expirations;
+    ngx_uint_t                    evictions;  /* of unexpired nodes */
+    ngx_queue_t                  *persist;  /* next node the snapshot
+                                               writer copies */
+    ngx_atomic_t                  persist_lock;  /* pid of the writer */
+    time_t                        persisted;
 } ngx_http_lua_shdict_shctx_t;
 
 
+#ifndef NGX_HTTP_LUA_SHDICT_MAX_SHARDS
+#define NGX_HTTP_LUA_SHDICT_MAX_SHARDS 64
+#endif
+
+
 typedef struct {
     ngx_http_lua_shdict_shctx_t  *sh;
     ngx_slab_pool_t              *shpool;
     ngx_str_t                     name;
+    ngx_uint_t                    nshards;
+    ngx_uint_t                    shard;    /* index of this sub-zone */
+    ngx_shm_zone_t              **shards;  /* of nshards sub-zones, NULL
+                                              unless shards=N is given */
+    ngx_flag_t                    read_mostly;  /* get without the mutex */
+    ngx_msec_t                    sweep;    /* expiry sweep interval, 0: off */
+    ngx_uint_t                    high_water;  /* percent, 0: off */
+    size_t                        high_water_size;
+    ngx_event_t                   sweep_event;
+    ngx_str_t                     persist;  /* snapshot file, null-terminated */
+    ngx_str_t                     persist_tmp;
+    ngx_msec_t                    persist_interval;
+    ngx_event_t                   persist_event;
 } ngx_http_lua_shdict_ctx_t;
 
 
@@ -36,6 +66,12 @@ ngx_int_t ngx_http_lua_shdict_init_zone(ngx_shm_zone_t *shm_zone, void *data);
 void ngx_http_lua_shdict_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 
+ngx_int_t ngx_http_lua_shdict_init_process(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf);
+
+void ngx_http_lua_shdict_exit_master(ngx_cycle_t *cycle,
+    ngx_http_lua_main_conf_t *lmcf);
+
 void ngx_http_lua_inject_shdict_api(ngx_http_lua_main_conf_t *lmcf,
         lua_State *L);
 
@@ -0,0 +1,1875 @@
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_socket.h"
+#include "ngx_http_lua_contentby.h"
+
+
+/*
+ * A socket object is a full userdata holding its upstream. Every
+ * operation that cannot complete right away registers the event handlers
+ * for it, marks the request ctx as busy with the socket and yields the
+ * request coroutine. The event handlers then prepare the return values
+ * and resume the coroutine through ngx_http_lua_wev_handler, the same way
+ * ngx.req.read_body and the subrequests do.
+ *
+ * Connections handed over by setkeepalive() are kept in per-worker pools
+ * keyed by "host:port" or by the unix domain socket path. An idle
+ * connection only has its read event armed, to notice the peer closing
+ * it, and is detached from the request that opened it.
+ */
+
+
+#define NGX_HTTP_LUA_SOCKET_TCP_MT   "ngx_lua_tcp_socket_mt"
+#define NGX_HTTP_LUA_SOCKET_POOL_MT  "ngx_lua_tcp_socket_pool_mt"
+
+
+static int ngx_http_lua_socket_tcp(lua_State *L);
+static int ngx_http_lua_socket_tcp_connect(lua_State *L);
+static int ngx_http_lua_socket_tcp_send(lua_State *L);
+static int ngx_http_lua_socket_tcp_receive(lua_State *L);
+static int ngx_http_lua_socket_tcp_close(lua_State *L);
+static int ngx_http_lua_socket_tcp_settimeout(lua_State *L);
+static int ngx_http_lua_socket_tcp_setkeepalive(lua_State *L);
+static int ngx_http_lua_socket_tcp_getreusedtimes(lua_State *L);
+static int ngx_http_lua_socket_tcp_gc(lua_State *L);
+static int ngx_http_lua_socket_stats(lua_State *L);
+static void ngx_http_lua_socket_push_pool_key(lua_State *L,
+    ngx_http_lua_socket_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_pool_get(lua_State *L,
+    ngx_http_request_t *r, ngx_http_lua_socket_upstream_t *u);
+static void ngx_http_lua_socket_keepalive_close_handler(ngx_event_t *ev);
+static void ngx_http_lua_socket_keepalive_dummy_handler(ngx_event_t *ev);
+static int ngx_http_lua_socket_pool_gc(lua_State *L);
+static ngx_http_request_t *ngx_http_lua_socket_tcp_get_request(lua_State *L,
+    ngx_http_lua_ctx_t **ctxp);
+static int ngx_http_lua_socket_tcp_yield(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_http_lua_socket_upstream_t *u);
+static void ngx_http_lua_socket_tcp_wakeup(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+static void ngx_http_lua_socket_tcp_finalize(
+    ngx_http_lua_socket_upstream_t *u);
+static void ngx_http_lua_socket_tcp_cleanup(void *data);
+static void ngx_http_lua_socket_tcp_handler(ngx_event_t *ev);
+static void ngx_http_lua_socket_dummy_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+static void ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_http_lua_socket_connect_peer(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, struct sockaddr *sockaddr,
+    socklen_t socklen);
+static void ngx_http_lua_socket_connected_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_test_connect(
+    ngx_http_lua_socket_upstream_t *u, ngx_connection_t *c);
+static ngx_int_t ngx_http_lua_socket_send(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+static void ngx_http_lua_socket_send_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_read(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+static void ngx_http_lua_socket_read_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_read_line(
+    ngx_http_lua_socket_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_read_size(
+    ngx_http_lua_socket_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_read_all(
+    ngx_http_lua_socket_upstream_t *u);
+static ngx_int_t ngx_http_lua_socket_append(ngx_http_lua_socket_upstream_t *u,
+    u_char *p, size_t len);
+static int ngx_http_lua_socket_error_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L);
+static int ngx_http_lua_socket_connect_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L);
+static int ngx_http_lua_socket_send_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L);
+static int ngx_http_lua_socket_receive_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L);
+
+
+void
+ngx_http_lua_inject_socket_api(lua_State *L)
+{
+    luaL_newmetatable(L, NGX_HTTP_LUA_SOCKET_TCP_MT); /* mt */
+
+    lua_createtable(L, 0, 7 /* nrec */); /* mt methods */
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_connect);
+    lua_setfield(L, -2, "connect");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_send);
+    lua_setfield(L, -2, "send");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_receive);
+    lua_setfield(L, -2, "receive");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_close);
+    lua_setfield(L, -2, "close");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_settimeout);
+    lua_setfield(L, -2, "settimeout");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_setkeepalive);
+    lua_setfield(L, -2, "setkeepalive");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_getreusedtimes);
+    lua_setfield(L, -2, "getreusedtimes");
+
+    lua_setfield(L, -2, "__index"); /* mt */
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, NGX_HTTP_LUA_SOCKET_POOL_MT);
+
+    lua_pushcfunction(L, ngx_http_lua_socket_pool_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 2 /* nrec */);    /* ngx.socket */
+
+    lua_pushcfunction(L, ngx_http_lua_socket_tcp);
+    lua_setfield(L, -2, "tcp");
+
+    lua_pushcfunction(L, ngx_http_lua_socket_stats);
+    lua_setfield(L, -2, "stats");
+
+    lua_setfield(L, -2, "socket");
+}
+
+
+static int
+ngx_http_lua_socket_tcp(lua_State *L)
+{
+    ngx_http_request_t              *r;
+    ngx_http_lua_loc_conf_t         *llcf;
+    ngx_http_lua_socket_upstream_t  *u;
+
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting zero arguments, but got %d",
+                          lua_gettop(L));
+    }
+
+    r = ngx_http_lua_get_req(L);
+
+    if (r == NULL) {
+        return luaL_error(L, "no request object found");
+    }
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    u = lua_newuserdata(L, sizeof(ngx_http_lua_socket_upstream_t));
+
+    ngx_memzero(u, sizeof(ngx_http_lua_socket_upstream_t));
+
+    u->connect_timeout = llcf->socket_connect_timeout;
+    u->send_timeout = llcf->socket_send_timeout;
+    u->read_timeout = llcf->socket_read_timeout;
+    u->buffer_size = llcf->socket_buffer_size;
+
+    luaL_getmetatable(L, NGX_HTTP_LUA_SOCKET_TCP_MT);
+    lua_setmetatable(L, -2);
+
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_connect(lua_State *L)
+{
+    int                              n;
+    u_char                          *p;
+    size_t                           len;
+    lua_Integer                      port;
+    in_addr_t                        addr;
+    ngx_int_t                        rc;
+    ngx_url_t                        url;
+    struct sockaddr_in              *sin;
+    ngx_resolver_ctx_t              *rctx, temp;
+    ngx_http_cleanup_t              *cln;
+    ngx_http_request_t              *r;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_core_loc_conf_t        *clcf;
+    ngx_http_lua_socket_upstream_t  *u;
+
+    n = lua_gettop(L);
+    if (n != 2 && n != 3) {
+        return luaL_error(L, "expecting 2 or 3 arguments (including the "
+                          "object), but got %d", n);
+    }
+
+    r = ngx_http_lua_socket_tcp_get_request(L, &ctx);
+
+    u = luaL_checkudata(L, 1, NGX_HTTP_LUA_SOCKET_TCP_MT);
+
+    p = (u_char *) luaL_checklstring(L, 2, &len);
+
+    port = 0;
+
+    if (len > sizeof("unix:") - 1
+        && ngx_strncasecmp(p, (u_char *) "unix:", sizeof("unix:") - 1) == 0)
+    {
+        if (n != 2) {
+            return luaL_error(L, "unexpected port for a unix domain socket");
+        }
+
+    } else {
+        if (n != 3) {
+            return luaL_error(L, "expecting a port number");
+        }
+
+        port = luaL_checkinteger(L, 3);
+
+        if (port <= 0 || port > 65535) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "bad port number: %d", (int) port);
+            return 2;
+        }
+    }
+
+    if (u->waiting) {
+        return luaL_error(L, "socket busy");
+    }
+
+    /* the object may be reused by a later request, or for another peer */
+
+    ngx_http_lua_socket_tcp_finalize(u);
+
+    if (u->request != r) {
+        ngx_memzero(&u->buffer, sizeof(ngx_buf_t));
+        ngx_memzero(&u->recv, sizeof(ngx_buf_t));
+        ngx_memzero(&u->send, sizeof(ngx_buf_t));
+
+        u->cln = NULL;
+        u->host_size = 0;
+
+        u->request = r;
+
+    } else {
+        u->buffer.pos = u->buffer.start;
+        u->buffer.last = u->buffer.start;
+    }
+
+    /* the cleanup and the host buffer of this request are reused */
+
+    cln = u->cln;
+
+    if (cln == NULL) {
+        cln = ngx_http_cleanup_add(r, 0);
+        if (cln == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        u->cln = cln;
+    }
+
+    cln->handler = ngx_http_lua_socket_tcp_cleanup;
+    cln->data = u;
+    u->cleanup = &cln->handler;
+
+    if (len + 1 > u->host_size) {
+        u->host.data = ngx_palloc(r->pool, len + 1);
+        if (u->host.data == NULL) {
+            u->host_size = 0;
+            return luaL_error(L, "out of memory");
+        }
+
+        u->host_size = len + 1;
+    }
+
+    ngx_memcpy(u->host.data, p, len);
+    u->host.data[len] = '\0';
+    u->host.len = len;
+    u->port = (in_port_t) port;
+
+    u->ft_type = 0;
+    u->waiting = 0;
+    u->done = 0;
+    u->reused = 0;
+    u->prepare_retvals = ngx_http_lua_socket_connect_retval_handler;
+    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+    u->write_event_handler = ngx_http_lua_socket_dummy_handler;
+
+    if (ngx_http_lua_socket_pool_get(L, r, u) == NGX_OK) {
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    if (port == 0) {
+        ngx_memzero(&url, sizeof(ngx_url_t));
+
+        url.url = u->host;
+
+        if (ngx_parse_url(r->pool, &url) != NGX_OK || url.naddrs == 0) {
+            lua_pushnil(L);
+
+            if (url.err) {
+                lua_pushfstring(L, "failed to parse \"%s\": %s",
+                                u->host.data, url.err);
+
+            } else {
+                lua_pushfstring(L, "failed to parse \"%s\"", u->host.data);
+            }
+
+            return 2;
+        }
+
+        rc = ngx_http_lua_socket_connect_peer(r, u, url.addrs[0].sockaddr,
+                                              url.addrs[0].socklen);
+
+        goto connecting;
+    }
+
+    addr = ngx_inet_addr(u->host.data, u->host.len);
+
+    if (addr != INADDR_NONE) {
+        sin = ngx_pcalloc(r->pool, sizeof(struct sockaddr_in));
+        if (sin == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(u->port);
+        sin->sin_addr.s_addr = addr;
+
+        rc = ngx_http_lua_socket_connect_peer(r, u, (struct sockaddr *) sin,
+                                              sizeof(struct sockaddr_in));
+
+        goto connecting;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    temp.name = u->host;
+
+    rctx = ngx_resolve_start(clcf->resolver, &temp);
+    if (rctx == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+
+    if (rctx == NGX_NO_RESOLVER) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "no resolver defined to resolve \"%s\"",
+                        u->host.data);
+        return 2;
+    }
+
+    rctx->name = u->host;
+#if !defined(nginx_version) || nginx_version < 1005008
+    rctx->type = NGX_RESOLVE_A;
+#endif
+    rctx->handler = ngx_http_lua_socket_resolve_handler;
+    rctx->data = u;
+    rctx->timeout = clcf->resolver_timeout;
+
+    u->resolver_ctx = rctx;
+
+    if (ngx_resolve_name(rctx) != NGX_OK) {
+        u->resolver_ctx = NULL;
+
+        lua_pushnil(L);
+        lua_pushfstring(L, "failed to resolve \"%s\"", u->host.data);
+        return 2;
+    }
+
+    if (u->done) {
+        /* answered right away from the resolver cache */
+        return u->prepare_retvals(r, u, L);
+    }
+
+    return ngx_http_lua_socket_tcp_yield(L, r, ctx, u);
+
+connecting:
+
+    if (rc == NGX_AGAIN) {
+        return ngx_http_lua_socket_tcp_yield(L, r, ctx, u);
+    }
+
+    return u->prepare_retvals(r, u, L);
+}
+
+
+static int
+ngx_http_lua_socket_tcp_send(lua_State *L)
+{
+    u_char                          *p, *start;
+    size_t                           len;
+    ngx_int_t                        rc;
+    ngx_buf_t                       *b;
+    ngx_http_request_t              *r;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_lua_socket_upstream_t  *u;
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting 2 arguments (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    r = ngx_http_lua_socket_tcp_get_request(L, &ctx);
+
+    u = luaL_checkudata(L, 1, NGX_HTTP_LUA_SOCKET_TCP_MT);
+
+    p = (u_char *) luaL_checklstring(L, 2, &len);
+
+    if (u->peer.connection == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    /* the Lua string may be collected while we are waiting */
+
+    b = &u->send;
+
+    if ((size_t) (b->end - b->start) < len) {
+        start = ngx_palloc(r->pool, len);
+        if (start == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        if (b->start) {
+            ngx_pfree(r->pool, b->start);
+        }
+
+        b->start = start;
+        b->end = start + len;
+    }
+
+    b->pos = b->start;
+    b->last = ngx_copy(b->pos, p, len);
+
+    u->sent = len;
+    u->ft_type = 0;
+    u->prepare_retvals = ngx_http_lua_socket_send_retval_handler;
+
+    rc = ngx_http_lua_socket_send(r, u);
+
+    if (rc != NGX_AGAIN) {
+        return u->prepare_retvals(r, u, L);
+    }
+
+    u->write_event_handler = ngx_http_lua_socket_send_handler;
+
+    return ngx_http_lua_socket_tcp_yield(L, r, ctx, u);
+}
+
+
+static int
+ngx_http_lua_socket_tcp_receive(lua_State *L)
+{
+    int                              n;
+    u_char                          *p;
+    size_t                           len;
+    lua_Number                       bytes;
+    ngx_int_t                        rc;
+    ngx_http_request_t              *r;
+    ngx_http_lua_ctx_t              *ctx;
+    ngx_http_lua_socket_upstream_t  *u;
+
+    n = lua_gettop(L);
+    if (n != 1 && n != 2) {
+        return luaL_error(L, "expecting 1 or 2 arguments (including the "
+                          "object), but got %d", n);
+    }
+
+    r = ngx_http_lua_socket_tcp_get_request(L, &ctx);
+
+    u = luaL_checkudata(L, 1, NGX_HTTP_LUA_SOCKET_TCP_MT);
+
+    u->input_filter = ngx_http_lua_socket_read_line;
+
+    if (n == 2) {
+        switch (lua_type(L, 2)) {
+        case LUA_TSTRING:
+            p = (u_char *) lua_tolstring(L, 2, &len);
+
+            if (len == 2 && p[0] == '*' && p[1] == 'l') {
+                break;
+            }
+
+            if (len == 2 && p[0] == '*' && p[1] == 'a') {
+                u->input_filter = ngx_http_lua_socket_read_all;
+                break;
+            }
+
+            return luaL_argerror(L, 2, "bad pattern");
+
+        case LUA_TNUMBER:
+            bytes = lua_tonumber(L, 2);
+
+            if (bytes < 0) {
+                return luaL_argerror(L, 2, "bad size");
+            }
+
+            if (bytes == 0) {
+                lua_pushliteral(L, "");
+                return 1;
+            }
+
+            u->input_filter = ngx_http_lua_socket_read_size;
+            u->rest = (size_t) bytes;
+            break;
+
+        default:
+            return luaL_argerror(L, 2, "string or number expected");
+        }
+    }
+
+    if (u->peer.connection == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        lua_pushliteral(L, "");
+        return 3;
+    }
+
+    if (u->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (u->buffer.start == NULL) {
+        u->buffer.start = ngx_palloc(r->pool, u->buffer_size);
+        if (u->buffer.start == NULL) {
+            return luaL_error(L, "out of memory");
+        }
+
+        u->buffer.pos = u->buffer.start;
+        u->buffer.last = u->buffer.start;
+        u->buffer.end = u->buffer.start + u->buffer_size;
+    }
+
+    u->recv.last = u->recv.pos;
+    u->ft_type = 0;
+    u->prepare_retvals = ngx_http_lua_socket_receive_retval_handler;
+
+    rc = ngx_http_lua_socket_read(r, u);
+
+    if (rc != NGX_AGAIN) {
+        return u->prepare_retvals(r, u, L);
+    }
+
+    u->read_event_handler = ngx_http_lua_socket_read_handler;
+
+    return ngx_http_lua_socket_tcp_yield(L, r, ctx, u);
+}
+
+
+static int
+ngx_http_lua_socket_tcp_close(lua_State *L)
+{
+    ngx_http_lua_socket_upstream_t  *u;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    u = luaL_checkudata(L, 1, NGX_HTTP_LUA_SOCKET_TCP_MT);
+
+    if (u->peer.connection == NULL && u->resolver_ctx == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    ngx_http_lua_socket_tcp_finalize(u);
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_settimeout(lua_State *L)
+{
+    lua_Number                       timeout;
+    ngx_http_lua_socket_upstream_t  *u;
+
+    if (lua_gettop(L) != 2) {
+        return luaL_error(L, "expecting 2 arguments (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    u = luaL_checkudata(L, 1, NGX_HTTP_LUA_SOCKET_TCP_MT);
+
+    timeout = luaL_checknumber(L, 2);
+
+    if (timeout < 0) {
+        return luaL_argerror(L, 2, "bad timeout");
+    }
+
+    u->connect_timeout = (ngx_msec_t) timeout;
+    u->send_timeout = (ngx_msec_t) timeout;
+    u->read_timeout = (ngx_msec_t) timeout;
+
+    return 0;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_setkeepalive(lua_State *L)
+{
+    int                                  n;
+    lua_Number                           timeout;
+    lua_Integer                          pool_size;
+    size_t                               size;
+    ngx_uint_t                           i;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_request_t                  *r;
+    ngx_http_lua_ctx_t                  *ctx;
+    ngx_http_lua_loc_conf_t             *llcf;
+    ngx_http_lua_socket_pool_t          *spool, *stub;
+    ngx_http_lua_socket_pool_item_t     *items, *item;
+    ngx_http_lua_socket_upstream_t      *u;
+
+    n = lua_gettop(L);
+    if (n < 1 || n > 3) {
+        return luaL_error(L, "expecting 1 to 3 arguments (including the "
+                          "object), but got %d", n);
+    }
+
+    r = ngx_http_lua_socket_tcp_get_request(L, &ctx);
+
+    u = luaL_checkudata(L, 1, NGX_HTTP_LUA_SOCKET_TCP_MT);
+
+    llcf = ngx_http_get_module_loc_conf(r, ngx_http_lua_module);
+
+    timeout = (lua_Number) llcf->socket_keepalive_timeout;
+
+    if (n >= 2 && !lua_isnil(L, 2)) {
+        timeout = luaL_checknumber(L, 2);
+
+        if (timeout < 0) {
+            return luaL_argerror(L, 2, "bad timeout");
+        }
+    }
+
+    pool_size = (lua_Integer) llcf->socket_pool_size;
+
+    if (n == 3 && !lua_isnil(L, 3)) {
+        pool_size = luaL_checkinteger(L, 3);
+
+        if (pool_size <= 0) {
+            return luaL_argerror(L, 3, "bad pool size");
+        }
+    }
+
+    c = u->peer.connection;
+
+    if (c == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    if (u->request != r) {
+        return luaL_error(L, "bad request");
+    }
+
+    if (u->buffer.pos < u->buffer.last) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "unread data in buffer");
+        return 2;
+    }
+
+    if (c->read->eof
+        || c->read->error
+        || c->read->timedout
+        || c->write->error
+        || ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        ngx_http_lua_socket_tcp_finalize(u);
+
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid connection");
+        return 2;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NGX_LUA_SOCKET_POOL); /* pools */
+    ngx_http_lua_socket_push_pool_key(L, u);  /* pools key */
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);                        /* pools key pool */
+
+    spool = lua_touserdata(L, -1);
+    lua_pop(L, 1);                            /* pools key */
+
+    if (spool == NULL || spool->stub) {
+        /* the first caller decides the size of the pool, the misses
+         * counted before are kept */
+
+        stub = spool;
+
+        size = sizeof(ngx_http_lua_socket_pool_t)
+               + sizeof(ngx_http_lua_socket_pool_item_t) * pool_size;
+
+        spool = lua_newuserdata(L, size);     /* pools key pool */
+
+        ngx_memzero(spool, sizeof(ngx_http_lua_socket_pool_t));
+
+        if (stub) {
+            spool->misses = stub->misses;
+        }
+
+        luaL_getmetatable(L, NGX_HTTP_LUA_SOCKET_POOL_MT);
+        lua_setmetatable(L, -2);
+
+        ngx_queue_init(&spool->cache);
+        ngx_queue_init(&spool->free);
+
+        spool->size = (ngx_uint_t) pool_size;
+
+        items = (ngx_http_lua_socket_pool_item_t *) (spool + 1);
+
+        for (i = 0; i < spool->size; i++) {
+            items[i].socket_pool = spool;
+            ngx_queue_insert_tail(&spool->free, &items[i].queue);
+        }
+
+        lua_rawset(L, -3);                    /* pools */
+        lua_pop(L, 1);
+
+    } else {
+        lua_pop(L, 2);
+    }
+
+    if (!ngx_queue_empty(&spool->free)) {
+        q = ngx_queue_head(&spool->free);
+        ngx_queue_remove(q);
+
+        item = ngx_queue_data(q, ngx_http_lua_socket_pool_item_t, queue);
+
+    } else if (!ngx_queue_empty(&spool->cache)) {
+        /* make room by closing the least recently used idle connection */
+
+        q = ngx_queue_last(&spool->cache);
+        ngx_queue_remove(q);
+        spool->idle--;
+
+        item = ngx_queue_data(q, ngx_http_lua_socket_pool_item_t, queue);
+
+        ngx_close_connection(item->connection);
+
+        spool->evictions++;
+
+    } else {
+        /* lua_socket_pool_size 0 */
+
+        ngx_http_lua_socket_tcp_finalize(u);
+
+        lua_pushinteger(L, 1);
+        return 1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket keepalive: saving connection %p, "
+                   "timeout: %M", c, (ngx_msec_t) timeout);
+
+    item->connection = c;
+    item->reused = u->reused;
+
+    ngx_queue_insert_head(&spool->cache, q);
+    spool->idle++;
+
+    if (u->cleanup) {
+        *u->cleanup = NULL;
+        u->cleanup = NULL;
+    }
+
+    u->peer.connection = NULL;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (timeout) {
+        ngx_add_timer(c->read, (ngx_msec_t) timeout);
+    }
+
+    /* the connection outlives the request from now on */
+
+    c->data = item;
+    c->idle = 1;
+    c->pool = NULL;
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+
+    c->read->handler = ngx_http_lua_socket_keepalive_close_handler;
+    c->write->handler = ngx_http_lua_socket_keepalive_dummy_handler;
+
+    if (c->read->ready) {
+        /* the peer may have closed it or sent something unexpected */
+        ngx_http_lua_socket_keepalive_close_handler(c->read);
+    }
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_getreusedtimes(lua_State *L)
+{
+    ngx_http_lua_socket_upstream_t  *u;
+
+    if (lua_gettop(L) != 1) {
+        return luaL_error(L, "expecting 1 argument (including the object), "
+                          "but got %d", lua_gettop(L));
+    }
+
+    u = luaL_checkudata(L, 1, NGX_HTTP_LUA_SOCKET_TCP_MT);
+
+    if (u->peer.connection == NULL) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "closed");
+        return 2;
+    }
+
+    lua_pushinteger(L, (lua_Integer) u->reused);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_gc(lua_State *L)
+{
+    ngx_http_lua_socket_upstream_t  *u;
+
+    u = lua_touserdata(L, 1);
+
+    ngx_http_lua_socket_tcp_finalize(u);
+
+    return 0;
+}
+
+
+static int
+ngx_http_lua_socket_stats(lua_State *L)
+{
+    ngx_http_lua_socket_pool_t      *spool;
+
+    if (lua_gettop(L) != 0) {
+        return luaL_error(L, "expecting zero arguments, but got %d",
+                          lua_gettop(L));
+    }
+
+    lua_newtable(L);                                         /* res */
+    lua_getfield(L, LUA_REGISTRYINDEX, NGX_LUA_SOCKET_POOL); /* res pools */
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {               /* res pools key pool */
+        spool = lua_touserdata(L, -1);
+        lua_pop(L, 1);                           /* res pools key */
+
+        lua_pushvalue(L, -1);                    /* res pools key key */
+        lua_createtable(L, 0, 7 /* nrec */);
+
+        lua_pushinteger(L, (lua_Integer) spool->size);
+        lua_setfield(L, -2, "size");
+
+        lua_pushinteger(L, (lua_Integer) spool->idle);
+        lua_setfield(L, -2, "idle");
+
+        lua_pushinteger(L, (lua_Integer) spool->hits);
+        lua_setfield(L, -2, "hits");
+
+        lua_pushinteger(L, (lua_Integer) spool->misses);
+        lua_setfield(L, -2, "misses");
+
+        lua_pushinteger(L, (lua_Integer) spool->closed);
+        lua_setfield(L, -2, "closed");
+
+        lua_pushinteger(L, (lua_Integer) spool->expired);
+        lua_setfield(L, -2, "expired");
+
+        lua_pushinteger(L, (lua_Integer) spool->evictions);
+        lua_setfield(L, -2, "evictions");
+
+        lua_rawset(L, -5);                       /* res pools key */
+    }
+
+    lua_pop(L, 1);                               /* res */
+
+    return 1;
+}
+
+
+static void
+ngx_http_lua_socket_push_pool_key(lua_State *L,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    if (u->port == 0) {
+        /* "unix:" path */
+        lua_pushlstring(L, (char *) u->host.data, u->host.len);
+        return;
+    }
+
+    lua_pushfstring(L, "%s:%d", u->host.data, (int) u->port);
+}
+
+
+/* takes the most recently saved idle connection to the peer, if any */
+static ngx_int_t
+ngx_http_lua_socket_pool_get(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_lua_socket_pool_t          *spool;
+    ngx_http_lua_socket_pool_item_t     *item;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NGX_LUA_SOCKET_POOL); /* pools */
+    ngx_http_lua_socket_push_pool_key(L, u);  /* pools key */
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);                        /* pools key pool */
+
+    spool = lua_touserdata(L, -1);
+    lua_pop(L, 1);                            /* pools key */
+
+    if (spool == NULL) {
+        /* nothing was ever saved for this peer: count the miss in a
+         * pool without items, setkeepalive() sizes it */
+
+        spool = lua_newuserdata(L, sizeof(ngx_http_lua_socket_pool_t));
+
+        ngx_memzero(spool, sizeof(ngx_http_lua_socket_pool_t));
+
+        luaL_getmetatable(L, NGX_HTTP_LUA_SOCKET_POOL_MT);
+        lua_setmetatable(L, -2);
+
+        ngx_queue_init(&spool->cache);
+        ngx_queue_init(&spool->free);
+
+        spool->stub = 1;
+
+        lua_rawset(L, -3);                    /* pools */
+        lua_pop(L, 1);
+
+    } else {
+        lua_pop(L, 2);
+    }
+
+    if (ngx_queue_empty(&spool->cache)) {
+        spool->misses++;
+        return NGX_DECLINED;
+    }
+
+    spool->hits++;
+
+    q = ngx_queue_head(&spool->cache);
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&spool->free, q);
+    spool->idle--;
+
+    item = ngx_queue_data(q, ngx_http_lua_socket_pool_item_t, queue);
+    c = item->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket keepalive: reusing connection %p", c);
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    c->data = u;
+    c->idle = 0;
+    c->pool = r->pool;
+    c->log = r->connection->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->read->handler = ngx_http_lua_socket_tcp_handler;
+    c->write->handler = ngx_http_lua_socket_tcp_handler;
+
+    u->peer.connection = c;
+    u->peer.sockaddr = NULL;
+    u->peer.socklen = 0;
+    u->peer.name = &u->host;
+
+    u->reused = item->reused + 1;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_socket_keepalive_close_handler(ngx_event_t *ev)
+{
+    char                                 buf[1];
+    ssize_t                              n;
+    ngx_connection_t                    *c;
+    ngx_http_lua_socket_pool_t          *spool;
+    ngx_http_lua_socket_pool_item_t     *item;
+
+    c = ev->data;
+    item = c->data;
+    spool = item->socket_pool;
+
+    if (c->close) {
+        /* the worker is shutting down */
+        goto close;
+    }
+
+    if (ev->timedout) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "lua tcp socket keepalive: connection %p expired", c);
+
+        spool->expired++;
+        goto close;
+    }
+
+    /* an idle connection can only become readable by being closed */
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+        ev->ready = 0;
+
+        if (ngx_handle_read_event(c->read, 0) == NGX_OK) {
+            return;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "lua tcp socket keepalive: connection %p closed by the "
+                   "peer, recv: %z", c, n);
+
+    spool->closed++;
+
+close:
+
+    ngx_close_connection(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&spool->free, &item->queue);
+    spool->idle--;
+}
+
+
+static void
+ngx_http_lua_socket_keepalive_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "lua tcp socket keepalive dummy handler");
+}
+
+
+static int
+ngx_http_lua_socket_pool_gc(lua_State *L)
+{
+    ngx_queue_t                         *q;
+    ngx_http_lua_socket_pool_t          *spool;
+    ngx_http_lua_socket_pool_item_t     *item;
+
+    spool = lua_touserdata(L, 1);
+
+    while (!ngx_queue_empty(&spool->cache)) {
+        q = ngx_queue_head(&spool->cache);
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&spool->free, q);
+
+        item = ngx_queue_data(q, ngx_http_lua_socket_pool_item_t, queue);
+
+        ngx_close_connection(item->connection);
+    }
+
+    spool->idle = 0;
+
+    return 0;
+}
+
+
+/* only the request coroutine itself can wait for a socket */
+static ngx_http_request_t *
+ngx_http_lua_socket_tcp_get_request(lua_State *L, ngx_http_lua_ctx_t **ctxp)
+{
+    ngx_http_request_t          *r;
+    ngx_http_lua_ctx_t          *ctx;
+
+    r = ngx_http_lua_get_req(L);
+
+    if (r == NULL) {
+        luaL_error(L, "no request object found");
+        return NULL;
+    }
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        luaL_error(L, "no request ctx found");
+        return NULL;
+    }
+
+    if (ctx->cc != L) {
+        luaL_error(L, "API disabled in the current context");
+        return NULL;
+    }
+
+    *ctxp = ctx;
+
+    return r;
+}
+
+
+static int
+ngx_http_lua_socket_tcp_yield(lua_State *L, ngx_http_request_t *r,
+    ngx_http_lua_ctx_t *ctx, ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket operation requires I/O interruptions");
+
+    u->waiting = 1;
+
+    ctx->socket_busy = 1;
+    ctx->socket_ready = 0;
+    ctx->socket = u;
+
+    if (ctx->entered_content_phase) {
+        /* mimic ngx_http_set_write_handler */
+        r->write_event_handler = ngx_http_lua_content_wev_handler;
+    }
+
+    return lua_yield(L, 0);
+}
+
+
+static void
+ngx_http_lua_socket_tcp_wakeup(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_http_lua_ctx_t          *ctx;
+
+    u->read_event_handler = ngx_http_lua_socket_dummy_handler;
+    u->write_event_handler = ngx_http_lua_socket_dummy_handler;
+
+    u->done = 1;
+
+    if (!u->waiting) {
+        return;
+    }
+
+    u->waiting = 0;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_lua_module);
+    if (ctx == NULL) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket waking up the lua thread");
+
+    ctx->socket_busy = 0;
+    ctx->socket_ready = 1;
+
+    if (ctx->entered_content_phase || ctx->timer) {
+        r->write_event_handler(r);
+
+    } else {
+        ngx_http_core_run_phases(r);
+    }
+}
+
+
+static void
+ngx_http_lua_socket_tcp_finalize(ngx_http_lua_socket_upstream_t *u)
+{
+    if (u->cleanup) {
+        *u->cleanup = NULL;
+        u->cleanup = NULL;
+    }
+
+    if (u->resolver_ctx) {
+        ngx_resolve_name_done(u->resolver_ctx);
+        u->resolver_ctx = NULL;
+    }
+
+    if (u->peer.connection) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, u->peer.connection->log, 0,
+                       "lua close tcp socket connection: %d",
+                       u->peer.connection->fd);
+
+        ngx_close_connection(u->peer.connection);
+        u->peer.connection = NULL;
+    }
+}
+
+
+static void
+ngx_http_lua_socket_tcp_cleanup(void *data)
+{
+    ngx_http_lua_socket_upstream_t  *u = data;
+
+    u->cleanup = NULL;
+    u->waiting = 0;
+
+    ngx_http_lua_socket_tcp_finalize(u);
+
+    /* the buffers go away with the request pool */
+    u->request = NULL;
+}
+
+
+static void
+ngx_http_lua_socket_tcp_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    ngx_http_lua_socket_upstream_t  *u;
+
+    c = ev->data;
+    u = c->data;
+    r = u->request;
+    c = r->connection;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua tcp socket handler: \"%V?%V\"", &r->uri, &r->args);
+
+    if (ev->write) {
+        u->write_event_handler(r, u);
+
+    } else {
+        u->read_event_handler(r, u);
+    }
+
+#if defined(nginx_version) && nginx_version >= 8011
+    ngx_http_run_posted_requests(c);
+#endif
+}
+
+
+static void
+ngx_http_lua_socket_dummy_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket dummy handler");
+}
+
+
+static void
+ngx_http_lua_socket_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    ngx_uint_t                       i;
+    ngx_int_t                        rc;
+    ngx_uint_t                       waiting;
+    socklen_t                        socklen;
+    ngx_connection_t                *c;
+    ngx_http_request_t              *r;
+    struct sockaddr                 *sockaddr;
+    ngx_http_lua_socket_upstream_t  *u;
+#if !defined(nginx_version) || nginx_version < 1005008
+    struct sockaddr_in              *sin;
+#endif
+
+    u = ctx->data;
+    r = u->request;
+    c = r->connection;
+    waiting = u->waiting;
+
+    if (ctx->state) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "lua tcp socket failed to resolve \"%V\": %i",
+                       &ctx->name, ctx->state);
+
+        u->resolver_state = ctx->state;
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_RESOLVER;
+
+        ngx_resolve_name_done(ctx);
+        u->resolver_ctx = NULL;
+
+        ngx_http_lua_socket_tcp_wakeup(r, u);
+        goto done;
+    }
+
+    i = ngx_random() % ctx->naddrs;
+
+#if defined(nginx_version) && nginx_version >= 1005008
+    socklen = ctx->addrs[i].socklen;
+
+    sockaddr = ngx_palloc(r->pool, socklen);
+    if (sockaddr != NULL) {
+        ngx_memcpy(sockaddr, ctx->addrs[i].sockaddr, socklen);
+        ngx_inet_set_port(sockaddr, u->port);
+    }
+#else
+    socklen = sizeof(struct sockaddr_in);
+
+    sin = ngx_pcalloc(r->pool, socklen);
+    if (sin != NULL) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(u->port);
+        sin->sin_addr.s_addr = ctx->addrs[i];
+    }
+
+    sockaddr = (struct sockaddr *) sin;
+#endif
+
+    ngx_resolve_name_done(ctx);
+    u->resolver_ctx = NULL;
+
+    if (sockaddr == NULL) {
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_NOMEM;
+        ngx_http_lua_socket_tcp_wakeup(r, u);
+        goto done;
+    }
+
+    rc = ngx_http_lua_socket_connect_peer(r, u, sockaddr, socklen);
+
+    if (rc != NGX_AGAIN) {
+        ngx_http_lua_socket_tcp_wakeup(r, u);
+    }
+
+done:
+
+#if defined(nginx_version) && nginx_version >= 8011
+    if (waiting) {
+        ngx_http_run_posted_requests(c);
+    }
+#else
+    (void) waiting;
+#endif
+}
+
+
+/* returns NGX_AGAIN if the connect() is in progress */
+static ngx_int_t
+ngx_http_lua_socket_connect_peer(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, struct sockaddr *sockaddr,
+    socklen_t socklen)
+{
+    ngx_int_t                rc;
+    ngx_connection_t        *c;
+    ngx_peer_connection_t   *pc;
+
+    pc = &u->peer;
+
+    pc->sockaddr = sockaddr;
+    pc->socklen = socklen;
+    pc->name = &u->host;
+    pc->get = ngx_event_get_peer;
+    pc->log = r->connection->log;
+    pc->log_error = NGX_ERROR_ERR;
+    pc->tries = 1;
+
+    rc = ngx_event_connect_peer(pc);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua tcp socket connect: %i", rc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        u->socket_errno = ngx_socket_errno;
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+        pc->connection = NULL;
+        return NGX_ERROR;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN */
+
+    c = pc->connection;
+
+    c->data = u;
+    c->read->handler = ngx_http_lua_socket_tcp_handler;
+    c->write->handler = ngx_http_lua_socket_tcp_handler;
+
+    c->pool = r->pool;
+    c->log = r->connection->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    if (rc == NGX_OK) {
+        return NGX_OK;
+    }
+
+    u->read_event_handler = ngx_http_lua_socket_connected_handler;
+    u->write_event_handler = ngx_http_lua_socket_connected_handler;
+
+    ngx_add_timer(c->write, u->connect_timeout);
+
+    return NGX_AGAIN;
+}
+
+
+static void
+ngx_http_lua_socket_connected_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_connection_t            *c;
+
+    c = u->peer.connection;
+
+    if (c->write->timedout) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "lua tcp socket connect timed out");
+
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_TIMEOUT;
+        ngx_http_lua_socket_tcp_finalize(u);
+        ngx_http_lua_socket_tcp_wakeup(r, u);
+        return;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (ngx_http_lua_socket_test_connect(u, c) != NGX_OK) {
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+        ngx_http_lua_socket_tcp_finalize(u);
+    }
+
+    ngx_http_lua_socket_tcp_wakeup(r, u);
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_test_connect(ngx_http_lua_socket_upstream_t *u,
+    ngx_connection_t *c)
+{
+    int              err;
+    socklen_t        len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            u->socket_errno = err;
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        /*
+         * BSDs and Linux return 0 and set a pending error in err
+         * Solaris returns -1 and sets errno
+         */
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_errno;
+        }
+
+        if (err) {
+            u->socket_errno = err;
+
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_send(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ssize_t                  n;
+    ngx_buf_t               *b;
+    ngx_connection_t        *c;
+
+    c = u->peer.connection;
+    b = &u->send;
+
+    while (b->pos < b->last) {
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua tcp socket sent %z bytes", n);
+
+        if (n == NGX_ERROR) {
+            u->socket_errno = ngx_socket_errno;
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+            ngx_http_lua_socket_tcp_finalize(u);
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_AGAIN || n == 0) {
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+                ngx_http_lua_socket_tcp_finalize(u);
+                return NGX_ERROR;
+            }
+
+            ngx_add_timer(c->write, u->send_timeout);
+
+            return NGX_AGAIN;
+        }
+
+        b->pos += n;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_socket_send_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_connection_t            *c;
+
+    c = u->peer.connection;
+
+    if (c->write->timedout) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "lua tcp socket write timed out");
+
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_TIMEOUT;
+        ngx_http_lua_socket_tcp_finalize(u);
+        ngx_http_lua_socket_tcp_wakeup(r, u);
+        return;
+    }
+
+    if (ngx_http_lua_socket_send(r, u) == NGX_AGAIN) {
+        return;
+    }
+
+    ngx_http_lua_socket_tcp_wakeup(r, u);
+}
+
+
+/*
+ * Runs the input filter on the buffered data and reads more until it is
+ * satisfied. Whatever the filter leaves in the buffer is kept for the next
+ * receive() call.
+ */
+static ngx_int_t
+ngx_http_lua_socket_read(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ssize_t                  n;
+    ngx_int_t                rc;
+    ngx_buf_t               *b;
+    ngx_event_t             *rev;
+    ngx_connection_t        *c;
+
+    c = u->peer.connection;
+    rev = c->read;
+    b = &u->buffer;
+
+    for ( ;; ) {
+
+        if (b->pos != b->last) {
+            rc = u->input_filter(u);
+
+            if (rc == NGX_OK) {
+                break;
+            }
+
+            if (rc == NGX_ERROR) {
+                u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_NOMEM;
+                ngx_http_lua_socket_tcp_finalize(u);
+                return NGX_ERROR;
+            }
+
+            /* rc == NGX_AGAIN: the buffer has been consumed */
+        }
+
+        b->pos = b->start;
+        b->last = b->start;
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "lua tcp socket recv returned %z", n);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+                ngx_http_lua_socket_tcp_finalize(u);
+                return NGX_ERROR;
+            }
+
+            ngx_add_timer(rev, u->read_timeout);
+
+            return NGX_AGAIN;
+        }
+
+        if (n == 0) {
+            ngx_http_lua_socket_tcp_finalize(u);
+
+            if (u->input_filter == ngx_http_lua_socket_read_all) {
+                return NGX_OK;
+            }
+
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_CLOSED;
+            return NGX_ERROR;
+        }
+
+        if (n == NGX_ERROR) {
+            u->socket_errno = ngx_socket_errno;
+            u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_ERROR;
+            ngx_http_lua_socket_tcp_finalize(u);
+            return NGX_ERROR;
+        }
+
+        b->last += n;
+    }
+
+    if (rev->timer_set) {
+        ngx_del_timer(rev);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_socket_read_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_connection_t            *c;
+
+    c = u->peer.connection;
+
+    if (c->read->timedout) {
+        c->read->timedout = 0;
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "lua tcp socket read timed out");
+
+        /* the connection is kept, it is up to the caller to close it */
+
+        u->ft_type |= NGX_HTTP_LUA_SOCKET_FT_TIMEOUT;
+        ngx_http_lua_socket_tcp_wakeup(r, u);
+        return;
+    }
+
+    if (ngx_http_lua_socket_read(r, u) == NGX_AGAIN) {
+        return;
+    }
+
+    ngx_http_lua_socket_tcp_wakeup(r, u);
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_read_line(ngx_http_lua_socket_upstream_t *u)
+{
+    u_char                  *lf;
+    ngx_buf_t               *b;
+
+    b = &u->buffer;
+
+    lf = ngx_strlchr(b->pos, b->last, LF);
+
+    if (lf == NULL) {
+        if (ngx_http_lua_socket_append(u, b->pos, b->last - b->pos)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        b->pos = b->last;
+        return NGX_AGAIN;
+    }
+
+    if (ngx_http_lua_socket_append(u, b->pos, lf - b->pos) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    b->pos = lf + 1;
+
+    /* the CR may have come in the previous buffer */
+
+    if (u->recv.last > u->recv.pos && *(u->recv.last - 1) == CR) {
+        u->recv.last--;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_read_size(ngx_http_lua_socket_upstream_t *u)
+{
+    size_t                   size;
+    ngx_buf_t               *b;
+
+    b = &u->buffer;
+
+    size = ngx_min(u->rest, (size_t) (b->last - b->pos));
+
+    if (ngx_http_lua_socket_append(u, b->pos, size) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    b->pos += size;
+    u->rest -= size;
+
+    return u->rest ? NGX_AGAIN : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_read_all(ngx_http_lua_socket_upstream_t *u)
+{
+    ngx_buf_t               *b;
+
+    b = &u->buffer;
+
+    if (ngx_http_lua_socket_append(u, b->pos, b->last - b->pos) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    b->pos = b->last;
+
+    /* until the peer closes the connection */
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_lua_socket_append(ngx_http_lua_socket_upstream_t *u, u_char *p,
+    size_t len)
+{
+    size_t                   size;
+    u_char                  *start;
+    ngx_buf_t               *b;
+    ngx_pool_t              *pool;
+
+    b = &u->recv;
+
+    if ((size_t) (b->end - b->last) < len) {
+        size = ngx_max((size_t) (b->last - b->pos) + len,
+                       2 * (size_t) (b->end - b->start));
+
+        size = ngx_max(size, u->buffer_size);
+
+        pool = u->request->pool;
+
+        start = ngx_palloc(pool, size);
+        if (start == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->last = ngx_copy(start, b->pos, b->last - b->pos);
+
+        if (b->start) {
+            ngx_pfree(pool, b->start);
+        }
+
+        b->start = start;
+        b->pos = start;
+        b->end = start + size;
+    }
+
+    b->last = ngx_copy(b->last, p, len);
+
+    return NGX_OK;
+}
+
+
+static int
+ngx_http_lua_socket_error_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L)
+{
+    lua_pushnil(L);
+
+    if (u->ft_type & NGX_HTTP_LUA_SOCKET_FT_TIMEOUT) {
+        lua_pushliteral(L, "timeout");
+
+    } else if (u->ft_type & NGX_HTTP_LUA_SOCKET_FT_CLOSED) {
+        lua_pushliteral(L, "closed");
+
+    } else if (u->ft_type & NGX_HTTP_LUA_SOCKET_FT_RESOLVER) {
+        lua_pushfstring(L, "%s could not be resolved (%d: %s)",
+                        u->host.data, (int) u->resolver_state,
+                        ngx_resolver_strerror(u->resolver_state));
+
+    } else if (u->ft_type & NGX_HTTP_LUA_SOCKET_FT_NOMEM) {
+        lua_pushliteral(L, "out of memory");
+
+    } else if (u->socket_errno) {
+        lua_pushstring(L, strerror(u->socket_errno));
+
+    } else {
+        lua_pushliteral(L, "error");
+    }
+
+    return 2;
+}
+
+
+static int
+ngx_http_lua_socket_connect_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L)
+{
+    if (u->ft_type) {
+        return ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_send_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L)
+{
+    if (u->ft_type) {
+        return ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    lua_pushinteger(L, (lua_Integer) u->sent);
+    return 1;
+}
+
+
+static int
+ngx_http_lua_socket_receive_retval_handler(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L)
+{
+    int                      n;
+
+    n = 0;
+
+    if (u->ft_type) {
+        n = ngx_http_lua_socket_error_retval_handler(r, u, L);
+    }
+
+    /* the partial data, if any, goes along with the error */
+
+    if (u->recv.pos == NULL) {
+        lua_pushliteral(L, "");
+
+    } else {
+        lua_pushlstring(L, (char *) u->recv.pos, u->recv.last - u->recv.pos);
+        u->recv.last = u->recv.pos;
+    }
+
+    return n + 1;
+}
@@ -0,0 +1,105 @@
+#ifndef NGX_HTTP_LUA_SOCKET_H
+#define NGX_HTTP_LUA_SOCKET_H
+
+
+#include "ngx_http_lua_common.h"
+
+
+#define NGX_HTTP_LUA_SOCKET_FT_ERROR        0x0001
+#define NGX_HTTP_LUA_SOCKET_FT_TIMEOUT      0x0002
+#define NGX_HTTP_LUA_SOCKET_FT_CLOSED       0x0004
+#define NGX_HTTP_LUA_SOCKET_FT_RESOLVER     0x0008
+#define NGX_HTTP_LUA_SOCKET_FT_NOMEM        0x0010
+
+
+typedef struct ngx_http_lua_socket_upstream_s
+    ngx_http_lua_socket_upstream_t;
+
+typedef struct ngx_http_lua_socket_pool_s  ngx_http_lua_socket_pool_t;
+
+
+typedef int (*ngx_http_lua_socket_retval_handler_pt)(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u, lua_State *L);
+
+typedef void (*ngx_http_lua_socket_event_handler_pt)(ngx_http_request_t *r,
+    ngx_http_lua_socket_upstream_t *u);
+
+typedef ngx_int_t (*ngx_http_lua_socket_input_filter_pt)(
+    ngx_http_lua_socket_upstream_t *u);
+
+
+struct ngx_http_lua_socket_upstream_s {
+    ngx_http_lua_socket_retval_handler_pt   prepare_retvals;
+    ngx_http_lua_socket_event_handler_pt    read_event_handler;
+    ngx_http_lua_socket_event_handler_pt    write_event_handler;
+    ngx_http_lua_socket_input_filter_pt     input_filter;
+
+    ngx_http_request_t                     *request;
+    ngx_http_cleanup_pt                    *cleanup;
+    ngx_http_cleanup_t                     *cln;  /* of request, kept for
+                                                     the next connect() */
+
+    ngx_peer_connection_t                   peer;
+    ngx_resolver_ctx_t                     *resolver_ctx;
+    ngx_str_t                               host;
+    size_t                                  host_size;  /* allocated */
+    in_port_t                               port;
+
+    ngx_msec_t                              connect_timeout;
+    ngx_msec_t                              send_timeout;
+    ngx_msec_t                              read_timeout;
+
+    size_t                                  buffer_size;
+    ngx_buf_t                               buffer;   /* raw input */
+    ngx_buf_t                               recv;     /* data of the current
+                                                         receive() call */
+    ngx_buf_t                               send;
+
+    size_t                                  rest;     /* receive(size) */
+    size_t                                  sent;
+
+    ngx_uint_t                              ft_type;
+    ngx_err_t                               socket_errno;
+    ngx_int_t                               resolver_state;
+
+    ngx_uint_t                              reused;
+
+    unsigned                                waiting:1;
+    unsigned                                done:1;
+};
+
+
+typedef struct {
+    ngx_http_lua_socket_pool_t             *socket_pool;
+    ngx_queue_t                             queue;
+    ngx_connection_t                       *connection;
+    ngx_uint_t                              reused;
+} ngx_http_lua_socket_pool_item_t;
+
+
+/* lives in a full userdata anchored in the Lua registry of every worker */
+struct ngx_http_lua_socket_pool_s {
+    ngx_queue_t                             cache;    /* idle connections,
+                                                         most recent first */
+    ngx_queue_t                             free;
+    ngx_uint_t                              size;
+    ngx_uint_t                              idle;
+
+    ngx_uint_t                              hits;
+    ngx_uint_t                              misses;
+    ngx_uint_t                              closed;   /* by the peer */
+    ngx_uint_t                              expired;
+    ngx_uint_t                              evictions;  /* to make room */
+
+    unsigned                                stub:1;   /* counters only,
+                                                         until the first
+                                                         setkeepalive() */
+
+    /* followed by the size items */
+};
+
+
+void ngx_http_lua_inject_socket_api(lua_State *L);
+
+
+#endif /* NGX_HTTP_LUA_SOCKET_H */
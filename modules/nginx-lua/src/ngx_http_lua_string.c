@@ -79,9 +79,7 @@ ngx_http_lua_ngx_escape_uri(lua_State *L)
     uintptr_t                escape;
     u_char                  *src, *dst;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -128,9 +126,7 @@ ngx_http_lua_ngx_unescape_uri(lua_State *L)
     u_char                  *p;
     u_char                  *src, *dst;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -168,9 +164,7 @@ ngx_http_lua_ngx_quote_sql_str(lua_State *L)
     u_char                  *p;
     u_char                  *src, *dst;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -377,9 +371,7 @@ ngx_http_lua_ngx_decode_base64(lua_State *L)
     ngx_http_request_t      *r;
     ngx_str_t                p, src;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -423,9 +415,7 @@ ngx_http_lua_ngx_encode_base64(lua_State *L)
     ngx_http_request_t      *r;
     ngx_str_t                p, src;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return luaL_error(L, "no request object found");
@@ -506,9 +496,7 @@ ngx_http_lua_ngx_encode_args(lua_State *L) {
                 lua_gettop(L));
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     luaL_checktype(L, 1, LUA_TTABLE);
 
@@ -0,0 +1,551 @@
+#ifndef DDEBUG
+#define DDEBUG 0
+#endif
+#include "ddebug.h"
+
+
+#include "ngx_http_lua_timer.h"
+#include "ngx_http_lua_util.h"
+
+
+/*
+ * ngx.timer.at() moves the callback and its arguments into a new
+ * coroutine anchored in the registry and arms a plain nginx timer. When
+ * the timer expires, the coroutine runs on a fake connection and request
+ * carrying the configuration of the request that created the timer, so
+ * that most of the ngx.* API (ngx.var, ngx.ctx, ngx.shared, cosockets
+ * and so on) just works. The APIs that talk to the downstream client are
+ * disabled with NGX_HTTP_LUA_CHECK_TIMER.
+ *
+ * Timers still pending when the worker is shutting down are expired
+ * right away with the "premature" argument set to true. We learn about
+ * the shutdown through the "watcher", a fake idle connection that nginx
+ * closes along with the other idle connections of the exiting worker.
+ */
+
+
+static int ngx_http_lua_ngx_timer_at(lua_State *L);
+static void ngx_http_lua_timer_handler(ngx_event_t *ev);
+static void ngx_http_lua_timer_wev_handler(ngx_http_request_t *r);
+static void ngx_http_lua_timer_finalize(ngx_http_request_t *r);
+static ngx_http_request_t *ngx_http_lua_timer_create_request(
+    ngx_http_lua_timer_ctx_t *tctx);
+static void ngx_http_lua_timer_close_connection(ngx_connection_t *c);
+static void ngx_http_lua_timer_free_connection(ngx_connection_t *c);
+static ngx_int_t ngx_http_lua_timer_watch_shutdown(
+    ngx_http_lua_main_conf_t *lmcf);
+static void ngx_http_lua_abort_pending_timers(ngx_event_t *ev);
+static void ngx_http_lua_timer_collect(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel, ngx_event_t **evs, ngx_uint_t *n,
+    ngx_uint_t max);
+
+
+void
+ngx_http_lua_inject_timer_api(lua_State *L)
+{
+    lua_createtable(L, 0 /* narr */, 1 /* nrec */);    /* ngx.timer. */
+
+    lua_pushcfunction(L, ngx_http_lua_ngx_timer_at);
+    lua_setfield(L, -2, "at");
+
+    lua_setfield(L, -2, "timer");
+}
+
+
+static int
+ngx_http_lua_ngx_timer_at(lua_State *L)
+{
+    int                          nargs, co_ref;
+    lua_Number                   delay;
+    lua_State                   *vm, *co;
+    ngx_event_t                 *ev;
+    ngx_http_request_t          *r;
+    ngx_http_lua_main_conf_t    *lmcf;
+    ngx_http_lua_timer_ctx_t    *tctx;
+
+    nargs = lua_gettop(L);
+    if (nargs < 2) {
+        return luaL_error(L, "expecting at least 2 arguments but got %d",
+                          nargs);
+    }
+
+    delay = luaL_checknumber(L, 1);
+    if (delay < 0) {
+        return luaL_argerror(L, 1, "negative delay");
+    }
+
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    r = ngx_http_lua_get_req(L);
+
+    if (r == NULL) {
+        return luaL_error(L, "no request object found");
+    }
+
+    if (ngx_exiting) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "process exiting");
+        return 2;
+    }
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (lmcf->pending_timers >= lmcf->max_pending_timers) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "too many pending timers");
+        return 2;
+    }
+
+    if (lmcf->watcher == NULL
+        && ngx_http_lua_timer_watch_shutdown(lmcf) != NGX_OK)
+    {
+        return luaL_error(L, "out of memory");
+    }
+
+    ev = ngx_alloc(sizeof(ngx_event_t) + sizeof(ngx_http_lua_timer_ctx_t),
+                   r->connection->log);
+    if (ev == NULL) {
+        return luaL_error(L, "out of memory");
+    }
+
+    /* the callback runs on a coroutine of the main thread, just like
+     * the request handlers */
+
+    vm = lmcf->lua;
+
+    co = ngx_http_lua_new_thread(r, vm, &co_ref);
+    if (co == NULL) {
+        ngx_free(ev);
+        return luaL_error(L, "failed to create the timer coroutine");
+    }
+
+    /* move the callback and its arguments over */
+    lua_xmove(L, co, nargs - 1);
+
+    lua_pushvalue(co, 1);
+    lua_setglobal(co, GLOBALS_SYMBOL_RUNCODE);
+
+    tctx = (ngx_http_lua_timer_ctx_t *) (ev + 1);
+
+    tctx->main_conf = r->main_conf;
+    tctx->srv_conf = r->srv_conf;
+    tctx->loc_conf = r->loc_conf;
+    tctx->lmcf = lmcf;
+    tctx->co = co;
+    tctx->co_ref = co_ref;
+    tctx->nargs = nargs - 2;
+    tctx->premature = 0;
+
+    ngx_memzero(ev, sizeof(ngx_event_t));
+
+    ev->handler = ngx_http_lua_timer_handler;
+    ev->data = tctx;
+    ev->log = ngx_cycle->log;
+
+    ngx_add_timer(ev, (ngx_msec_t) (delay * 1000));
+
+    lmcf->pending_timers++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua ngx.timer.at added timer %p, pending timers: %i",
+                   ev, lmcf->pending_timers);
+
+    lua_pushinteger(L, 1);
+    return 1;
+}
+
+
+static void
+ngx_http_lua_timer_handler(ngx_event_t *ev)
+{
+    lua_State                   *L;
+    ngx_int_t                    rc;
+    ngx_http_request_t          *r;
+    ngx_http_cleanup_t          *cln;
+    ngx_http_lua_ctx_t          *ctx;
+    ngx_http_lua_main_conf_t    *lmcf;
+    ngx_http_lua_timer_ctx_t     tctx;
+
+    tctx = *(ngx_http_lua_timer_ctx_t *) ev->data;
+    ngx_free(ev);
+
+    lmcf = tctx.lmcf;
+    L = lmcf->lua;
+
+    lmcf->pending_timers--;
+
+    if (ngx_exiting) {
+        tctx.premature = 1;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua ngx.timer expired, premature: %d, pending timers: %i",
+                   (int) tctx.premature, lmcf->pending_timers);
+
+    if (lmcf->running_timers >= lmcf->max_running_timers) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "%i lua_max_running_timers are not enough",
+                      lmcf->max_running_timers);
+        goto failed;
+    }
+
+    r = ngx_http_lua_timer_create_request(&tctx);
+    if (r == NULL) {
+        goto failed;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_lua_ctx_t));
+    if (ctx == NULL) {
+        goto abort;
+    }
+
+    ctx->ctx_ref = LUA_NOREF;
+    ctx->timer = 1;
+
+    ngx_http_set_ctx(r, ctx, ngx_http_lua_module);
+
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        goto abort;
+    }
+
+    /* from now on the request cleanup owns the coroutine */
+
+    ctx->cc = tctx.co;
+    ctx->cc_ref = tctx.co_ref;
+
+    cln->handler = ngx_http_lua_request_cleanup;
+    cln->data = r;
+    ctx->cleanup = &cln->handler;
+
+    /* the callback is called as fn(premature, ...) */
+    lua_pushboolean(tctx.co, tctx.premature);
+    lua_insert(tctx.co, 2);
+
+    r->write_event_handler = ngx_http_lua_timer_wev_handler;
+
+    lmcf->running_timers++;
+
+    rc = ngx_http_lua_run_thread(L, r, ctx, tctx.nargs + 1);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua ngx.timer run thread returned %i", rc);
+
+    if (rc == NGX_AGAIN) {
+        return;
+    }
+
+    ngx_http_lua_timer_finalize(r);
+    return;
+
+abort:
+
+    ngx_http_lua_timer_close_connection(r->connection);
+
+failed:
+
+    lua_getfield(L, LUA_REGISTRYINDEX, NGX_LUA_CORT_REF);
+    luaL_unref(L, -1, tctx.co_ref);
+    lua_pop(L, 1);
+}
+
+
+static void
+ngx_http_lua_timer_wev_handler(ngx_http_request_t *r)
+{
+    ngx_int_t           rc;
+
+    rc = ngx_http_lua_wev_handler(r);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua ngx.timer wev handler returned %i", rc);
+
+    if (rc == NGX_DONE) {
+        /* the coroutine is still waiting for something */
+        return;
+    }
+
+    ngx_http_lua_timer_finalize(r);
+}
+
+
+static void
+ngx_http_lua_timer_finalize(ngx_http_request_t *r)
+{
+    ngx_http_cleanup_t          *cln;
+    ngx_http_lua_main_conf_t    *lmcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "lua ngx.timer finalize");
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    lmcf->running_timers--;
+
+    /* releases the coroutine, ngx.ctx and any socket left open */
+
+    for (cln = r->cleanup; cln; cln = cln->next) {
+        if (cln->handler) {
+            cln->handler(cln->data);
+            cln->handler = NULL;
+        }
+    }
+
+    ngx_http_lua_timer_close_connection(r->connection);
+}
+
+
+static ngx_http_request_t *
+ngx_http_lua_timer_create_request(ngx_http_lua_timer_ctx_t *tctx)
+{
+    ngx_pool_t                  *pool;
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_core_main_conf_t   *cmcf;
+
+    c = ngx_get_connection(0, ngx_cycle->log);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->fd = (ngx_socket_t) -1;
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        c->destroyed = 1;
+        ngx_http_lua_timer_free_connection(c);
+        return NULL;
+    }
+
+    c->pool = pool;
+    c->log = ngx_cycle->log;
+    c->log_error = NGX_ERROR_INFO;
+
+    r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
+    if (r == NULL) {
+        goto failed;
+    }
+
+    c->data = r;
+    c->requests++;
+
+    r->connection = c;
+    r->pool = pool;
+
+    r->ctx = ngx_pcalloc(pool, sizeof(void *) * ngx_http_max_module);
+    if (r->ctx == NULL) {
+        goto failed;
+    }
+
+    r->main_conf = tctx->main_conf;
+    r->srv_conf = tctx->srv_conf;
+    r->loc_conf = tctx->loc_conf;
+
+    cmcf = ngx_http_get_module_main_conf(r, ngx_http_core_module);
+
+    r->variables = ngx_pcalloc(pool, cmcf->variables.nelts
+                               * sizeof(ngx_http_variable_value_t));
+    if (r->variables == NULL) {
+        goto failed;
+    }
+
+    if (ngx_list_init(&r->headers_in.headers, pool, 2,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    if (ngx_list_init(&r->headers_out.headers, pool, 2,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        goto failed;
+    }
+
+    r->main = r;
+#if defined(nginx_version) && nginx_version >= 8011
+    r->count = 1;
+#endif
+
+    r->method = NGX_HTTP_UNKNOWN;
+    r->headers_in.content_length_n = -1;
+    r->headers_out.content_length_n = -1;
+    r->headers_out.last_modified_time = -1;
+
+    r->uri_changes = NGX_HTTP_MAX_URI_CHANGES + 1;
+    r->subrequests = NGX_HTTP_MAX_SUBREQUESTS + 1;
+
+    r->discard_body = 1;
+    r->read_event_handler = ngx_http_block_reading;
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    r->http_state = NGX_HTTP_PROCESS_REQUEST_STATE;
+    r->signature = NGX_HTTP_MODULE;
+
+    return r;
+
+failed:
+
+    ngx_http_lua_timer_close_connection(c);
+    return NULL;
+}
+
+
+static void
+ngx_http_lua_timer_close_connection(ngx_connection_t *c)
+{
+    ngx_pool_t          *pool;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "lua ngx.timer close fake connection");
+
+    pool = c->pool;
+
+    /* the socket event handlers call ngx_http_run_posted_requests() on
+     * this connection after resuming us */
+    c->destroyed = 1;
+
+    ngx_http_lua_timer_free_connection(c);
+
+    ngx_destroy_pool(pool);
+}
+
+
+/*
+ * Our fake connections have no fd, but ngx_free_connection() clears
+ * ngx_cycle->files[c->fd] under the fd based event methods: lend it
+ * fd 0 and put back whatever files[0] held.
+ */
+static void
+ngx_http_lua_timer_free_connection(ngx_connection_t *c)
+{
+    ngx_connection_t    *saved_c = NULL;
+
+    if (ngx_cycle->files) {
+        saved_c = ngx_cycle->files[0];
+    }
+
+    c->fd = 0;
+    ngx_free_connection(c);
+
+    if (ngx_cycle->files) {
+        ngx_cycle->files[0] = saved_c;
+    }
+
+    c->fd = (ngx_socket_t) -1;
+}
+
+
+/*
+ * The exiting worker closes its idle connections in every cycle of the
+ * shutdown loop, and only those with fd != -1, hence the -2.
+ */
+static ngx_int_t
+ngx_http_lua_timer_watch_shutdown(ngx_http_lua_main_conf_t *lmcf)
+{
+    ngx_connection_t            *c;
+
+    c = ngx_get_connection(0, ngx_cycle->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->fd = (ngx_socket_t) -2;
+    c->idle = 1;
+    c->data = lmcf;
+    c->read->handler = ngx_http_lua_abort_pending_timers;
+
+    lmcf->watcher = c;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_lua_abort_pending_timers(ngx_event_t *ev)
+{
+    ngx_uint_t                   i, n;
+    ngx_event_t                **evs;
+    ngx_connection_t            *c;
+    ngx_http_lua_main_conf_t    *lmcf;
+    ngx_http_lua_timer_ctx_t    *tctx;
+
+    c = ev->data;
+
+    if (!c->close) {
+        return;
+    }
+
+    lmcf = c->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "lua abort pending timers: %i", lmcf->pending_timers);
+
+    c->read->closed = 1;
+    c->write->closed = 1;
+
+    ngx_http_lua_timer_free_connection(c);
+
+    lmcf->watcher = NULL;
+
+    if (lmcf->pending_timers == 0) {
+        return;
+    }
+
+    evs = ngx_alloc(lmcf->pending_timers * sizeof(ngx_event_t *),
+                    ngx_cycle->log);
+    if (evs == NULL) {
+        return;
+    }
+
+    n = 0;
+
+    if (ngx_event_timer_rbtree.root != ngx_event_timer_rbtree.sentinel) {
+        ngx_http_lua_timer_collect(ngx_event_timer_rbtree.root,
+                                   ngx_event_timer_rbtree.sentinel,
+                                   evs, &n, (ngx_uint_t) lmcf->pending_timers);
+    }
+
+    /* the callbacks may add or delete timers, so do not run them while
+     * walking the tree */
+
+    for (i = 0; i < n; i++) {
+        ev = evs[i];
+
+        ngx_del_timer(ev);
+
+        tctx = ev->data;
+        tctx->premature = 1;
+
+        ev->timedout = 1;
+        ev->handler(ev);
+    }
+
+    ngx_free(evs);
+}
+
+
+static void
+ngx_http_lua_timer_collect(ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel, ngx_event_t **evs, ngx_uint_t *n,
+    ngx_uint_t max)
+{
+    ngx_event_t         *ev;
+
+    while (node != sentinel && *n < max) {
+        ngx_http_lua_timer_collect(node->left, sentinel, evs, n, max);
+
+        if (*n == max) {
+            return;
+        }
+
+        ev = (ngx_event_t *) ((char *) node - offsetof(ngx_event_t, timer));
+
+        if (ev->handler == ngx_http_lua_timer_handler) {
+            evs[(*n)++] = ev;
+        }
+
+        node = node->right;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef NGX_HTTP_LUA_TIMER_H
+#define NGX_HTTP_LUA_TIMER_H
+
+
+#include "ngx_http_lua_common.h"
+
+
+typedef struct {
+    void                        **main_conf;
+    void                        **srv_conf;
+    void                        **loc_conf;
+
+    ngx_http_lua_main_conf_t     *lmcf;
+
+    lua_State                    *co;       /* the callback coroutine */
+    int                           co_ref;   /* anchored in NGX_LUA_CORT_REF */
+    int                           nargs;    /* user arguments on co's stack */
+
+    unsigned                      premature:1;
+} ngx_http_lua_timer_ctx_t;
+
+
+void ngx_http_lua_inject_timer_api(lua_State *L);
+
+
+#endif /* NGX_HTTP_LUA_TIMER_H */
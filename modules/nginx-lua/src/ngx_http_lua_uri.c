@@ -55,9 +55,7 @@ ngx_http_lua_ngx_req_set_uri(lua_State *L)
         return luaL_error(L, "expecting 1 argument but seen %d", n);
     }
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (n == 2) {
         luaL_checktype(L, 2, LUA_TBOOLEAN);
@@ -26,11 +26,16 @@
 #include "ngx_http_lua_misc.h"
 #include "ngx_http_lua_consts.h"
 #include "ngx_http_lua_shdict.h"
+#include "ngx_http_lua_lrucache.h"
+#include "ngx_http_lua_socket.h"
+#include "ngx_http_lua_timer.h"
 
 
 static ngx_int_t ngx_http_lua_send_http10_headers(ngx_http_request_t *r,
         ngx_http_lua_ctx_t *ctx);
 static void init_ngx_lua_registry(ngx_conf_t *cf, lua_State *L);
+static ngx_int_t ngx_http_lua_pool_thread(ngx_http_request_t *r,
+    lua_State *cr, int ref);
 static void init_ngx_lua_globals(ngx_conf_t *cf, lua_State *L);
 static void ngx_http_lua_set_path(ngx_conf_t *cf, lua_State *L, int tab_idx,
         const char *fieldname, const char *path, const char *default_path);
@@ -43,6 +48,9 @@ static ngx_int_t ngx_http_lua_handle_rewrite_jump(lua_State *L,
 static int ngx_http_lua_ngx_check_aborted(lua_State *L);
 
 
+ngx_http_request_t  *ngx_http_lua_cur_req = NULL;
+
+
 #ifndef LUA_PATH_SEP
 #define LUA_PATH_SEP ";"
 #endif
@@ -168,16 +176,38 @@ ngx_http_lua_new_state(ngx_conf_t *cf, ngx_http_lua_main_conf_t *lmcf)
 lua_State *
 ngx_http_lua_new_thread(ngx_http_request_t *r, lua_State *L, int *ref)
 {
-    int              top;
-    lua_State       *cr;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "lua creating new thread");
+    int                          top;
+    int                         *refs;
+    lua_State                   *cr;
+    ngx_http_lua_main_conf_t    *lmcf;
 
     top = lua_gettop(L);
 
     lua_getfield(L, LUA_REGISTRYINDEX, NGX_LUA_CORT_REF);
 
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (lmcf->coroutine_pool && lmcf->coroutine_pool->nelts) {
+        /*  reuse a coroutine released by ngx_http_lua_del_thread, it is
+         *  still anchored in the registry */
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "lua reusing pooled thread");
+
+        refs = lmcf->coroutine_pool->elts;
+        *ref = refs[--lmcf->coroutine_pool->nelts];
+
+        lua_rawgeti(L, -1, *ref);
+        cr = lua_tothread(L, -1);
+
+        lua_settop(L, top);
+
+        return cr;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "lua creating new thread");
+
     cr = lua_newthread(L);
 
     if (cr) {
@@ -187,9 +217,7 @@ ngx_http_lua_new_thread(ngx_http_request_t *r, lua_State *L, int *ref)
         /*  {{{ inherit coroutine's globals to main thread's globals table
          *  for print() function will try to find tostring() in current
          *  globals *  table. */
-        lua_createtable(cr, 0, 1);
-        lua_pushvalue(cr, LUA_GLOBALSINDEX);
-        lua_setfield(cr, -2, "__index");
+        lua_getfield(cr, LUA_REGISTRYINDEX, NGX_LUA_GLOBALS_MT);
         lua_setmetatable(cr, -2);
         /*  }}} */
 
@@ -216,6 +244,7 @@ ngx_http_lua_del_thread(ngx_http_request_t *r, lua_State *L, int ref,
         int force_quit)
 {
     ngx_http_lua_ctx_t  *ctx;
+    ngx_http_request_t  *old_req;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
             "lua deleting thread");
@@ -248,9 +277,13 @@ ngx_http_lua_del_thread(ngx_http_request_t *r, lua_State *L, int ref,
         /* }}} */
 
         /* {{{ blocking run code till ending */
+        old_req = ngx_http_lua_set_req(r);
+
         do {
             lua_settop(cr, 0);
         } while (lua_resume(cr, 0) == LUA_YIELD);
+
+        ngx_http_lua_set_req(old_req);
         /* }}} */
 
         /* {{{ restore orig code closure's env */
@@ -262,12 +295,76 @@ ngx_http_lua_del_thread(ngx_http_request_t *r, lua_State *L, int ref,
         /* }}} */
     }
 
+    if (cr && ngx_http_lua_pool_thread(r, cr, ref) == NGX_OK) {
+        lua_pop(L, 1);
+        return;
+    }
+
     /* release reference to coroutine */
     luaL_unref(L, -1, ref);
     lua_pop(L, 1);
 }
 
 
+/*
+ * A coroutine whose function has returned normally can run another one,
+ * so instead of dropping it we keep it anchored and put it into the
+ * per-worker pool, with its globals table emptied. Coroutines that died
+ * of an error, are still suspended or have had their globals replaced
+ * by setfenv(0, ...) are left to the GC.
+ */
+static ngx_int_t
+ngx_http_lua_pool_thread(ngx_http_request_t *r, lua_State *cr, int ref)
+{
+    int                          *p, own;
+    lua_Debug                     ar;
+    ngx_http_lua_main_conf_t     *lmcf;
+
+    lmcf = ngx_http_get_module_main_conf(r, ngx_http_lua_module);
+
+    if (lmcf->coroutine_pool == NULL
+        || lmcf->coroutine_pool->nelts == lmcf->coroutine_pool->nalloc)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (lua_status(cr) != 0 || lua_getstack(cr, 0, &ar)) {
+        return NGX_DECLINED;
+    }
+
+    if (!lua_getmetatable(cr, LUA_GLOBALSINDEX)) {
+        return NGX_DECLINED;
+    }
+
+    lua_getfield(cr, LUA_REGISTRYINDEX, NGX_LUA_GLOBALS_MT);
+    own = lua_rawequal(cr, -1, -2);
+    lua_pop(cr, 2);
+
+    if (!own) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "lua pooling thread");
+
+    lua_settop(cr, 0);
+
+    /*  clearing keeps the table's slots around for the next request */
+    lua_pushnil(cr);
+    while (lua_next(cr, LUA_GLOBALSINDEX) != 0) {
+        lua_pop(cr, 1);
+        lua_pushvalue(cr, -1);
+        lua_pushnil(cr);
+        lua_rawset(cr, LUA_GLOBALSINDEX);
+    }
+
+    p = ngx_array_push(lmcf->coroutine_pool);
+    *p = ref;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_http_lua_has_inline_var(ngx_str_t *s)
 {
@@ -493,6 +590,14 @@ init_ngx_lua_registry(ngx_conf_t *cf, lua_State *L)
     lua_setfield(L, LUA_REGISTRYINDEX, NGX_LUA_CORT_REF);
     /* }}} */
 
+    /* {{{ register the metatable shared by the coroutine globals tables:
+     * {__index = [main thread's globals]} */
+    lua_createtable(L, 0, 1);
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+    lua_setfield(L, -2, "__index");
+    lua_setfield(L, LUA_REGISTRYINDEX, NGX_LUA_GLOBALS_MT);
+    /* }}} */
+
     /* create registry entry for the Lua request ctx data table */
     lua_newtable(L);
     lua_setfield(L, LUA_REGISTRYINDEX, NGX_LUA_REQ_CTX_REF);
@@ -501,6 +606,11 @@ init_ngx_lua_registry(ngx_conf_t *cf, lua_State *L)
     lua_newtable(L);
     lua_setfield(L, LUA_REGISTRYINDEX, NGX_LUA_REGEX_CACHE);
 
+    /* create registry entry for the tcp socket connection pools:
+     * {([string]pool_key) = [pool userdata]} */
+    lua_newtable(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, NGX_LUA_SOCKET_POOL);
+
     /* {{{ register table to cache user code:
      * {([string]cache_key) = [code closure]} */
     lua_newtable(L);
@@ -548,6 +658,9 @@ init_ngx_lua_globals(ngx_conf_t *cf, lua_State *L)
     ngx_http_lua_inject_resp_header_api(L);
     ngx_http_lua_inject_variable_api(L);
     ngx_http_lua_inject_shdict_api(lmcf, L);
+    ngx_http_lua_inject_lrucache_api(L);
+    ngx_http_lua_inject_socket_api(L);
+    ngx_http_lua_inject_timer_api(L);
     ngx_http_lua_inject_misc_api(L);
 
     lua_getglobal(L, "package"); /* ngx package */
@@ -665,6 +778,9 @@ ngx_http_lua_reset_ctx(ngx_http_request_t *r, lua_State *L,
     ctx->sr_bodies = NULL;
 
     ctx->aborted = 0;
+
+    ctx->socket_busy = 0;
+    ctx->socket_ready = 0;
 }
 
 
@@ -762,6 +878,7 @@ ngx_http_lua_run_thread(lua_State *L, ngx_http_request_t *r,
     lua_State               *cc;
     const char              *err, *msg;
     ngx_int_t                rc;
+    ngx_http_request_t      *old_req;
 #if (NGX_PCRE)
     ngx_pool_t              *old_pool;
 #endif
@@ -785,9 +902,13 @@ ngx_http_lua_run_thread(lua_State *L, ngx_http_request_t *r,
 
         dd("calling lua_resume: vm %p, nret %d", cc, (int) nret);
 
+        old_req = ngx_http_lua_set_req(r);
+
         /*  run code */
         rv = lua_resume(cc, nret);
 
+        ngx_http_lua_set_req(old_req);
+
 #if (NGX_PCRE)
         /* XXX: work-around to nginx regex subsystem */
         ngx_http_lua_pcre_malloc_done(old_pool);
@@ -903,6 +1024,7 @@ ngx_http_lua_wev_handler(ngx_http_request_t *r)
     ngx_connection_t            *c;
     ngx_event_t                 *wev;
     ngx_http_core_loc_conf_t    *clcf;
+    ngx_http_lua_socket_upstream_t  *u;
 
     c = r->connection;
 
@@ -1057,6 +1179,13 @@ ngx_http_lua_wev_handler(ngx_http_request_t *r)
         }
     }
 
+    if (ctx->socket_busy && !ctx->socket_ready) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                "lua waiting for the tcp socket");
+
+        return NGX_DONE;
+    }
+
     if (ctx->waiting_flush) {
 
         ctx->waiting_flush = 0;
@@ -1076,6 +1205,17 @@ ngx_http_lua_wev_handler(ngx_http_request_t *r)
 
         goto run;
 
+    } else if (ctx->socket_ready) {
+        ctx->socket_ready = 0;
+
+        u = ctx->socket;
+        nret = u->prepare_retvals(r, u, ctx->cc);
+
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                "lua tcp socket operation done, resuming lua thread");
+
+        goto run;
+
     } else if (ctx->done) {
         ctx->done = 0;
 
@@ -2119,9 +2259,7 @@ ngx_http_lua_ngx_check_aborted(lua_State *L)
     ngx_http_request_t          *r;
     ngx_http_lua_ctx_t          *ctx;
 
-    lua_getglobal(L, GLOBALS_SYMBOL_REQUEST);
-    r = lua_touserdata(L, -1);
-    lua_pop(L, 1);
+    r = ngx_http_lua_get_req(L);
 
     if (r == NULL) {
         return 0;
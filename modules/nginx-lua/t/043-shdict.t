@@ -993,3 +993,343 @@ GET /test
 incr: nil not a number
 foo = true
 
+
+
+
+=== TEST 42: sharded dict, set and get many keys
+--- http_config
+    lua_shared_dict dogs 1m shards=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            for i = 1, 200 do
+                dogs:set("key" .. i, i)
+            end
+            local sum = 0
+            for i = 1, 200 do
+                sum = sum + dogs:get("key" .. i)
+            end
+            ngx.say("sum: ", sum)
+            ngx.say("missing: ", dogs:get("key201"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+sum: 20100
+missing: nil
+
+
+
+=== TEST 43: sharded dict, add, replace, incr and delete
+--- http_config
+    lua_shared_dict dogs 1m shards=3;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say("add: ", dogs:add("foo", 10))
+            ngx.say("add: ", dogs:add("foo", 11))
+            ngx.say("replace: ", dogs:replace("bar", 1))
+            ngx.say("replace: ", dogs:replace("foo", 20))
+            ngx.say("incr: ", dogs:incr("foo", 2))
+            dogs:delete("foo")
+            ngx.say("foo = ", dogs:get("foo"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+add: truenilfalse
+add: falseexistsfalse
+replace: falsenot foundfalse
+replace: truenilfalse
+incr: 22nil
+foo = nil
+
+
+
+=== TEST 44: sharded dict, a shard running out of memory evicts its own LRU keys
+--- http_config
+    lua_shared_dict dogs 100k shards=4;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local forcible = false
+            local val = string.rep("a", 1000)
+            for i = 1, 200 do
+                local ok, err, f = dogs:set("key" .. i, val)
+                if not ok then
+                    ngx.say("set failed: ", err)
+                end
+                forcible = forcible or f
+            end
+            ngx.say("forcible: ", forcible)
+            ngx.say("last: ", #dogs:get("key200"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+forcible: true
+last: 1000
+
+
+
+=== TEST 45: shards=1 is the same as no shards
+--- http_config
+    lua_shared_dict dogs 1m shards=1;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", "hello")
+            ngx.say(dogs:get("foo"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+hello
+
+
+
+=== TEST 46: read_mostly dict, get after set, add, incr and delete
+--- http_config
+    lua_shared_dict dogs 1m read_mostly;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", 32)
+            dogs:set("bar", "hello")
+            dogs:set("baz", true)
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"), " ", dogs:get("baz"))
+            dogs:set("bar", "hello, world")
+            dogs:incr("foo", 10)
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"))
+            dogs:delete("bar")
+            ngx.say(dogs:get("bar"), " ", dogs:get("none"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+32 hello true
+42 hello, world
+nil nil
+
+
+
+=== TEST 47: read_mostly dict, expired keys
+--- http_config
+    lua_shared_dict dogs 1m read_mostly;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", 32, 0.01)
+            dogs:set("bar", 56)
+            ngx.location.capture("/sleep/0.02")
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"))
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+nil 56
+
+
+
+=== TEST 48: read_mostly dict, many keys and evictions
+--- http_config
+    lua_shared_dict dogs 100k read_mostly shards=2;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local val = string.rep("a", 100)
+            for i = 1, 2000 do
+                dogs:set("key" .. i, val .. i)
+                local v = dogs:get("key" .. i)
+                if v ~= val .. i then
+                    ngx.say("bad value for key", i, ": ", v)
+                end
+            end
+            ngx.say("first: ", dogs:get("key1"))
+            ngx.say("last: ", #dogs:get("key2000"))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+first: nil
+last: 104
+
+
+
+=== TEST 49: stats
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", 32, 0.01)
+            dogs:set("bar", 56)
+            dogs:set("baz", "hello")
+            ngx.location.capture("/sleep/0.02")
+            dogs:set("blah", true)
+            local stats = dogs:stats()
+            ngx.say("items: ", stats.items)
+            ngx.say("expirations: ", stats.expirations)
+            ngx.say("evictions: ", stats.evictions)
+            ngx.say("used: ", stats.used > 0 and stats.used < stats.capacity)
+            ngx.say("free: ", stats.free > 0 and stats.free < stats.capacity)
+            ngx.say("fragmentation: ",
+                    stats.fragmentation >= 0 and stats.fragmentation < 1)
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+items: 3
+expirations: 1
+evictions: 0
+used: true
+free: true
+fragmentation: true
+
+
+
+=== TEST 50: the sweeper frees expired keys nobody looks up
+--- http_config
+    lua_shared_dict dogs 1m shards=2 sweep=10ms;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", 32)
+            for i = 1, 100 do
+                dogs:set("key" .. i, i, 0.01)
+            end
+            ngx.location.capture("/sleep/0.1")
+            local stats = dogs:stats()
+            ngx.say(stats.items, " ", stats.expirations)
+            ngx.say(dogs:get("foo"))
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+1 100
+32
+
+
+
+=== TEST 51: high_water evicts before the zone is full
+--- http_config
+    lua_shared_dict dogs 100k high_water=50%;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            local val = string.rep("a", 100)
+            local forcible_seen = false
+            for i = 1, 2000 do
+                local ok, err, forcible = dogs:set("key" .. i, val)
+                if not ok then
+                    ngx.say("failed to set key", i, ": ", err)
+                end
+                if forcible then
+                    forcible_seen = true
+                end
+            end
+            local stats = dogs:stats()
+            ngx.say("forcible: ", forcible_seen)
+            ngx.say("evictions: ", stats.evictions > 0)
+            ngx.say("under high water: ", stats.used <= stats.capacity / 2)
+            ngx.say("last: ", dogs:get("key2000") == val)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+forcible: true
+evictions: true
+under high water: true
+last: true
+
+
+
+=== TEST 52: persist writes a snapshot periodically
+--- http_config
+    lua_shared_dict dogs 1m persist=html/dogs.lsd persist_interval=100ms;
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            dogs:set("foo", "hello")
+            dogs:set("bar", 32, 100)
+            dogs:set("baz", true, 0.001)
+            ngx.location.capture("/sleep/0.3")
+            local f = io.open(ngx.var.document_root .. "/dogs.lsd", "rb")
+            local data = f:read("*a")
+            f:close()
+            ngx.say(string.sub(data, 1, 8), " ", #data)
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+ngxlsd01 91
+
+
+
+=== TEST 53: persist restores the snapshot in a new zone
+--- http_config
+    lua_shared_dict dogs 1m shards=2 persist=html/dogs.lsd;
+--- user_files eval
+use Compress::Zlib ();
+my $entries = '';
+my $n = 0;
+for my $e (["bar", 3, 0, pack("d", 3.5)], ["baz", 1, 0, "\1"],
+           ["gone", 4, 1, "expired"], ["foo", 4, 3600000, "hello"])
+{
+    $entries .= pack("Q L S C C", $e->[2], length($e->[3]), length($e->[0]),
+                     $e->[1], 0) . $e->[0] . $e->[3];
+    $n++;
+}
+">>> dogs.lsd\n"
+. pack("a8 L L Q Q Q", "ngxlsd01", 0x01020304,
+       Compress::Zlib::crc32($entries), $n, length($entries),
+       (time() - 10) * 1000)
+. $entries
+--- config
+    location = /test {
+        content_by_lua '
+            local dogs = ngx.shared.dogs
+            ngx.say(dogs:get("foo"), " ", dogs:get("bar"), " ",
+                    dogs:get("baz"), " ", dogs:get("gone"))
+            ngx.say(dogs:stats().items)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+hello 3.5 true nil
+3
@@ -0,0 +1,192 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2 + 1);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+run_tests();
+
+__DATA__
+
+=== TEST 1: set and get
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(10)
+            cache:set("foo", 32)
+            cache:set("bah", "hello")
+            cache:set(3, {dog = "cat"})
+            ngx.say(cache:get("foo"), " ", cache:get("bah"), " ",
+                    cache:get(3).dog, " ", cache:get("baz"))
+            ngx.say(cache:count())
+        ';
+    }
+--- request
+GET /test
+--- response_body
+32 hello cat nil
+3
+
+
+
+=== TEST 2: tables are stored by reference
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(10)
+            local t = {1, 2}
+            cache:set("t", t)
+            ngx.say(cache:get("t") == t)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+true
+
+
+
+=== TEST 3: least recently used items evicted first
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(3)
+            cache:set("a", 1)
+            cache:set("b", 2)
+            cache:set("c", 3)
+            cache:get("a")
+            cache:set("d", 4)
+            ngx.say(cache:get("a"), " ", cache:get("b"), " ",
+                    cache:get("c"), " ", cache:get("d"))
+            ngx.say(cache:count())
+        ';
+    }
+--- request
+GET /test
+--- response_body
+1 nil 3 4
+3
+
+
+
+=== TEST 4: replacing a value does not evict
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(2)
+            cache:set("a", 1)
+            cache:set("b", 2)
+            cache:set("a", 3)
+            ngx.say(cache:get("a"), " ", cache:get("b"), " ", cache:count())
+        ';
+    }
+--- request
+GET /test
+--- response_body
+3 2 2
+
+
+
+=== TEST 5: expired items
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(10)
+            cache:set("foo", 32, 0.01)
+            cache:set("bar", 56)
+            ngx.location.capture("/sleep/0.02")
+            ngx.update_time()
+            ngx.say(cache:get("foo"), " ", cache:get("bar"), " ", cache:count())
+        ';
+    }
+    location ~ ^/sleep/(.+) {
+        echo_sleep $1;
+    }
+--- request
+GET /test
+--- response_body
+nil 56 1
+
+
+
+=== TEST 6: delete, set to nil and flush_all
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(10)
+            cache:set("a", 1)
+            cache:set("b", 2)
+            cache:set("c", 3)
+            cache:delete("a")
+            cache:set("b", nil)
+            ngx.say(cache:get("a"), " ", cache:get("b"), " ", cache:count())
+            cache:flush_all()
+            ngx.say(cache:get("c"), " ", cache:count())
+            cache:set("d", 4)
+            ngx.say(cache:get("d"), " ", cache:count())
+        ';
+    }
+--- request
+GET /test
+--- response_body
+nil nil 1
+nil 0
+4 1
+
+
+
+=== TEST 7: boolean values
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(10)
+            cache:set(true, false)
+            ngx.say(cache:get(true))
+        ';
+    }
+--- request
+GET /test
+--- response_body
+false
+
+
+
+=== TEST 8: nil keys
+--- config
+    location = /test {
+        content_by_lua '
+            local cache = ngx.lrucache.new(10)
+            local ok, err = pcall(cache.set, cache, nil, 1)
+            ngx.say(ok, " ", err)
+        ';
+    }
+--- request
+GET /test
+--- response_body
+false attempt to use nil keys
+
+
+
+=== TEST 9: bad cache size
+--- config
+    location = /test {
+        content_by_lua '
+            ngx.lrucache.new(0)
+        ';
+    }
+--- request
+GET /test
+--- response_body_like: 500 Internal Server Error
+--- error_code: 500
+--- error_log
+bad cache size: 0
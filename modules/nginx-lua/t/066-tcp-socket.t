@@ -0,0 +1,380 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2 + 4);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+run_tests();
+
+__DATA__
+
+=== TEST 1: sanity
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            ngx.say("connected: ", ok)
+
+            local req = "GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n"
+
+            local bytes, err = sock:send(req)
+            if not bytes then
+                ngx.say("failed to send request: ", err)
+                return
+            end
+
+            ngx.say("request sent: ", bytes)
+
+            local line, err = sock:receive()
+            ngx.say("status: ", line)
+
+            while line ~= "" do
+                line, err = sock:receive("*l")
+                if not line then
+                    ngx.say("failed to receive a header: ", err)
+                    return
+                end
+            end
+
+            local body, err = sock:receive("*a")
+            ngx.say("body: ", body)
+
+            local line, err, partial = sock:receive()
+            ngx.say("receive: ", tostring(line), " ", err, " [", partial, "]")
+
+            ok, err = sock:close()
+            ngx.say("close: ", tostring(ok), " ", err)
+        ';
+    }
+
+    location /foo {
+        echo foo;
+    }
+--- request
+GET /t
+--- response_body
+connected: 1
+request sent: 38
+status: HTTP/1.1 200 OK
+body: foo
+
+receive: nil closed []
+close: nil closed
+
+
+
+=== TEST 2: receive a given number of bytes
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            sock:send("GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            ngx.say(sock:receive(4))
+            ngx.say(sock:receive(1))
+            ngx.say(sock:receive())
+            ngx.say(sock:receive(0) == "")
+
+            sock:close()
+        ';
+    }
+
+    location /foo {
+        echo foo;
+    }
+--- request
+GET /t
+--- response_body
+HTTP
+/
+1.1 200 OK
+true
+
+
+
+=== TEST 3: lines longer than the buffer
+--- config
+    lua_socket_buffer_size 1;
+
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            sock:send("GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            local line = sock:receive()
+            ngx.say("status: ", line)
+
+            while line ~= "" do
+                line = sock:receive()
+            end
+
+            ngx.say("body: ", sock:receive("*l"))
+            ngx.say("body: ", sock:receive("*l"))
+
+            sock:close()
+        ';
+    }
+
+    location /foo {
+        echo "hello, world";
+        echo "the second line";
+    }
+--- request
+GET /t
+--- response_body
+status: HTTP/1.1 200 OK
+body: hello, world
+body: the second line
+
+
+
+=== TEST 4: connection refused
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", 16787)
+            ngx.say("connect: ", tostring(ok), " ", err)
+
+            local bytes, err = sock:send("hello")
+            ngx.say("send: ", tostring(bytes), " ", err)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+connect: nil Connection refused
+send: nil closed
+--- error_log
+connect() failed (111: Connection refused)
+
+
+
+=== TEST 5: read timeout set by settimeout
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            sock:settimeout(100)
+
+            sock:send("GET /slow HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            local line, err, partial = sock:receive()
+            ngx.say("receive: ", tostring(line), " ", err, " [", partial, "]")
+
+            -- the connection is still usable
+            sock:settimeout(1000)
+
+            line, err = sock:receive()
+            ngx.say("receive: ", line)
+
+            sock:close()
+        ';
+    }
+
+    location /slow {
+        echo_sleep 0.3;
+        echo done;
+    }
+--- request
+GET /t
+--- response_body
+receive: nil timeout []
+receive: HTTP/1.1 200 OK
+--- error_log
+lua tcp socket read timed out
+
+
+
+=== TEST 6: read timeout set by lua_socket_read_timeout
+--- config
+    lua_socket_read_timeout 100ms;
+
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.say("failed to connect: ", err)
+                return
+            end
+
+            sock:send("GET /slow HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            local line, err = sock:receive()
+            ngx.say("receive: ", tostring(line), " ", err)
+
+            sock:close()
+        ';
+    }
+
+    location /slow {
+        echo_sleep 0.3;
+        echo done;
+    }
+--- request
+GET /t
+--- response_body
+receive: nil timeout
+--- error_log
+lua tcp socket read timed out
+
+
+
+=== TEST 7: rewrite_by_lua
+--- config
+    location /t {
+        set $status '';
+
+        rewrite_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+            if not ok then
+                ngx.var.status = "failed to connect: " .. err
+                return
+            end
+
+            sock:send("GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            ngx.var.status = sock:receive()
+
+            sock:close()
+        ';
+
+        echo "status: $status";
+    }
+
+    location /foo {
+        echo foo;
+    }
+--- request
+GET /t
+--- response_body
+status: HTTP/1.1 200 OK
+
+
+
+=== TEST 8: unix domain socket
+--- http_config eval
+"
+    server {
+        listen unix:$::HtmlDir/nginx.sock;
+
+        location /foo {
+            echo foo;
+        }
+    }
+"
+--- config eval
+"
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            local ok, err = sock:connect(\"unix:$::HtmlDir/nginx.sock\")
+            if not ok then
+                ngx.say(\"failed to connect: \", err)
+                return
+            end
+
+            sock:send(\"GET /foo HTTP/1.0\\\\r\\\\nHost: localhost\\\\r\\\\n\\\\r\\\\n\")
+
+            ngx.say(\"status: \", sock:receive())
+
+            sock:close()
+        ';
+    }
+"
+--- request
+GET /t
+--- response_body
+status: HTTP/1.1 200 OK
+
+
+
+=== TEST 9: reuse a socket object
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+
+            for i = 1, 2 do
+                local ok, err = sock:connect("127.0.0.1", ngx.var.server_port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                sock:send("GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+                ngx.say(i, ": ", sock:receive())
+
+                ngx.say("close: ", sock:close())
+            end
+
+            local ok, err = sock:close()
+            ngx.say("close: ", tostring(ok), " ", err)
+        ';
+    }
+
+    location /foo {
+        echo foo;
+    }
+--- request
+GET /t
+--- response_body
+1: HTTP/1.1 200 OK
+close: 1
+2: HTTP/1.1 200 OK
+close: 1
+close: nil closed
+
+
+
+=== TEST 10: bad receive pattern
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            sock:receive("*x")
+        ';
+    }
+--- request
+GET /t
+--- response_body_like: 500 Internal Server Error
+--- error_code: 500
+--- error_log
+bad argument #1 to 'receive' (bad pattern)
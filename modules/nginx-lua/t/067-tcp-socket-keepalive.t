@@ -0,0 +1,444 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2);
+
+our $HtmlDir = html_dir;
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+run_tests();
+
+__DATA__
+
+=== TEST 1: sanity
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    location /t {
+        content_by_lua '
+            local fetch = require "fetch"
+            local port = ngx.var.server_port
+
+            local sock = ngx.socket.tcp()
+
+            for i = 1, 2 do
+                local ok, err = sock:connect("127.0.0.1", port)
+                if not ok then
+                    ngx.say("failed to connect: ", err)
+                    return
+                end
+
+                ngx.say("connected: ", ok, ", reused: ", sock:getreusedtimes())
+
+                ngx.print("body: ", fetch.get(sock, "/foo"))
+
+                ngx.say("setkeepalive: ", sock:setkeepalive())
+            end
+
+            local stats = ngx.socket.stats()["127.0.0.1:" .. port]
+            ngx.say("size: ", stats.size, ", idle: ", stats.idle,
+                    ", hits: ", stats.hits, ", misses: ", stats.misses)
+        ';
+    }
+--- user_files
+>>> fetch.lua
+module("fetch", package.seeall)
+
+function get(sock, uri)
+    local bytes, err = sock:send("GET " .. uri .. " HTTP/1.1\r\n"
+                                 .. "Host: localhost\r\n\r\n")
+    if not bytes then
+        return nil, err
+    end
+
+    local len
+    while true do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        if line == "" then
+            break
+        end
+
+        local n = string.match(line, "^Content%-Length: (%d+)")
+        if n then
+            len = tonumber(n)
+        end
+    end
+
+    return sock:receive(len)
+end
+>>> foo
+hello, world
+--- request
+GET /t
+--- response_body
+connected: 1, reused: 0
+body: hello, world
+setkeepalive: 1
+connected: 1, reused: 1
+body: hello, world
+setkeepalive: 1
+size: 30, idle: 1, hits: 1, misses: 1
+
+
+
+=== TEST 2: the pool size set by the first setkeepalive
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    location /t {
+        content_by_lua '
+            local fetch = require "fetch"
+            local port = ngx.var.server_port
+
+            local sock1 = ngx.socket.tcp()
+            local sock2 = ngx.socket.tcp()
+
+            sock1:connect("127.0.0.1", port)
+            sock2:connect("127.0.0.1", port)
+
+            ngx.print("body: ", fetch.get(sock1, "/foo"))
+            ngx.print("body: ", fetch.get(sock2, "/foo"))
+
+            ngx.say("setkeepalive: ", sock1:setkeepalive(0, 1))
+            ngx.say("setkeepalive: ", sock2:setkeepalive(0, 5))
+
+            local stats = ngx.socket.stats()["127.0.0.1:" .. port]
+            ngx.say("size: ", stats.size, ", idle: ", stats.idle)
+
+            local ok, err = sock1:connect("127.0.0.1", port)
+            ngx.say("connected: ", ok, ", reused: ", sock1:getreusedtimes())
+
+            ok, err = sock2:connect("127.0.0.1", port)
+            ngx.say("connected: ", ok, ", reused: ", sock2:getreusedtimes())
+
+            stats = ngx.socket.stats()["127.0.0.1:" .. port]
+            ngx.say("hits: ", stats.hits, ", misses: ", stats.misses,
+                    ", evictions: ", stats.evictions)
+        ';
+    }
+--- user_files
+>>> fetch.lua
+module("fetch", package.seeall)
+
+function get(sock, uri)
+    local bytes, err = sock:send("GET " .. uri .. " HTTP/1.1\r\n"
+                                 .. "Host: localhost\r\n\r\n")
+    if not bytes then
+        return nil, err
+    end
+
+    local len
+    while true do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        if line == "" then
+            break
+        end
+
+        local n = string.match(line, "^Content%-Length: (%d+)")
+        if n then
+            len = tonumber(n)
+        end
+    end
+
+    return sock:receive(len)
+end
+>>> foo
+hello, world
+--- request
+GET /t
+--- response_body
+body: hello, world
+body: hello, world
+setkeepalive: 1
+setkeepalive: 1
+size: 1, idle: 1
+connected: 1, reused: 1
+connected: 1, reused: 0
+hits: 1, misses: 3, evictions: 1
+
+
+
+=== TEST 3: idle connection closed by the peer
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    location /t {
+        content_by_lua '
+            local fetch = require "fetch"
+            local port = ngx.var.server_port
+
+            local sock = ngx.socket.tcp()
+            sock:connect("127.0.0.1", port)
+
+            ngx.print("body: ", fetch.get(sock, "/close"))
+            ngx.say("setkeepalive: ", sock:setkeepalive())
+
+            ngx.location.capture("/sleep")
+
+            local stats = ngx.socket.stats()["127.0.0.1:" .. port]
+            ngx.say("idle: ", stats.idle, ", closed: ", stats.closed,
+                    ", expired: ", stats.expired)
+        ';
+    }
+
+    location /close {
+        keepalive_timeout 0;
+        alias html/foo;
+    }
+
+    location /sleep {
+        echo_sleep 0.1;
+    }
+--- user_files
+>>> fetch.lua
+module("fetch", package.seeall)
+
+function get(sock, uri)
+    local bytes, err = sock:send("GET " .. uri .. " HTTP/1.1\r\n"
+                                 .. "Host: localhost\r\n\r\n")
+    if not bytes then
+        return nil, err
+    end
+
+    local len
+    while true do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        if line == "" then
+            break
+        end
+
+        local n = string.match(line, "^Content%-Length: (%d+)")
+        if n then
+            len = tonumber(n)
+        end
+    end
+
+    return sock:receive(len)
+end
+>>> foo
+hello, world
+--- request
+GET /t
+--- response_body
+body: hello, world
+setkeepalive: 1
+idle: 0, closed: 1, expired: 0
+
+
+
+=== TEST 4: idle connection expired
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    location /t {
+        content_by_lua '
+            local fetch = require "fetch"
+            local port = ngx.var.server_port
+
+            local sock = ngx.socket.tcp()
+            sock:connect("127.0.0.1", port)
+
+            ngx.print("body: ", fetch.get(sock, "/foo"))
+            ngx.say("setkeepalive: ", sock:setkeepalive(10))
+
+            ngx.location.capture("/sleep")
+
+            local stats = ngx.socket.stats()["127.0.0.1:" .. port]
+            ngx.say("idle: ", stats.idle, ", closed: ", stats.closed,
+                    ", expired: ", stats.expired)
+        ';
+    }
+
+    location /sleep {
+        echo_sleep 0.1;
+    }
+--- user_files
+>>> fetch.lua
+module("fetch", package.seeall)
+
+function get(sock, uri)
+    local bytes, err = sock:send("GET " .. uri .. " HTTP/1.1\r\n"
+                                 .. "Host: localhost\r\n\r\n")
+    if not bytes then
+        return nil, err
+    end
+
+    local len
+    while true do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        if line == "" then
+            break
+        end
+
+        local n = string.match(line, "^Content%-Length: (%d+)")
+        if n then
+            len = tonumber(n)
+        end
+    end
+
+    return sock:receive(len)
+end
+>>> foo
+hello, world
+--- request
+GET /t
+--- response_body
+body: hello, world
+setkeepalive: 1
+idle: 0, closed: 0, expired: 1
+
+
+
+=== TEST 5: unread data
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    location /t {
+        content_by_lua '
+            local sock = ngx.socket.tcp()
+            sock:connect("127.0.0.1", ngx.var.server_port)
+
+            sock:send("GET /foo HTTP/1.1\\r\\nHost: localhost\\r\\n\\r\\n")
+
+            ngx.say("status: ", sock:receive())
+
+            local ok, err = sock:setkeepalive()
+            ngx.say("setkeepalive: ", tostring(ok), " ", err)
+
+            ngx.say("close: ", sock:close())
+        ';
+    }
+--- user_files
+>>> fetch.lua
+module("fetch", package.seeall)
+
+function get(sock, uri)
+    local bytes, err = sock:send("GET " .. uri .. " HTTP/1.1\r\n"
+                                 .. "Host: localhost\r\n\r\n")
+    if not bytes then
+        return nil, err
+    end
+
+    local len
+    while true do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        if line == "" then
+            break
+        end
+
+        local n = string.match(line, "^Content%-Length: (%d+)")
+        if n then
+            len = tonumber(n)
+        end
+    end
+
+    return sock:receive(len)
+end
+>>> foo
+hello, world
+--- request
+GET /t
+--- response_body
+status: HTTP/1.1 200 OK
+setkeepalive: nil unread data in buffer
+close: 1
+
+
+
+=== TEST 6: lua_socket_pool_size and lua_socket_keepalive_timeout
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    lua_socket_pool_size 5;
+    lua_socket_keepalive_timeout 10ms;
+
+    location /t {
+        content_by_lua '
+            local fetch = require "fetch"
+            local port = ngx.var.server_port
+
+            local sock = ngx.socket.tcp()
+            sock:connect("127.0.0.1", port)
+
+            ngx.print("body: ", fetch.get(sock, "/foo"))
+            ngx.say("setkeepalive: ", sock:setkeepalive())
+
+            ngx.location.capture("/sleep")
+
+            local stats = ngx.socket.stats()["127.0.0.1:" .. port]
+            ngx.say("size: ", stats.size, ", idle: ", stats.idle,
+                    ", expired: ", stats.expired)
+        ';
+    }
+
+    location /sleep {
+        echo_sleep 0.1;
+    }
+--- user_files
+>>> fetch.lua
+module("fetch", package.seeall)
+
+function get(sock, uri)
+    local bytes, err = sock:send("GET " .. uri .. " HTTP/1.1\r\n"
+                                 .. "Host: localhost\r\n\r\n")
+    if not bytes then
+        return nil, err
+    end
+
+    local len
+    while true do
+        local line, err = sock:receive()
+        if not line then
+            return nil, err
+        end
+
+        if line == "" then
+            break
+        end
+
+        local n = string.match(line, "^Content%-Length: (%d+)")
+        if n then
+            len = tonumber(n)
+        end
+    end
+
+    return sock:receive(len)
+end
+>>> foo
+hello, world
+--- request
+GET /t
+--- response_body
+body: hello, world
+setkeepalive: 1
+size: 5, idle: 0, expired: 1
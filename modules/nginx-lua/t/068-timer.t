@@ -0,0 +1,258 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2 + 4);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+run_tests();
+
+__DATA__
+
+=== TEST 1: sanity
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location /t {
+        content_by_lua '
+            local function f(premature, a, b)
+                ngx.shared.dogs:set("res", tostring(premature) .. " " .. a .. " " .. b)
+            end
+
+            local ok, err = ngx.timer.at(0.05, f, "hello", 32)
+            ngx.say("set timer: ", ok, " ", err)
+            ngx.say("before: ", ngx.shared.dogs:get("res"))
+
+            ngx.location.capture("/sleep")
+
+            ngx.say("after: ", ngx.shared.dogs:get("res"))
+        ';
+    }
+
+    location /sleep {
+        echo_sleep 0.1;
+    }
+--- request
+GET /t
+--- response_body
+set timer: 1 nil
+before: nil
+after: false hello 32
+
+
+
+=== TEST 2: cosockets, ngx.var and ngx.ctx in the callback
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location /t {
+        content_by_lua '
+            local function f(premature, port)
+                ngx.ctx.port = port
+
+                local sock = ngx.socket.tcp()
+                local ok, err = sock:connect("127.0.0.1", ngx.ctx.port)
+                if not ok then
+                    ngx.shared.dogs:set("res", "failed to connect: " .. err)
+                    return
+                end
+
+                sock:send("GET /foo HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+
+                local line = sock:receive()
+                sock:close()
+
+                ngx.shared.dogs:set("res", line .. ", uri: [" .. ngx.var.uri .. "]")
+            end
+
+            ngx.say("set timer: ", ngx.timer.at(0, f, ngx.var.server_port))
+
+            ngx.location.capture("/sleep")
+
+            ngx.say("result: ", ngx.shared.dogs:get("res"))
+        ';
+    }
+
+    location /sleep {
+        echo_sleep 0.1;
+    }
+
+    location /foo {
+        echo foo;
+    }
+--- request
+GET /t
+--- response_body
+set timer: 1
+result: HTTP/1.1 200 OK, uri: []
+
+
+
+=== TEST 3: lua_max_pending_timers
+--- http_config
+    lua_max_pending_timers 2;
+--- config
+    location /t {
+        content_by_lua '
+            local function f() end
+
+            for i = 1, 3 do
+                local ok, err = ngx.timer.at(0.01, f)
+                ngx.say(i, ": ", ok, " ", err)
+            end
+        ';
+    }
+--- request
+GET /t
+--- response_body
+1: 1 nil
+2: 1 nil
+3: nil too many pending timers
+
+
+
+=== TEST 4: lua_max_running_timers
+--- http_config
+    lua_max_running_timers 1;
+    lua_shared_dict dogs 1m;
+--- config
+    location /t {
+        content_by_lua '
+            local function f(premature, port, key)
+                local sock = ngx.socket.tcp()
+                sock:connect("127.0.0.1", port)
+                sock:send("GET /slow HTTP/1.0\\r\\nHost: localhost\\r\\n\\r\\n")
+                sock:receive()
+                sock:close()
+
+                ngx.shared.dogs:set(key, true)
+            end
+
+            local port = ngx.var.server_port
+
+            ngx.timer.at(0, f, port, "first")
+            ngx.timer.at(0.05, f, port, "second")
+
+            ngx.location.capture("/sleep")
+
+            ngx.say("first: ", ngx.shared.dogs:get("first"))
+            ngx.say("second: ", ngx.shared.dogs:get("second"))
+        ';
+    }
+
+    location /sleep {
+        echo_sleep 0.3;
+    }
+
+    location /slow {
+        echo_sleep 0.15;
+        echo done;
+    }
+--- request
+GET /t
+--- response_body
+first: true
+second: nil
+--- error_log
+1 lua_max_running_timers are not enough
+
+
+
+=== TEST 5: output APIs are disabled
+--- config
+    location /t {
+        content_by_lua '
+            local function f()
+                ngx.say("hello")
+            end
+
+            ngx.timer.at(0, f)
+
+            ngx.location.capture("/sleep")
+
+            ngx.say("done")
+        ';
+    }
+
+    location /sleep {
+        echo_sleep 0.05;
+    }
+--- request
+GET /t
+--- response_body
+done
+--- error_log
+API disabled in the context of ngx.timer
+
+
+
+=== TEST 6: ngx.exit quits the callback
+--- http_config
+    lua_shared_dict dogs 1m;
+--- config
+    location /t {
+        content_by_lua '
+            local function f()
+                ngx.shared.dogs:set("before", true)
+                ngx.exit(404)
+                ngx.shared.dogs:set("after", true)
+            end
+
+            ngx.timer.at(0, f)
+
+            ngx.location.capture("/sleep")
+
+            ngx.say("before: ", ngx.shared.dogs:get("before"))
+            ngx.say("after: ", ngx.shared.dogs:get("after"))
+        ';
+    }
+
+    location /sleep {
+        echo_sleep 0.05;
+    }
+--- request
+GET /t
+--- response_body
+before: true
+after: nil
+
+
+
+=== TEST 7: negative delay
+--- config
+    location /t {
+        content_by_lua '
+            ngx.timer.at(-1, function () end)
+        ';
+    }
+--- request
+GET /t
+--- response_body_like: 500 Internal Server Error
+--- error_code: 500
+--- error_log
+bad argument #1 to 'at' (negative delay)
+
+
+
+=== TEST 8: too few arguments
+--- config
+    location /t {
+        content_by_lua '
+            ngx.timer.at(1)
+        ';
+    }
+--- request
+GET /t
+--- response_body_like: 500 Internal Server Error
+--- error_code: 500
+--- error_log
+expecting at least 2 arguments but got 1
@@ -0,0 +1,185 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2);
+
+our $HtmlDir = html_dir;
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+run_tests();
+
+__DATA__
+
+=== TEST 1: globals do not leak through pooled coroutines
+--- config
+    location /t {
+        content_by_lua '
+            for i = 1, 3 do
+                local res = ngx.location.capture("/sub?i=" .. i)
+                ngx.print(res.body)
+            end
+        ';
+    }
+
+    location /sub {
+        content_by_lua '
+            ngx.say("before: ", tostring(foo))
+            foo = ngx.var.arg_i
+        ';
+    }
+--- request
+GET /t
+--- response_body
+before: nil
+before: nil
+before: nil
+
+
+
+=== TEST 2: coroutines aborted by errors are not reused
+--- config
+    location /t {
+        content_by_lua '
+            local res = ngx.location.capture("/err")
+            ngx.say("err: ", res.status)
+
+            res = ngx.location.capture("/sub")
+            ngx.print(res.body)
+        ';
+    }
+
+    location /err {
+        content_by_lua '
+            foo = 1
+            error("boom")
+        ';
+    }
+
+    location /sub {
+        content_by_lua '
+            ngx.say("foo: ", tostring(foo))
+        ';
+    }
+--- request
+GET /t
+--- response_body
+err: 500
+foo: nil
+
+
+
+=== TEST 3: globals replaced by setfenv(0) are left alone
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    location /t {
+        content_by_lua '
+            local env = require "env"
+
+            ngx.location.capture("/swap")
+            ngx.location.capture("/sub")
+
+            ngx.say("dog: ", env.globals.dog)
+        ';
+    }
+
+    location /swap {
+        content_by_lua '
+            local env = require "env"
+            setfenv(0, env.globals)
+            setfenv(1, env.globals)
+            dog = 32
+        ';
+    }
+
+    location /sub {
+        content_by_lua '
+            ngx.say("hello")
+        ';
+    }
+--- user_files
+>>> env.lua
+module("env", package.seeall)
+
+globals = setmetatable({}, { __index = _G })
+--- request
+GET /t
+--- response_body
+dog: 32
+
+
+
+=== TEST 4: pooling disabled
+--- http_config
+    lua_coroutine_pool_size 0;
+--- config
+    location /t {
+        content_by_lua '
+            for i = 1, 2 do
+                local res = ngx.location.capture("/sub")
+                ngx.print(res.body)
+            end
+        ';
+    }
+
+    location /sub {
+        content_by_lua '
+            ngx.say("foo: ", tostring(foo))
+            foo = 1
+        ';
+    }
+--- request
+GET /t
+--- response_body
+foo: nil
+foo: nil
+
+
+
+=== TEST 5: closures lose the globals of a reused coroutine, not their upvalues
+--- http_config eval
+    "lua_package_path '$::HtmlDir/?.lua;./?.lua';"
+--- config
+    location /t {
+        content_by_lua '
+            local saved = require "saved"
+
+            ngx.location.capture("/first")
+            ngx.location.capture("/second")
+
+            ngx.say("closure: ", saved.f())
+        ';
+    }
+
+    location /first {
+        content_by_lua '
+            local saved = require "saved"
+            local bar = "first"
+            foo = "first"
+            saved.f = function () return tostring(foo) .. " " .. bar end
+        ';
+    }
+
+    location /second {
+        content_by_lua '
+            ngx.say("foo: ", tostring(foo))
+            foo = "second"
+        ';
+    }
+--- user_files
+>>> saved.lua
+module("saved", package.seeall)
+--- request
+GET /t
+--- response_body
+closure: nil first
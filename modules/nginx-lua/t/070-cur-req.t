@@ -0,0 +1,73 @@
+# vim:set ft= ts=4 sw=4 et fdm=marker:
+use lib 'lib';
+use Test::Nginx::Socket;
+
+#worker_connections(1014);
+#master_process_enabled(1);
+#log_level('warn');
+
+#repeat_each(2);
+
+plan tests => repeat_each() * (blocks() * 2);
+
+#no_diff();
+no_long_string();
+#master_on();
+#workers(2);
+run_tests();
+
+__DATA__
+
+=== TEST 1: API calls from coroutines created by user code
+--- config
+    location /t {
+        content_by_lua '
+            local co = coroutine.wrap(function ()
+                ngx.say("uri: ", ngx.var.uri)
+                coroutine.yield()
+                ngx.say("arg: ", ngx.var.arg_a)
+            end)
+
+            co()
+            ngx.say("main")
+            co()
+        ';
+    }
+--- request
+GET /t?a=1
+--- response_body
+uri: /t
+main
+arg: 1
+
+
+
+=== TEST 2: header filter run from inside the content handler
+--- config
+    location /t {
+        header_filter_by_lua '
+            ngx.header.Foo = ngx.var.uri
+        ';
+
+        content_by_lua '
+            ngx.send_headers()
+            local res = ngx.location.capture("/sub")
+            ngx.say("uri: ", ngx.var.uri, ", foo: ", ngx.header.Foo)
+            ngx.say("sub: ", res.header.Foo, " ", res.body)
+        ';
+    }
+
+    location /sub {
+        header_filter_by_lua '
+            ngx.header.Foo = ngx.var.uri
+        ';
+
+        content_by_lua '
+            ngx.print(ngx.var.uri)
+        ';
+    }
+--- request
+GET /t
+--- response_body
+uri: /t, foo: /t
+sub: /sub /sub
@@ -0,0 +1,141 @@
+#!/bin/bash
+
+# lua_coroutine_pool_size benchmark.
+#
+# Runs the nginx built by util/build.sh (work/sbin/nginx) with a single
+# worker, every request running a trivial content_by_lua handler, once
+# with the coroutine pool disabled and once with $size coroutines, and
+# prints for each:
+#
+#   * requests per second;
+#   * Lua bytes allocated per request, measured with the collector
+#     stopped, from collectgarbage("count") before and after the run;
+#   * collector cycles per 10k requests, counted by a userdata whose
+#     __gc metamethod re-creates itself at the end of every cycle.
+#
+# usage: util/coroutine-pool-bench.sh [pool size]
+#
+# needs ab (ApacheBench) and curl; requests and concurrency can be
+# overridden from the environment.
+
+root=$(cd ${0%/*}/.. && echo $PWD)
+nginx=$root/work/sbin/nginx
+size=${1:-64}
+requests=${requests:-100000}
+concurrency=${concurrency:-32}
+port=${port:-1984}
+prefix=$root/work/coroutine-pool-bench
+
+if [ ! -x $nginx ]; then
+    echo "$nginx not found, run util/build.sh first" >&2
+    exit 1
+fi
+
+for prog in ab curl; do
+    if ! which $prog > /dev/null; then
+        echo "$prog not found" >&2
+        exit 1
+    fi
+done
+
+mkdir -p $prefix/conf $prefix/logs $prefix/lua
+
+cat > $prefix/lua/gcstat.lua <<'EOF'
+module("gcstat", package.seeall)
+
+cycles = 0
+
+local function sentinel()
+    local p = newproxy(true)
+    getmetatable(p).__gc = function ()
+        cycles = cycles + 1
+        sentinel()
+    end
+end
+
+sentinel()
+EOF
+
+stat() {
+    curl -s http://127.0.0.1:$port/gc?$1
+}
+
+run() {
+    local pool_size=$1
+
+    cat > $prefix/conf/nginx.conf <<EOF
+worker_processes 1;
+daemon on;
+master_process on;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 1024;
+}
+
+http {
+    access_log off;
+    lua_package_path '$prefix/lua/?.lua;;';
+    lua_coroutine_pool_size $pool_size;
+
+    server {
+        listen $port;
+
+        location = /bench {
+            content_by_lua 'ngx.say("ok")';
+        }
+
+        location = /gc {
+            content_by_lua '
+                local gcstat = require "gcstat"
+                local op = ngx.var.args
+
+                if op == "stop" or op == "restart" then
+                    collectgarbage(op)
+                end
+
+                ngx.say(collectgarbage("count") * 1024, " ", gcstat.cycles)
+            ';
+        }
+    }
+}
+EOF
+
+    $nginx -p $prefix/ -c conf/nginx.conf || exit 1
+    sleep 1
+
+    # warm up the code cache and the pool
+    ab -q -k -n 1000 -c $concurrency http://127.0.0.1:$port/bench > /dev/null
+
+    local before after
+    before=$(stat stop)
+    ab -q -k -n $requests -c $concurrency \
+        http://127.0.0.1:$port/bench > /dev/null
+    after=$(stat restart)
+
+    local bytes
+    bytes=$(echo "$before $after" \
+            | awk -v n=$requests '{ printf "%d", ($3 - $1) / n }')
+
+    before=$(stat)
+    local rps
+    rps=$(ab -q -k -n $requests -c $concurrency \
+              http://127.0.0.1:$port/bench \
+          | awk '/^Requests per second/ { print $4 }')
+    after=$(stat)
+
+    local cycles
+    cycles=$(echo "$before $after" \
+             | awk -v n=$requests '{ printf "%.1f", ($4 - $2) * 10000 / n }')
+
+    kill -QUIT $(cat $prefix/logs/nginx.pid)
+    sleep 1
+
+    printf "%-10s %12s %12s %16s\n" $pool_size $rps $bytes $cycles
+}
+
+printf "%-10s %12s %12s %16s\n" "pool size" "req/s" "bytes/req" "gc cycles/10k"
+
+run 0
+run $size
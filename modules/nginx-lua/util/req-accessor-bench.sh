@@ -0,0 +1,123 @@
+#!/bin/bash
+
+# Lua API call overhead microbenchmark.
+#
+# Runs each given nginx binary (work/sbin/nginx, as built by util/build.sh,
+# by default) with a single worker and, inside one content_by_lua
+# handler, times $calls back-to-back calls of ngx.var.uri and
+# $print_calls of ngx.print("x"), printing the calls per second of each.
+# Both are cheap enough for the request lookup every Lua API function
+# starts with to show up; pass the binaries built before and after a
+# change to compare them:
+#
+#   util/req-accessor-bench.sh /path/to/old/sbin/nginx work/sbin/nginx
+#
+# usage: util/req-accessor-bench.sh [nginx binary...]
+#
+# needs curl; calls, print_calls, rounds and port can be overridden from
+# the environment. The best of $rounds runs is reported.
+
+root=$(cd ${0%/*}/.. && echo $PWD)
+calls=${calls:-1000000}
+print_calls=${print_calls:-100000}
+rounds=${rounds:-5}
+port=${port:-1984}
+prefix=$root/work/req-accessor-bench
+
+if [ $# -eq 0 ]; then
+    set -- $root/work/sbin/nginx
+fi
+
+for nginx in "$@"; do
+    if [ ! -x $nginx ]; then
+        echo "$nginx not found, run util/build.sh first" >&2
+        exit 1
+    fi
+done
+
+if ! which curl > /dev/null; then
+    echo "curl not found" >&2
+    exit 1
+fi
+
+mkdir -p $prefix/conf $prefix/logs
+
+cat > $prefix/conf/nginx.conf <<EOF
+worker_processes 1;
+daemon on;
+master_process on;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 1024;
+}
+
+http {
+    access_log off;
+
+    server {
+        listen $port;
+
+        location = /var {
+            content_by_lua '
+                local n = $calls
+                local var = ngx.var
+                local v
+
+                local t0 = os.clock()
+                for i = 1, n do
+                    v = var.uri
+                end
+                local elapsed = os.clock() - t0
+
+                ngx.say(string.format("%d", n / elapsed))
+            ';
+        }
+
+        location = /print {
+            content_by_lua '
+                local n = $print_calls
+                local print = ngx.print
+
+                local t0 = os.clock()
+                for i = 1, n do
+                    print("x")
+                end
+                local elapsed = os.clock() - t0
+
+                -- goes out after the output, so it is found at the end
+                ngx.print(string.format("\\\\n%d\\\\n", n / elapsed))
+            ';
+        }
+    }
+}
+EOF
+
+best() {
+    local uri=$1 i max=0 rate
+
+    for ((i = 0; i < rounds; i++)); do
+        rate=$(curl -s http://127.0.0.1:$port$uri | tail -n 1)
+        if [ "${rate:-0}" -gt $max ]; then
+            max=$rate
+        fi
+    done
+
+    echo $max
+}
+
+printf "%-50s %14s %14s\n" "nginx" "ngx.var/s" "ngx.print/s"
+
+for nginx in "$@"; do
+    $nginx -p $prefix/ -c conf/nginx.conf || exit 1
+    sleep 1
+
+    # warm up the code cache
+    curl -s http://127.0.0.1:$port/var > /dev/null
+
+    printf "%-50s %14s %14s\n" $nginx $(best /var) $(best /print)
+
+    kill -QUIT $(cat $prefix/logs/nginx.pid)
+    sleep 1
+done
@@ -0,0 +1,96 @@
+#!/bin/bash
+
+# ngx.shared.DICT contention benchmark.
+#
+# Runs the nginx built by util/build.sh (work/sbin/nginx) with 1, 2, 4 ...
+# worker processes, every request doing $ops incr/get/set on a dict of
+# $keys keys, and prints requests per second with a single zone and with
+# shards=$shards. With a single zone, throughput stops scaling as soon as
+# the workers queue up on the zone mutex.
+#
+# usage: util/shdict-bench.sh [max workers] [shards]
+#
+# needs ab (ApacheBench); ops, keys, requests and concurrency can be
+# overridden from the environment.
+
+root=$(cd ${0%/*}/.. && echo $PWD)
+nginx=$root/work/sbin/nginx
+max_workers=${1:-$(getconf _NPROCESSORS_ONLN)}
+shards=${2:-16}
+ops=${ops:-100}
+keys=${keys:-1000}
+requests=${requests:-200000}
+concurrency=${concurrency:-64}
+port=${port:-1984}
+prefix=$root/work/shdict-bench
+
+if [ ! -x $nginx ]; then
+    echo "$nginx not found, run util/build.sh first" >&2
+    exit 1
+fi
+
+if ! which ab > /dev/null; then
+    echo "ab not found" >&2
+    exit 1
+fi
+
+mkdir -p $prefix/conf $prefix/logs
+
+run() {
+    local workers=$1 shard_opt=$2
+
+    cat > $prefix/conf/nginx.conf <<EOF
+worker_processes $workers;
+daemon on;
+master_process on;
+error_log logs/error.log warn;
+pid logs/nginx.pid;
+
+events {
+    worker_connections 1024;
+}
+
+http {
+    access_log off;
+    lua_shared_dict bench 64m $shard_opt;
+
+    server {
+        listen $port;
+
+        location = /bench {
+            content_by_lua '
+                local dict = ngx.shared.bench
+                local n = math.random($keys)
+                for i = 1, $ops do
+                    local key = "key" .. (n + i) % $keys
+                    if not dict:incr(key, 1) then
+                        dict:add(key, 0)
+                    end
+                    dict:get(key)
+                end
+                ngx.say("ok")
+            ';
+        }
+    }
+}
+EOF
+
+    $nginx -p $prefix/ -c conf/nginx.conf || exit 1
+    sleep 1
+
+    ab -q -k -n $requests -c $concurrency http://127.0.0.1:$port/bench \
+        | awk '/^Requests per second/ { print $4 }'
+
+    kill -QUIT $(cat $prefix/logs/nginx.pid)
+    sleep 1
+}
+
+printf "%-8s %14s %14s\n" workers "single req/s" "shards=$shards"
+
+workers=1
+while [ $workers -le $max_workers ]; do
+    single=$(run $workers "")
+    sharded=$(run $workers "shards=$shards")
+    printf "%-8s %14s %14s\n" $workers $single $sharded
+    workers=$((workers * 2))
+done